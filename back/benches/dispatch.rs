@@ -0,0 +1,57 @@
+//! Benchmarks for decoding and dispatching instructions through the
+//! interpreter's lookup tables.
+
+#[path = "../../core/benches/common/mod.rs"]
+mod common;
+
+use std::hint::black_box;
+
+use criterion::{criterion_group, criterion_main, Criterion};
+
+use ironic_backend::interp::lut::INTERP_LUT;
+use ironic_core::cpu::Cpu;
+
+/// Some data-processing instructions, which don't touch memory.
+const ARM: [(&str, u32); 3] = [
+    ("mov", 0xe1a0_0001), // mov r0, r1
+    ("add", 0xe081_0002), // add r0, r1, r2
+    ("orr_lsl", 0xe181_0102), // orr r0, r1, r2, lsl #2
+];
+const THUMB: [(&str, u16); 3] = [
+    ("mov", 0x1c08), // adds r0, r1, #0
+    ("add", 0x1888), // adds r0, r1, r2
+    ("lsl", 0x0088), // lsls r0, r1, #2
+];
+
+fn arm(c: &mut Criterion) {
+    let mut cpu = Cpu::new(common::shared_bus());
+    let mut group = c.benchmark_group("ArmLut");
+    for (name, opcd) in ARM {
+        group.bench_function(format!("lookup/{name}"), |b| b.iter(|| {
+            INTERP_LUT.arm.lookup(black_box(opcd))
+        }));
+        group.bench_function(format!("dispatch/{name}"), |b| b.iter(|| {
+            let opcd = black_box(opcd);
+            (INTERP_LUT.arm.lookup(opcd).0)(&mut cpu, opcd)
+        }));
+    }
+    group.finish();
+}
+
+fn thumb(c: &mut Criterion) {
+    let mut cpu = Cpu::new(common::shared_bus());
+    let mut group = c.benchmark_group("ThumbLut");
+    for (name, opcd) in THUMB {
+        group.bench_function(format!("lookup/{name}"), |b| b.iter(|| {
+            INTERP_LUT.thumb.lookup(black_box(opcd))
+        }));
+        group.bench_function(format!("dispatch/{name}"), |b| b.iter(|| {
+            let opcd = black_box(opcd);
+            (INTERP_LUT.thumb.lookup(opcd).0)(&mut cpu, opcd)
+        }));
+    }
+    group.finish();
+}
+
+criterion_group!(benches, arm, thumb);
+criterion_main!(benches);
@@ -109,6 +109,26 @@ impl xDisplay for ClzBits {
     }
 }
 
+/// ['Swp', 'Swpb']
+#[repr(transparent)]
+pub struct SwpBits(pub u32);
+impl SwpBits {
+    #[inline(always)]
+    pub fn cond(&self) -> u32 { (self.0 & 0xf0000000) >> 28 }
+    #[inline(always)]
+    pub fn rn(&self) -> u32 { (self.0 & 0x000f0000) >> 16 }
+    #[inline(always)]
+    pub fn rt(&self) -> u32 { (self.0 & 0x0000f000) >> 12 }
+    #[inline(always)]
+    pub fn rt2(&self) -> u32 { self.0 & 0x0000000f }
+}
+impl xDisplay for SwpBits {
+    fn fmt(&self, f: &mut String, _: DisassemblyContext) -> anyhow::Result<()> {
+        f.push_str(&format!("r{} r{} [r{}]", self.rt(), self.rt2(), self.rn()));
+        Ok(())
+    }
+}
+
 /// ['Bkpt']
 #[repr(transparent)]
 pub struct BkptBits(pub u32);
@@ -28,6 +28,7 @@ pub enum ArmInst {
     LdmRegUser, StmRegUser,
     MsrImm, MsrReg, Mrs, Mcrr, Mrrc, Mrc, Mcr, Stc,
     PldReg, PldImm, LdcImm, Clz, 
+    Swp, Swpb,
     B, BlImm, Bx, BlxReg, Bxj, 
     Svc, Bkpt, 
     BlxImm,
@@ -154,6 +155,8 @@ impl std::fmt::Display for ArmInst {
             ArmInst::PldImm         => write!(f, "pld"),
             ArmInst::LdcImm         => write!(f, "ldc"),
             ArmInst::Clz            => write!(f, "clz"),
+            ArmInst::Swp            => write!(f, "swp"),
+            ArmInst::Swpb           => write!(f, "swpb"),
             ArmInst::B              => write!(f, "b"),
             ArmInst::BlImm          => write!(f, "bl"),
             ArmInst::Bx             => write!(f, "bx"),
@@ -198,6 +201,11 @@ impl ArmInst {
             0x00200090 => return Mla,
             _ => {},
         }
+        match opcd & 0x0ff00ff0 {
+            0x01000090 => return Swp,
+            0x01400090 => return Swpb,
+            _ => {},
+        }
         match opcd & 0x0fb000f0 {
             0x01200000 => return MsrReg,
             0x01000000 => return Mrs,
@@ -483,6 +491,8 @@ impl ArmInst {
             ArmInst::PldImm         => Box::new(PldImmBits(bits)) as Box<dyn xDisplay>,
             ArmInst::LdcImm         => Box::new(LsCoprocBits(bits)) as Box<dyn xDisplay>,
             ArmInst::Clz            => Box::new(ClzBits(bits)) as Box<dyn xDisplay>,
+            ArmInst::Swp            => Box::new(SwpBits(bits)) as Box<dyn xDisplay>,
+            ArmInst::Swpb           => Box::new(SwpBits(bits)) as Box<dyn xDisplay>,
             ArmInst::B              => Box::new(BranchBits(bits)) as Box<dyn xDisplay>,
             ArmInst::BlImm          => Box::new(BranchBits(bits)) as Box<dyn xDisplay>,
             ArmInst::Bx             => Box::new(BxBits(bits)) as Box<dyn xDisplay>,
@@ -0,0 +1,355 @@
+//! A server for the GDB remote serial protocol.
+//!
+//! The server thread owns the TCP connection: it checks and acknowledges
+//! packets, and answers the ones that don't depend on the state of the
+//! machine (like the target description). Everything else is relayed to the
+//! CPU thread, which only serves packets while it's stopped for the debugger
+//! (see [crate::interp::debug]). While the CPU is running, the server waits
+//! for it to stop, and for the client to interrupt it.
+//!
+//! Only one client is served at a time. Disconnecting (or detaching, or
+//! killing the target) removes every breakpoint and watchpoint, and lets the
+//! machine run on.
+
+use std::io::{ErrorKind, Read, Write};
+use std::net::{TcpListener, TcpStream};
+use std::sync::Arc;
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::mpsc::{channel, Receiver, RecvTimeoutError, Sender};
+use std::time::Duration;
+
+use anyhow::{bail, Context};
+use log::{info, warn};
+use parking_lot::RwLock;
+
+use ironic_core::bus::Bus;
+use ironic_core::bus::notify::Notifier;
+
+use crate::back::Backend;
+
+/// How often to check the socket and the CPU while the CPU is running.
+const POLL_INTERVAL: Duration = Duration::from_millis(10);
+
+/// The largest packet we accept, which is advertised to the client.
+pub const PACKET_SIZE: usize = 0x4000;
+
+/// The registers in the `g` packet, in order.
+const TARGET_XML: &str = r#"<?xml version="1.0"?>
+<!DOCTYPE target SYSTEM "gdb-target.dtd">
+<target version="1.0">
+  <architecture>arm</architecture>
+  <feature name="org.gnu.gdb.arm.core">
+    <reg name="r0" bitsize="32"/>
+    <reg name="r1" bitsize="32"/>
+    <reg name="r2" bitsize="32"/>
+    <reg name="r3" bitsize="32"/>
+    <reg name="r4" bitsize="32"/>
+    <reg name="r5" bitsize="32"/>
+    <reg name="r6" bitsize="32"/>
+    <reg name="r7" bitsize="32"/>
+    <reg name="r8" bitsize="32"/>
+    <reg name="r9" bitsize="32"/>
+    <reg name="r10" bitsize="32"/>
+    <reg name="r11" bitsize="32"/>
+    <reg name="r12" bitsize="32"/>
+    <reg name="sp" bitsize="32" type="data_ptr"/>
+    <reg name="lr" bitsize="32"/>
+    <reg name="pc" bitsize="32" type="code_ptr"/>
+    <reg name="cpsr" bitsize="32"/>
+  </feature>
+</target>
+"#;
+
+/// Sent from the CPU thread to the server.
+#[derive(Debug)]
+pub enum GdbEvent {
+    /// The reply to a packet.
+    Reply(String),
+    /// The CPU has started running again, after a packet asking it to.
+    Resumed,
+    /// The CPU has stopped, with some stop reply.
+    Stopped(String),
+}
+
+/// The CPU thread's end of the connection to a [GdbServer].
+pub struct GdbLink {
+    pub(crate) packets: Receiver<String>,
+    pub(crate) events: Sender<GdbEvent>,
+    /// Set when the client asks to stop the CPU.
+    pub(crate) interrupt: Arc<AtomicBool>,
+    /// Set while a client is connected.
+    pub(crate) attached: Arc<AtomicBool>,
+}
+
+/// Something read from the client.
+enum Incoming {
+    Packet(String),
+    /// A Ctrl-C, asking to stop the CPU.
+    Interrupt,
+    Closed,
+}
+
+/// A connection to a client, with the packets it has only partly sent.
+struct Connection {
+    stream: TcpStream,
+    buf: Vec<u8>,
+    /// The last packet sent, in case the client asks for it again.
+    last: Vec<u8>,
+    /// Set once the client has turned off acknowledgements.
+    no_ack: bool,
+}
+
+fn checksum(data: &[u8]) -> u8 {
+    data.iter().fold(0u8, |sum, b| sum.wrapping_add(*b))
+}
+
+impl Connection {
+    fn new(stream: TcpStream) -> std::io::Result<Self> {
+        stream.set_nodelay(true)?;
+        stream.set_read_timeout(Some(POLL_INTERVAL))?;
+        Ok(Connection { stream, buf: Vec::new(), last: Vec::new(), no_ack: false })
+    }
+
+    fn send(&mut self, data: &str) -> std::io::Result<()> {
+        self.last = format!("${data}#{:02x}", checksum(data.as_bytes())).into_bytes();
+        self.stream.write_all(&self.last)
+    }
+
+    /// Read the next thing from the client. Returns [None] if nothing
+    /// arrived within [POLL_INTERVAL].
+    fn next(&mut self) -> std::io::Result<Option<Incoming>> {
+        loop {
+            if let Some(incoming) = self.parse()? {
+                return Ok(Some(incoming));
+            }
+            let mut chunk = [0; 0x1000];
+            match self.stream.read(&mut chunk) {
+                Ok(0) => return Ok(Some(Incoming::Closed)),
+                Ok(len) => self.buf.extend_from_slice(&chunk[..len]),
+                Err(e) if matches!(e.kind(), ErrorKind::WouldBlock | ErrorKind::TimedOut) => return Ok(None),
+                Err(e) if e.kind() == ErrorKind::Interrupted => {},
+                Err(e) => return Err(e),
+            }
+        }
+    }
+
+    /// Take the first complete thing out of the buffer.
+    fn parse(&mut self) -> std::io::Result<Option<Incoming>> {
+        while let Some(&first) = self.buf.first() {
+            match first {
+                0x03 => {
+                    self.buf.remove(0);
+                    return Ok(Some(Incoming::Interrupt));
+                },
+                b'$' => {
+                    let Some(end) = self.buf.iter().position(|b| *b == b'#') else {
+                        // Don't keep a packet longer than we said we'd take,
+                        // the rest of it is dropped as it arrives.
+                        if self.buf.len() > PACKET_SIZE {
+                            warn!(target: "GDB", "Dropping a packet longer than {PACKET_SIZE:#x} bytes");
+                            self.buf.clear();
+                        }
+                        return Ok(None);
+                    };
+                    if self.buf.len() < end + 3 {
+                        return Ok(None);
+                    }
+                    let data = self.buf[1..end].to_vec();
+                    let sum = std::str::from_utf8(&self.buf[end + 1..end + 3]).ok()
+                        .and_then(|sum| u8::from_str_radix(sum, 16).ok());
+                    self.buf.drain(..end + 3);
+                    if sum != Some(checksum(&data)) {
+                        self.stream.write_all(b"-")?;
+                        continue;
+                    }
+                    if !self.no_ack {
+                        self.stream.write_all(b"+")?;
+                    }
+                    return Ok(Some(Incoming::Packet(String::from_utf8_lossy(&data).into_owned())));
+                },
+                b'-' => {
+                    self.buf.remove(0);
+                    let last = self.last.clone();
+                    self.stream.write_all(&last)?;
+                },
+                // Acknowledgements, and anything outside of a packet
+                _ => {
+                    self.buf.remove(0);
+                },
+            }
+        }
+        Ok(None)
+    }
+}
+
+/// Answer the packets that don't depend on the state of the machine.
+fn local_reply(packet: &str) -> Option<String> {
+    let reply = match packet {
+        _ if packet.starts_with("qSupported") =>
+            format!("PacketSize={PACKET_SIZE:x};qXfer:features:read+;QStartNoAckMode+"),
+        _ if packet.starts_with("qXfer:features:read:target.xml:") => {
+            let args = &packet["qXfer:features:read:target.xml:".len()..];
+            let (off, len) = args.split_once(',')?;
+            let off = usize::from_str_radix(off, 16).ok()?.min(TARGET_XML.len());
+            let len = usize::from_str_radix(len, 16).ok()?;
+            let end = (off + len).min(TARGET_XML.len());
+            let more = if end < TARGET_XML.len() { "m" } else { "l" };
+            format!("{more}{}", &TARGET_XML[off..end])
+        },
+        _ if packet.starts_with('H') => "OK".to_owned(),
+        _ if packet.starts_with('T') => "OK".to_owned(),
+        "qC" => "QC1".to_owned(),
+        "qAttached" => "1".to_owned(),
+        "qfThreadInfo" => "m1".to_owned(),
+        "qsThreadInfo" => "l".to_owned(),
+        "qSymbol::" => "OK".to_owned(),
+        _ => return None,
+    };
+    Some(reply)
+}
+
+pub struct GdbServer {
+    pub port: u16,
+    packets: Sender<String>,
+    events: Receiver<GdbEvent>,
+    interrupt: Arc<AtomicBool>,
+    attached: Arc<AtomicBool>,
+    /// Wakes up the CPU while it's idle, so that it sees interrupts.
+    arm_wake: Arc<Notifier>,
+}
+
+impl GdbServer {
+    /// Create a server on some port, and the link to be attached to the CPU
+    /// thread (see [crate::interp::debug::Debugger]).
+    pub fn new(bus: &Arc<RwLock<Bus>>, port: u16) -> (Self, GdbLink) {
+        let (packet_tx, packet_rx) = channel();
+        let (event_tx, event_rx) = channel();
+        let interrupt = Arc::new(AtomicBool::new(false));
+        let attached = Arc::new(AtomicBool::new(false));
+        let server = GdbServer {
+            port,
+            packets: packet_tx,
+            events: event_rx,
+            interrupt: interrupt.clone(),
+            attached: attached.clone(),
+            arm_wake: bus.read().arm_wake.clone(),
+        };
+        let link = GdbLink { packets: packet_rx, events: event_tx, interrupt, attached };
+        (server, link)
+    }
+
+    /// Ask the CPU to stop.
+    fn interrupt(&self) {
+        self.interrupt.store(true, Ordering::Release);
+        self.arm_wake.notify();
+    }
+
+    /// Wait for the CPU to stop, returning the stop reply.
+    fn wait_stopped(&self) -> anyhow::Result<String> {
+        loop {
+            match self.events.recv().context("The CPU thread has stopped")? {
+                GdbEvent::Stopped(reply) => return Ok(reply),
+                other => warn!(target: "GDB", "Unexpected {other:?} while running"),
+            }
+        }
+    }
+
+    /// Send a packet to the CPU thread, and wait for it to be handled.
+    /// Returns the reply, or [None] if the CPU has resumed.
+    fn relay(&self, packet: String) -> anyhow::Result<Option<String>> {
+        self.packets.send(packet).context("The CPU thread has stopped")?;
+        match self.events.recv().context("The CPU thread has stopped")? {
+            GdbEvent::Reply(reply) => Ok(Some(reply)),
+            GdbEvent::Resumed => Ok(None),
+            GdbEvent::Stopped(reply) => bail!("CPU stopped ({reply}) while it was already stopped"),
+        }
+    }
+
+    fn serve(&self, stream: TcpStream) -> anyhow::Result<()> {
+        let mut conn = Connection::new(stream)?;
+        // The client expects the target to be stopped once it's attached.
+        self.attached.store(true, Ordering::Release);
+        self.interrupt();
+        self.wait_stopped()?;
+        let mut running = false;
+        let detached = match self.session(&mut conn, &mut running) {
+            Ok(detached) => detached,
+            Err(reason) => {
+                warn!(target: "GDB", "Lost the connection to GDB: {reason:#}");
+                false
+            },
+        };
+        // Let the machine run on without the client
+        if !detached {
+            if running {
+                self.interrupt();
+                self.wait_stopped()?;
+            }
+            self.relay("D".to_owned())?;
+        }
+        self.attached.store(false, Ordering::Release);
+        Ok(())
+    }
+
+    /// Serve packets until the client goes away. Returns true if it detached
+    /// (rather than just disconnecting).
+    fn session(&self, conn: &mut Connection, running: &mut bool) -> anyhow::Result<bool> {
+        loop {
+            if *running {
+                match self.events.recv_timeout(POLL_INTERVAL) {
+                    Ok(GdbEvent::Stopped(reply)) => {
+                        *running = false;
+                        conn.send(&reply)?;
+                    },
+                    Ok(other) => warn!(target: "GDB", "Unexpected {other:?} while running"),
+                    Err(RecvTimeoutError::Timeout) => {},
+                    Err(RecvTimeoutError::Disconnected) => bail!("The CPU thread has stopped"),
+                }
+            }
+            match conn.next()? {
+                None => {},
+                Some(Incoming::Interrupt) => {
+                    if *running {
+                        self.interrupt();
+                    }
+                },
+                Some(Incoming::Packet(packet)) => {
+                    if packet == "QStartNoAckMode" {
+                        conn.send("OK")?;
+                        conn.no_ack = true;
+                    } else if let Some(reply) = local_reply(&packet) {
+                        conn.send(&reply)?;
+                    } else if *running {
+                        warn!(target: "GDB", "Ignoring packet {packet} while running");
+                    } else {
+                        let detach = packet.starts_with('D') || packet == "k";
+                        match self.relay(packet)? {
+                            Some(reply) => conn.send(&reply)?,
+                            None => *running = true,
+                        }
+                        if detach {
+                            return Ok(true);
+                        }
+                    }
+                },
+                Some(Incoming::Closed) => return Ok(false),
+            }
+        }
+    }
+}
+
+impl Backend for GdbServer {
+    fn run(&mut self) -> anyhow::Result<()> {
+        let listener = TcpListener::bind(("127.0.0.1", self.port))
+            .context(format!("Couldn't listen for GDB on port {}", self.port))?;
+        info!(target: "GDB", "Waiting for GDB on localhost:{}", self.port);
+        for stream in listener.incoming() {
+            let stream = stream?;
+            info!(target: "GDB", "GDB connected from {}", stream.peer_addr()?);
+            // Only losing the CPU thread is fatal
+            self.serve(stream)?;
+            info!(target: "GDB", "GDB disconnected");
+        }
+        Ok(())
+    }
+}
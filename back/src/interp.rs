@@ -2,10 +2,18 @@
 
 pub mod arm;
 pub mod thumb;
+pub mod block;
 pub mod dispatch;
 pub mod lut;
+pub mod snapshot;
+pub mod bench;
+pub mod trace;
+pub mod hooks;
+pub mod fuzz;
+pub mod debug;
 
 use anyhow::anyhow;
+use bincode::{Decode, Encode};
 use gimli::{BigEndian, read::*};
 use log::{error, info};
 use parking_lot::RwLock;
@@ -18,16 +26,25 @@ extern crate elf;
 
 use crate::back::*;
 use crate::interp::lut::*;
+use crate::interp::block::BlockCache;
+use crate::interp::bench::BootBench;
+use crate::interp::trace::{TraceBuffer, TraceRecord};
+use crate::interp::hooks::HookTable;
+use crate::interp::fuzz::Fuzzer;
+use crate::interp::debug::Debugger;
 use crate::interp::dispatch::DispatchRes;
 
-use crate::decode::arm::*;
-use crate::decode::thumb::*;
-
 use ironic_core::bus::*;
+use ironic_core::bus::notify::Notifier;
+use ironic_core::metrics::{self, LockUser, METRICS};
 use ironic_core::cpu::{Cpu, CpuRes};
 use ironic_core::cpu::reg::Reg;
 use ironic_core::cpu::excep::ExceptionType;
 
+/// How long to wait for the PPC while the CPU is halted and nothing is
+/// scheduled on the bus, before checking the bus again anyway.
+const IDLE_POLL: Duration = Duration::from_millis(1);
+
 static PPC_EARLY_ON: std::sync::atomic::AtomicBool = std::sync::atomic::AtomicBool::new(false);
 
 /// A list of known boot1 hashes in OTP
@@ -42,7 +59,7 @@ static BOOT1_VERSIONS: &[([u32;5], &str)] = &[
 
 
 /// Current stage in the platform's boot process.
-#[derive(PartialEq)]
+#[derive(Clone, Copy, Debug, PartialEq, Encode, Decode)]
 pub enum BootStatus { 
     /// Execution in the mask ROM.
     Boot0, 
@@ -64,14 +81,31 @@ pub enum BootStatus {
 ///
 /// Right now, the main loop works like this:
 ///
-/// - Execute all pending work on the bus
+/// - Catch the bus up, and execute all pending work on it
 /// - Update the state of any signals from the bus to the CPU
-/// - Decode/dispatch an instruction, mutating the CPU state
+/// - Decode/dispatch a slice of instructions, mutating the CPU state
+///
+/// A slice runs until the next cycle with scheduled work on the bus, or
+/// until an instruction writes to the bus through the slow path (which may
+/// schedule work, or change the state of the IRQ line). Accesses through the
+/// slow path bring the bus clock up to date first. Slices guarantee that
+/// scheduled bus work never runs before the cycle it's due on, and that any
+/// CPU access through the slow path sees the bus as of the current cycle,
+/// without taking the bus lock for every instruction.
+///
+/// This is not the same as perfectly interleaving bus and CPU cycles:
 ///
-/// For now it's sufficient to perfectly interleave bus and CPU cycles, but
-/// maybe at some point it will become more efficient to let dispatched
-/// instructions return some hint to the backend (requesting that a bus cycle
-/// should be completed before the next instruction).
+/// - The IRQ line is only sampled in [InterpBackend::begin_slice], so a
+///   change made by another thread (i.e. PPC HLE) partway through a slice is
+///   seen up to [mmio::MAX_SLICE_CYCLES] cycles late.
+/// - The JIT backend runs whole blocks, which may overrun the end of a
+///   slice. Bus work due in the meantime is done late.
+/// - While halted with nothing scheduled, [InterpBackend::check_halted]
+///   advances the clock by [mmio::MAX_SLICE_CYCLES] for each wait on the
+///   host, regardless of how much host time actually passed.
+///
+/// When the CPU is waiting for an interrupt (or spinning in an idle loop),
+/// the clock skips ahead to the next scheduled event instead.
 
 pub struct InterpBackend {
     /// Reference to a bus (attached to memories and devices).
@@ -80,97 +114,99 @@ pub struct InterpBackend {
     /// The CPU state.
     pub cpu: Cpu,
 
-    /// Number of CPU cycles elapsed.
-    pub cpu_cycle: usize,
-    /// Number of bus cycles elapsed.
-    pub bus_cycle: usize,
-
     /// Buffer for semi-hosting debug writes.
     pub svc_buf: String,
     /// Current stage in the platform boot process.
     pub boot_status: BootStatus,
     pub custom_kernel: Option<String>,
-    debugger_attached: bool,
+    /// Cache of decoded instructions, when running as a cached interpreter.
+    pub block_cache: Option<BlockCache>,
+    /// Where to save a snapshot once the kernel has been reached.
+    pub save_state_path: Option<String>,
+    /// Set when the machine was restored from a snapshot.
+    restored: bool,
+    /// Wakes up the CPU while it's idle (see [Bus::arm_wake]).
+    arm_wake: Arc<Notifier>,
+    /// The last notification seen on [InterpBackend::arm_wake].
+    wake_seen: u64,
+    /// Number of instructions retired since starting.
+    pub retired: usize,
+    /// Timing for the boot process, when benchmarking.
+    pub bench: Option<BootBench>,
+    /// History of recently executed instructions, when tracing.
+    pub trace: Option<TraceBuffer>,
+    /// Hooks on the PC, checked before each step.
+    pub hooks: HookTable,
+    /// Coverage and reset requests, when fuzzing.
+    pub fuzz: Option<Fuzzer>,
+    /// Connection to a debugger, when one can attach.
+    pub debug: Option<Debugger>,
 }
 impl InterpBackend {
     pub fn new(bus: Arc<RwLock<Bus>>, custom_kernel: Option<String>, ppc_early_on: bool) -> Self {
         if ppc_early_on {
             PPC_EARLY_ON.store(true, std::sync::atomic::Ordering::Release);
         }
+        let arm_wake = bus.read().arm_wake.clone();
+        let wake_seen = arm_wake.seq();
         InterpBackend {
             svc_buf: String::new(),
             cpu: Cpu::new(bus.clone()),
             boot_status: BootStatus::Boot0,
-            cpu_cycle: 0,
-            bus_cycle: 0,
             bus,
             custom_kernel,
-            debugger_attached: false,
+            block_cache: None,
+            save_state_path: None,
+            restored: false,
+            arm_wake,
+            wake_seen,
+            retired: 0,
+            bench: None,
+            trace: None,
+            hooks: HookTable::with_defaults(),
+            fuzz: None,
+            debug: None,
         }
     }
 }
 
 impl InterpBackend {
-    /// Check if we need to update the current boot stage.
-    pub fn update_boot_status(&mut self) {
-        match self.boot_status {
-            BootStatus::Boot0 => {
-                if self.cpu.read_fetch_pc() == 0xfff0_0000 {
-                    if let Some(bus) = self.bus.try_read_for(Duration::new(1,0)) { // Try to detect boot1 version
-                        let boot1_otp_hash =
-                        [
-                            bus.hlwd.otp.read(0),
-                            bus.hlwd.otp.read(1),
-                            bus.hlwd.otp.read(2),
-                            bus.hlwd.otp.read(3),
-                            bus.hlwd.otp.read(4),
-                        ];
-                        let mut version = "? (unknown)";
-                        for known_versions in BOOT1_VERSIONS {
-                            if boot1_otp_hash == known_versions.0 {
-                                version = known_versions.1;
-                                break;
-                            }
+    /// Move on to some stage of the boot process.
+    pub fn enter_stage(&mut self, stage: BootStatus) {
+        match stage {
+            BootStatus::Boot1 => {
+                if let Some(bus) = self.bus.try_read_for(Duration::new(1,0)) { // Try to detect boot1 version
+                    let boot1_otp_hash =
+                    [
+                        bus.hlwd.otp.read(0),
+                        bus.hlwd.otp.read(1),
+                        bus.hlwd.otp.read(2),
+                        bus.hlwd.otp.read(3),
+                        bus.hlwd.otp.read(4),
+                    ];
+                    let mut version = "? (unknown)";
+                    for known_versions in BOOT1_VERSIONS {
+                        if boot1_otp_hash == known_versions.0 {
+                            version = known_versions.1;
+                            break;
                         }
-                        info!(target: "Other", "Entered boot1. Version: boot1{version}");
                     }
-                    else { // Couldn't get bus -> no problem skip it.
-                        info!(target: "Other", "Entered boot1");
-                    }
-                    self.boot_status = BootStatus::Boot1;
-                }
-            }
-            BootStatus::Boot1 => {
-                if self.cpu.read_fetch_pc() == 0xfff0_0058 {
-                    info!(target: "Other", "Entered boot2 stub");
-                    self.boot_status = BootStatus::Boot2Stub;
+                    info!(target: "Other", "Entered boot1. Version: boot1{version}");
                 }
-            }
-            BootStatus::Boot2Stub => {
-                if self.cpu.read_fetch_pc() == 0xffff_0000 {
-                    info!(target: "Other", "Entered boot2");
-                    self.boot_status = BootStatus::Boot2;
-                }
-            }
-            BootStatus::Boot2 => {
-                if self.cpu.read_fetch_pc() == 0xffff_2224 {
-                    info!(target: "Other", "Entered kernel");
-                    self.boot_status = BootStatus::IOSKernel;
-                }
-            }
-            BootStatus::IOSKernel => {
-                if self.cpu.read_fetch_pc() == 0x0001_0000 {
-                    info!(target: "Other", "Entered foreign kernel stub");
-                    self.boot_status = BootStatus::UserKernelStub;
-                }
-            }
-            BootStatus::UserKernelStub=> {
-                if self.cpu.read_fetch_pc() == 0xffff_0000 {
-                    info!(target: "Other", "Entered foreign kernel");
-                    self.boot_status = BootStatus::UserKernel;
+                else { // Couldn't get bus -> no problem skip it.
+                    info!(target: "Other", "Entered boot1");
                 }
             },
-            _ => {},
+            BootStatus::Boot0 => {},
+            BootStatus::Boot2Stub => info!(target: "Other", "Entered boot2 stub"),
+            BootStatus::Boot2 => info!(target: "Other", "Entered boot2"),
+            BootStatus::IOSKernel => info!(target: "Other", "Entered kernel"),
+            BootStatus::UserKernelStub => info!(target: "Other", "Entered foreign kernel stub"),
+            BootStatus::UserKernel => info!(target: "Other", "Entered foreign kernel"),
+        }
+        self.boot_status = stage;
+        if let Some(bench) = self.bench.as_mut() {
+            bench.enter(stage, self.retired);
         }
     }
 
@@ -193,7 +229,7 @@ impl InterpBackend {
         // Probably a limitation of their early semihosting hardware
         // We buffer that internally until we see a newline, that's our cue to print
         let mut line_buf = [0u8; 16];
-        self.bus.read().dma_read(paddr, &mut line_buf)?;
+        metrics::read_bus(&self.bus, LockUser::Cpu).dma_read(paddr, &mut line_buf)?;
 
         let s = std::str::from_utf8(&line_buf)?
             .trim_matches(char::from(0));
@@ -213,63 +249,6 @@ impl InterpBackend {
         info!(target: "Other", "IOS syscall {opcd:08x}, lr={:08x}", self.cpu.reg[Reg::Lr]);
     }
 
-    /// Write the current instruction to stdout.
-    pub fn dbg_print(&mut self) -> anyhow::Result<()> {
-        let pc = self.cpu.read_fetch_pc();
-        if self.cpu.dbg_on {
-            if self.cpu.reg.cpsr.thumb() {
-                let opcd = self.cpu.read16(pc)?;
-                let inst = ThumbInst::decode(opcd);
-                if let ThumbInst::BlImmSuffix = inst {
-                    return Ok(());
-                }
-                let name = format!("{:?}", ThumbInst::decode(opcd));
-                info!(target: "Other", "({opcd:08x}) {name:12} {:x?}", self.cpu.reg);
-                //info!(target: "Other", "{:?}", self.cpu.reg);
-            } else {
-                let opcd = self.cpu.read32(pc)?;
-                let name = format!("{:?}", ArmInst::decode(opcd));
-                info!(target: "Other", "({opcd:08x}) {name:12} {:x?}", self.cpu.reg);
-                //info!(target: "Other", "{:?}", self.cpu.reg);
-            };
-        }
-        Ok(())
-    }
-
-    /// Patch containing a call to ThreadCancel()
-    const THREAD_CANCEL_PATCH: [u8; 0x8] = [
-        // e6000050 .word   0xe6000050
-        0xe6, 0x00, 0x00, 0x50,
-        // e12fff1e bx      lr
-        0xe1, 0x2f, 0xff, 0x1e,
-    ];
-
-    /// Skyeye intentionally kills a bunch of threads, specifically NCD, KD,
-    /// WL, and WD; presumably to avoid having to deal with emulating WLAN.
-    pub fn hotpatch_check(&mut self) -> anyhow::Result<()> {
-        use ironic_core::cpu::mmu::prim::{TLBReq, Access};
-        if self.boot_status == BootStatus::IOSKernel {
-            let pc = self.cpu.read_fetch_pc();
-            let vaddr = match pc {
-                0x13d9_0024 | // NCD
-                0x13db_0024 | // KD
-                0x13ed_0024 | // WL
-                0x13eb_0024 => Some(pc), // WD
-                _ => None
-            };
-            if let Some(vaddr) = vaddr {
-                let paddr = self.cpu.translate(
-                    TLBReq::new(vaddr, Access::Debug)
-                )?;
-                info!(target: "Other", "DBG hotpatching module entrypoint {paddr:08x}");
-                info!(target: "Other", "{:?}", self.cpu.reg);
-                self.bus.write().dma_write(paddr,
-                    &Self::THREAD_CANCEL_PATCH)?;
-            }
-        }
-        Ok(())
-    }
-
     /// Do a single step of the CPU.
     pub fn cpu_step(&mut self) -> CpuRes {
         assert!((self.cpu.read_fetch_pc() & 1) == 0);
@@ -282,49 +261,48 @@ impl InterpBackend {
             };
         }
 
-        // Fetch/decode/execute an ARM or Thumb instruction depending on
-        // the state of the Thumb flag in the CPSR.
-        let disp_res = if self.cpu.reg.cpsr.thumb() {
-            self.dbg_print().unwrap_or_default(); // Ok to fail - just a debug print
-            let opcd = match self.cpu.read16(self.cpu.read_fetch_pc()) {
-                Ok(val) => val,
-                Err(reason) => {
-                    return CpuRes::HaltEmulation(reason);
-                }
-            };
-            let func = INTERP_LUT.thumb.lookup(opcd);
-            func.0(&mut self.cpu, opcd)
-        } else {
-            self.dbg_print().unwrap_or_default(); // Ok to fail - just a debug print
-            let opcd = match self.cpu.read32(self.cpu.read_fetch_pc()) {
-                Ok(val) => val,
-                Err(reason) => {
-                    return CpuRes::HaltEmulation(reason);
-                }
-            };
-            match self.cpu.reg.cond_pass(opcd) {
-                Ok(cond_did_pass) => {
-                    if cond_did_pass {
-                        let func = INTERP_LUT.arm.lookup(opcd);
-                        func.0(&mut self.cpu, opcd)
-                    } else {
-                        DispatchRes::CondFailed
-                    }
-                },
-                Err(reason) => {
-                    DispatchRes::FatalErr(reason)
-                }
-            }
-        };
+        if self.trace.is_none() && !self.cpu.dbg_on {
+            let disp_res = self.dispatch();
+            return self.retire(disp_res);
+        }
+
+        // Record the effects of the instruction (before the PC moves on).
+        let (mut rec, regs) = TraceRecord::begin(&self.cpu);
+        let disp_res = self.dispatch();
+        rec.finish(&self.cpu, &regs);
+        if self.cpu.dbg_on {
+            info!(target: "Other", "{}", rec.disassemble());
+        }
+        if let Some(trace) = self.trace.as_mut() {
+            trace.push(rec);
+        }
+        self.retire(disp_res)
+    }
 
-        // Depending on the instruction, adjust the program counter
+    /// Decode and execute the instruction at the PC.
+    #[inline(always)]
+    fn dispatch(&mut self) -> DispatchRes {
+        match self.block_cache.as_mut() {
+            Some(cache) => cache.step(&mut self.cpu),
+            None => fetch_dispatch(&mut self.cpu),
+        }
+    }
+
+    /// Finish a dispatched instruction, adjusting the program counter and
+    /// taking any exceptions depending on the result.
+    pub fn retire(&mut self, disp_res: DispatchRes) -> CpuRes {
         let cpu_res = match disp_res {
             DispatchRes::Breakpoint => {
-                self.debugger_attached = true;
+                self.debug_trap();
                 self.cpu.increment_pc();
                 CpuRes::StepOk
             }
-            DispatchRes::RetireBranch => { CpuRes::StepOk },
+            DispatchRes::RetireBranch => {
+                if let Some(fuzz) = self.fuzz.as_mut() {
+                    fuzz.branch(self.cpu.read_fetch_pc());
+                }
+                CpuRes::StepOk
+            },
             DispatchRes::RetireOk | 
             DispatchRes::CondFailed => {
                 self.cpu.increment_pc(); 
@@ -365,13 +343,13 @@ impl InterpBackend {
             },
         };
 
-        self.update_boot_status();
         cpu_res
     }
 }
 
-impl Backend for InterpBackend {
-    fn run(&mut self) -> anyhow::Result<()> {
+impl InterpBackend {
+    /// Load the user-supplied kernel (if any) into guest memory.
+    pub fn load_custom_kernel(&mut self) -> anyhow::Result<()> {
         if self.custom_kernel.is_some() {
             // Read the user supplied kernel file
             let filename = self.custom_kernel.as_ref().unwrap();
@@ -403,12 +381,17 @@ impl Backend for InterpBackend {
                 Err(err) => {error!(target: "Custom Kernel", "Failed to load debug frames for kernel: {err}")},
             }
 
+            // The kernel is already in memory after restoring a snapshot.
+            if self.restored {
+                return Ok(());
+            }
             let headers = kernel_elf.phdrs;
             let mut bus = self.bus.write();
             // We are relying on the mirror being available
             // Or else we would be writing to mask ROM.
             bus.rom_disabled = true;
             bus.mirror_enabled = true;
+            bus.remap();
             // A basic ELF loader
             for header in headers.iter() {
                 if header.progtype == elf::types::PT_LOAD && header.filesz > 0 {
@@ -423,69 +406,182 @@ impl Backend for InterpBackend {
                 bus.hlwd.ppc_on = true;
             }
         }
-        loop {
-            // Take ownership of the bus to deal with any pending tasks
-            {
-                let mut bus = self.bus.write();
-                bus.step(self.cpu_cycle)?;
-                self.bus_cycle += 1;
-                bus.update_debug_location(Some(self.cpu.read_fetch_pc()), Some(self.cpu.reg.r[14]), Some(self.cpu.reg.r[13]));
-                self.cpu.irq_input = bus.hlwd.irq.arm_irq_output;
-            }
+        Ok(())
+    }
 
-            // Before each CPU step, check if we need to patch any close code
-            // I'm ok swallowing the possible Err result here because the only way this can error is
-            // failing to translate the address the PC is at. This is obviously very rare, and in
-            // the case it does happen we will know very soon anyway.
-            self.hotpatch_check().unwrap_or_default();
-
-            let res = self.cpu_step();
-            match res {
-                CpuRes::StepOk => {},
-                CpuRes::HaltEmulation(reason) => {
-                    error!(target: "Other", "CPU returned fatal error: {reason:#}");
-                    error!(target: "Other", "{:?}", self.cpu.reg);
-                    let pc = self.cpu.read_fetch_pc();
-                    if self.cpu.reg.cpsr.thumb() {
-                        if let Ok(opcd) = self.cpu.read16(pc){
-                            error!(target: "Other",
-                                "Possibly faulting instruction: {}",
-                                crate::bits::disassembly::disassmble_thumb(opcd, pc).unwrap_or("Unknown".to_owned())
-                            );
-                        }
-                    }
-                    else if let Ok(opcd) = self.cpu.read32(pc){
+    /// Bring the bus up to date before running a slice of instructions.
+    /// Returns the maximum number of instructions in the slice.
+    pub fn begin_slice(&mut self, bus: &mut Bus) -> anyhow::Result<usize> {
+        self.check_save_state(bus);
+        self.check_trace_request();
+        self.check_fuzz_request(bus);
+        let (hits, misses) = self.cpu.p15.tlb.take_counts();
+        METRICS.publish_tlb(hits, misses);
+        bus.catch_up(self.cpu.cycle)?;
+        bus.step()?;
+        self.cpu.irq_input = bus.hlwd.irq.arm_irq_output;
+        self.cpu.bus_sync.set(false);
+        if let Some(cache) = self.block_cache.as_mut() {
+            cache.sync(bus);
+        }
+        if self.debug_stepping() {
+            return Ok(1);
+        }
+        Ok(bus.cycles_until_event())
+    }
+
+    /// Called before each step. Returns true if the CPU is halted, in which
+    /// case the rest of the slice should be skipped.
+    ///
+    /// A halted CPU wakes up when the IRQ line is asserted (even when IRQs
+    /// are masked in the CPSR). Until then, there's nothing to execute, so
+    /// the clock skips ahead to the next scheduled task on the bus.
+    pub fn check_halted(&mut self) -> bool {
+        if !self.cpu.halted {
+            return false;
+        }
+        if self.cpu.irq_input {
+            self.cpu.halted = false;
+            return false;
+        }
+        let next_due = metrics::read_bus(&self.bus, LockUser::Cpu).tasks.next_due();
+        match next_due {
+            Some(due) => self.cpu.cycle = self.cpu.cycle.max(due),
+            None => {
+                // Don't hold up other threads waiting for the fast path
+                self.cpu.ram.leave();
+                self.wake_seen = self.arm_wake.wait(self.wake_seen, Some(IDLE_POLL));
+                self.cpu.cycle += mmio::MAX_SLICE_CYCLES;
+            },
+        }
+        true
+    }
+
+    /// Handle the result of a CPU step. Returns false when emulation should
+    /// stop (including once a boot benchmark has reached its target).
+    pub fn handle_step_result(&mut self, res: CpuRes) -> bool {
+        match res {
+            CpuRes::StepOk => {},
+            CpuRes::HaltEmulation(reason) => {
+                error!(target: "Other", "CPU returned fatal error: {reason:#}");
+                error!(target: "Other", "{:?}", self.cpu.reg);
+                let pc = self.cpu.read_fetch_pc();
+                if self.cpu.reg.cpsr.thumb() {
+                    if let Ok(opcd) = self.cpu.read16(pc){
                         error!(target: "Other",
-                            "Possibly faulting instrcution: {}",
-                            crate::bits::disassembly::disassmble_arm(opcd, pc).unwrap_or("Unknown".to_owned())
+                            "Possibly faulting instruction: {}",
+                            crate::bits::disassembly::disassmble_thumb(opcd, pc).unwrap_or("Unknown".to_owned())
                         );
                     }
-                    break;
-                },
-                CpuRes::StepException(e) => {
-                    match e {
-                        ExceptionType::Undef(_) => {},
-                        ExceptionType::Irq => {},
-                        ExceptionType::Swi => {},
-                        _ => {
-                            info!(target: "Other", "Unimplemented exception type {e:?}");
-                            break;
-                        }
+                }
+                else if let Ok(opcd) = self.cpu.read32(pc){
+                    error!(target: "Other",
+                        "Possibly faulting instrcution: {}",
+                        crate::bits::disassembly::disassmble_arm(opcd, pc).unwrap_or("Unknown".to_owned())
+                    );
+                }
+                self.dump_trace();
+                return false;
+            },
+            CpuRes::StepException(e) => {
+                match e {
+                    ExceptionType::Undef(_) => {},
+                    ExceptionType::Irq => {},
+                    ExceptionType::Swi => {},
+                    _ => {
+                        info!(target: "Other", "Unimplemented exception type {e:?}");
+                        return false;
                     }
-                },
-                CpuRes::Semihosting => {
-                    self.svc_read().unwrap_or_else(|reason|{
-                        info!(target: "Other", "FIXME: svc_read got error {reason}");
-                    });
+                }
+            },
+            CpuRes::Semihosting => {
+                self.svc_read().unwrap_or_else(|reason|{
+                    info!(target: "Other", "FIXME: svc_read got error {reason}");
+                });
+            }
+        }
+        !self.bench.as_ref().is_some_and(BootBench::done)
+    }
+}
+
+impl Backend for InterpBackend {
+    fn run(&mut self) -> anyhow::Result<()> {
+        self.load_custom_kernel()?;
+        // SAFETY: the CPU can't move while we're borrowed
+        let _location = unsafe { ironic_core::dbg::location::track(&self.cpu.reg) };
+        'run: loop {
+            self.check_debugger();
+            // Take ownership of the bus to deal with any pending tasks
+            let slice_len = {
+                let bus = self.bus.clone();
+                let mut bus = metrics::write_bus(&bus, LockUser::Cpu);
+                self.begin_slice(&mut bus)?
+            };
+
+            self.cpu.ram.enter();
+            let end = self.cpu.cycle + slice_len;
+            while self.cpu.cycle < end {
+                if self.check_halted() {
+                    break;
+                }
+                // Before each CPU step, run any hooks on the PC. Failing
+                // hooks are skipped, and the guest code runs instead.
+                if let Err(reason) = self.check_hooks() {
+                    error!(target: "Other", "Hook failed: {reason:#}");
+                }
+
+                let res = self.cpu_step();
+                if !self.handle_step_result(res) {
+                    break 'run;
+                }
+                self.cpu.cycle += 1;
+                self.retired += 1;
+                if self.cpu.cycle >= self.cpu.profile_next {
+                    self.cpu.sample_profile();
+                }
+                if self.cpu.bus_sync.get() {
+                    break;
                 }
             }
-            self.cpu_cycle += 1;
+            self.cpu.ram.leave();
         }
+        self.cpu.ram.leave();
         info!(target: "Other", "CPU stopped at pc={:08x}", self.cpu.read_fetch_pc());
         Ok(())
     }
 }
 
+/// Fetch/decode/execute an ARM or Thumb instruction depending on the state
+/// of the Thumb flag in the CPSR.
+fn fetch_dispatch(cpu: &mut Cpu) -> DispatchRes {
+    if cpu.reg.cpsr.thumb() {
+        let opcd = match cpu.fetch16(cpu.read_fetch_pc()) {
+            Ok(val) => val,
+            Err(reason) => return DispatchRes::FatalErr(reason),
+        };
+        let func = INTERP_LUT.thumb.lookup(opcd);
+        func.0(cpu, opcd)
+    } else {
+        let opcd = match cpu.fetch32(cpu.read_fetch_pc()) {
+            Ok(val) => val,
+            Err(reason) => return DispatchRes::FatalErr(reason),
+        };
+        match cpu.reg.cond_pass(opcd) {
+            Ok(cond_did_pass) => {
+                if cond_did_pass {
+                    let func = INTERP_LUT.arm.lookup(opcd);
+                    func.0(cpu, opcd)
+                } else {
+                    DispatchRes::CondFailed
+                }
+            },
+            Err(reason) => {
+                DispatchRes::FatalErr(reason)
+            }
+        }
+    }
+}
+
 macro_rules! elf_header_expect_equal {
     ($vec:ident, $have:expr, $want:expr, $message:expr) => {
         if $have != $want {
@@ -25,6 +25,10 @@ pub fn bl_imm(cpu: &mut Cpu, op: BranchBits) -> DispatchRes {
 pub fn b(cpu: &mut Cpu, op: BranchBits) -> DispatchRes {
     let offset = sign_extend(op.imm24(), 24, 30) << 2;
     let target = (cpu.read_exec_pc() as i32).wrapping_add(offset) as u32;
+    // An idle loop that can only be left by taking an interrupt
+    if target == cpu.read_fetch_pc() && !cpu.reg.cpsr.irq_disable() {
+        cpu.halted = true;
+    }
     cpu.write_exec_pc(target);
     DispatchRes::RetireBranch
 }
@@ -7,6 +7,10 @@ use crate::interp::DispatchRes;
 pub fn mcr(cpu: &mut Cpu, op: MoveCoprocBits) -> DispatchRes {
     assert_eq!(op.coproc(), 15);
     cpu.p15.write(cpu.reg[op.rt()], op.crn(), op.crm(), op.opc2());
+    if cpu.p15.wait_for_interrupt {
+        cpu.p15.wait_for_interrupt = false;
+        cpu.halted = true;
+    }
     DispatchRes::RetireOk
 }
 
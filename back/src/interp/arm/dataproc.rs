@@ -6,23 +6,12 @@ use ironic_core::cpu::alu::*;
 use crate::bits::arm::*;
 use crate::interp::DispatchRes;
 
-/// Set all of the condition flags.
-macro_rules! set_all_flags { 
-    ($cpu:ident, $n:ident, $z:ident, $c:ident, $v:ident) => {
-        $cpu.reg.cpsr.set_n($n);
-        $cpu.reg.cpsr.set_z($z);
-        $cpu.reg.cpsr.set_c($c);
-        $cpu.reg.cpsr.set_v($v);
-    }
-}
-
-pub fn add_imm(cpu: &mut Cpu, op: DpImmBits) -> DispatchRes {
-    let (val, _) = barrel_shift(ShiftArgs::Imm {
-        imm12: op.imm12(), c_in: cpu.reg.cpsr.c()
-    });
-    let (res, n, z, c, v) = add_generic(cpu.reg[op.rn()], val);
+pub fn add_imm<const S: bool>(cpu: &mut Cpu, op: DpImmBits) -> DispatchRes {
+    let (val, _) = rot_by_imm(op.imm12(), cpu.reg.cpsr.c());
+    let (a, b) = (cpu.reg[op.rn()], val);
+    let res = a.wrapping_add(b);
     if op.rd() == 15 {
-        if op.s() {
+        if S {
             if let Err(reason) = cpu.exception_return(res){
                 return DispatchRes::FatalErr(reason);
             };
@@ -32,20 +21,19 @@ pub fn add_imm(cpu: &mut Cpu, op: DpImmBits) -> DispatchRes {
         DispatchRes::RetireBranch
     } else {
         cpu.reg[op.rd()] = res;
-        if op.s() {
-            set_all_flags!(cpu, n, z, c, v);
+        if S {
+            cpu.reg.cpsr.set_add_flags(a, b);
         }
         DispatchRes::RetireOk
     }
 }
 
-pub fn rsb_imm(cpu: &mut Cpu, op: DpImmBits) -> DispatchRes {
-    let (val, _) = barrel_shift(ShiftArgs::Imm {
-        imm12: op.imm12(), c_in: cpu.reg.cpsr.c()
-    });
-    let (res, n, z, c, v) = sub_generic(val, cpu.reg[op.rn()]);
+pub fn rsb_imm<const S: bool>(cpu: &mut Cpu, op: DpImmBits) -> DispatchRes {
+    let (val, _) = rot_by_imm(op.imm12(), cpu.reg.cpsr.c());
+    let (a, b) = (val, cpu.reg[op.rn()]);
+    let res = a.wrapping_sub(b);
     if op.rd() == 15 {
-        if op.s() {
+        if S {
             if let Err(reason) = cpu.exception_return(res){
                 return DispatchRes::FatalErr(reason);
             };
@@ -55,26 +43,25 @@ pub fn rsb_imm(cpu: &mut Cpu, op: DpImmBits) -> DispatchRes {
         DispatchRes::RetireBranch
     } else {
         cpu.reg[op.rd()] = res;
-        if op.s() {
-            set_all_flags!(cpu, n, z, c, v);
+        if S {
+            cpu.reg.cpsr.set_sub_flags(a, b);
         }
         DispatchRes::RetireOk
     }
 }
 
-pub fn sub_imm(cpu: &mut Cpu, op: DpImmBits) -> DispatchRes {
-    let (val, _) = barrel_shift(ShiftArgs::Imm {
-        imm12: op.imm12(), c_in: cpu.reg.cpsr.c()
-    });
+pub fn sub_imm<const S: bool>(cpu: &mut Cpu, op: DpImmBits) -> DispatchRes {
+    let (val, _) = rot_by_imm(op.imm12(), cpu.reg.cpsr.c());
     let rn_val = if op.rn() == 15 {
         cpu.read_exec_pc()
     } else {
         cpu.reg[op.rn()]
     };
 
-    let (res, n, z, c, v) = sub_generic(rn_val, val);
+    let (a, b) = (rn_val, val);
+    let res = a.wrapping_sub(b);
     if op.rd() == 15 {
-        if op.s() {
+        if S {
             if let Err(reason) = cpu.exception_return(res){
                 return DispatchRes::FatalErr(reason);
             };
@@ -84,22 +71,20 @@ pub fn sub_imm(cpu: &mut Cpu, op: DpImmBits) -> DispatchRes {
         DispatchRes::RetireBranch
     } else {
         cpu.reg[op.rd()] = res;
-        if op.s() {
-            set_all_flags!(cpu, n, z, c, v);
+        if S {
+            cpu.reg.cpsr.set_sub_flags(a, b);
         }
         DispatchRes::RetireOk
     }
 }
 
-pub fn mvn_imm(cpu: &mut Cpu, op: MovImmBits) -> DispatchRes {
+pub fn mvn_imm<const S: bool>(cpu: &mut Cpu, op: MovImmBits) -> DispatchRes {
     assert_ne!(op.rd(), 15);
 
-    let (val, carry) = barrel_shift(ShiftArgs::Imm { 
-        imm12: op.imm12(), c_in: cpu.reg.cpsr.c() 
-    });
+    let (val, carry) = rot_by_imm(op.imm12(), cpu.reg.cpsr.c());
     let res = !val;
     if op.rd() == 15 {
-        if op.s() {
+        if S {
             if let Err(reason) = cpu.exception_return(res){
                 return DispatchRes::FatalErr(reason);
             };
@@ -109,22 +94,18 @@ pub fn mvn_imm(cpu: &mut Cpu, op: MovImmBits) -> DispatchRes {
         DispatchRes::RetireBranch
     } else {
         cpu.reg[op.rd()] = res;
-        if op.s() {
-            cpu.reg.cpsr.set_n((res & 0x8000_0000) != 0);
-            cpu.reg.cpsr.set_z(res == 0);
-            cpu.reg.cpsr.set_c(carry);
+        if S {
+            cpu.reg.cpsr.set_logic_flags(res, carry);
         }
         DispatchRes::RetireOk
     }
 }
 
-pub fn mov_imm(cpu: &mut Cpu, op: MovImmBits) -> DispatchRes {
+pub fn mov_imm<const S: bool>(cpu: &mut Cpu, op: MovImmBits) -> DispatchRes {
     assert_ne!(op.rd(), 15);
-    let (res, carry) = barrel_shift(ShiftArgs::Imm { 
-        imm12: op.imm12(), c_in: cpu.reg.cpsr.c() 
-    });
+    let (res, carry) = rot_by_imm(op.imm12(), cpu.reg.cpsr.c());
     if op.rd() == 15 {
-        if op.s() {
+        if S {
             if let Err(reason) = cpu.exception_return(res){
                 return DispatchRes::FatalErr(reason);
             };
@@ -134,21 +115,17 @@ pub fn mov_imm(cpu: &mut Cpu, op: MovImmBits) -> DispatchRes {
         DispatchRes::RetireBranch
     } else {
         cpu.reg[op.rd()] = res;
-        if op.s() {
-            cpu.reg.cpsr.set_n((res & 0x8000_0000) != 0);
-            cpu.reg.cpsr.set_z(res == 0);
-            cpu.reg.cpsr.set_c(carry);
+        if S {
+            cpu.reg.cpsr.set_logic_flags(res, carry);
         }
         DispatchRes::RetireOk
     }
 }
 
 
-pub fn add_reg(cpu: &mut Cpu, op: DpRegBits) -> DispatchRes {
+pub fn add_reg<const S: bool, const STYPE: u32>(cpu: &mut Cpu, op: DpRegBits) -> DispatchRes {
     let rm = if op.rm() == 15 { cpu.read_exec_pc() } else { cpu.reg[op.rm()] };
-    let (val, _) = barrel_shift(ShiftArgs::Reg { rm, 
-        stype: op.stype(), imm5: op.imm5(), c_in: cpu.reg.cpsr.c()
-    });
+    let (val, _) = shift_imm::<STYPE>(rm, op.imm5(), cpu.reg.cpsr.c());
 
     let rn_val = if op.rn() == 15 {
         cpu.read_exec_pc()
@@ -156,10 +133,11 @@ pub fn add_reg(cpu: &mut Cpu, op: DpRegBits) -> DispatchRes {
         cpu.reg[op.rn()]
     };
 
-    let (res, n, z, c, v) = add_generic(rn_val, val);
+    let (a, b) = (rn_val, val);
+    let res = a.wrapping_add(b);
 
     if op.rd() == 15 {
-        if op.s() {
+        if S {
             if let Err(reason) = cpu.exception_return(res){
                 return DispatchRes::FatalErr(reason);
             };
@@ -169,20 +147,19 @@ pub fn add_reg(cpu: &mut Cpu, op: DpRegBits) -> DispatchRes {
         DispatchRes::RetireBranch
     } else {
         cpu.reg[op.rd()] = res;
-        if op.s() {
-            set_all_flags!(cpu, n, z, c, v);
+        if S {
+            cpu.reg.cpsr.set_add_flags(a, b);
         }
         DispatchRes::RetireOk
     }
 }
 
-pub fn rsb_reg(cpu: &mut Cpu, op: DpRegBits) -> DispatchRes {
-    let (val, _) = barrel_shift(ShiftArgs::Reg { rm: cpu.reg[op.rm()],
-        stype: op.stype(), imm5: op.imm5(), c_in: cpu.reg.cpsr.c()
-    });
-    let (res, n, z, c, v) = sub_generic(val, cpu.reg[op.rn()]);
+pub fn rsb_reg<const S: bool, const STYPE: u32>(cpu: &mut Cpu, op: DpRegBits) -> DispatchRes {
+    let (val, _) = shift_imm::<STYPE>(cpu.reg[op.rm()], op.imm5(), cpu.reg.cpsr.c());
+    let (a, b) = (val, cpu.reg[op.rn()]);
+    let res = a.wrapping_sub(b);
     if op.rd() == 15 {
-        if op.s() {
+        if S {
             if let Err(reason) = cpu.exception_return(res){
                 return DispatchRes::FatalErr(reason);
             };
@@ -192,21 +169,20 @@ pub fn rsb_reg(cpu: &mut Cpu, op: DpRegBits) -> DispatchRes {
         DispatchRes::RetireBranch
     } else {
         cpu.reg[op.rd()] = res;
-        if op.s() {
-            set_all_flags!(cpu, n, z, c, v);
+        if S {
+            cpu.reg.cpsr.set_sub_flags(a, b);
         }
         DispatchRes::RetireOk
     }
 }
 
-pub fn sub_reg(cpu: &mut Cpu, op: DpRegBits) -> DispatchRes {
+pub fn sub_reg<const S: bool, const STYPE: u32>(cpu: &mut Cpu, op: DpRegBits) -> DispatchRes {
     let rm = if op.rm() == 15 { cpu.read_exec_pc() } else { cpu.reg[op.rm()] };
-    let (val, _) = barrel_shift(ShiftArgs::Reg { rm, 
-        stype: op.stype(), imm5: op.imm5(), c_in: cpu.reg.cpsr.c()
-    });
-    let (res, n, z, c, v) = sub_generic(cpu.reg[op.rn()], val);
+    let (val, _) = shift_imm::<STYPE>(rm, op.imm5(), cpu.reg.cpsr.c());
+    let (a, b) = (cpu.reg[op.rn()], val);
+    let res = a.wrapping_sub(b);
     if op.rd() == 15 {
-        if op.s() {
+        if S {
             if let Err(reason) = cpu.exception_return(res){
                 return DispatchRes::FatalErr(reason);
             };
@@ -216,21 +192,19 @@ pub fn sub_reg(cpu: &mut Cpu, op: DpRegBits) -> DispatchRes {
         DispatchRes::RetireBranch
     } else {
         cpu.reg[op.rd()] = res;
-        if op.s() {
-            set_all_flags!(cpu, n, z, c, v);
+        if S {
+            cpu.reg.cpsr.set_sub_flags(a, b);
         }
         DispatchRes::RetireOk
     }
 
 }
 
-pub fn mvn_reg(cpu: &mut Cpu, op: MovRegBits) -> DispatchRes {
-    let (val, carry) = barrel_shift(ShiftArgs::Reg { rm: cpu.reg[op.rm()],
-        stype: op.stype(), imm5: op.imm5(), c_in: cpu.reg.cpsr.c(),
-    });
+pub fn mvn_reg<const S: bool, const STYPE: u32>(cpu: &mut Cpu, op: MovRegBits) -> DispatchRes {
+    let (val, carry) = shift_imm::<STYPE>(cpu.reg[op.rm()], op.imm5(), cpu.reg.cpsr.c());
     let res = !val;
     if op.rd() == 15  {
-        if op.s() {
+        if S {
             if let Err(reason) = cpu.exception_return(res){
                 return DispatchRes::FatalErr(reason);
             };
@@ -240,22 +214,18 @@ pub fn mvn_reg(cpu: &mut Cpu, op: MovRegBits) -> DispatchRes {
         DispatchRes::RetireBranch
     } else {
         cpu.reg[op.rd()] = res;
-        if op.s() {
-            cpu.reg.cpsr.set_n((res & 0x8000_0000) != 0);
-            cpu.reg.cpsr.set_z(res == 0);
-            cpu.reg.cpsr.set_c(carry);
+        if S {
+            cpu.reg.cpsr.set_logic_flags(res, carry);
         }
         DispatchRes::RetireOk
     }
 }
 
-pub fn mov_reg(cpu: &mut Cpu, op: MovRegBits) -> DispatchRes {
+pub fn mov_reg<const S: bool, const STYPE: u32>(cpu: &mut Cpu, op: MovRegBits) -> DispatchRes {
     let rm = if op.rm() == 15 { cpu.read_exec_pc() } else { cpu.reg[op.rm()] };
-    let (res, carry) = barrel_shift(ShiftArgs::Reg { rm,
-        stype: op.stype(), imm5: op.imm5(), c_in: cpu.reg.cpsr.c()
-    });
+    let (res, carry) = shift_imm::<STYPE>(rm, op.imm5(), cpu.reg.cpsr.c());
     if op.rd() == 15 {
-        if op.s() { 
+        if S { 
             if let Err(reason) = cpu.exception_return(res){
                 return DispatchRes::FatalErr(reason);
             };
@@ -265,10 +235,8 @@ pub fn mov_reg(cpu: &mut Cpu, op: MovRegBits) -> DispatchRes {
         DispatchRes::RetireBranch
     } else {
         cpu.reg[op.rd()] = res;
-        if op.s() {
-            cpu.reg.cpsr.set_n((res & 0x8000_0000) != 0);
-            cpu.reg.cpsr.set_z(res == 0);
-            cpu.reg.cpsr.set_c(carry);
+        if S {
+            cpu.reg.cpsr.set_logic_flags(res, carry);
         }
         DispatchRes::RetireOk
     }
@@ -288,13 +256,7 @@ pub fn mov_rsr(cpu: &mut Cpu, op: MovRsrBits) -> DispatchRes {
         },
         (true, false) => { // S + no PC == set flags
             cpu.reg[op.rd()] = val;
-            let (n,z,c, v) = (
-                ((val >> 31) & 0x1 == 1), // N
-                val == 0, // Z
-                carry, // C
-                cpu.reg.cpsr.v() // V
-            );
-            set_all_flags!(cpu, n, z, c, v);
+            cpu.reg.cpsr.set_logic_flags(val, carry);
             DispatchRes::RetireOk
         },
         (false, true) => { // no S + PC == branch
@@ -320,9 +282,7 @@ pub fn orr_rsr(cpu: &mut Cpu, op: DpRsrBits) -> DispatchRes {
 
     let res = cpu.reg[op.rn()] | val;
     if op.s() {
-        cpu.reg.cpsr.set_n((res & 0x8000_0000) != 0);
-        cpu.reg.cpsr.set_z(res == 0);
-        cpu.reg.cpsr.set_c(carry);
+        cpu.reg.cpsr.set_logic_flags(res, carry);
     }
     cpu.reg[op.rd()] = res;
     DispatchRes::RetireOk
@@ -339,9 +299,7 @@ pub fn and_rsr(cpu: &mut Cpu, op: DpRsrBits) -> DispatchRes {
 
     let res = cpu.reg[op.rn()] & val;
     if op.s() {
-        cpu.reg.cpsr.set_n((res & 0x8000_0000) != 0);
-        cpu.reg.cpsr.set_z(res == 0);
-        cpu.reg.cpsr.set_c(carry);
+        cpu.reg.cpsr.set_logic_flags(res, carry);
     }
     cpu.reg[op.rd()] = res;
     DispatchRes::RetireOk
@@ -350,17 +308,13 @@ pub fn and_rsr(cpu: &mut Cpu, op: DpRsrBits) -> DispatchRes {
 
 
 #[allow(unreachable_patterns)]
-fn do_bitwise_reg(cpu: &mut Cpu, opcd: DpRegBits, op: BitwiseOp) -> DispatchRes {
+fn do_bitwise_reg<const S: bool, const STYPE: u32>(cpu: &mut Cpu, opcd: DpRegBits, op: BitwiseOp) -> DispatchRes {
     let rn = opcd.rn();
     let rm = opcd.rm();
     let rd = opcd.rd();
     let imm5 = opcd.imm5();
-    let s = opcd.s();
-    let stype = opcd.stype();
     assert_ne!(rd, 15);
-    let (val, carry) = barrel_shift(ShiftArgs::Reg {
-        rm: cpu.reg[rm], stype, imm5, c_in: cpu.reg.cpsr.c()
-    });
+    let (val, carry) = shift_imm::<STYPE>(cpu.reg[rm], imm5, cpu.reg.cpsr.c());
     let base = cpu.reg[rn];
     let res = match op {
         BitwiseOp::And => base & val,
@@ -370,7 +324,7 @@ fn do_bitwise_reg(cpu: &mut Cpu, opcd: DpRegBits, op: BitwiseOp) -> DispatchRes
         _ => { return DispatchRes::FatalErr(anyhow!("ARM reg bitwise {op:?} unimpl")); },
     };
     if rd == 15 {
-        if s {
+        if S {
             if let Err(reason) = cpu.exception_return(res){
                 return DispatchRes::FatalErr(reason);
             };
@@ -380,35 +334,31 @@ fn do_bitwise_reg(cpu: &mut Cpu, opcd: DpRegBits, op: BitwiseOp) -> DispatchRes
         DispatchRes::RetireBranch
     } else {
         cpu.reg[rd] = res;
-        if s {
-            cpu.reg.cpsr.set_n((res & 0x8000_0000) != 0);
-            cpu.reg.cpsr.set_z(res == 0);
-            cpu.reg.cpsr.set_c(carry);
+        if S {
+            cpu.reg.cpsr.set_logic_flags(res, carry);
         }
         DispatchRes::RetireOk
     }
 }
-pub fn orr_reg(cpu: &mut Cpu, op: DpRegBits) -> DispatchRes {
-    do_bitwise_reg(cpu, op, BitwiseOp::Orr)
+pub fn orr_reg<const S: bool, const STYPE: u32>(cpu: &mut Cpu, op: DpRegBits) -> DispatchRes {
+    do_bitwise_reg::<S, STYPE>(cpu, op, BitwiseOp::Orr)
 }
-pub fn eor_reg(cpu: &mut Cpu, op: DpRegBits) -> DispatchRes {
-    do_bitwise_reg(cpu, op, BitwiseOp::Eor)
+pub fn eor_reg<const S: bool, const STYPE: u32>(cpu: &mut Cpu, op: DpRegBits) -> DispatchRes {
+    do_bitwise_reg::<S, STYPE>(cpu, op, BitwiseOp::Eor)
 }
-pub fn and_reg(cpu: &mut Cpu, op: DpRegBits) -> DispatchRes {
-    do_bitwise_reg(cpu, op, BitwiseOp::And)
+pub fn and_reg<const S: bool, const STYPE: u32>(cpu: &mut Cpu, op: DpRegBits) -> DispatchRes {
+    do_bitwise_reg::<S, STYPE>(cpu, op, BitwiseOp::And)
 }
-pub fn bic_reg(cpu: &mut Cpu, op: DpRegBits) -> DispatchRes {
-    do_bitwise_reg(cpu, op, BitwiseOp::Bic)
+pub fn bic_reg<const S: bool, const STYPE: u32>(cpu: &mut Cpu, op: DpRegBits) -> DispatchRes {
+    do_bitwise_reg::<S, STYPE>(cpu, op, BitwiseOp::Bic)
 }
 
 
 #[allow(unreachable_patterns)]
-fn do_bitwise_imm(cpu: &mut Cpu, rn: u32, rd: u32, imm: u32, 
-    s: bool, op: BitwiseOp) -> DispatchRes {
+fn do_bitwise_imm<const S: bool>(cpu: &mut Cpu, rn: u32, rd: u32, imm: u32,
+    op: BitwiseOp) -> DispatchRes {
     assert_ne!(rd, 15);
-    let (val, carry) = barrel_shift(ShiftArgs::Imm { 
-        imm12: imm, c_in: cpu.reg.cpsr.c() 
-    });
+    let (val, carry) = rot_by_imm(imm, cpu.reg.cpsr.c());
     let base = cpu.reg[rn];
     let res = match op {
         BitwiseOp::And => base & val,
@@ -418,7 +368,7 @@ fn do_bitwise_imm(cpu: &mut Cpu, rn: u32, rd: u32, imm: u32,
         _ => { return DispatchRes::FatalErr(anyhow!("ARM imm bitwise {op:?} unimplemented")); },
     };
     if rd == 15 {
-        if s {
+        if S {
             if let Err(reason) = cpu.exception_return(res){
                 return DispatchRes::FatalErr(reason);
             };
@@ -428,85 +378,63 @@ fn do_bitwise_imm(cpu: &mut Cpu, rn: u32, rd: u32, imm: u32,
         DispatchRes::RetireBranch
     } else {
         cpu.reg[rd] = res;
-        if s {
-            cpu.reg.cpsr.set_n((res & 0x8000_0000) != 0);
-            cpu.reg.cpsr.set_z(res == 0);
-            cpu.reg.cpsr.set_c(carry);
+        if S {
+            cpu.reg.cpsr.set_logic_flags(res, carry);
         }
         DispatchRes::RetireOk
     }
 }
-pub fn and_imm(cpu: &mut Cpu, op: DpImmBits) -> DispatchRes {
-    do_bitwise_imm(cpu, op.rn(), op.rd(), op.imm12(), op.s(), BitwiseOp::And)
+pub fn and_imm<const S: bool>(cpu: &mut Cpu, op: DpImmBits) -> DispatchRes {
+    do_bitwise_imm::<S>(cpu, op.rn(), op.rd(), op.imm12(), BitwiseOp::And)
 }
-pub fn bic_imm(cpu: &mut Cpu, op: DpImmBits) -> DispatchRes {
-    do_bitwise_imm(cpu, op.rn(), op.rd(), op.imm12(), op.s(), BitwiseOp::Bic)
+pub fn bic_imm<const S: bool>(cpu: &mut Cpu, op: DpImmBits) -> DispatchRes {
+    do_bitwise_imm::<S>(cpu, op.rn(), op.rd(), op.imm12(), BitwiseOp::Bic)
 }
-pub fn orr_imm(cpu: &mut Cpu, op: DpImmBits) -> DispatchRes {
-    do_bitwise_imm(cpu, op.rn(), op.rd(), op.imm12(), op.s(), BitwiseOp::Orr)
+pub fn orr_imm<const S: bool>(cpu: &mut Cpu, op: DpImmBits) -> DispatchRes {
+    do_bitwise_imm::<S>(cpu, op.rn(), op.rd(), op.imm12(), BitwiseOp::Orr)
 }
-pub fn eor_imm(cpu: &mut Cpu, op: DpImmBits) -> DispatchRes {
-    do_bitwise_imm(cpu, op.rn(), op.rd(), op.imm12(), op.s(), BitwiseOp::Eor)
+pub fn eor_imm<const S: bool>(cpu: &mut Cpu, op: DpImmBits) -> DispatchRes {
+    do_bitwise_imm::<S>(cpu, op.rn(), op.rd(), op.imm12(), BitwiseOp::Eor)
 }
 
 
 
 
 pub fn cmn_imm(cpu: &mut Cpu, op: DpTestImmBits) -> DispatchRes {
-    let (val, _) = barrel_shift(ShiftArgs::Imm {
-        imm12: op.imm12(), c_in: cpu.reg.cpsr.c()
-    });
-    let (_, n, z, c, v) = add_generic(cpu.reg[op.rn()], val);
-    set_all_flags!(cpu, n, z, c, v);
+    let (val, _) = rot_by_imm(op.imm12(), cpu.reg.cpsr.c());
+    let (a, b) = (cpu.reg[op.rn()], val);
+    cpu.reg.cpsr.set_add_flags(a, b);
     DispatchRes::RetireOk
 }
 
 pub fn cmp_imm(cpu: &mut Cpu, op: DpTestImmBits) -> DispatchRes {
-    let (val, _) = barrel_shift(ShiftArgs::Imm {
-        imm12: op.imm12(), c_in: cpu.reg.cpsr.c()
-    });
-    let (_, n, z, c, v) = sub_generic(cpu.reg[op.rn()], val);
-    set_all_flags!(cpu, n, z, c, v);
+    let (val, _) = rot_by_imm(op.imm12(), cpu.reg.cpsr.c());
+    let (a, b) = (cpu.reg[op.rn()], val);
+    cpu.reg.cpsr.set_sub_flags(a, b);
     DispatchRes::RetireOk
 }
 
-pub fn cmp_reg(cpu: &mut Cpu, op: DpTestRegBits) -> DispatchRes {
-    let (val, _) = barrel_shift(ShiftArgs::Reg {
-        rm: cpu.reg[op.rm()], 
-        stype: op.stype(), 
-        imm5: op.imm5(), 
-        c_in: cpu.reg.cpsr.c()
-    });
+pub fn cmp_reg<const STYPE: u32>(cpu: &mut Cpu, op: DpTestRegBits) -> DispatchRes {
+    let (val, _) = shift_imm::<STYPE>(cpu.reg[op.rm()], op.imm5(), cpu.reg.cpsr.c());
 
-    let (_, n, z, c, v) = sub_generic(cpu.reg[op.rn()], val);
-    set_all_flags!(cpu, n, z, c, v);
+    let (a, b) = (cpu.reg[op.rn()], val);
+    cpu.reg.cpsr.set_sub_flags(a, b);
     DispatchRes::RetireOk
 }
 
 
 pub fn tst_imm(cpu: &mut Cpu, op: DpTestImmBits) -> DispatchRes {
-    let (val, carry) = barrel_shift(ShiftArgs::Imm {
-        imm12: op.imm12(), c_in: cpu.reg.cpsr.c()
-    });
+    let (val, carry) = rot_by_imm(op.imm12(), cpu.reg.cpsr.c());
     let res = cpu.reg[op.rn()] & val;
-    cpu.reg.cpsr.set_n(res & 0x8000_0000 != 0);
-    cpu.reg.cpsr.set_z(res == 0);
-    cpu.reg.cpsr.set_c(carry);
+    cpu.reg.cpsr.set_logic_flags(res, carry);
     DispatchRes::RetireOk
 }
 
-pub fn tst_reg(cpu: &mut Cpu, op: DpTestRegBits) -> DispatchRes {
-    let (val, carry) = barrel_shift(ShiftArgs::Reg {
-        rm: cpu.reg[op.rm()], 
-        stype: op.stype(), 
-        imm5: op.imm5(), 
-        c_in: cpu.reg.cpsr.c()
-    });
+pub fn tst_reg<const STYPE: u32>(cpu: &mut Cpu, op: DpTestRegBits) -> DispatchRes {
+    let (val, carry) = shift_imm::<STYPE>(cpu.reg[op.rm()], op.imm5(), cpu.reg.cpsr.c());
 
     let res = cpu.reg[op.rn()] & val;
-    cpu.reg.cpsr.set_n(res & 0x8000_0000 != 0);
-    cpu.reg.cpsr.set_z(res == 0);
-    cpu.reg.cpsr.set_c(carry);
+    cpu.reg.cpsr.set_logic_flags(res, carry);
     DispatchRes::RetireOk
 }
 
@@ -535,9 +463,7 @@ pub fn bic_rsr(cpu: &mut Cpu, op: DpRsrBits) -> DispatchRes {
     let res = cpu.reg[op.rn()] & !val;
 
     if op.s() {
-        cpu.reg.cpsr.set_n((res & 0x8000_0000) != 0);
-        cpu.reg.cpsr.set_z(res == 0);
-        cpu.reg.cpsr.set_c(carry);
+        cpu.reg.cpsr.set_logic_flags(res, carry);
     }
 
     cpu.reg[op.rd()] = res;
@@ -546,38 +472,27 @@ pub fn bic_rsr(cpu: &mut Cpu, op: DpRsrBits) -> DispatchRes {
 }
 
 pub fn adc_imm(cpu: &mut Cpu, op: DpImmBits) -> DispatchRes {
-    let (res, n, z, c,v ) = add_generic(cpu.reg[op.rn()], op.imm12());
+    let (a, b) = (cpu.reg[op.rn()], op.imm12());
+    let res = a.wrapping_add(b);
     cpu.reg[op.rd()] = res;
     if op.s() {
-        set_all_flags!(cpu, n, z, c, v);
+        cpu.reg.cpsr.set_add_flags(a, b);
     }
     DispatchRes::RetireOk
 }
 
 pub fn teq_imm(cpu: &mut Cpu, op: DpTestImmBits) -> DispatchRes {
-    let (val, carry) = barrel_shift(ShiftArgs::Imm {
-        imm12: op.imm12(),
-        c_in: cpu.reg.cpsr.c(),
-    });
+    let (val, carry) = rot_by_imm(op.imm12(), cpu.reg.cpsr.c());
 
     let res = cpu.reg[op.rn()] ^ val;
-    cpu.reg.cpsr.set_n(res & 0x8000_0000 != 0);
-    cpu.reg.cpsr.set_z(res == 0);
-    cpu.reg.cpsr.set_c(carry);
+    cpu.reg.cpsr.set_logic_flags(res, carry);
     DispatchRes::RetireOk
 }
 
-pub fn teq_reg(cpu: &mut Cpu, op: DpTestRegBits) -> DispatchRes {
-    let (val, carry) = barrel_shift(ShiftArgs::Reg {
-        rm: cpu.reg[op.rm()],
-        stype: op.stype(),
-        imm5: op.imm5(),
-        c_in: cpu.reg.cpsr.c(),
-    });
+pub fn teq_reg<const STYPE: u32>(cpu: &mut Cpu, op: DpTestRegBits) -> DispatchRes {
+    let (val, carry) = shift_imm::<STYPE>(cpu.reg[op.rm()], op.imm5(), cpu.reg.cpsr.c());
 
     let res = cpu.reg[op.rn()] ^ val;
-    cpu.reg.cpsr.set_n(res & 0x8000_0000 != 0);
-    cpu.reg.cpsr.set_z(res == 0);
-    cpu.reg.cpsr.set_c(carry);
+    cpu.reg.cpsr.set_logic_flags(res, carry);
     DispatchRes::RetireOk
 }
\ No newline at end of file
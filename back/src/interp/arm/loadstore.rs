@@ -8,9 +8,11 @@ use ironic_core::cpu::alu::*;
 use crate::bits::arm::*;
 use crate::interp::DispatchRes;
 
-pub fn do_amode(rn: u32, imm: u32, u: bool, p: bool, w: bool) -> anyhow::Result<(u32, u32)> {
-    let res = if u { rn.wrapping_add(imm) } else { rn.wrapping_sub(imm) };
-    match (p, w) {
+/// Returns the address to access and the address written back to Rn.
+#[inline(always)]
+pub fn do_amode<const P: bool, const U: bool, const W: bool>(rn: u32, imm: u32) -> anyhow::Result<(u32, u32)> {
+    let res = if U { rn.wrapping_add(imm) } else { rn.wrapping_sub(imm) };
+    match (P, W) {
         (false, false)  => Ok((rn, res)),
         (true, false)   => Ok((res, rn)),
         (true, true)    => Ok((res, res)),
@@ -26,15 +28,14 @@ pub fn do_amode_lit(pc: u32, imm: u32, p: bool, u: bool) -> u32 {
     }
 }
 
-pub fn ldrb_imm(cpu: &mut Cpu, op: LsImmBits) -> DispatchRes {
+pub fn ldrb_imm<const P: bool, const U: bool, const W: bool>(cpu: &mut Cpu, op: LsImmBits) -> DispatchRes {
     assert_ne!(op.rt(), 15);
     let res = if op.rn() == 15 {
-        assert!(!op.w());
-        let addr = do_amode_lit(cpu.read_exec_pc(), op.imm12(), op.p(), op.u());
+        assert!(!W);
+        let addr = do_amode_lit(cpu.read_exec_pc(), op.imm12(), P, U);
         cpu.read8(addr)
     } else {
-        let (addr, wb_addr) = match do_amode(cpu.reg[op.rn()],
-            op.imm12(), op.u(), op.p(), op.w()){
+        let (addr, wb_addr) = match do_amode::<P, U, W>(cpu.reg[op.rn()], op.imm12()){
                 Ok(val) => val,
                 Err(reason) => { return DispatchRes::FatalErr(reason); }
             };
@@ -51,10 +52,10 @@ pub fn ldrb_imm(cpu: &mut Cpu, op: LsImmBits) -> DispatchRes {
     DispatchRes::RetireOk
 }
 
-pub fn ldrh_imm(cpu: &mut Cpu, op: LsSignedImmBits) -> DispatchRes {
+pub fn ldrh_imm<const P: bool, const U: bool, const W: bool>(cpu: &mut Cpu, op: LsSignedImmBits) -> DispatchRes {
     assert_ne!(op.rt(), 15);
     let offset = (op.imm4h() << 4) | op.imm4l();
-    let (addr,wb_addr) = match do_amode(cpu.reg[op.rn()], offset, op.u(), op.p(), op.w()) {
+    let (addr,wb_addr) = match do_amode::<P, U, W>(cpu.reg[op.rn()], offset) {
         Ok(val) => val,
         Err(reason) => { return DispatchRes::FatalErr(reason); }
     };
@@ -71,14 +72,13 @@ pub fn ldrh_imm(cpu: &mut Cpu, op: LsSignedImmBits) -> DispatchRes {
 
 
 
-pub fn ldr_imm(cpu: &mut Cpu, op: LsImmBits) -> DispatchRes {
+pub fn ldr_imm<const P: bool, const U: bool, const W: bool>(cpu: &mut Cpu, op: LsImmBits) -> DispatchRes {
     let res = if op.rn() == 15 {
-        assert!(!op.w());
-        let addr = do_amode_lit(cpu.read_exec_pc(), op.imm12(), op.p(), op.u());
+        assert!(!W);
+        let addr = do_amode_lit(cpu.read_exec_pc(), op.imm12(), P, U);
         cpu.read32(addr)
     } else {
-        let (addr, wb_addr) = match do_amode(cpu.reg[op.rn()],
-            op.imm12(), op.u(), op.p(), op.w()){
+        let (addr, wb_addr) = match do_amode::<P, U, W>(cpu.reg[op.rn()], op.imm12()){
                 Ok(val) => val,
                 Err(reason) => { return DispatchRes::FatalErr(reason); }
             };
@@ -101,9 +101,8 @@ pub fn ldr_imm(cpu: &mut Cpu, op: LsImmBits) -> DispatchRes {
     }
 }
 
-pub fn str_imm(cpu: &mut Cpu, op: LsImmBits) -> DispatchRes {
-    let (addr, wb_addr) = match do_amode(cpu.reg[op.rn()],
-    op.imm12(), op.u(), op.p(), op.w()){
+pub fn str_imm<const P: bool, const U: bool, const W: bool>(cpu: &mut Cpu, op: LsImmBits) -> DispatchRes {
+    let (addr, wb_addr) = match do_amode::<P, U, W>(cpu.reg[op.rn()], op.imm12()){
         Ok(val) => val,
         Err(reason) => { return DispatchRes::FatalErr(reason); }
     };
@@ -113,9 +112,8 @@ pub fn str_imm(cpu: &mut Cpu, op: LsImmBits) -> DispatchRes {
         Err(reason) => DispatchRes::FatalErr(reason)
     }
 }
-pub fn strb_imm(cpu: &mut Cpu, op: LsImmBits) -> DispatchRes {
-    let (addr, wb_addr) = match do_amode(cpu.reg[op.rn()],
-    op.imm12(), op.u(), op.p(), op.w()){
+pub fn strb_imm<const P: bool, const U: bool, const W: bool>(cpu: &mut Cpu, op: LsImmBits) -> DispatchRes {
+    let (addr, wb_addr) = match do_amode::<P, U, W>(cpu.reg[op.rn()], op.imm12()){
         Ok(val) => val,
         Err(reason) => { return DispatchRes::FatalErr(reason); }
     };
@@ -129,13 +127,10 @@ pub fn strb_imm(cpu: &mut Cpu, op: LsImmBits) -> DispatchRes {
 
 
 
-pub fn ldr_reg(cpu: &mut Cpu, op: LsRegBits) -> DispatchRes {
-    let (offset, _) = barrel_shift(ShiftArgs::Reg { rm: cpu.reg[op.rm()],
-        stype: op.stype(), imm5: op.imm5(), c_in: cpu.reg.cpsr.c()
-    });
+pub fn ldr_reg<const P: bool, const U: bool, const W: bool, const STYPE: u32>(cpu: &mut Cpu, op: LsRegBits) -> DispatchRes {
+    let (offset, _) = shift_imm::<STYPE>(cpu.reg[op.rm()], op.imm5(), cpu.reg.cpsr.c());
 
-    let (addr, wb_addr) = match do_amode(cpu.reg[op.rn()],
-        offset, op.u(), op.p(), op.w()) {
+    let (addr, wb_addr) = match do_amode::<P, U, W>(cpu.reg[op.rn()], offset) {
             Ok(val) => val,
             Err(reason) => { return DispatchRes::FatalErr(reason); }
     };
@@ -156,13 +151,10 @@ pub fn ldr_reg(cpu: &mut Cpu, op: LsRegBits) -> DispatchRes {
     }
 }
 
-pub fn str_reg(cpu: &mut Cpu, op: LsRegBits) -> DispatchRes {
-    let (offset, _) = barrel_shift(ShiftArgs::Reg { rm: cpu.reg[op.rm()],
-        stype: op.stype(), imm5: op.imm5(), c_in: cpu.reg.cpsr.c()
-    });
+pub fn str_reg<const P: bool, const U: bool, const W: bool, const STYPE: u32>(cpu: &mut Cpu, op: LsRegBits) -> DispatchRes {
+    let (offset, _) = shift_imm::<STYPE>(cpu.reg[op.rm()], op.imm5(), cpu.reg.cpsr.c());
 
-    let (addr, wb_addr) = match do_amode(cpu.reg[op.rn()],
-        offset, op.u(), op.p(), op.w()){
+    let (addr, wb_addr) = match do_amode::<P, U, W>(cpu.reg[op.rn()], offset){
             Ok(val) => val,
             Err(reason) => { return DispatchRes::FatalErr(reason); }
         };
@@ -180,6 +172,40 @@ pub fn str_reg(cpu: &mut Cpu, op: LsRegBits) -> DispatchRes {
 
 
 
+/// Read the words for the registers in a list with one block transfer.
+/// Returns the value for each register, indexed by register number.
+#[inline(always)]
+fn read_reglist(cpu: &Cpu, addr: u32, reglist: u32) -> anyhow::Result<[u32; 16]> {
+    let mut words = [0; 16];
+    cpu.read_block32(addr, &mut words[..reglist.count_ones() as usize])?;
+    let mut vals = [0; 16];
+    let mut words = words.into_iter();
+    for (i, val) in vals.iter_mut().enumerate() {
+        if (reglist & (1 << i)) != 0 {
+            *val = words.next().unwrap();
+        }
+    }
+    Ok(vals)
+}
+
+/// Write the registers in a list with one block transfer.
+#[inline(always)]
+fn write_reglist(cpu: &mut Cpu, addr: u32, reglist: u32) -> anyhow::Result<()> {
+    let mut words = [0; 16];
+    let mut len = 0;
+    for i in 0..16 {
+        if (reglist & (1 << i)) != 0 {
+            words[len] = if i == 15 {
+                cpu.read_exec_pc()
+            } else {
+                cpu.reg[i as u32]
+            };
+            len += 1;
+        }
+    }
+    cpu.write_block32(addr, &words[..len])
+}
+
 pub fn stm_user(cpu: &mut Cpu, op: StmRegUserBits) -> DispatchRes {
     assert_ne!(op.rn(), 15);
     let reglist = op.register_list();
@@ -198,19 +224,13 @@ pub fn stm_user(cpu: &mut Cpu, op: StmRegUserBits) -> DispatchRes {
     if current_mode != CpuMode::Usr { 
         cpu.reg.swap_bank(current_mode, CpuMode::Usr); 
     }
-    for i in 0..16 {
-        if (reglist & (1 << i)) != 0 {
-            let val = cpu.reg[i as u32];
-            match cpu.write32(addr, val) {
-                Ok(_) => {},
-                Err(reason) => { return DispatchRes::FatalErr(reason); } 
-            }
-            addr += 4;
-        }
-    }
+    let res = write_reglist(cpu, addr, reglist);
     if current_mode != CpuMode::Usr { 
         cpu.reg.swap_bank(CpuMode::Usr, current_mode); 
     }
+    if let Err(reason) = res {
+        return DispatchRes::FatalErr(reason);
+    }
     DispatchRes::RetireOk
 }
 
@@ -230,6 +250,10 @@ pub fn ldm_user(cpu: &mut Cpu, op: LdmRegUserBits) -> DispatchRes {
     if op.p() == op.u() {
         addr += 4;
     }
+    let vals = match read_reglist(cpu, addr, reglist) {
+        Ok(vals) => vals,
+        Err(reason) => return DispatchRes::FatalErr(reason),
+    };
 
     // Executing in Usr/Sys is actually unpredictable according to ARM ARM
     let current_mode = cpu.reg.cpsr.mode();
@@ -238,14 +262,7 @@ pub fn ldm_user(cpu: &mut Cpu, op: LdmRegUserBits) -> DispatchRes {
     }
     for i in 0..16 {
         if (reglist & (1 << i)) != 0 {
-            let val = match cpu.read32(addr) {
-                Ok(val) => val,
-                Err(reason) => {
-                    return DispatchRes::FatalErr(reason);
-                }
-            };
-            cpu.reg[i as u32] = val;
-            addr += 4;
+            cpu.reg[i as u32] = vals[i];
         }
     }
     if current_mode != CpuMode::Usr { 
@@ -266,6 +283,10 @@ pub fn ldm_user_pc(cpu: &mut Cpu, op: LdmRegUserBits) -> DispatchRes {
     if op.p() == op.u() {
         addr += 4;
     }
+    let vals = match read_reglist(cpu, addr, reglist) {
+        Ok(vals) => vals,
+        Err(reason) => return DispatchRes::FatalErr(reason),
+    };
 
     let current_mode = cpu.reg.cpsr.mode();
     if current_mode != CpuMode::Usr { 
@@ -273,24 +294,12 @@ pub fn ldm_user_pc(cpu: &mut Cpu, op: LdmRegUserBits) -> DispatchRes {
     }
     for i in 0..=14 {
         if (reglist & (1 << i)) != 0 {
-            let val = match cpu.read32(addr) {
-                Ok(val) => val,
-                Err(reason) => {
-                    return DispatchRes::FatalErr(reason);
-                }
-            };
-            cpu.reg[i as u32] = val;
-            addr += 4;
+            cpu.reg[i as u32] = vals[i];
         }
     }
 
-    let new_pc = match cpu.read32(addr) {
-        Ok(val) => val,
-        Err(reason) => {
-            return DispatchRes::FatalErr(reason);
-        }
-    };
-    addr += 4;
+    let new_pc = vals[15];
+    addr += len;
     if op.w() {
         cpu.reg[op.rn()] = addr;
     }
@@ -304,21 +313,18 @@ pub fn ldm_user_pc(cpu: &mut Cpu, op: LdmRegUserBits) -> DispatchRes {
 pub fn ldmib(cpu: &mut Cpu, op: LsMultiBits) -> DispatchRes {
     assert_ne!(op.rn(), 15);
     let reglist = op.register_list();
-    let mut addr = cpu.reg[op.rn()] + 4;
+    let addr = cpu.reg[op.rn()] + 4;
     let wb_addr = addr + (reglist.count_ones() * 4);
 
+    let vals = match read_reglist(cpu, addr, reglist) {
+        Ok(vals) => vals,
+        Err(reason) => return DispatchRes::FatalErr(reason),
+    };
     for i in 0..16 {
         if (reglist & (1 << i)) != 0 {
-            cpu.reg[i as u32] = match cpu.read32(addr){
-                Ok(val) => val,
-                Err(reason) => {
-                    return DispatchRes::FatalErr(reason);
-                }
-            };
-            addr += 4;
+            cpu.reg[i as u32] = vals[i];
         }
     }
-    assert!(addr == wb_addr);
     if op.w() { 
         cpu.reg[op.rn()] = wb_addr;
     }
@@ -329,41 +335,26 @@ pub fn ldmib(cpu: &mut Cpu, op: LsMultiBits) -> DispatchRes {
 pub fn ldmia(cpu: &mut Cpu, op: LsMultiBits) -> DispatchRes {
     assert_ne!(op.rn(), 15);
     let reglist = op.register_list();
-    let mut addr = cpu.reg[op.rn()];
+    let addr = cpu.reg[op.rn()];
     let wb_addr = addr + (reglist.count_ones() * 4);
 
-    let mut branch = false;
-    for i in 0..16 {
+    let vals = match read_reglist(cpu, addr, reglist) {
+        Ok(vals) => vals,
+        Err(reason) => return DispatchRes::FatalErr(reason),
+    };
+    for i in 0..15 {
         if (reglist & (1 << i)) != 0 {
-            if i == 15 {
-                let temp_addr = match cpu.read32(addr) {
-                    Ok(val) => val,
-                    Err(reason) => {
-                        return DispatchRes::FatalErr(reason);
-                    }
-                };
-                cpu.reg.cpsr.set_thumb(temp_addr & 1 != 0);
-                cpu.write_exec_pc(temp_addr & 0xfffffffe);
-                branch = true;
-                addr += 4;
-            } else {
-                let temp_addr = match cpu.read32(addr) {
-                    Ok(val) => val,
-                    Err(reason) => {
-                        return DispatchRes::FatalErr(reason);
-                    }
-                };
-                cpu.reg[i as u32] = temp_addr;
-                addr += 4;
-            }
+            cpu.reg[i as u32] = vals[i];
         }
     }
-    assert!(addr == wb_addr);
     if op.w() { 
         cpu.reg[op.rn()] = wb_addr;
     }
 
-    if branch {
+    if (reglist & (1 << 15)) != 0 {
+        let new_pc = vals[15];
+        cpu.reg.cpsr.set_thumb(new_pc & 1 != 0);
+        cpu.write_exec_pc(new_pc & 0xfffffffe);
         DispatchRes::RetireBranch
     } else {
         DispatchRes::RetireOk
@@ -375,22 +366,11 @@ pub fn ldmia(cpu: &mut Cpu, op: LsMultiBits) -> DispatchRes {
 pub fn stmdb(cpu: &mut Cpu, op: LsMultiBits) -> DispatchRes {
     assert_ne!(op.rn(), 15);
     let reglist = op.register_list();
-    let mut addr = cpu.reg[op.rn()] - (reglist.count_ones() * 4);
+    let addr = cpu.reg[op.rn()] - (reglist.count_ones() * 4);
     let wb_addr = addr;
 
-    for i in 0..16 {
-        if (reglist & (1 << i)) != 0 {
-            let val = if i == 15 {
-                cpu.read_exec_pc()
-            } else {
-                cpu.reg[i as u32]
-            };
-            match cpu.write32(addr, val)  {
-                Ok(_) => {},
-                Err(reason) => { return DispatchRes::FatalErr(reason); }
-            };
-            addr += 4;
-        }
+    if let Err(reason) = write_reglist(cpu, addr, reglist) {
+        return DispatchRes::FatalErr(reason);
     }
     if op.w() { 
         cpu.reg[op.rn()] = wb_addr;
@@ -402,35 +382,21 @@ pub fn stm(cpu: &mut Cpu, op: LsMultiBits) -> DispatchRes {
     assert_ne!(op.rn(), 15);
 
     let reglist = op.register_list();
-    let mut addr = cpu.reg[op.rn()];
+    let addr = cpu.reg[op.rn()];
     let wb_addr = addr + (reglist.count_ones() * 4);
 
-    for i in 0..16 {
-        if (reglist & (1 << i)) != 0 {
-            let val = if i == 15 {
-                cpu.read_exec_pc()
-            } else {
-                cpu.reg[i as u32]
-            };
-            match cpu.write32(addr, val) {
-                Ok(_) => {},
-                Err(reason) => { return DispatchRes::FatalErr(reason); }
-            };
-            addr += 4;
-        }
+    if let Err(reason) = write_reglist(cpu, addr, reglist) {
+        return DispatchRes::FatalErr(reason);
     }
-
-    assert!(addr == wb_addr);
     if op.w() { 
         cpu.reg[op.rn()] = wb_addr;
     }
     DispatchRes::RetireOk
 }
 
-pub fn strh_imm(cpu: &mut Cpu, op: LsSignedImmBits) -> DispatchRes {
+pub fn strh_imm<const P: bool, const U: bool, const W: bool>(cpu: &mut Cpu, op: LsSignedImmBits) -> DispatchRes {
     let offset = (op.imm4h() << 4) | op.imm4l();
-    let (addr, wb_addr) = match do_amode(cpu.reg[op.rn()],
-        offset, op.u(), op.p(), op.w()) {
+    let (addr, wb_addr) = match do_amode::<P, U, W>(cpu.reg[op.rn()], offset) {
             Ok(val) => val,
             Err(reason) => { return DispatchRes::FatalErr(reason); }
         };
@@ -441,8 +407,8 @@ pub fn strh_imm(cpu: &mut Cpu, op: LsSignedImmBits) -> DispatchRes {
     }
 }
 
-pub fn strh_reg(cpu: &mut Cpu, op: LsSignedRegBits) -> DispatchRes {
-    let (addr, wb_addr) = match do_amode(cpu.reg[op.rn()], cpu.reg[op.rm()], op.u(), op.p(), op.w()) {
+pub fn strh_reg<const P: bool, const U: bool, const W: bool>(cpu: &mut Cpu, op: LsSignedRegBits) -> DispatchRes {
+    let (addr, wb_addr) = match do_amode::<P, U, W>(cpu.reg[op.rn()], cpu.reg[op.rm()]) {
         Ok(val) => val,
         Err(reason) => { return DispatchRes::FatalErr(reason); }
     };
@@ -452,3 +418,33 @@ pub fn strh_reg(cpu: &mut Cpu, op: LsSignedRegBits) -> DispatchRes {
         Err(reason) => DispatchRes::FatalErr(reason)
     }
 }
+
+/// Swap a word in memory with a register.
+pub fn swp(cpu: &mut Cpu, op: SwpBits) -> DispatchRes {
+    assert_ne!(op.rt(), 15);
+    let addr = cpu.reg[op.rn()];
+    let val = match cpu.read32(addr) {
+        Ok(val) => val,
+        Err(reason) => return DispatchRes::FatalErr(reason),
+    };
+    if let Err(reason) = cpu.write32(addr, cpu.reg[op.rt2()]) {
+        return DispatchRes::FatalErr(reason);
+    }
+    cpu.reg[op.rt()] = val;
+    DispatchRes::RetireOk
+}
+
+/// Swap a byte in memory with a register.
+pub fn swpb(cpu: &mut Cpu, op: SwpBits) -> DispatchRes {
+    assert_ne!(op.rt(), 15);
+    let addr = cpu.reg[op.rn()];
+    let val = match cpu.read8(addr) {
+        Ok(val) => val,
+        Err(reason) => return DispatchRes::FatalErr(reason),
+    };
+    if let Err(reason) = cpu.write8(addr, cpu.reg[op.rt2()]) {
+        return DispatchRes::FatalErr(reason);
+    }
+    cpu.reg[op.rt()] = val as u32;
+    DispatchRes::RetireOk
+}
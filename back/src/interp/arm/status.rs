@@ -15,7 +15,7 @@ pub fn mrs(cpu: &mut Cpu, op: MrsBits) -> DispatchRes {
             };
             psr.0
         },
-        false => cpu.reg.cpsr.0,
+        false => cpu.reg.cpsr.get().0,
     };
     cpu.reg[op.rd()] = res;
     DispatchRes::RetireOk
@@ -51,7 +51,7 @@ pub fn do_msr(cpu: &mut Cpu, val: u32, r: bool, m: u32) -> DispatchRes {
         };
     } else {
         // Write the CPSR
-        let old_cpsr = cpu.reg.cpsr;
+        let old_cpsr = cpu.reg.cpsr.get();
         let new_cpsr = Psr((old_cpsr.0 & !mask) | (val & mask));
         cpu.reg.write_cpsr(new_cpsr);
     }
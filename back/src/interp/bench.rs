@@ -0,0 +1,79 @@
+//! Timing the boot process, so that changes in performance can be tracked.
+
+use std::fmt::Write;
+use std::time::Instant;
+
+use crate::interp::{BootStatus, InterpBackend};
+
+/// Records the wall time and number of instructions spent in each stage of
+/// the boot process, until some stage is reached.
+pub struct BootBench {
+    /// Emulation stops once this stage has been reached.
+    pub target: BootStatus,
+    /// Each stage entered so far, along with when it was entered and the
+    /// number of instructions retired by then.
+    stages: Vec<(BootStatus, Instant, usize)>,
+}
+
+impl BootBench {
+    pub fn new(target: BootStatus, current: BootStatus, retired: usize) -> Self {
+        BootBench { target, stages: vec![(current, Instant::now(), retired)] }
+    }
+
+    /// Record the start of a new stage.
+    pub fn enter(&mut self, status: BootStatus, retired: usize) {
+        self.stages.push((status, Instant::now(), retired));
+    }
+
+    /// Whether the target stage has been reached.
+    pub fn done(&self) -> bool {
+        self.stages.last().is_some_and(|stage| stage.0 == self.target)
+    }
+
+    /// Format the time spent in each stage. Time spent after reaching the
+    /// target stage isn't counted.
+    pub fn report(&self, retired: usize) -> String {
+        let now = Instant::now();
+        let end = if self.done() { self.stages.len() - 1 } else { self.stages.len() };
+        // When (and after how many instructions) some stage was left.
+        let left = |idx: usize| self.stages.get(idx + 1)
+            .map_or((now, retired), |stage| (stage.1, stage.2));
+
+        let mut out = String::new();
+        let mut line = |name: &str, start: Instant, start_insns: usize, (stop, stop_insns): (Instant, usize)| {
+            let secs = (stop - start).as_secs_f64();
+            let insns = stop_insns - start_insns;
+            let mips = insns as f64 / secs.max(f64::EPSILON) / 1_000_000.0;
+            let _ = writeln!(out, "{name:<16} {secs:>9.3}s {insns:>13} insns {mips:>9.2} MIPS");
+        };
+        for (idx, (status, start, start_insns)) in self.stages[..end].iter().enumerate() {
+            line(&format!("{status:?}"), *start, *start_insns, left(idx));
+        }
+        let (_, start, start_insns) = self.stages[0];
+        line("Total", start, start_insns, left(end.max(1) - 1));
+        if !self.done() {
+            let _ = writeln!(out, "Stopped before reaching {:?}", self.target);
+        }
+        out
+    }
+}
+
+impl InterpBackend {
+    /// Start timing the boot process, and stop emulation once some stage
+    /// has been reached.
+    pub fn start_bench(&mut self, target: BootStatus) {
+        self.bench = Some(BootBench::new(target, self.boot_status, self.retired));
+    }
+
+    /// Print the results of a boot benchmark, if one was running. Returns
+    /// false if the benchmark didn't reach its target.
+    pub fn report_bench(&self) -> bool {
+        match self.bench.as_ref() {
+            Some(bench) => {
+                print!("{}", bench.report(self.retired));
+                bench.done()
+            },
+            None => true,
+        }
+    }
+}
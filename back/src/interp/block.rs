@@ -0,0 +1,174 @@
+//! Decoded-code cache for the interpreter backend.
+//!
+//! Instead of fetching and decoding every instruction, guest code is decoded
+//! once into per-page arrays of [ArmFn]/[ThumbFn] pointers (along with their
+//! opcodes). Pages are keyed by their backing memory, and the bus tells us
+//! when one of them is written so the decoded copy can be thrown away.
+//!
+//! While execution stays on the same virtual page (in the same CPU mode,
+//! with the same set of translations), we don't need to consult the MMU or
+//! the bus at all.
+
+use std::collections::HashMap;
+
+use ironic_core::bus::Bus;
+use ironic_core::bus::code::CodePageKey;
+use ironic_core::cpu::Cpu;
+use ironic_core::cpu::mmu::prim::{TLBReq, Access};
+use ironic_core::metrics::{self, LockUser};
+
+use crate::interp::lut::*;
+use crate::interp::dispatch::DispatchRes;
+
+const PAGE_MASK: u32 = 0xffff_f000;
+const ARM_SLOTS: usize = 0x1000 / 4;
+const THUMB_SLOTS: usize = 0x1000 / 2;
+
+/// A page of decoded code. Entries are filled lazily on first execution.
+enum CodePage {
+    Arm(Box<[Option<(ArmFn, u32)>; ARM_SLOTS]>),
+    Thumb(Box<[Option<(ThumbFn, u16)>; THUMB_SLOTS]>),
+}
+
+/// The page we're currently executing from.
+#[derive(Clone, Copy)]
+struct Cursor {
+    /// Virtual page base.
+    vpage: u32,
+    /// CPU mode and Thumb bit from the CPSR.
+    mode: u32,
+    /// TLB generation when we resolved this page.
+    tlb_gen: u32,
+    /// Index into [BlockCache::pages].
+    slot: usize,
+}
+
+#[derive(Default)]
+pub struct BlockCache {
+    /// Storage for decoded pages.
+    pages: Vec<Option<CodePage>>,
+    /// Unused entries in [BlockCache::pages].
+    free: Vec<usize>,
+    /// Map from a page of backing memory (and ISA) to a decoded page.
+    index: HashMap<(CodePageKey, bool), usize>,
+    cursor: Option<Cursor>,
+    /// Last observed generation of the bus code tracker.
+    bus_gen: u32,
+}
+
+impl BlockCache {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Drop any pages that were written since the last call.
+    /// This must be called with the bus held, between CPU steps.
+    pub fn sync(&mut self, bus: &mut Bus) {
+        if bus.code.generation == self.bus_gen {
+            return;
+        }
+        self.bus_gen = bus.code.generation;
+        self.cursor = None;
+        for key in bus.code.take_dirty() {
+            for thumb in [false, true] {
+                if let Some(slot) = self.index.remove(&(key, thumb)) {
+                    self.pages[slot] = None;
+                    self.free.push(slot);
+                }
+            }
+        }
+    }
+
+    /// Resolve the decoded page for the current PC, creating it if necessary.
+    /// Returns [None] when executing from somewhere we can't cache.
+    fn enter(&mut self, cpu: &Cpu, pc: u32, mode: u32) -> anyhow::Result<Option<usize>> {
+        let thumb = cpu.reg.cpsr.thumb();
+        let paddr = cpu.translate(TLBReq::new(pc, Access::Read))?;
+        let key = match metrics::write_bus(&cpu.bus, LockUser::Cpu).track_code_page(paddr) {
+            Some(key) => key,
+            None => return Ok(None),
+        };
+        let slot = match self.index.get(&(key, thumb)) {
+            Some(slot) => *slot,
+            None => {
+                let page = if thumb {
+                    CodePage::Thumb(Box::new([None; THUMB_SLOTS]))
+                } else {
+                    CodePage::Arm(Box::new([None; ARM_SLOTS]))
+                };
+                let slot = match self.free.pop() {
+                    Some(slot) => { self.pages[slot] = Some(page); slot },
+                    None => { self.pages.push(Some(page)); self.pages.len() - 1 },
+                };
+                self.index.insert((key, thumb), slot);
+                slot
+            },
+        };
+        self.cursor = Some(Cursor {
+            vpage: pc & PAGE_MASK,
+            mode,
+            tlb_gen: cpu.p15.tlb.generation(),
+            slot,
+        });
+        Ok(Some(slot))
+    }
+
+    /// Fetch, decode, and dispatch a single instruction from the cache,
+    /// falling back to the normal path if the PC isn't in cacheable memory.
+    pub fn step(&mut self, cpu: &mut Cpu) -> DispatchRes {
+        let pc = cpu.read_fetch_pc();
+        let mode = cpu.reg.cpsr.control() & 0x3f;
+        let slot = match self.cursor {
+            Some(c) if c.vpage == pc & PAGE_MASK && c.mode == mode
+                && c.tlb_gen == cpu.p15.tlb.generation() => c.slot,
+            _ => match self.enter(cpu, pc, mode) {
+                Ok(Some(slot)) => slot,
+                Ok(None) => return super::fetch_dispatch(cpu),
+                Err(reason) => return DispatchRes::FatalErr(reason),
+            },
+        };
+
+        match self.pages[slot].as_mut().unwrap() {
+            CodePage::Thumb(page) => {
+                let idx = ((pc & !PAGE_MASK) >> 1) as usize;
+                let (func, opcd) = match page[idx] {
+                    Some(entry) => entry,
+                    None => {
+                        let opcd = match cpu.read16(pc) {
+                            Ok(val) => val,
+                            Err(reason) => return DispatchRes::FatalErr(reason),
+                        };
+                        let entry = (INTERP_LUT.thumb.lookup(opcd), opcd);
+                        page[idx] = Some(entry);
+                        entry
+                    },
+                };
+                func.0(cpu, opcd)
+            },
+            CodePage::Arm(page) => {
+                let idx = ((pc & !PAGE_MASK) >> 2) as usize;
+                let (func, opcd) = match page[idx] {
+                    Some(entry) => entry,
+                    None => {
+                        let opcd = match cpu.read32(pc) {
+                            Ok(val) => val,
+                            Err(reason) => return DispatchRes::FatalErr(reason),
+                        };
+                        let entry = (INTERP_LUT.arm.lookup(opcd), opcd);
+                        page[idx] = Some(entry);
+                        entry
+                    },
+                };
+                // AL and the unconditional space always pass
+                if opcd >= 0xe000_0000 {
+                    return func.0(cpu, opcd);
+                }
+                match cpu.reg.cond_pass(opcd) {
+                    Ok(true) => func.0(cpu, opcd),
+                    Ok(false) => DispatchRes::CondFailed,
+                    Err(reason) => DispatchRes::FatalErr(reason),
+                }
+            },
+        }
+    }
+}
@@ -0,0 +1,371 @@
+//! Stopping the CPU for a debugger (see [crate::gdb]).
+//!
+//! Nothing here costs anything per instruction while the CPU is running:
+//!
+//! - Breakpoints are hooks on the PC (see [crate::interp::hooks]). Setting
+//!   one drops any code compiled from its page, so that blocks end on it.
+//! - Watchpoints take their pages off the fast path into guest RAM, and are
+//!   checked on the slow path (see [ironic_core::bus::watch]). A hit ends
+//!   the slice, so the CPU stops after the access (or, with the JIT, at the
+//!   end of the block).
+//! - Everything else (single steps, interrupts from the client, and `bkpt`
+//!   instructions) is checked once per slice.
+//!
+//! GDB removes its breakpoints whenever the target stops, and steps over
+//! the one at the PC itself before continuing, so breakpoints are never
+//! skipped here.
+
+use std::sync::atomic::Ordering;
+
+use anyhow::{anyhow, bail, Context};
+use log::{debug, info};
+
+use ironic_core::bus::watch::{WatchKind, Watchpoint};
+use ironic_core::cpu::mmu::prim::{Access, TLBReq};
+use ironic_core::cpu::psr::Psr;
+
+use crate::gdb::{GdbEvent, GdbLink, PACKET_SIZE};
+use crate::interp::InterpBackend;
+
+/// Number of registers in the `g` packet (r0-r15 and the CPSR).
+const NUM_REGS: usize = 17;
+
+/// Why the CPU stopped.
+#[derive(Clone, Copy, Debug)]
+enum StopReason {
+    Breakpoint,
+    Step,
+    /// The guest executed a `bkpt` instruction.
+    Trap,
+    Interrupt,
+    Watch(Watchpoint),
+}
+
+impl StopReason {
+    /// The stop reply sent to the client.
+    fn reply(self) -> String {
+        match self {
+            StopReason::Interrupt => "S02".to_owned(),
+            StopReason::Watch(wp) => {
+                let kind = match wp.kind {
+                    WatchKind::Write => "watch",
+                    WatchKind::Read => "rwatch",
+                    WatchKind::Access => "awatch",
+                };
+                format!("T05{kind}:{:08x};", wp.vaddr)
+            },
+            _ => "S05".to_owned(),
+        }
+    }
+}
+
+/// What the CPU does after handling a packet.
+enum Command {
+    Reply(String),
+    Resume { step: bool },
+    Detach,
+}
+
+/// State kept by the CPU thread while it can be debugged.
+pub struct Debugger {
+    link: GdbLink,
+    /// Set when the CPU should stop again after one instruction.
+    stepping: bool,
+    /// Set when the guest has executed a `bkpt` instruction.
+    trapped: bool,
+    /// The last stop reply, sent again when the client asks for it.
+    last_stop: String,
+}
+
+impl Debugger {
+    pub fn new(link: GdbLink) -> Self {
+        Debugger { link, stepping: false, trapped: false, last_stop: "S05".to_owned() }
+    }
+}
+
+fn hex(s: &str) -> anyhow::Result<u32> {
+    u32::from_str_radix(s, 16).map_err(|_| anyhow!("Invalid number {s}"))
+}
+
+/// Parse `<addr>,<len>` (which may be followed by more arguments).
+fn addr_len(args: &str) -> anyhow::Result<(u32, u32)> {
+    let (addr, rest) = args.split_once(',').context("Expected an address and a length")?;
+    let len = rest.split([',', ':', ';']).next().unwrap_or(rest);
+    Ok((hex(addr)?, hex(len)?))
+}
+
+fn decode_hex(s: &str) -> anyhow::Result<Vec<u8>> {
+    if s.len() % 2 != 0 {
+        bail!("Odd number of digits in {s}");
+    }
+    let digit = |b: u8| (b as char).to_digit(16);
+    s.as_bytes().chunks(2)
+        .map(|pair| Some((digit(pair[0])? << 4 | digit(pair[1])?) as u8))
+        .collect::<Option<Vec<u8>>>()
+        .ok_or_else(|| anyhow!("Invalid hex {s}"))
+}
+
+fn encode_hex(bytes: &[u8]) -> String {
+    bytes.iter().map(|b| format!("{b:02x}")).collect()
+}
+
+impl InterpBackend {
+    /// Returns true when the next slice should only be one instruction.
+    #[inline(always)]
+    pub fn debug_stepping(&self) -> bool {
+        self.debug.as_ref().is_some_and(|debug| debug.stepping)
+    }
+
+    /// Stop for the debugger if necessary. Called before each slice, while
+    /// the bus isn't held.
+    #[inline(always)]
+    pub fn check_debugger(&mut self) {
+        if self.debug.is_some() {
+            self.check_stop();
+        }
+    }
+
+    fn check_stop(&mut self) {
+        let Some(debug) = self.debug.as_mut() else {
+            return;
+        };
+        let reason = if let Some(wp) = self.cpu.watch_hit.take() {
+            StopReason::Watch(wp)
+        } else if std::mem::take(&mut debug.stepping) {
+            StopReason::Step
+        } else if std::mem::take(&mut debug.trapped) {
+            StopReason::Trap
+        } else if debug.link.interrupt.load(Ordering::Acquire) {
+            StopReason::Interrupt
+        } else {
+            return;
+        };
+        self.debug_stop(reason);
+    }
+
+    /// Called when the guest executes a `bkpt` instruction.
+    pub(crate) fn debug_trap(&mut self) {
+        if let Some(debug) = self.debug.as_mut() {
+            if debug.link.attached.load(Ordering::Acquire) {
+                debug.trapped = true;
+                self.cpu.bus_sync.set(true);
+            }
+        }
+    }
+
+    /// Called by a breakpoint hook on the PC.
+    pub(crate) fn debug_break(&mut self) {
+        if self.debug.is_some() {
+            self.debug_stop(StopReason::Breakpoint);
+        }
+    }
+
+    /// Serve packets from the debugger until it lets the CPU run again.
+    fn debug_stop(&mut self, reason: StopReason) {
+        let Some(debug) = self.debug.as_mut() else {
+            return;
+        };
+        debug.link.interrupt.store(false, Ordering::Release);
+        debug.last_stop = reason.reply();
+        debug!(target: "GDB", "Stopped at pc={:08x} ({reason:?})", self.cpu.read_fetch_pc());
+        if debug.link.events.send(GdbEvent::Stopped(debug.last_stop.clone())).is_err() {
+            self.debug_detach();
+            return;
+        }
+        loop {
+            let Some(debug) = self.debug.as_mut() else {
+                return;
+            };
+            let Ok(packet) = debug.link.packets.recv() else {
+                self.debug_detach();
+                break;
+            };
+            let cmd = self.gdb_command(&packet).unwrap_or_else(|reason| {
+                debug!(target: "GDB", "Packet {packet} failed: {reason:#}");
+                Command::Reply("E01".to_owned())
+            });
+            let debug = self.debug.as_mut().unwrap();
+            match cmd {
+                Command::Reply(reply) => {
+                    let _ = debug.link.events.send(GdbEvent::Reply(reply));
+                },
+                Command::Resume { step } => {
+                    debug.stepping = step;
+                    let _ = debug.link.events.send(GdbEvent::Resumed);
+                    break;
+                },
+                Command::Detach => {
+                    let _ = debug.link.events.send(GdbEvent::Reply("OK".to_owned()));
+                    self.debug_detach();
+                    break;
+                },
+            }
+        }
+        // Start a new slice, since the debugger may have changed anything.
+        self.cpu.bus_sync.set(true);
+    }
+
+    /// Remove every breakpoint and watchpoint, and run on.
+    fn debug_detach(&mut self) {
+        info!(target: "GDB", "Debugger detached");
+        for pc in self.hooks.clear_breakpoints() {
+            self.invalidate_breakpoint(pc);
+        }
+        self.bus.write().clear_watchpoints();
+        self.cpu.watch_hit.set(None);
+        if let Some(debug) = self.debug.as_mut() {
+            debug.stepping = false;
+            debug.trapped = false;
+            debug.link.interrupt.store(false, Ordering::Release);
+        }
+    }
+
+    fn gdb_command(&mut self, packet: &str) -> anyhow::Result<Command> {
+        let Some(first) = packet.chars().next() else {
+            return Ok(Command::Reply(String::new()));
+        };
+        let args = &packet[first.len_utf8()..];
+        let reply = match first {
+            '?' => self.debug.as_ref().unwrap().last_stop.clone(),
+            'g' => (0..NUM_REGS).map(|idx| format!("{:08x}", self.read_gdb_reg(idx))).collect(),
+            'G' => {
+                let regs = decode_hex(args)?;
+                if regs.len() != NUM_REGS * 4 {
+                    bail!("Expected {NUM_REGS} registers");
+                }
+                // The CPSR goes first, since the PC depends on the Thumb bit
+                for idx in (0..NUM_REGS).rev() {
+                    let val = u32::from_be_bytes(regs[idx * 4..idx * 4 + 4].try_into().unwrap());
+                    self.write_gdb_reg(idx, val)?;
+                }
+                "OK".to_owned()
+            },
+            'p' => format!("{:08x}", self.read_gdb_reg(hex(args)? as usize)),
+            'P' => {
+                let (idx, val) = args.split_once('=').context("Expected a register and a value")?;
+                let val = u32::from_be_bytes(decode_hex(val)?.try_into().map_err(|_| anyhow!("Bad value"))?);
+                self.write_gdb_reg(hex(idx)? as usize, val)?;
+                "OK".to_owned()
+            },
+            'm' => {
+                let (addr, len) = addr_len(args)?;
+                encode_hex(&self.debug_read(addr, len.min(PACKET_SIZE as u32 / 2 - 0x10))?)
+            },
+            'M' => {
+                let (addr, len) = addr_len(args)?;
+                let (_, data) = args.split_once(':').context("Expected data")?;
+                let data = decode_hex(data)?;
+                if data.len() != len as usize {
+                    bail!("Expected {len} bytes");
+                }
+                self.debug_write(addr, &data)?;
+                "OK".to_owned()
+            },
+            'c' | 's' => {
+                if !args.is_empty() {
+                    self.cpu.write_exec_pc(hex(args)?);
+                }
+                return Ok(Command::Resume { step: first == 's' });
+            },
+            'D' | 'k' => return Ok(Command::Detach),
+            'Z' | 'z' => {
+                let (kind, args) = args.split_once(',').context("Expected a type")?;
+                let (addr, len) = addr_len(args)?;
+                self.set_debug_point(kind, addr, len, first == 'Z')?
+            },
+            _ => String::new(),
+        };
+        Ok(Command::Reply(reply))
+    }
+
+    fn read_gdb_reg(&self, idx: usize) -> u32 {
+        match idx {
+            0..=14 => self.cpu.reg.r[idx],
+            15 => self.cpu.read_fetch_pc(),
+            16 => self.cpu.reg.cpsr.get().0,
+            _ => 0,
+        }
+    }
+
+    fn write_gdb_reg(&mut self, idx: usize, val: u32) -> anyhow::Result<()> {
+        match idx {
+            0..=14 => self.cpu.reg.r[idx] = val,
+            15 => self.cpu.write_exec_pc(val),
+            16 => {
+                let pc = self.cpu.read_fetch_pc();
+                self.cpu.reg.write_cpsr(Psr(val));
+                self.cpu.write_exec_pc(pc);
+            },
+            _ => bail!("No register {idx}"),
+        }
+        Ok(())
+    }
+
+    /// Read guest memory at some virtual address.
+    fn debug_read(&self, addr: u32, len: u32) -> anyhow::Result<Vec<u8>> {
+        let mut buf = vec![0; len as usize];
+        let mut off = 0;
+        let bus = self.bus.read();
+        for (paddr, run) in self.hle_runs(addr, len, Access::Debug)? {
+            bus.dma_read(paddr, &mut buf[off..off + run])?;
+            off += run;
+        }
+        Ok(buf)
+    }
+
+    /// Write guest memory at some virtual address.
+    fn debug_write(&mut self, addr: u32, data: &[u8]) -> anyhow::Result<()> {
+        let runs = self.hle_runs(addr, data.len() as u32, Access::Debug)?;
+        let bus = self.bus.clone();
+        let mut bus = bus.write();
+        let mut off = 0;
+        for (paddr, run) in runs {
+            bus.dma_write(paddr, &data[off..off + run])?;
+            off += run;
+        }
+        // Don't run anything decoded from before the write
+        if let Some(cache) = self.block_cache.as_mut() {
+            cache.sync(&mut bus);
+        }
+        Ok(())
+    }
+
+    /// Insert or remove a breakpoint (types 0 and 1) or a watchpoint (types
+    /// 2 to 4).
+    fn set_debug_point(&mut self, kind: &str, addr: u32, len: u32, insert: bool) -> anyhow::Result<String> {
+        let kind = match kind {
+            "0" | "1" => {
+                let pc = addr & !1;
+                let changed = if insert {
+                    self.hooks.add_breakpoint(pc)
+                } else {
+                    self.hooks.remove_breakpoint(pc)
+                };
+                if changed {
+                    self.invalidate_breakpoint(pc);
+                }
+                return Ok("OK".to_owned());
+            },
+            "2" => WatchKind::Write,
+            "3" => WatchKind::Read,
+            "4" => WatchKind::Access,
+            _ => return Ok(String::new()),
+        };
+        let mut bus = self.bus.write();
+        if insert {
+            let paddr = self.cpu.translate(TLBReq::new(addr, Access::Debug))?;
+            bus.add_watchpoint(Watchpoint { vaddr: addr, paddr, len, kind });
+        } else if !bus.remove_watchpoint(addr, len, kind) {
+            bail!("No watchpoint at {addr:08x}");
+        }
+        Ok("OK".to_owned())
+    }
+
+    /// Drop any compiled code on the page of a breakpoint, since blocks only
+    /// end on addresses that were hooked when they were compiled.
+    fn invalidate_breakpoint(&mut self, pc: u32) {
+        if let Ok(paddr) = self.cpu.translate(TLBReq::new(pc, Access::Debug)) {
+            self.bus.write().invalidate_code(paddr);
+        }
+    }
+}
@@ -56,10 +56,46 @@ macro_rules! tfn { ($func:expr) => { unsafe {
 }}}
 
 
+// Some handlers take bits of the opcode as const generic parameters, so
+// that they don't have to branch on them. These bits are always part of the
+// LUT index, and this macro picks the instantiation for some opcode, with
+// the parameters in the order they're listed:
+//
+// - `s`: bit 20 (set flags)
+// - `p`, `u`, `w`: bits 24, 23, and 21 (addressing mode)
+// - `stype`: bits 6:5 (shift type)
+macro_rules! arm_spec {
+    ($opcd:ident, [$($f:ident)::+] [$($g:expr),*]) => {
+        ArmFn(afn!($($f)::+::<$({$g}),*>))
+    };
+    ($opcd:ident, [$($f:ident)::+] [$($g:expr),*] stype $($rest:ident)*) => {
+        match ($opcd >> 5) & 0b11 {
+            0b00 => arm_spec!($opcd, [$($f)::+] [$($g,)* 0b00] $($rest)*),
+            0b01 => arm_spec!($opcd, [$($f)::+] [$($g,)* 0b01] $($rest)*),
+            0b10 => arm_spec!($opcd, [$($f)::+] [$($g,)* 0b10] $($rest)*),
+            _    => arm_spec!($opcd, [$($f)::+] [$($g,)* 0b11] $($rest)*),
+        }
+    };
+    ($opcd:ident, [$($f:ident)::+] [$($g:expr),*] $bit:ident $($rest:ident)*) => {
+        if $opcd & (1 << arm_spec!(@bit $bit)) != 0 {
+            arm_spec!($opcd, [$($f)::+] [$($g,)* true] $($rest)*)
+        } else {
+            arm_spec!($opcd, [$($f)::+] [$($g,)* false] $($rest)*)
+        }
+    };
+    (@bit s) => { 20 };
+    (@bit p) => { 24 };
+    (@bit u) => { 23 };
+    (@bit w) => { 21 };
+    ($opcd:ident, $($f:ident)::+; $($bits:ident)*) => {
+        arm_spec!($opcd, [$($f)::+] [] $($bits)*)
+    };
+}
 
-/// Map each decoded instruction to an implementation of an ARM instruction.
+/// Map each decoded instruction to an implementation of an ARM instruction,
+/// specialised for some opcode with that encoding (see `arm_spec`).
 impl ArmFn {
-    pub const fn from_inst(inst: ArmInst) -> Self {
+    pub const fn from_inst(inst: ArmInst, opcd: u32) -> Self {
         use ArmInst::*;
         match inst {
             MsrImm      => ArmFn(afn!(arm::status::msr_imm)),
@@ -69,26 +105,28 @@ impl ArmFn {
             Umlal       => ArmFn(afn!(arm::multiply::umlal)),
             Mul         => ArmFn(afn!(arm::multiply::mul)),
 
-            LdrImm      => ArmFn(afn!(arm::loadstore::ldr_imm)),
-            LdrbImm     => ArmFn(afn!(arm::loadstore::ldrb_imm)),
-            LdrhImm     => ArmFn(afn!(arm::loadstore::ldrh_imm)),
-            SubImm      => ArmFn(afn!(arm::dataproc::sub_imm)),
-            SubReg      => ArmFn(afn!(arm::dataproc::sub_reg)),
+            LdrImm      => arm_spec!(opcd, arm::loadstore::ldr_imm; p u w),
+            LdrbImm     => arm_spec!(opcd, arm::loadstore::ldrb_imm; p u w),
+            LdrhImm     => arm_spec!(opcd, arm::loadstore::ldrh_imm; p u w),
+            SubImm      => arm_spec!(opcd, arm::dataproc::sub_imm; s),
+            SubReg      => arm_spec!(opcd, arm::dataproc::sub_reg; s stype),
 
-            LdrReg      => ArmFn(afn!(arm::loadstore::ldr_reg)),
-            StrReg      => ArmFn(afn!(arm::loadstore::str_reg)),
+            LdrReg      => arm_spec!(opcd, arm::loadstore::ldr_reg; p u w stype),
+            StrReg      => arm_spec!(opcd, arm::loadstore::str_reg; p u w stype),
 
             Ldmib       => ArmFn(afn!(arm::loadstore::ldmib)),
             Ldm         => ArmFn(afn!(arm::loadstore::ldmia)),
             LdmRegUser  => ArmFn(afn!(arm::loadstore::ldm_user)),
 
-            StrImm      => ArmFn(afn!(arm::loadstore::str_imm)),
-            StrbImm     => ArmFn(afn!(arm::loadstore::strb_imm)),
+            StrImm      => arm_spec!(opcd, arm::loadstore::str_imm; p u w),
+            StrbImm     => arm_spec!(opcd, arm::loadstore::strb_imm; p u w),
             Stmdb       => ArmFn(afn!(arm::loadstore::stmdb)),
             Stm         => ArmFn(afn!(arm::loadstore::stm)),
             StmRegUser  => ArmFn(afn!(arm::loadstore::stm_user)),
-            StrhImm     => ArmFn(afn!(arm::loadstore::strh_imm)),
-            StrhReg     => ArmFn(afn!(arm::loadstore::strh_reg)),
+            StrhImm     => arm_spec!(opcd, arm::loadstore::strh_imm; p u w),
+            StrhReg     => arm_spec!(opcd, arm::loadstore::strh_reg; p u w),
+            Swp         => ArmFn(afn!(arm::loadstore::swp)),
+            Swpb        => ArmFn(afn!(arm::loadstore::swpb)),
 
             Mcr         => ArmFn(afn!(arm::coproc::mcr)),
             Mrc         => ArmFn(afn!(arm::coproc::mrc)),
@@ -98,31 +136,31 @@ impl ArmFn {
             Bx          => ArmFn(afn!(arm::branch::bx)),
             BlImm       => ArmFn(afn!(arm::branch::bl_imm)),
 
-            RsbImm      => ArmFn(afn!(arm::dataproc::rsb_imm)),
-            RsbReg      => ArmFn(afn!(arm::dataproc::rsb_reg)),
-            MovImm      => ArmFn(afn!(arm::dataproc::mov_imm)),
-            MvnImm      => ArmFn(afn!(arm::dataproc::mvn_imm)),
-            MvnReg      => ArmFn(afn!(arm::dataproc::mvn_reg)),
-            MovReg      => ArmFn(afn!(arm::dataproc::mov_reg)),
+            RsbImm      => arm_spec!(opcd, arm::dataproc::rsb_imm; s),
+            RsbReg      => arm_spec!(opcd, arm::dataproc::rsb_reg; s stype),
+            MovImm      => arm_spec!(opcd, arm::dataproc::mov_imm; s),
+            MvnImm      => arm_spec!(opcd, arm::dataproc::mvn_imm; s),
+            MvnReg      => arm_spec!(opcd, arm::dataproc::mvn_reg; s stype),
+            MovReg      => arm_spec!(opcd, arm::dataproc::mov_reg; s stype),
             MovRegShiftReg=> ArmFn(afn!(arm::dataproc::mov_rsr)),
-            AddImm      => ArmFn(afn!(arm::dataproc::add_imm)),
-            AddReg      => ArmFn(afn!(arm::dataproc::add_reg)),
+            AddImm      => arm_spec!(opcd, arm::dataproc::add_imm; s),
+            AddReg      => arm_spec!(opcd, arm::dataproc::add_reg; s stype),
             AdcImm      => ArmFn(afn!(arm::dataproc::adc_imm)),
-            OrrImm      => ArmFn(afn!(arm::dataproc::orr_imm)),
-            OrrReg      => ArmFn(afn!(arm::dataproc::orr_reg)),
-            EorReg      => ArmFn(afn!(arm::dataproc::eor_reg)),
-            EorImm      => ArmFn(afn!(arm::dataproc::eor_imm)),
-            AndImm      => ArmFn(afn!(arm::dataproc::and_imm)),
-            AndReg      => ArmFn(afn!(arm::dataproc::and_reg)),
+            OrrImm      => arm_spec!(opcd, arm::dataproc::orr_imm; s),
+            OrrReg      => arm_spec!(opcd, arm::dataproc::orr_reg; s stype),
+            EorReg      => arm_spec!(opcd, arm::dataproc::eor_reg; s stype),
+            EorImm      => arm_spec!(opcd, arm::dataproc::eor_imm; s),
+            AndImm      => arm_spec!(opcd, arm::dataproc::and_imm; s),
+            AndReg      => arm_spec!(opcd, arm::dataproc::and_reg; s stype),
             CmnImm      => ArmFn(afn!(arm::dataproc::cmn_imm)),
             CmpImm      => ArmFn(afn!(arm::dataproc::cmp_imm)),
-            CmpReg      => ArmFn(afn!(arm::dataproc::cmp_reg)),
-            TstReg      => ArmFn(afn!(arm::dataproc::tst_reg)),
+            CmpReg      => arm_spec!(opcd, arm::dataproc::cmp_reg; stype),
+            TstReg      => arm_spec!(opcd, arm::dataproc::tst_reg; stype),
             TstImm      => ArmFn(afn!(arm::dataproc::tst_imm)),
-            TeqReg      => ArmFn(afn!(arm::dataproc::teq_reg)),
+            TeqReg      => arm_spec!(opcd, arm::dataproc::teq_reg; stype),
             TeqImm      => ArmFn(afn!(arm::dataproc::teq_imm)),
-            BicImm      => ArmFn(afn!(arm::dataproc::bic_imm)),
-            BicReg      => ArmFn(afn!(arm::dataproc::bic_reg)),
+            BicImm      => arm_spec!(opcd, arm::dataproc::bic_imm; s),
+            BicReg      => arm_spec!(opcd, arm::dataproc::bic_reg; s stype),
             BicRegShiftReg => ArmFn(afn!(arm::dataproc::bic_rsr)),
             Clz         => ArmFn(afn!(arm::dataproc::clz)),
 
@@ -0,0 +1,172 @@
+//! Support for fuzzing guest code.
+//!
+//! A fuzzer drives the emulator over the PPC HLE socket: it sets a reset
+//! point once the guest is ready, and then repeatedly sends an input (i.e.
+//! an ioctl to some IOS module), reads the coverage, and resets the machine.
+//!
+//! Resets only put back the pages that were written since the reset point
+//! (see [ironic_core::mem::dirty]), along with the CPU and device state, so
+//! each input costs about as much as running it. The bus has to be created
+//! with [ironic_core::bus::BusOptions::track_dirty_pages] for that.
+//!
+//! Coverage is kept AFL-style: every taken branch bumps a counter in a
+//! [CoverageMap], indexed by a hash of the branch target and the target of
+//! the previous branch.
+
+use std::sync::Arc;
+use std::sync::atomic::{AtomicBool, AtomicU8, Ordering};
+use std::time::Duration;
+
+use anyhow::{bail, Context};
+use log::error;
+
+use ironic_core::bus::Bus;
+use ironic_core::bus::notify::Notifier;
+use ironic_core::snapshot;
+
+use crate::interp::InterpBackend;
+
+/// Number of bits in an index into a [CoverageMap].
+const COVERAGE_BITS: u32 = 16;
+
+/// Counters for each edge between branch targets.
+pub struct CoverageMap {
+    counts: Box<[AtomicU8]>,
+}
+
+impl Default for CoverageMap {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+impl CoverageMap {
+    pub fn new() -> Self {
+        CoverageMap { counts: (0..1 << COVERAGE_BITS).map(|_| AtomicU8::new(0)).collect() }
+    }
+
+    /// Bump some counter. Only the CPU thread writes to the map, so this
+    /// doesn't need to be atomic.
+    #[inline(always)]
+    fn hit(&self, idx: usize) {
+        let count = &self.counts[idx];
+        count.store(count.load(Ordering::Relaxed).wrapping_add(1), Ordering::Relaxed);
+    }
+
+    /// Take the counters, clearing them.
+    pub fn take(&self) -> Vec<u8> {
+        self.counts.iter().map(|count| count.swap(0, Ordering::Relaxed)).collect()
+    }
+}
+
+/// Something the CPU thread has been asked to do.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+#[repr(u8)]
+pub enum FuzzRequest {
+    None,
+    /// Save the current state as the reset point.
+    SetResetPoint,
+    /// Go back to the reset point.
+    Reset,
+}
+
+/// Shared between the CPU thread and the PPC HLE thread, which makes
+/// requests on behalf of the fuzzer.
+#[derive(Default)]
+pub struct FuzzControl {
+    pending: AtomicU8,
+    failed: AtomicBool,
+    done: Notifier,
+    pub coverage: CoverageMap,
+}
+
+impl FuzzControl {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Ask the CPU thread to do something, and wait for it to be done. The
+    /// CPU is woken up with `arm_wake` in case it's idle.
+    pub fn request(&self, req: FuzzRequest, arm_wake: &Notifier, timeout: Duration) -> anyhow::Result<()> {
+        let seen = self.done.seq();
+        self.pending.store(req as u8, Ordering::Release);
+        arm_wake.notify();
+        if self.done.wait(seen, Some(timeout)) == seen {
+            bail!("CPU thread didn't handle {req:?} in {timeout:?}");
+        }
+        if self.failed.load(Ordering::Acquire) {
+            bail!("{req:?} failed");
+        }
+        Ok(())
+    }
+
+    fn take_request(&self) -> FuzzRequest {
+        match self.pending.swap(FuzzRequest::None as u8, Ordering::Acquire) {
+            1 => FuzzRequest::SetResetPoint,
+            2 => FuzzRequest::Reset,
+            _ => FuzzRequest::None,
+        }
+    }
+}
+
+/// State kept by the CPU thread while fuzzing.
+pub struct Fuzzer {
+    pub control: Arc<FuzzControl>,
+    /// Hash of the previous branch target.
+    prev: u32,
+    /// State saved by [snapshot::save_reset_point].
+    reset_point: Option<Vec<u8>>,
+}
+
+impl Fuzzer {
+    pub fn new(control: Arc<FuzzControl>) -> Self {
+        Fuzzer { control, prev: 0, reset_point: None }
+    }
+
+    /// Record a taken branch to some address.
+    #[inline(always)]
+    pub fn branch(&mut self, target: u32) {
+        let cur = (target >> 1) ^ (target >> (COVERAGE_BITS + 1));
+        self.control.coverage.hit(((cur ^ self.prev) & ((1 << COVERAGE_BITS) - 1)) as usize);
+        self.prev = cur >> 1;
+    }
+}
+
+impl InterpBackend {
+    /// Save the current state of the machine as the reset point.
+    pub fn set_reset_point(&mut self, bus: &Bus) -> anyhow::Result<()> {
+        let point = snapshot::save_reset_point(&[&self.boot_status, &self.svc_buf, &self.cpu, bus])?;
+        let fuzz = self.fuzz.as_mut().context("Fuzzing isn't enabled")?;
+        fuzz.reset_point = Some(point);
+        fuzz.prev = 0;
+        Ok(())
+    }
+
+    /// Put the machine back in the state it was in at the reset point.
+    pub fn reset(&mut self, bus: &mut Bus) -> anyhow::Result<()> {
+        let fuzz = self.fuzz.as_mut().context("Fuzzing isn't enabled")?;
+        let point = fuzz.reset_point.as_deref().context("There's no reset point")?;
+        fuzz.prev = 0;
+        snapshot::restore_reset_point(point, &mut [
+            &mut self.boot_status, &mut self.svc_buf, &mut self.cpu, bus
+        ])
+    }
+
+    /// Handle a request from the fuzzer, if there is one.
+    pub(crate) fn check_fuzz_request(&mut self, bus: &mut Bus) {
+        let Some(fuzz) = self.fuzz.as_ref() else {
+            return;
+        };
+        let control = fuzz.control.clone();
+        let res = match control.take_request() {
+            FuzzRequest::None => return,
+            FuzzRequest::SetResetPoint => self.set_reset_point(bus),
+            FuzzRequest::Reset => self.reset(bus),
+        };
+        if let Err(reason) = res.as_ref() {
+            error!(target: "Other", "Fuzzer request failed: {reason:#}");
+        }
+        control.failed.store(res.is_err(), Ordering::Release);
+        control.done.notify();
+    }
+}
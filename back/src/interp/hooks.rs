@@ -0,0 +1,383 @@
+//! Hooks on the program counter.
+//!
+//! A hook runs when the CPU is about to execute some (virtual) address. They
+//! track the boot process, patch guest code, replace hot guest functions
+//! with native implementations (HLE), and stop for a debugger (see
+//! [crate::interp::debug]).
+//!
+//! Backends check for hooks before every step, but most steps only test one
+//! bit in a filter. The JIT also ends blocks on hooked addresses, so that
+//! they're never skipped over.
+//!
+//! More hooks can be loaded from a file (see [HookTable::load_file]), with
+//! one hook on each line:
+//!
+//! ```text
+//! # address  stage      action  [argument]
+//! 13d90024   IOSKernel  patch   e6000050e12fff1e
+//! <address>  IOSKernel  memcpy
+//! <address>  any        return  0
+//! ```
+//!
+//! The stage is the [BootStatus] that the hook applies to (or `any`). The
+//! actions are:
+//!
+//! - `patch <hex bytes>`: overwrite the code at the address
+//! - `return [hex value]`: return to the caller, optionally setting r0
+//! - `memcpy`: copy r2 bytes from r1 to r0, and return r0
+//! - `memset`: fill r2 bytes at r0 with the low byte of r1, and return r0
+//! - `log`: log the registers
+
+use std::collections::HashMap;
+
+use anyhow::{anyhow, bail, Context};
+use log::info;
+
+use ironic_core::cpu::mmu::prim::{Access, TLBReq};
+use ironic_core::cpu::reg::Reg;
+use ironic_core::metrics::{self, LockUser};
+
+use crate::interp::{BootStatus, InterpBackend};
+
+/// Number of bits in the [HookTable] filter.
+const FILTER_BITS: usize = 1 << 16;
+
+/// Patch containing a call to ThreadCancel()
+const THREAD_CANCEL_PATCH: [u8; 0x8] = [
+    // e6000050 .word   0xe6000050
+    0xe6, 0x00, 0x00, 0x50,
+    // e12fff1e bx      lr
+    0xe1, 0x2f, 0xff, 0x1e,
+];
+
+/// Something done when a hook is hit.
+#[derive(Clone, Debug)]
+pub enum HookAction {
+    /// Move on to some stage of the boot process.
+    Boot(BootStatus),
+    /// Overwrite the code at the PC with some bytes.
+    Patch(Vec<u8>),
+    /// Return to the caller, optionally with some value in r0.
+    Return(Option<u32>),
+    /// Run `memcpy(r0, r1, r2)` and return.
+    Memcpy,
+    /// Run `memset(r0, r1, r2)` and return.
+    Memset,
+    /// Log the registers.
+    Log,
+    /// Stop for the debugger.
+    Breakpoint,
+}
+
+#[derive(Clone, Debug)]
+pub struct Hook {
+    /// The boot stage this hook applies to, or [None] for any stage.
+    pub stage: Option<BootStatus>,
+    pub action: HookAction,
+}
+
+/// Hooks, by virtual address.
+pub struct HookTable {
+    hooks: HashMap<u32, Vec<Hook>>,
+    /// A bit is set for every hooked address that hashes to it, so that most
+    /// addresses can be ruled out without looking at the table.
+    filter: Box<[u64]>,
+}
+
+impl Default for HookTable {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+impl HookTable {
+    pub fn new() -> Self {
+        HookTable {
+            hooks: HashMap::new(),
+            filter: vec![0; FILTER_BITS / 64].into_boxed_slice(),
+        }
+    }
+
+    /// The hooks needed to boot normally.
+    pub fn with_defaults() -> Self {
+        use BootStatus::*;
+        let mut table = Self::new();
+        for (pc, from, to) in [
+            (0xfff0_0000, Boot0, Boot1),
+            (0xfff0_0058, Boot1, Boot2Stub),
+            (0xffff_0000, Boot2Stub, Boot2),
+            (0xffff_2224, Boot2, IOSKernel),
+            (0x0001_0000, IOSKernel, UserKernelStub),
+            (0xffff_0000, UserKernelStub, UserKernel),
+        ] {
+            table.add(pc, Hook { stage: Some(from), action: HookAction::Boot(to) });
+        }
+
+        // Skyeye intentionally kills a bunch of threads, specifically NCD,
+        // KD, WL, and WD; presumably to avoid having to deal with emulating
+        // WLAN.
+        for pc in [0x13d9_0024, 0x13db_0024, 0x13ed_0024, 0x13eb_0024] {
+            table.add(pc, Hook {
+                stage: Some(IOSKernel),
+                action: HookAction::Patch(THREAD_CANCEL_PATCH.to_vec()),
+            });
+        }
+        table
+    }
+
+    #[inline(always)]
+    fn filter_bit(pc: u32) -> (usize, u64) {
+        let idx = (pc >> 1) as usize & (FILTER_BITS - 1);
+        (idx / 64, 1 << (idx % 64))
+    }
+
+    pub fn add(&mut self, pc: u32, hook: Hook) {
+        let (word, bit) = Self::filter_bit(pc);
+        self.filter[word] |= bit;
+        self.hooks.entry(pc).or_default().push(hook);
+    }
+
+    /// Add a breakpoint, which runs before any other hooks on the address.
+    /// Returns false if there already was one.
+    pub fn add_breakpoint(&mut self, pc: u32) -> bool {
+        let (word, bit) = Self::filter_bit(pc);
+        self.filter[word] |= bit;
+        let hooks = self.hooks.entry(pc).or_default();
+        if hooks.iter().any(|hook| matches!(hook.action, HookAction::Breakpoint)) {
+            return false;
+        }
+        hooks.insert(0, Hook { stage: None, action: HookAction::Breakpoint });
+        true
+    }
+
+    /// Remove the breakpoint on some address. Returns false if there wasn't
+    /// one.
+    pub fn remove_breakpoint(&mut self, pc: u32) -> bool {
+        let Some(hooks) = self.hooks.get_mut(&pc) else {
+            return false;
+        };
+        let len = hooks.len();
+        hooks.retain(|hook| !matches!(hook.action, HookAction::Breakpoint));
+        let removed = hooks.len() != len;
+        if hooks.is_empty() {
+            self.hooks.remove(&pc);
+            self.rebuild_filter();
+        }
+        removed
+    }
+
+    /// Remove every breakpoint, returning their addresses.
+    pub fn clear_breakpoints(&mut self) -> Vec<u32> {
+        let pcs: Vec<u32> = self.hooks.iter()
+            .filter(|(_, hooks)| hooks.iter().any(|hook| matches!(hook.action, HookAction::Breakpoint)))
+            .map(|(pc, _)| *pc)
+            .collect();
+        for pc in pcs.iter() {
+            self.remove_breakpoint(*pc);
+        }
+        pcs
+    }
+
+    fn rebuild_filter(&mut self) {
+        self.filter.fill(0);
+        for pc in self.hooks.keys() {
+            let (word, bit) = Self::filter_bit(*pc);
+            self.filter[word] |= bit;
+        }
+    }
+
+    /// Returns false when there are definitely no hooks on some address.
+    #[inline(always)]
+    pub fn maybe_hooked(&self, pc: u32) -> bool {
+        let (word, bit) = Self::filter_bit(pc);
+        self.filter[word] & bit != 0
+    }
+
+    /// Whether there are any hooks on some address.
+    pub fn contains(&self, pc: u32) -> bool {
+        self.maybe_hooked(pc) && self.hooks.contains_key(&pc)
+    }
+
+    /// Add the hooks listed in some file.
+    pub fn load_file(&mut self, path: &str) -> anyhow::Result<()> {
+        let text = std::fs::read_to_string(path)
+            .context(format!("Couldn't read hooks from {path}"))?;
+        for (num, line) in text.lines().enumerate() {
+            let line = line.split('#').next().unwrap().trim();
+            if line.is_empty() {
+                continue;
+            }
+            let (pc, hook) = Self::parse_hook(line)
+                .context(format!("{path}:{}: bad hook", num + 1))?;
+            self.add(pc, hook);
+        }
+        Ok(())
+    }
+
+    fn parse_hook(line: &str) -> anyhow::Result<(u32, Hook)> {
+        let hex = |s: &str| u32::from_str_radix(s.trim_start_matches("0x"), 16)
+            .map_err(|_| anyhow!("Invalid number {s}"));
+        let words: Vec<&str> = line.split_whitespace().collect();
+        let [pc, stage, action, args @ ..] = words.as_slice() else {
+            bail!("Expected an address, a stage and an action");
+        };
+        let pc = hex(pc)?;
+        let stage = match *stage {
+            "any" => None,
+            "Boot0" => Some(BootStatus::Boot0),
+            "Boot1" => Some(BootStatus::Boot1),
+            "Boot2Stub" => Some(BootStatus::Boot2Stub),
+            "Boot2" => Some(BootStatus::Boot2),
+            "IOSKernel" => Some(BootStatus::IOSKernel),
+            "UserKernelStub" => Some(BootStatus::UserKernelStub),
+            "UserKernel" => Some(BootStatus::UserKernel),
+            _ => bail!("Unknown boot stage {stage}"),
+        };
+        let action = match (*action, args) {
+            ("patch", [bytes]) => {
+                if bytes.len() % 2 != 0 {
+                    bail!("Patch {bytes} has an odd number of digits");
+                }
+                let bytes = (0..bytes.len()).step_by(2)
+                    .map(|i| u8::from_str_radix(&bytes[i..i + 2], 16))
+                    .collect::<Result<Vec<u8>, _>>()
+                    .map_err(|_| anyhow!("Invalid patch {bytes}"))?;
+                HookAction::Patch(bytes)
+            },
+            ("return", []) => HookAction::Return(None),
+            ("return", [val]) => HookAction::Return(Some(hex(val)?)),
+            ("memcpy", []) => HookAction::Memcpy,
+            ("memset", []) => HookAction::Memset,
+            ("log", []) => HookAction::Log,
+            _ => bail!("Unknown action {action} {}", args.join(" ")),
+        };
+        Ok((pc, Hook { stage, action }))
+    }
+}
+
+impl InterpBackend {
+    /// Run any hooks on the PC. Called before each step.
+    #[inline(always)]
+    pub fn check_hooks(&mut self) -> anyhow::Result<()> {
+        let pc = self.cpu.read_fetch_pc();
+        if !self.hooks.maybe_hooked(pc) {
+            return Ok(());
+        }
+        self.run_hooks(pc)
+    }
+
+    #[cold]
+    fn run_hooks(&mut self, pc: u32) -> anyhow::Result<()> {
+        let Some(hooks) = self.hooks.hooks.get(&pc) else {
+            return Ok(());
+        };
+        let actions: Vec<HookAction> = hooks.iter()
+            .filter(|hook| hook.stage.is_none_or(|stage| stage == self.boot_status))
+            .map(|hook| hook.action.clone())
+            .collect();
+        for action in actions {
+            match action {
+                HookAction::Boot(stage) => self.enter_stage(stage),
+                HookAction::Patch(bytes) => self.patch(pc, &bytes)?,
+                HookAction::Return(val) => {
+                    if let Some(val) = val {
+                        self.cpu.reg.r[0] = val;
+                    }
+                    self.hle_return();
+                },
+                HookAction::Memcpy => {
+                    let (dst, src, len) = (self.cpu.reg.r[0], self.cpu.reg.r[1], self.cpu.reg.r[2]);
+                    self.hle_memcpy(dst, src, len)?;
+                    self.hle_return();
+                },
+                HookAction::Memset => {
+                    let (dst, val, len) = (self.cpu.reg.r[0], self.cpu.reg.r[1], self.cpu.reg.r[2]);
+                    self.hle_memset(dst, val as u8, len)?;
+                    self.hle_return();
+                },
+                HookAction::Log => {
+                    info!(target: "Other", "Hook at {pc:08x}: {:?}", self.cpu.reg);
+                },
+                HookAction::Breakpoint => self.debug_break(),
+            }
+            // Anything after a return applies to the old PC
+            if self.cpu.read_fetch_pc() != pc {
+                break;
+            }
+        }
+        Ok(())
+    }
+
+    /// Overwrite the code at some virtual address.
+    fn patch(&mut self, vaddr: u32, bytes: &[u8]) -> anyhow::Result<()> {
+        let paddr = self.cpu.translate(TLBReq::new(vaddr, Access::Debug))?;
+        info!(target: "Other", "DBG hotpatching code at {paddr:08x}");
+        info!(target: "Other", "{:?}", self.cpu.reg);
+        let mut bus = metrics::write_bus(&self.bus, LockUser::Cpu);
+        bus.dma_write(paddr, bytes)?;
+        // Don't run anything decoded from before the patch, and let
+        // the backend know that the bus has changed.
+        if let Some(cache) = self.block_cache.as_mut() {
+            cache.sync(&mut bus);
+        }
+        self.cpu.bus_sync.set(true);
+        Ok(())
+    }
+
+    /// Return from a function replaced by a hook (like `bx lr`).
+    fn hle_return(&mut self) {
+        let lr = self.cpu.reg[Reg::Lr];
+        self.cpu.reg.cpsr.set_thumb(lr & 1 != 0);
+        self.cpu.write_exec_pc(lr & 0xffff_fffe);
+    }
+
+    /// Split an access to virtual memory into runs that don't cross a page,
+    /// each with its physical address.
+    pub(crate) fn hle_runs(&self, vaddr: u32, len: u32, kind: Access) -> anyhow::Result<Vec<(u32, usize)>> {
+        let mut runs = Vec::new();
+        let mut done = 0;
+        while done < len {
+            let addr = vaddr.wrapping_add(done);
+            let run = (0x1000 - (addr & 0xfff)).min(len - done);
+            let paddr = self.cpu.translate(TLBReq::new(addr, kind))?;
+            runs.push((paddr, run as usize));
+            done += run;
+        }
+        Ok(runs)
+    }
+
+    /// Copy a run at a time, where neither the source nor the destination
+    /// crosses a page, without buffering anything.
+    fn hle_memcpy(&mut self, dst: u32, src: u32, len: u32) -> anyhow::Result<()> {
+        let bus = self.bus.clone();
+        let mut done = 0;
+        while done < len {
+            let (src, dst) = (src.wrapping_add(done), dst.wrapping_add(done));
+            let run = (0x1000 - (src & 0xfff)).min(0x1000 - (dst & 0xfff)).min(len - done);
+            let src_paddr = self.cpu.translate(TLBReq::new(src, Access::Read))?;
+            let dst_paddr = self.cpu.translate(TLBReq::new(dst, Access::Write))?;
+            metrics::write_bus(&bus, LockUser::Cpu).dma_copy(src_paddr, dst_paddr, run as usize)?;
+            done += run;
+        }
+        let mut bus = metrics::write_bus(&bus, LockUser::Cpu);
+        if let Some(cache) = self.block_cache.as_mut() {
+            cache.sync(&mut bus);
+        }
+        self.cpu.bus_sync.set(true);
+        Ok(())
+    }
+
+    fn hle_memset(&mut self, dst: u32, val: u8, len: u32) -> anyhow::Result<()> {
+        let runs = self.hle_runs(dst, len, Access::Write)?;
+        let bus = self.bus.clone();
+        let mut bus = metrics::write_bus(&bus, LockUser::Cpu);
+        for (paddr, run) in runs {
+            bus.dma_fill(paddr, run, val)?;
+        }
+        if let Some(cache) = self.block_cache.as_mut() {
+            cache.sync(&mut bus);
+        }
+        self.cpu.bus_sync.set(true);
+        Ok(())
+    }
+}
@@ -50,7 +50,7 @@ impl ArmLut {
         let mut i = 0;
         while i < Self::LUT_SIZE {
             let opcd = ArmLut::idx_to_opcd(i);
-            lut.data[i] = ArmFn::from_inst(ArmInst::decode(opcd));
+            lut.data[i] = ArmFn::from_inst(ArmInst::decode(opcd), opcd);
             i += 1;
         }
         lut
@@ -0,0 +1,55 @@
+//! Saving and restoring the state of the interpreter backend.
+//!
+//! See [ironic_core::snapshot] for the file format.
+
+use std::io::{Read, Write};
+
+use log::error;
+
+use ironic_core::bus::Bus;
+use ironic_core::snapshot::{self, Snapshot};
+
+use crate::interp::{BootStatus, InterpBackend};
+
+impl Snapshot for BootStatus {
+    fn save(&self, w: &mut dyn Write) -> anyhow::Result<()> {
+        snapshot::put(w, self)
+    }
+    fn restore(&mut self, r: &mut dyn Read) -> anyhow::Result<()> {
+        *self = snapshot::get!(r);
+        Ok(())
+    }
+}
+
+impl InterpBackend {
+    /// Save the state of the whole machine to some file.
+    pub fn save_state(&self, bus: &Bus, path: &str) -> anyhow::Result<()> {
+        snapshot::save_file(path, &[&self.boot_status, &self.svc_buf, &self.cpu, bus])
+    }
+
+    /// Replace the state of the whole machine with the contents of some
+    /// snapshot file. This must be called before [crate::back::Backend::run].
+    pub fn load_state(&mut self, path: &str) -> anyhow::Result<()> {
+        let bus = self.bus.clone();
+        let mut bus = bus.write();
+        snapshot::restore_file(path, &mut [
+            &mut self.boot_status, &mut self.svc_buf, &mut self.cpu, &mut *bus
+        ])?;
+        self.restored = true;
+        Ok(())
+    }
+
+    /// Save a snapshot if one was requested, once the kernel has been
+    /// reached. Errors are logged and otherwise ignored: failing to save
+    /// shouldn't stop emulation.
+    pub(crate) fn check_save_state(&mut self, bus: &Bus) {
+        if self.boot_status != BootStatus::IOSKernel {
+            return;
+        }
+        if let Some(path) = self.save_state_path.take() {
+            if let Err(reason) = self.save_state(bus, &path) {
+                error!(target: "Other", "Failed to save snapshot to {path}: {reason:#}");
+            }
+        }
+    }
+}
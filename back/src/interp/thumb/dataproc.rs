@@ -6,16 +6,6 @@ use ironic_core::cpu::alu::*;
 use ironic_core::cpu::reg::Reg;
 
 
-/// Set all of the condition flags.
-macro_rules! set_all_flags { 
-    ($cpu:ident, $n:ident, $z:ident, $c:ident, $v:ident) => {
-        $cpu.reg.cpsr.set_n($n);
-        $cpu.reg.cpsr.set_z($z);
-        $cpu.reg.cpsr.set_c($c);
-        $cpu.reg.cpsr.set_v($v);
-    }
-}
-
 
 pub fn mov_rsr(cpu: &mut Cpu, op: MovRsrBits) -> DispatchRes {
     let rm_val = cpu.reg[op.rdm()];
@@ -27,9 +17,7 @@ pub fn mov_rsr(cpu: &mut Cpu, op: MovRsrBits) -> DispatchRes {
     });
 
     cpu.reg[op.rdm()] = res;
-    cpu.reg.cpsr.set_n(res & 0x8000_0000 != 0);
-    cpu.reg.cpsr.set_z(res == 0);
-    cpu.reg.cpsr.set_c(carry);
+    cpu.reg.cpsr.set_logic_flags(res, carry);
     DispatchRes::RetireOk
 }
 
@@ -61,9 +49,7 @@ pub fn mov_reg_alt(cpu: &mut Cpu, op: MovRegAltBits) -> DispatchRes {
         stype: op.op() as u32, imm5: op.imm5() as u32, c_in: cpu.reg.cpsr.c()
     });
     cpu.reg[op.rd()] = res;
-    cpu.reg.cpsr.set_n(res & 0x8000_0000 != 0);
-    cpu.reg.cpsr.set_z(res == 0);
-    cpu.reg.cpsr.set_c(carry);
+    cpu.reg.cpsr.set_logic_flags(res, carry);
     DispatchRes::RetireOk
 }
 
@@ -95,9 +81,7 @@ pub fn tst_reg(cpu: &mut Cpu, op: CmpRegBits) -> DispatchRes {
     });
 
     let res = cpu.reg[op.rn()] & val;
-    cpu.reg.cpsr.set_n(res & 0x8000_0000 != 0);
-    cpu.reg.cpsr.set_z(res == 0);
-    cpu.reg.cpsr.set_c(carry);
+    cpu.reg.cpsr.set_logic_flags(res, carry);
     DispatchRes::RetireOk
 }
 
@@ -106,9 +90,10 @@ pub fn add_reg(cpu: &mut Cpu, op: AddSubRegBits) -> DispatchRes {
     let (val, _) = barrel_shift(ShiftArgs::Reg { rm, 
         stype: ShiftType::Lsl as u32, imm5: 0, c_in: cpu.reg.cpsr.c()
     });
-    let (alu_out, n, z, c, v) = add_generic(cpu.reg[op.rn()], val);
+    let (a, b) = (cpu.reg[op.rn()], val);
+    let alu_out = a.wrapping_add(b);
     cpu.reg[op.rd()] = alu_out;
-    set_all_flags!(cpu, n, z, c, v);
+    cpu.reg.cpsr.set_add_flags(a, b);
     DispatchRes::RetireOk
 }
 
@@ -117,9 +102,10 @@ pub fn sub_reg(cpu: &mut Cpu, op: AddSubRegBits) -> DispatchRes {
     let (val, _) = barrel_shift(ShiftArgs::Reg { rm, 
         stype: ShiftType::Lsl as u32, imm5: 0, c_in: cpu.reg.cpsr.c()
     });
-    let (alu_out, n, z, c, v) = sub_generic(cpu.reg[op.rn()], val);
+    let (a, b) = (cpu.reg[op.rn()], val);
+    let alu_out = a.wrapping_sub(b);
     cpu.reg[op.rd()] = alu_out;
-    set_all_flags!(cpu, n, z, c, v);
+    cpu.reg.cpsr.set_sub_flags(a, b);
     DispatchRes::RetireOk
 }
 
@@ -130,9 +116,10 @@ pub fn sbc_reg(cpu: &mut Cpu, op: BitwiseRegBits) -> DispatchRes {
     });
     let val = if cpu.reg.cpsr.c() { shifted } else { shifted.wrapping_add(1) };
 
-    let (alu_out, n, z, c, v) = sub_generic(cpu.reg[op.rdn()], val);
+    let (a, b) = (cpu.reg[op.rdn()], val);
+    let alu_out = a.wrapping_sub(b);
     cpu.reg[op.rdn()] = alu_out;
-    set_all_flags!(cpu, n, z, c, v);
+    cpu.reg.cpsr.set_sub_flags(a, b);
     DispatchRes::RetireOk
 }
 
@@ -142,9 +129,10 @@ pub fn adc_reg(cpu: &mut Cpu, op: BitwiseRegBits) -> DispatchRes {
         stype: ShiftType::Lsl as u32, imm5: 0, c_in: cpu.reg.cpsr.c()
     });
     let val = if cpu.reg.cpsr.c() { shifted + 1 } else { shifted };
-    let (alu_out, n, z, c, v) = add_generic(cpu.reg[op.rdn()], val);
+    let (a, b) = (cpu.reg[op.rdn()], val);
+    let alu_out = a.wrapping_add(b);
     cpu.reg[op.rdn()] = alu_out;
-    set_all_flags!(cpu, n, z, c, v);
+    cpu.reg.cpsr.set_add_flags(a, b);
     DispatchRes::RetireOk
 }
 
@@ -173,9 +161,7 @@ pub fn do_bitwise_reg(cpu: &mut Cpu, rm: u16, rdn: u16, op: BitwiseOp) {
         BitwiseOp::Bic => base & !val,
     };
     cpu.reg[rdn] = res;
-    cpu.reg.cpsr.set_n(res & 0x8000_0000 != 0);
-    cpu.reg.cpsr.set_z(res == 0);
-    cpu.reg.cpsr.set_c(carry);
+    cpu.reg.cpsr.set_logic_flags(res, carry);
 }
 pub fn and_reg(cpu: &mut Cpu, op: BitwiseRegBits) -> DispatchRes {
     do_bitwise_reg(cpu, op.rm(), op.rdn(), BitwiseOp::And);
@@ -195,8 +181,8 @@ pub fn bic_reg(cpu: &mut Cpu, op: BitwiseRegBits) -> DispatchRes {
 }
 
 pub fn cmp_imm(cpu: &mut Cpu, op: CmpImmBits) -> DispatchRes {
-    let (_, n, z, c, v) = sub_generic(cpu.reg[op.rn()], op.imm8() as u32);
-    set_all_flags!(cpu, n, z, c, v);
+    let (a, b) = (cpu.reg[op.rn()], op.imm8() as u32);
+    cpu.reg.cpsr.set_sub_flags(a, b);
     DispatchRes::RetireOk
 }
 
@@ -206,8 +192,8 @@ pub fn cmp_reg(cpu: &mut Cpu, op: CmpRegBits) -> DispatchRes {
         stype: ShiftType::Lsl as u32, imm5: 0, c_in: cpu.reg.cpsr.c()
     });
 
-    let (_, n, z, c, v) = sub_generic(cpu.reg[op.rn()], val);
-    set_all_flags!(cpu, n, z, c, v);
+    let (a, b) = (cpu.reg[op.rn()], val);
+    cpu.reg.cpsr.set_sub_flags(a, b);
     DispatchRes::RetireOk
 }
 
@@ -220,52 +206,57 @@ pub fn cmp_reg_alt(cpu: &mut Cpu, op: CmpRegAltBits) -> DispatchRes {
     let (val, _) = barrel_shift(ShiftArgs::Reg { rm, 
         stype: ShiftType::Lsl as u32, imm5: 0, c_in: cpu.reg.cpsr.c()
     });
-    let (_, n, z, c, v) = sub_generic(cpu.reg[rn], val);
-    set_all_flags!(cpu, n, z, c, v);
+    let (a, b) = (cpu.reg[rn], val);
+    cpu.reg.cpsr.set_sub_flags(a, b);
     DispatchRes::RetireOk
 }
 
 pub fn neg(cpu: &mut Cpu, op: NegBits) -> DispatchRes {
     let rn_val = cpu.reg[op.rn()];
-    let (alu_out, n, z, c, v) = sub_generic(0, rn_val);
+    let (a, b) = (0u32, rn_val);
+    let alu_out = a.wrapping_sub(b);
     cpu.reg[op.rd()] = alu_out;
-    set_all_flags!(cpu, n, z, c, v);
+    cpu.reg.cpsr.set_sub_flags(a, b);
     DispatchRes::RetireOk
 }
 
 pub fn add_imm(cpu: &mut Cpu, op: AddSubImmBits) -> DispatchRes {
     let rn_val = cpu.reg[op.rn()];
     let imm3 = op.imm3() as u32;
-    let (alu_out, n, z, c, v) = add_generic(rn_val, imm3);
+    let (a, b) = (rn_val, imm3);
+    let alu_out = a.wrapping_add(b);
     cpu.reg[op.rd()] = alu_out;
-    set_all_flags!(cpu, n, z, c, v);
+    cpu.reg.cpsr.set_add_flags(a, b);
     DispatchRes::RetireOk
 }
 
 pub fn sub_imm(cpu: &mut Cpu, op: AddSubImmBits) -> DispatchRes {
     let rn_val = cpu.reg[op.rn()];
     let imm3 = op.imm3() as u32;
-    let (alu_out, n, z, c, v) = sub_generic(rn_val, imm3);
+    let (a, b) = (rn_val, imm3);
+    let alu_out = a.wrapping_sub(b);
     cpu.reg[op.rd()] = alu_out;
-    set_all_flags!(cpu, n, z, c, v);
+    cpu.reg.cpsr.set_sub_flags(a, b);
     DispatchRes::RetireOk
 }
 
 pub fn sub_imm_alt(cpu: &mut Cpu, op: AddSubImmAltBits) -> DispatchRes {
     let rn_val = cpu.reg[op.rdn()];
     let imm8 = op.imm8() as u32;
-    let (alu_out, n, z, c, v) = sub_generic(rn_val, imm8);
+    let (a, b) = (rn_val, imm8);
+    let alu_out = a.wrapping_sub(b);
     cpu.reg[op.rdn()] = alu_out;
-    set_all_flags!(cpu, n, z, c, v);
+    cpu.reg.cpsr.set_sub_flags(a, b);
     DispatchRes::RetireOk
 }
 
 pub fn add_imm_alt(cpu: &mut Cpu, op: AddSubImmAltBits) -> DispatchRes {
     let rn_val = cpu.reg[op.rdn()];
     let imm8 = op.imm8() as u32;
-    let (alu_out, n, z, c, v) = add_generic(rn_val, imm8);
+    let (a, b) = (rn_val, imm8);
+    let alu_out = a.wrapping_add(b);
     cpu.reg[op.rdn()] = alu_out;
-    set_all_flags!(cpu, n, z, c, v);
+    cpu.reg.cpsr.set_add_flags(a, b);
     DispatchRes::RetireOk
 }
 
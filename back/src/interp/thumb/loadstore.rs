@@ -214,27 +214,50 @@ pub fn str_imm_sp(cpu: &mut Cpu, op: LoadStoreAltBits) -> DispatchRes {
 
 
 
+/// Load the low registers in a list with one block transfer. If `extra` is
+/// set, one more word is read (for the PC) and returned.
+#[inline(always)]
+fn load_reglist(cpu: &mut Cpu, addr: u32, reglist: u16, extra: bool) -> anyhow::Result<Option<u32>> {
+    let mut words = [0; 9];
+    let len = reglist.count_ones() as usize + extra as usize;
+    cpu.read_block32(addr, &mut words[..len])?;
+    let mut words = words.into_iter();
+    for i in 0..8 {
+        if (reglist & (1 << i)) != 0 {
+            cpu.reg[i as u32] = words.next().unwrap();
+        }
+    }
+    Ok(if extra { words.next() } else { None })
+}
+
+/// Store the low registers in a list (followed by `extra`, if any) with one
+/// block transfer.
+#[inline(always)]
+fn store_reglist(cpu: &mut Cpu, addr: u32, reglist: u16, extra: Option<u32>) -> anyhow::Result<()> {
+    let mut words = [0; 9];
+    let mut len = 0;
+    for i in 0..8 {
+        if (reglist & (1 << i)) != 0 {
+            words[len] = cpu.reg[i as u32];
+            len += 1;
+        }
+    }
+    if let Some(val) = extra {
+        words[len] = val;
+        len += 1;
+    }
+    cpu.write_block32(addr, &words[..len])
+}
+
 pub fn ldm(cpu: &mut Cpu, op: LoadStoreMultiBits) -> DispatchRes {
     let num_regs = op.register_list().count_ones();
     let writeback = (op.register_list() & (1 << op.rn())) == 0;
 
     let start_addr = cpu.reg[op.rn()];
     let end_addr = start_addr + (4 * num_regs);
-    let mut addr = start_addr;
-    for i in 0..8 {
-        if (op.register_list() & (1 << i)) != 0 {
-            let val = match cpu.read32(addr){
-                Ok(val) => val,
-                Err(reason) => {
-                    return DispatchRes::FatalErr(reason);
-                }
-            };
-            cpu.reg[i as u32] = val;
-            addr += 4;
-        }
+    if let Err(reason) = load_reglist(cpu, start_addr, op.register_list(), false) {
+        return DispatchRes::FatalErr(reason);
     }
-
-    assert!(end_addr == addr);
     if writeback {
         cpu.reg[op.rn()] = end_addr;
     }
@@ -245,15 +268,8 @@ pub fn stm(cpu: &mut Cpu, op: LoadStoreMultiBits) -> DispatchRes {
     let num_regs = op.register_list().count_ones();
     let start_addr = cpu.reg[op.rn()];
     let end_addr = start_addr + (4 * num_regs);
-    let mut addr = start_addr;
-    for i in 0..8 {
-        if (op.register_list() & (1 << i)) != 0 {
-            match cpu.write32(addr, cpu.reg[i as u32]) {
-                Ok(_) => {},
-                Err(reason) => { return DispatchRes::FatalErr(reason); }
-            };
-            addr += 4;
-        }
+    if let Err(reason) = store_reglist(cpu, start_addr, op.register_list(), None) {
+        return DispatchRes::FatalErr(reason);
     }
     cpu.reg[op.rn()] = end_addr;
     DispatchRes::RetireOk
@@ -267,25 +283,10 @@ pub fn push(cpu: &mut Cpu, op: PushBits) -> DispatchRes {
     };
 
     let start_addr = cpu.reg[Reg::Sp] - (4 * num_regs);
-    let end_addr = cpu.reg[Reg::Sp] - 4;
-    let mut addr = start_addr;
-    for i in 0..8 {
-        if (op.register_list() & (1 << i)) != 0 {
-            match cpu.write32(addr, cpu.reg[i as u32]) {
-                Ok(_) => {},
-                Err(reason) => {return DispatchRes::FatalErr(reason) }
-            };
-            addr += 4;
-        }
-    }
-    if op.m() {
-        match cpu.write32(addr, cpu.reg[Reg::Lr]) {
-            Ok(_) => {},
-            Err(reason) => { return DispatchRes::FatalErr(reason); }
-        };
-        addr += 4;
+    let lr = op.m().then(|| cpu.reg[Reg::Lr]);
+    if let Err(reason) = store_reglist(cpu, start_addr, op.register_list(), lr) {
+        return DispatchRes::FatalErr(reason);
     }
-    assert!(end_addr == addr - 4);
     cpu.reg[Reg::Sp] = start_addr;
 
     DispatchRes::RetireOk
@@ -299,33 +300,10 @@ pub fn pop(cpu: &mut Cpu, op: PopBits) -> DispatchRes {
     };
     let start_addr = cpu.reg[Reg::Sp];
     let end_addr = start_addr + (4 * num_regs);
-    let mut addr = start_addr;
-    for i in 0..8 {
-        if (op.register_list() & (1 << i)) != 0 {
-            let val = match cpu.read32(addr){
-                Ok(val) => val,
-                Err(reason) => {
-                    return DispatchRes::FatalErr(reason);
-                }
-            };
-            cpu.reg[i as u32] = val;
-            addr += 4;
-        }
-    }
-
-    let new_pc = if op.p() {
-        let saved_lr = match cpu.read32(addr) {
-            Ok(val) => val,
-            Err(reason) => {
-                return DispatchRes::FatalErr(reason);
-            }
-        };
-        addr += 4;
-        Some(saved_lr)
-    } else { 
-        None 
+    let new_pc = match load_reglist(cpu, start_addr, op.register_list(), op.p()) {
+        Ok(val) => val,
+        Err(reason) => return DispatchRes::FatalErr(reason),
     };
-    assert!(end_addr == addr);
     cpu.reg[Reg::Sp] = end_addr;
 
     if let Some(new_pc) = new_pc {
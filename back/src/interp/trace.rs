@@ -0,0 +1,214 @@
+//! A history of the most recently executed instructions.
+//!
+//! Each step is recorded as a small, fixed-size [TraceRecord] in a ring
+//! buffer. The JIT backend records a step for each block it runs, rather
+//! than for each instruction, so that it can keep running compiled code.
+//! Nothing is decoded or formatted until the buffer is dumped, which happens
+//! when emulation halts on an error, or when another thread asks for it (see
+//! [DumpRequest]).
+
+use std::fs::File;
+use std::io::{BufWriter, Write};
+use std::sync::Arc;
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::time::Duration;
+
+use anyhow::Context;
+use log::{error, info};
+
+use ironic_core::bus::notify::Notifier;
+use ironic_core::cpu::Cpu;
+use ironic_core::cpu::psr::Psr;
+
+use crate::bits::disassembly::{disassmble_arm, disassmble_thumb};
+use crate::interp::InterpBackend;
+
+/// Number of written registers whose values are kept in a record.
+const SAVED_REGS: usize = 2;
+
+/// The effects of a single instruction, or of a block of them.
+#[derive(Clone, Copy, Default)]
+pub struct TraceRecord {
+    pub pc: u32,
+    /// The (first) instruction.
+    pub opcd: u32,
+    /// The CPSR before the instruction.
+    pub cpsr: u32,
+    /// Number of instructions retired.
+    pub count: u32,
+    /// The last address accessed (if any).
+    pub addr: Option<u32>,
+    /// Mask of the registers (r0-r14) written.
+    pub written: u16,
+    /// New values of the lowest-numbered written registers.
+    pub vals: [u32; SAVED_REGS],
+}
+
+impl TraceRecord {
+    /// Start recording the instruction at the PC. Returns the record and
+    /// the current registers, to be passed to [TraceRecord::finish].
+    pub fn begin(cpu: &Cpu) -> (Self, [u32; 15]) {
+        let pc = cpu.read_fetch_pc();
+        let opcd = if cpu.reg.cpsr.thumb() {
+            cpu.fetch16(pc).map(u32::from)
+        } else {
+            cpu.fetch32(pc)
+        };
+        cpu.last_access.set(None);
+        let rec = TraceRecord {
+            pc,
+            opcd: opcd.unwrap_or_default(),
+            cpsr: cpu.reg.cpsr.get().0,
+            count: 1,
+            ..Default::default()
+        };
+        (rec, cpu.reg.r)
+    }
+
+    /// Record the effects of the instruction, given the registers from
+    /// before it was executed.
+    pub fn finish(&mut self, cpu: &Cpu, before: &[u32; 15]) {
+        self.addr = cpu.last_access.get();
+        let mut saved = 0;
+        for (idx, (old, new)) in before.iter().zip(cpu.reg.r.iter()).enumerate() {
+            if old != new {
+                self.written |= 1 << idx;
+                if saved < SAVED_REGS {
+                    self.vals[saved] = *new;
+                    saved += 1;
+                }
+            }
+        }
+    }
+
+    /// Format the record as a line of text.
+    pub fn disassemble(&self) -> String {
+        let thumb = Psr(self.cpsr).thumb();
+        let inst = if thumb {
+            disassmble_thumb(self.opcd as u16, self.pc)
+        } else {
+            disassmble_arm(self.opcd, self.pc)
+        }.unwrap_or_else(|_| "???".to_owned());
+        let opcd = if thumb { format!("    {:04x}", self.opcd) } else { format!("{:08x}", self.opcd) };
+        let mut line = format!("{:08x}: {opcd} {inst:<32} cpsr={:08x}", self.pc, self.cpsr);
+        if self.count > 1 {
+            line += &format!(" (+{} more)", self.count - 1);
+        }
+        if let Some(addr) = self.addr {
+            line += &format!(" [{addr:08x}]");
+        }
+        let mut vals = self.vals.iter();
+        for idx in (0..15).filter(|idx| self.written & (1 << idx) != 0) {
+            match vals.next() {
+                Some(val) => line += &format!(" r{idx}={val:08x}"),
+                None => line += &format!(" r{idx}"),
+            }
+        }
+        line
+    }
+}
+
+/// Lets other threads ask for the trace to be dumped, since the buffer is
+/// only ever touched by the CPU thread.
+#[derive(Default)]
+pub struct DumpRequest {
+    pending: AtomicBool,
+    done: Notifier,
+}
+
+impl DumpRequest {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Ask for the trace to be dumped, and wait for it to be written.
+    /// Returns false if that didn't happen within some timeout.
+    pub fn dump(&self, timeout: Duration) -> bool {
+        let seen = self.done.seq();
+        self.pending.store(true, Ordering::Release);
+        self.done.wait(seen, Some(timeout)) != seen
+    }
+}
+
+/// Ring buffer with the most recent [TraceRecord]s.
+pub struct TraceBuffer {
+    records: Box<[TraceRecord]>,
+    /// Index of the next record to be written.
+    next: usize,
+    /// Set once the buffer has wrapped around.
+    full: bool,
+    /// Where the trace is written when it's dumped.
+    pub path: String,
+    pub requests: Arc<DumpRequest>,
+}
+
+impl TraceBuffer {
+    pub fn new(len: usize, path: &str) -> Self {
+        TraceBuffer {
+            records: vec![TraceRecord::default(); len.max(1)].into_boxed_slice(),
+            next: 0,
+            full: false,
+            path: path.to_owned(),
+            requests: Arc::new(DumpRequest::new()),
+        }
+    }
+
+    #[inline(always)]
+    pub fn push(&mut self, rec: TraceRecord) {
+        self.records[self.next] = rec;
+        self.next += 1;
+        if self.next == self.records.len() {
+            self.next = 0;
+            self.full = true;
+        }
+    }
+
+    /// The records in the buffer, oldest first.
+    pub fn iter(&self) -> impl Iterator<Item = &TraceRecord> {
+        let (new, old) = self.records.split_at(self.next);
+        let old = if self.full { old } else { &[] };
+        old.iter().chain(new.iter())
+    }
+
+    /// Write the trace to [TraceBuffer::path].
+    pub fn dump(&self) -> anyhow::Result<()> {
+        let mut f = BufWriter::new(File::create(&self.path)
+            .context(format!("Couldn't create trace file {}", self.path))?);
+        for rec in self.iter() {
+            writeln!(f, "{}", rec.disassemble())?;
+        }
+        f.flush()?;
+        Ok(())
+    }
+}
+
+impl InterpBackend {
+    /// Start keeping a trace.
+    pub fn attach_trace(&mut self, trace: TraceBuffer) {
+        self.cpu.trace_access = true;
+        self.trace = Some(trace);
+    }
+
+    /// Dump the trace (if any). Errors are logged and otherwise ignored.
+    pub fn dump_trace(&self) {
+        let Some(trace) = self.trace.as_ref() else {
+            return;
+        };
+        match trace.dump() {
+            Ok(_) => info!(target: "Other", "Wrote instruction trace to {}", trace.path),
+            Err(reason) => error!(target: "Other", "Failed to write instruction trace: {reason:#}"),
+        }
+    }
+
+    /// Dump the trace if another thread asked for it.
+    pub(crate) fn check_trace_request(&self) {
+        let Some(trace) = self.trace.as_ref() else {
+            return;
+        };
+        if trace.requests.pending.load(Ordering::Acquire) {
+            trace.requests.pending.store(false, Ordering::Relaxed);
+            self.dump_trace();
+            trace.requests.done.notify();
+        }
+    }
+}
@@ -0,0 +1,487 @@
+//! The JIT backend.
+//!
+//! Straight-line runs of guest code are compiled into host functions. A few
+//! simple ARM data-processing instructions are translated directly into host
+//! code; everything else in a block is compiled into a call to the matching
+//! interpreter handler from [crate::interp]. Anything that can change control
+//! flow, the CPU mode, or system state (branches, exceptions, coprocessor and
+//! status register operations) ends a block and runs through the interpreter.
+//!
+//! Stores are always the last instruction in a block, so that any bus task
+//! they produce (i.e. from an MMIO write) is handled before the next
+//! instruction executes, just like in the interpreter.
+
+pub mod a64;
+pub mod arena;
+pub mod emit;
+pub mod x64;
+
+use std::collections::HashMap;
+use std::mem::offset_of;
+
+use log::{error, info, warn};
+use parking_lot::RwLock;
+use std::sync::Arc;
+
+use ironic_core::bus::Bus;
+use ironic_core::bus::code::CodePageKey;
+use ironic_core::cpu::{Cpu, CpuRes};
+use ironic_core::cpu::alu::rot_by_imm;
+use ironic_core::cpu::mmu::prim::{TLBReq, Access};
+use ironic_core::cpu::reg::RegisterFile;
+use ironic_core::metrics::{self, LockUser};
+
+use crate::back::Backend;
+use crate::bits::arm::*;
+use crate::decode::arm::ArmInst;
+use crate::decode::thumb::ThumbInst;
+use crate::interp::InterpBackend;
+use crate::interp::dispatch::DispatchRes;
+use crate::interp::lut::INTERP_LUT;
+use crate::interp::trace::TraceRecord;
+use crate::jit::arena::CodeArena;
+use crate::jit::emit::*;
+
+#[cfg(not(target_arch = "aarch64"))]
+type HostEmitter = x64::X64Emitter;
+#[cfg(target_arch = "aarch64")]
+type HostEmitter = a64::A64Emitter;
+
+/// Whether or not we know how to generate code for this host.
+const HOST_SUPPORTED: bool = cfg!(any(target_arch = "x86_64", target_arch = "aarch64"));
+
+/// The maximum number of guest instructions in a block.
+const MAX_BLOCK_LEN: u32 = 64;
+
+/// Number of entries in the direct-mapped cache of blocks by virtual PC.
+const VMAP_ENTRIES: usize = 0x1000;
+
+const PAGE_MASK: u32 = 0xffff_f000;
+
+/// Byte offset of the program counter in [RegisterFile].
+const PC_OFF: u8 = offset_of!(RegisterFile, pc) as u8;
+
+/// Byte offset of a general-purpose register in [RegisterFile].
+const fn roff(r: u32) -> u8 {
+    (offset_of!(RegisterFile, r) + (r as usize * 4)) as u8
+}
+
+/// State shared between compiled blocks and the fallback functions.
+#[repr(C)]
+pub struct JitCtx {
+    /// The guest register file (this must be the first field).
+    reg: *mut RegisterFile,
+    cpu: *mut Cpu,
+    /// The result of the instruction that caused a block to exit early.
+    exit: Option<DispatchRes>,
+}
+
+/// A compiled block.
+type BlockFn = unsafe extern "C" fn(*mut JitCtx) -> u32;
+
+/// Finish an instruction dispatched from a compiled block. Returns non-zero
+/// if the block needs to exit.
+fn fallback_retire(ctx: &mut JitCtx, cpu: &mut Cpu, res: DispatchRes) -> u32 {
+    match res {
+        DispatchRes::RetireOk | DispatchRes::CondFailed => {
+            cpu.increment_pc();
+            0
+        },
+        res => {
+            ctx.exit = Some(res);
+            1
+        },
+    }
+}
+
+/// Run an ARM instruction with the interpreter.
+///
+/// Panics in interpreter handlers cannot unwind through compiled code, so
+/// they will abort (after running the panic hook).
+unsafe extern "C" fn arm_fallback(ctx: *mut JitCtx, opcd: u32) -> u32 {
+    let ctx = unsafe { &mut *ctx };
+    let cpu = unsafe { &mut *ctx.cpu };
+    let res = if opcd >= 0xe000_0000 {
+        INTERP_LUT.arm.lookup(opcd).0(cpu, opcd)
+    } else {
+        match cpu.reg.cond_pass(opcd) {
+            Ok(true) => INTERP_LUT.arm.lookup(opcd).0(cpu, opcd),
+            Ok(false) => DispatchRes::CondFailed,
+            Err(reason) => DispatchRes::FatalErr(reason),
+        }
+    };
+    fallback_retire(ctx, cpu, res)
+}
+
+/// Run a Thumb instruction with the interpreter.
+unsafe extern "C" fn thumb_fallback(ctx: *mut JitCtx, opcd: u32) -> u32 {
+    let ctx = unsafe { &mut *ctx };
+    let cpu = unsafe { &mut *ctx.cpu };
+    let opcd = opcd as u16;
+    let res = INTERP_LUT.thumb.lookup(opcd).0(cpu, opcd);
+    fallback_retire(ctx, cpu, res)
+}
+
+/// How a particular instruction is handled when building a block.
+enum Op {
+    /// Translated into host code.
+    Native(NativeOp),
+    /// A call to the interpreter.
+    Call,
+    /// A call to the interpreter, ending the block.
+    CallLast,
+    /// Ends the block before this instruction.
+    End,
+}
+
+enum NativeOp {
+    MovImm { rd: u32, imm: u32 },
+    MovReg { rd: u32, rm: u32 },
+    AluImm { op: AluOp, rd: u32, rn: u32, imm: u32 },
+}
+
+fn classify_arm(opcd: u32) -> Op {
+    use ArmInst::*;
+    let inst = ArmInst::decode(opcd);
+    let always = opcd >> 28 == 0xe;
+    match inst {
+        B | BlImm | Bx | BlxReg | Bxj | BlxImm | Svc | Bkpt | Undefined |
+        Mcr | Mrc | Mcrr | Mrrc | Stc | LdcImm | MsrImm | MsrReg |
+        LdmRegUser | StmRegUser => return Op::End,
+        _ => {},
+    }
+    // Anything naming r15 in the usual destination field may branch.
+    if (opcd & 0x0000_f000) == 0x0000_f000 {
+        return Op::End;
+    }
+    match inst {
+        Ldm | Ldmda | Ldmib | Ldmdb if (opcd & 0x0000_8000) != 0 => return Op::End,
+
+        StrImm | StrhImm | StrdImm | StrbImm | StrReg | StrbReg | StrhReg |
+        StrdReg | Strbt | Strt | StrbtAlt | StrtAlt |
+        Stm | Stmda | Stmdb | Stmib | Swp | Swpb => return Op::CallLast,
+        _ => {},
+    }
+    if !always {
+        return Op::Call;
+    }
+
+    match inst {
+        MovImm | MvnImm => {
+            let op = MovImmBits(opcd);
+            if op.s() { return Op::Call; }
+            let (imm, _) = rot_by_imm(op.imm12(), false);
+            let imm = if inst == MvnImm { !imm } else { imm };
+            Op::Native(NativeOp::MovImm { rd: op.rd(), imm })
+        },
+        MovReg => {
+            let op = MovRegBits(opcd);
+            if op.s() || op.imm5() != 0 || op.stype() != 0 || op.rm() == 15 {
+                return Op::Call;
+            }
+            Op::Native(NativeOp::MovReg { rd: op.rd(), rm: op.rm() })
+        },
+        AddImm | SubImm | RsbImm | AndImm | OrrImm | EorImm | BicImm => {
+            let op = DpImmBits(opcd);
+            if op.s() || op.rn() == 15 { return Op::Call; }
+            let (imm, _) = rot_by_imm(op.imm12(), false);
+            let (alu, imm) = match inst {
+                AddImm => (AluOp::Add, imm),
+                SubImm => (AluOp::Sub, imm),
+                RsbImm => (AluOp::Rsb, imm),
+                AndImm => (AluOp::And, imm),
+                OrrImm => (AluOp::Orr, imm),
+                EorImm => (AluOp::Eor, imm),
+                BicImm => (AluOp::And, !imm),
+                _ => unreachable!(),
+            };
+            Op::Native(NativeOp::AluImm { op: alu, rd: op.rd(), rn: op.rn(), imm })
+        },
+        _ => Op::Call,
+    }
+}
+
+fn classify_thumb(opcd: u16) -> Op {
+    use ThumbInst::*;
+    match ThumbInst::decode(opcd) {
+        B | BAlt | Bx | BlxReg | Svc | Bkpt | Undefined |
+        BlImmSuffix | BlxImmSuffix => Op::End,
+
+        // Hi register operations with r15 as the destination
+        AddRegAlt | MovRegAlt | CmpRegAlt
+            if ((opcd >> 4) & 0x8) | (opcd & 0x7) == 0xf => Op::End,
+
+        // `pop` including the program counter
+        Pop if (opcd & 0x0100) != 0 => Op::End,
+
+        StrbReg | StrReg | StrhReg | StrhImm | StrImm | StrbImm | StrImmAlt |
+        Stm | Push => Op::CallLast,
+
+        _ => Op::Call,
+    }
+}
+
+/// An entry in [JitBackend::vmap].
+#[derive(Clone, Copy)]
+struct VmapEntry {
+    pc: u32,
+    /// Mode and Thumb bits from the CPSR (zero when unused).
+    mode: u32,
+    block: Option<BlockFn>,
+}
+const VMAP_EMPTY: VmapEntry = VmapEntry { pc: 0, mode: 0, block: None };
+
+/// Backend that executes compiled blocks of guest code, falling back to the
+/// interpreter for everything else.
+pub struct JitBackend {
+    /// The interpreter, used for anything that isn't compiled.
+    pub interp: InterpBackend,
+    arena: CodeArena,
+
+    /// Compiled blocks for each page of backing memory, keyed by offset in
+    /// the page (with bit 0 set for Thumb code). `None` marks an address
+    /// where no block can be compiled.
+    blocks: HashMap<CodePageKey, HashMap<u32, Option<BlockFn>>>,
+    /// Recently-used blocks by virtual PC. This depends on the current set
+    /// of translations, and on the state of the physical memory map.
+    vmap: Box<[VmapEntry; VMAP_ENTRIES]>,
+    tlb_gen: u32,
+    bus_gen: u32,
+}
+
+impl JitBackend {
+    pub fn new(bus: Arc<RwLock<Bus>>, custom_kernel: Option<String>, ppc_early_on: bool) -> anyhow::Result<Self> {
+        if !HOST_SUPPORTED {
+            warn!(target: "Other", "JIT is unsupported on this host, everything will be interpreted");
+        }
+        Ok(JitBackend {
+            interp: InterpBackend::new(bus, custom_kernel, ppc_early_on),
+            arena: CodeArena::new()?,
+            blocks: HashMap::new(),
+            vmap: Box::new([VMAP_EMPTY; VMAP_ENTRIES]),
+            tlb_gen: 0,
+            bus_gen: 0,
+        })
+    }
+
+    /// Drop any blocks compiled from pages written since the last call.
+    /// This must be called with the bus held, between steps.
+    fn sync(&mut self, bus: &mut Bus) {
+        if bus.code.generation == self.bus_gen {
+            return;
+        }
+        self.bus_gen = bus.code.generation;
+        self.vmap.fill(VMAP_EMPTY);
+        for key in bus.code.take_dirty() {
+            self.blocks.remove(&key);
+        }
+    }
+
+    /// Drop every compiled block.
+    fn flush(&mut self) {
+        self.vmap.fill(VMAP_EMPTY);
+        self.blocks.clear();
+        self.arena.reset();
+    }
+
+    /// Find (or compile) the block starting at the current PC.
+    fn lookup(&mut self) -> anyhow::Result<Option<BlockFn>> {
+        let cpu = &self.interp.cpu;
+        let tlb_gen = cpu.p15.tlb.generation();
+        if tlb_gen != self.tlb_gen {
+            self.tlb_gen = tlb_gen;
+            self.vmap.fill(VMAP_EMPTY);
+        }
+
+        let pc = cpu.read_fetch_pc();
+        let mode = cpu.reg.cpsr.control() & 0x3f;
+        let idx = (pc >> 1) as usize & (VMAP_ENTRIES - 1);
+        let entry = self.vmap[idx];
+        if entry.pc == pc && entry.mode == mode {
+            return Ok(entry.block);
+        }
+
+        // Let the interpreter deal with failing translations
+        let paddr = match cpu.translate(TLBReq::new(pc, Access::Read)) {
+            Ok(paddr) => paddr,
+            Err(_) => return Ok(None),
+        };
+        let key = match metrics::write_bus(&cpu.bus, LockUser::Cpu).track_code_page(paddr) {
+            Some(key) => key,
+            None => return Ok(None),
+        };
+        let thumb = cpu.reg.cpsr.thumb();
+        let off = (pc & !PAGE_MASK) | thumb as u32;
+        let cached = self.blocks.get(&key).and_then(|page| page.get(&off)).copied();
+        let block = match cached {
+            Some(block) => block,
+            None => {
+                let block = self.compile(pc, thumb)?;
+                self.blocks.entry(key).or_default().insert(off, block);
+                block
+            },
+        };
+        self.vmap[idx] = VmapEntry { pc, mode, block };
+        Ok(block)
+    }
+
+    /// Compile a block starting at some virtual address.
+    fn compile(&mut self, pc: u32, thumb: bool) -> anyhow::Result<Option<BlockFn>> {
+        if !HOST_SUPPORTED {
+            return Ok(None);
+        }
+        let cpu = &self.interp.cpu;
+        let mut e = HostEmitter::new();
+        e.prologue();
+
+        let mut len = 0;
+        let mut addr = pc;
+        while len < MAX_BLOCK_LEN {
+            // Stay on one page, and stop anywhere the backend needs to look
+            // at the PC between instructions.
+            if len != 0 && ((addr & !PAGE_MASK) == 0 || self.interp.hooks.contains(addr)) {
+                break;
+            }
+
+            let (op, opcd, fallback, size) = if thumb {
+                let opcd = match cpu.read16(addr) { Ok(val) => val, Err(_) => break };
+                (classify_thumb(opcd), opcd as u32, thumb_fallback as usize, 2)
+            } else {
+                let opcd = match cpu.read32(addr) { Ok(val) => val, Err(_) => break };
+                (classify_arm(opcd), opcd, arm_fallback as usize, 4)
+            };
+
+            match op {
+                Op::End => break,
+                Op::Native(native) => {
+                    match native {
+                        NativeOp::MovImm { rd, imm } => e.mov_imm(roff(rd), imm),
+                        NativeOp::MovReg { rd, rm } => e.mov_reg(roff(rd), roff(rm)),
+                        NativeOp::AluImm { op, rd, rn, imm } => {
+                            e.alu_imm(op, roff(rd), roff(rn), imm)
+                        },
+                    }
+                    e.add_imm(PC_OFF, size);
+                    len += 1;
+                },
+                Op::Call => {
+                    e.call_fallback(fallback, opcd, len + 1);
+                    len += 1;
+                },
+                Op::CallLast => {
+                    e.call_fallback(fallback, opcd, len + 1);
+                    len += 1;
+                    break;
+                },
+            }
+            addr = addr.wrapping_add(size as u32);
+        }
+        if len == 0 {
+            return Ok(None);
+        }
+        e.exit(len);
+
+        let code = e.code();
+        if !self.arena.has_room(code.len()) {
+            info!(target: "Other", "JIT code arena is full, flushing all blocks");
+            self.flush();
+        }
+        let ptr = self.arena.alloc(code)?;
+        // SAFETY: the arena holds a complete function with this signature.
+        Ok(Some(unsafe { std::mem::transmute::<*const u8, BlockFn>(ptr) }))
+    }
+
+    /// Execute a block (or a single instruction, if we can't compile
+    /// anything here). Returns the result and the number of instructions
+    /// retired.
+    fn step(&mut self) -> (CpuRes, usize) {
+        // The interpreter is responsible for taking interrupts, for logging
+        // each instruction when debugging, for fuzzing, and for single steps.
+        let cpu = &self.interp.cpu;
+        if (cpu.irq_input && !cpu.reg.cpsr.irq_disable()) || cpu.dbg_on
+        || self.interp.fuzz.is_some() || self.interp.debug_stepping() {
+            return (self.interp.cpu_step(), 1);
+        }
+
+        let block = match self.lookup() {
+            Ok(Some(block)) => block,
+            Ok(None) => return (self.interp.cpu_step(), 1),
+            Err(reason) => return (CpuRes::HaltEmulation(reason), 1),
+        };
+
+        let cpu: *mut Cpu = &mut self.interp.cpu;
+        let mut ctx = JitCtx {
+            reg: unsafe { &raw mut (*cpu).reg },
+            cpu,
+            exit: None,
+        };
+        // Blocks are traced as a whole.
+        let traced = self.interp.trace.is_some().then(|| TraceRecord::begin(&self.interp.cpu));
+        // SAFETY: nothing else touches the CPU while the block runs.
+        let retired = unsafe { block(&mut ctx) } as usize;
+        if let Some((mut rec, regs)) = traced {
+            rec.finish(&self.interp.cpu, &regs);
+            rec.count = retired as u32;
+            if let Some(trace) = self.interp.trace.as_mut() {
+                trace.push(rec);
+            }
+        }
+        let res = match ctx.exit.take() {
+            Some(res) => self.interp.retire(res),
+            None => CpuRes::StepOk,
+        };
+        (res, retired)
+    }
+}
+
+impl Backend for JitBackend {
+    fn run(&mut self) -> anyhow::Result<()> {
+        self.interp.load_custom_kernel()?;
+        // SAFETY: the CPU can't move while we're borrowed
+        let _location = unsafe { ironic_core::dbg::location::track(&self.interp.cpu.reg) };
+        'run: loop {
+            self.interp.check_debugger();
+            // Catch up on the cycles covered by the last slice. Blocks may
+            // overrun the end of a slice, in which case the bus work that
+            // was due in the meantime is done late.
+            let slice_len = {
+                let bus = self.interp.bus.clone();
+                let mut bus = metrics::write_bus(&bus, LockUser::Cpu);
+                let slice_len = self.interp.begin_slice(&mut bus)?;
+                self.sync(&mut bus);
+                slice_len
+            };
+
+            self.interp.cpu.ram.enter();
+            let end = self.interp.cpu.cycle + slice_len;
+            while self.interp.cpu.cycle < end {
+                if self.interp.check_halted() {
+                    break;
+                }
+                if let Err(reason) = self.interp.check_hooks() {
+                    error!(target: "Other", "Hook failed: {reason:#}");
+                }
+                if self.interp.cpu.bus_sync.get() {
+                    self.sync(&mut self.interp.bus.clone().write());
+                }
+
+                let (res, retired) = self.step();
+                if !self.interp.handle_step_result(res) {
+                    break 'run;
+                }
+                self.interp.cpu.cycle += retired;
+                self.interp.retired += retired;
+                if self.interp.cpu.cycle >= self.interp.cpu.profile_next {
+                    self.interp.cpu.sample_profile();
+                }
+                if self.interp.cpu.bus_sync.get() {
+                    break;
+                }
+            }
+            self.interp.cpu.ram.leave();
+        }
+        self.interp.cpu.ram.leave();
+        info!(target: "Other", "CPU stopped at pc={:08x}", self.interp.cpu.read_fetch_pc());
+        Ok(())
+    }
+}
@@ -0,0 +1,123 @@
+//! Host code emitter for AArch64.
+//!
+//! Register usage:
+//! - `x19`: pointer to the [crate::jit::JitCtx]
+//! - `x20`: pointer to the guest register file
+//! - `w0`, `w1`, `x16`: scratch
+//!
+//! Both `x19` and `x20` are callee-saved in AAPCS64.
+
+use crate::jit::emit::*;
+
+pub struct A64Emitter {
+    buf: Vec<u8>,
+}
+
+const W0: u32 = 0;
+const W1: u32 = 1;
+const X16: u32 = 16;
+const X19: u32 = 19;
+const X20: u32 = 20;
+
+impl A64Emitter {
+    fn emit(&mut self, inst: u32) {
+        self.buf.extend_from_slice(&inst.to_le_bytes());
+    }
+
+    /// Materialize a 32-bit immediate with `movz`/`movk`.
+    fn mov32(&mut self, rd: u32, imm: u32) {
+        self.emit(0x5280_0000 | ((imm & 0xffff) << 5) | rd);
+        if imm >> 16 != 0 {
+            self.emit(0x72a0_0000 | ((imm >> 16) << 5) | rd);
+        }
+    }
+
+    /// Materialize a 64-bit immediate with `movz`/`movk`.
+    fn mov64(&mut self, rd: u32, imm: u64) {
+        self.emit(0xd280_0000 | (((imm & 0xffff) as u32) << 5) | rd);
+        for hw in 1..4 {
+            let part = ((imm >> (hw * 16)) & 0xffff) as u32;
+            if part != 0 {
+                self.emit(0xf280_0000 | ((hw as u32) << 21) | (part << 5) | rd);
+            }
+        }
+    }
+
+    /// `ldr wt, [x20, #off]`
+    fn load(&mut self, rt: u32, off: u8) {
+        self.emit(0xb940_0000 | ((off as u32 / 4) << 10) | (X20 << 5) | rt);
+    }
+    /// `str wt, [x20, #off]`
+    fn store(&mut self, rt: u32, off: u8) {
+        self.emit(0xb900_0000 | ((off as u32 / 4) << 10) | (X20 << 5) | rt);
+    }
+
+    /// Number of instructions emitted by [Emitter::exit].
+    fn exit_len(retired: u32) -> u32 {
+        if retired >> 16 != 0 { 5 } else { 4 }
+    }
+}
+
+impl Emitter for A64Emitter {
+    fn new() -> Self {
+        A64Emitter { buf: Vec::new() }
+    }
+    fn code(&self) -> &[u8] {
+        &self.buf
+    }
+
+    fn prologue(&mut self) {
+        self.emit(0xa9be_7bfd);                 // stp x29, x30, [sp, #-32]!
+        self.emit(0xa901_53f3);                 // stp x19, x20, [sp, #16]
+        self.emit(0xaa00_03f3);                 // mov x19, x0
+        self.emit(0xf940_0014);                 // ldr x20, [x0]
+    }
+
+    fn exit(&mut self, retired: u32) {
+        self.mov32(W0, retired);
+        self.emit(0xa941_53f3);                 // ldp x19, x20, [sp, #16]
+        self.emit(0xa8c2_7bfd);                 // ldp x29, x30, [sp], #32
+        self.emit(0xd65f_03c0);                 // ret
+    }
+
+    fn mov_imm(&mut self, rd: u8, imm: u32) {
+        self.mov32(W0, imm);
+        self.store(W0, rd);
+    }
+
+    fn mov_reg(&mut self, rd: u8, rm: u8) {
+        self.load(W0, rm);
+        self.store(W0, rd);
+    }
+
+    fn alu_imm(&mut self, op: AluOp, rd: u8, rn: u8, imm: u32) {
+        self.load(W0, rn);
+        self.mov32(W1, imm);
+        let (base, n, m) = match op {
+            AluOp::Add => (0x0b00_0000, W0, W1),
+            AluOp::Sub => (0x4b00_0000, W0, W1),
+            AluOp::Rsb => (0x4b00_0000, W1, W0),
+            AluOp::And => (0x0a00_0000, W0, W1),
+            AluOp::Orr => (0x2a00_0000, W0, W1),
+            AluOp::Eor => (0x4a00_0000, W0, W1),
+        };
+        self.emit(base | (m << 16) | (n << 5) | W0); // <op> w0, wn, wm
+        self.store(W0, rd);
+    }
+
+    fn add_imm(&mut self, off: u8, imm: u8) {
+        self.load(W0, off);
+        self.emit(0x1100_0000 | ((imm as u32) << 10) | (W0 << 5) | W0); // add w0, w0, #imm
+        self.store(W0, off);
+    }
+
+    fn call_fallback(&mut self, func: usize, arg: u32, retired: u32) {
+        self.emit(0xaa00_03e0 | (X19 << 16));   // mov x0, x19
+        self.mov32(W1, arg);
+        self.mov64(X16, func as u64);
+        self.emit(0xd63f_0000 | (X16 << 5));    // blr x16
+        // cbz w0, over the exit
+        self.emit(0x3400_0000 | ((Self::exit_len(retired) + 1) << 5) | W0);
+        self.exit(retired);
+    }
+}
@@ -0,0 +1,74 @@
+//! Executable memory for compiled blocks.
+
+use anyhow::bail;
+use memmap::{Mmap, MmapMut};
+
+/// Size of the region reserved for compiled code.
+pub const ARENA_LEN: usize = 0x0100_0000;
+
+/// A bump allocator over a region of executable memory.
+///
+/// The region is only ever writable or executable (never both). Blocks are
+/// never freed individually: when the arena fills up, the owner is expected
+/// to drop every block and [CodeArena::reset] it.
+pub struct CodeArena {
+    map: Option<Mmap>,
+    used: usize,
+}
+
+impl CodeArena {
+    pub fn new() -> anyhow::Result<Self> {
+        let map = MmapMut::map_anon(ARENA_LEN)?.make_exec()?;
+        Ok(CodeArena { map: Some(map), used: 0 })
+    }
+
+    /// Returns true if `len` more bytes of code will fit.
+    pub fn has_room(&self, len: usize) -> bool {
+        self.used + len <= ARENA_LEN
+    }
+
+    /// Forget about all previously-allocated code.
+    pub fn reset(&mut self) {
+        self.used = 0;
+    }
+
+    /// Copy some code into the arena, returning a pointer to it.
+    pub fn alloc(&mut self, code: &[u8]) -> anyhow::Result<*const u8> {
+        if !self.has_room(code.len()) {
+            bail!("JIT code arena is full");
+        }
+        let mut map = self.map.take().unwrap().make_mut()?;
+        let off = self.used;
+        map[off..off + code.len()].copy_from_slice(code);
+        let map = map.make_exec()?;
+        let ptr = unsafe { map.as_ptr().add(off) };
+        flush_icache(ptr, code.len());
+        self.map = Some(map);
+        // Keep blocks aligned for the fetch unit, and for AArch64 instructions
+        self.used = (off + code.len() + 15) & !15;
+        Ok(ptr)
+    }
+}
+
+/// Make sure the instruction stream observes newly-written code.
+#[cfg(target_arch = "aarch64")]
+fn flush_icache(ptr: *const u8, len: usize) {
+    use std::arch::asm;
+    let ctr: u64;
+    unsafe { asm!("mrs {}, ctr_el0", out(reg) ctr) };
+    let dline = 4 << ((ctr >> 16) & 0xf);
+    let iline = 4 << (ctr & 0xf);
+    let (start, end) = (ptr as usize, ptr as usize + len);
+    for addr in ((start & !(dline - 1))..end).step_by(dline) {
+        unsafe { asm!("dc cvau, {}", in(reg) addr) };
+    }
+    unsafe { asm!("dsb ish") };
+    for addr in ((start & !(iline - 1))..end).step_by(iline) {
+        unsafe { asm!("ic ivau, {}", in(reg) addr) };
+    }
+    unsafe { asm!("dsb ish", "isb") };
+}
+
+/// x86 keeps instruction fetch coherent with stores on its own.
+#[cfg(not(target_arch = "aarch64"))]
+fn flush_icache(_ptr: *const u8, _len: usize) {}
@@ -0,0 +1,47 @@
+//! Interface for emitting host code.
+//!
+//! Compiled blocks are host functions with the signature
+//! `extern "C" fn(*mut JitCtx) -> u32`, returning the number of guest
+//! instructions retired. The first field of [crate::jit::JitCtx] is a pointer
+//! to the guest register file, which native code uses directly; everything
+//! else goes through a call to one of the fallback functions, which have the
+//! signature `extern "C" fn(*mut JitCtx, u32) -> u32` and return non-zero
+//! when the block needs to exit.
+//!
+//! Register offsets passed to an [Emitter] are byte offsets into the
+//! register file.
+
+/// Data-processing operations with a native implementation.
+#[derive(Clone, Copy, Debug, PartialEq)]
+pub enum AluOp {
+    Add,
+    Sub,
+    /// Reverse subtract (`imm - rn`)
+    Rsb,
+    And,
+    Orr,
+    Eor,
+}
+
+pub trait Emitter {
+    fn new() -> Self;
+    /// The emitted code.
+    fn code(&self) -> &[u8];
+
+    /// Set up a stack frame and load the register file pointer.
+    fn prologue(&mut self);
+    /// Tear down the stack frame and return `retired` from the block.
+    fn exit(&mut self, retired: u32);
+
+    /// `r[rd] = imm`
+    fn mov_imm(&mut self, rd: u8, imm: u32);
+    /// `r[rd] = r[rm]`
+    fn mov_reg(&mut self, rd: u8, rm: u8);
+    /// `r[rd] = r[rn] <op> imm`
+    fn alu_imm(&mut self, op: AluOp, rd: u8, rn: u8, imm: u32);
+    /// `r[off] += imm`
+    fn add_imm(&mut self, off: u8, imm: u8);
+
+    /// Call `func(ctx, arg)`, exiting with `retired` if it returns non-zero.
+    fn call_fallback(&mut self, func: usize, arg: u32, retired: u32);
+}
@@ -0,0 +1,122 @@
+//! Host code emitter for x86-64.
+//!
+//! Register usage:
+//! - `rbx`: pointer to the [crate::jit::JitCtx]
+//! - `r12`: pointer to the guest register file
+//! - `eax`: scratch
+//!
+//! Both `rbx` and `r12` are callee-saved in the System V and Windows ABIs.
+
+use crate::jit::emit::*;
+
+/// Stack adjustment after pushing `rbx`/`r12`, keeping `rsp` 16-byte aligned
+/// at calls (and reserving shadow space on Windows).
+const FRAME: u8 = if cfg!(windows) { 40 } else { 8 };
+
+pub struct X64Emitter {
+    buf: Vec<u8>,
+}
+
+impl X64Emitter {
+    fn emit(&mut self, bytes: &[u8]) {
+        self.buf.extend_from_slice(bytes);
+    }
+    fn emit32(&mut self, val: u32) {
+        self.buf.extend_from_slice(&val.to_le_bytes());
+    }
+
+    /// `mov eax, dword [r12 + off]`
+    fn load_eax(&mut self, off: u8) {
+        self.emit(&[0x41, 0x8b, 0x44, 0x24, off]);
+    }
+    /// `mov dword [r12 + off], eax`
+    fn store_eax(&mut self, off: u8) {
+        self.emit(&[0x41, 0x89, 0x44, 0x24, off]);
+    }
+
+    /// Length of the sequence emitted by [Emitter::exit].
+    const EXIT_LEN: u8 = 13;
+}
+
+impl Emitter for X64Emitter {
+    fn new() -> Self {
+        X64Emitter { buf: Vec::new() }
+    }
+    fn code(&self) -> &[u8] {
+        &self.buf
+    }
+
+    fn prologue(&mut self) {
+        self.emit(&[0x53]);                     // push rbx
+        self.emit(&[0x41, 0x54]);               // push r12
+        self.emit(&[0x48, 0x83, 0xec, FRAME]);  // sub rsp, FRAME
+        if cfg!(windows) {
+            self.emit(&[0x48, 0x89, 0xcb]);     // mov rbx, rcx
+        } else {
+            self.emit(&[0x48, 0x89, 0xfb]);     // mov rbx, rdi
+        }
+        self.emit(&[0x4c, 0x8b, 0x23]);         // mov r12, [rbx]
+    }
+
+    fn exit(&mut self, retired: u32) {
+        let start = self.buf.len();
+        self.emit(&[0xb8]);                     // mov eax, retired
+        self.emit32(retired);
+        self.emit(&[0x48, 0x83, 0xc4, FRAME]);  // add rsp, FRAME
+        self.emit(&[0x41, 0x5c]);               // pop r12
+        self.emit(&[0x5b]);                     // pop rbx
+        self.emit(&[0xc3]);                     // ret
+        debug_assert_eq!(self.buf.len() - start, Self::EXIT_LEN as usize);
+    }
+
+    fn mov_imm(&mut self, rd: u8, imm: u32) {
+        // mov dword [r12 + rd], imm
+        self.emit(&[0x41, 0xc7, 0x44, 0x24, rd]);
+        self.emit32(imm);
+    }
+
+    fn mov_reg(&mut self, rd: u8, rm: u8) {
+        self.load_eax(rm);
+        self.store_eax(rd);
+    }
+
+    fn alu_imm(&mut self, op: AluOp, rd: u8, rn: u8, imm: u32) {
+        self.load_eax(rn);
+        let opcd = match op {
+            AluOp::Add => 0x05,
+            AluOp::Sub => 0x2d,
+            AluOp::And => 0x25,
+            AluOp::Orr => 0x0d,
+            AluOp::Eor => 0x35,
+            AluOp::Rsb => {
+                self.emit(&[0xf7, 0xd8]);       // neg eax
+                0x05
+            },
+        };
+        self.emit(&[opcd]);                     // <op> eax, imm
+        self.emit32(imm);
+        self.store_eax(rd);
+    }
+
+    fn add_imm(&mut self, off: u8, imm: u8) {
+        // add dword [r12 + off], imm
+        self.emit(&[0x41, 0x83, 0x44, 0x24, off, imm]);
+    }
+
+    fn call_fallback(&mut self, func: usize, arg: u32, retired: u32) {
+        if cfg!(windows) {
+            self.emit(&[0x48, 0x89, 0xd9]);     // mov rcx, rbx
+            self.emit(&[0xba]);                 // mov edx, arg
+        } else {
+            self.emit(&[0x48, 0x89, 0xdf]);     // mov rdi, rbx
+            self.emit(&[0xbe]);                 // mov esi, arg
+        }
+        self.emit32(arg);
+        self.emit(&[0x48, 0xb8]);               // mov rax, func
+        self.buf.extend_from_slice(&(func as u64).to_le_bytes());
+        self.emit(&[0xff, 0xd0]);               // call rax
+        self.emit(&[0x85, 0xc0]);               // test eax, eax
+        self.emit(&[0x74, Self::EXIT_LEN]);     // jz over the exit
+        self.exit(retired);
+    }
+}
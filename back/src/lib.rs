@@ -5,6 +5,8 @@ pub mod bits;
 pub mod decode;
 
 pub mod interp;
+pub mod jit;
 
 pub mod ipc;
 pub mod ppc;
+pub mod gdb;
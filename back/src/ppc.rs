@@ -1,20 +1,32 @@
 //! Backend for handling PowerPC HLE.
 //!
-//! NOTE: The socket is blocking right now, but I guess ultimately we don't
-//! want that. 
+//! The thread blocks on the socket while waiting for a client, and on the
+//! bus notifiers (see [ironic_core::bus::notify]) while waiting for ARM-world.
+//!
+//! Clients can also access MEM1 and MEM2 directly when they're exported as
+//! shared memory (see [ironic_core::bus::Bus::with_shared_ram]), in which case
+//! the socket is only needed for IPC messages.
+//!
+//! When fuzzing, clients can also ask the ARM core to set a reset point and
+//! to go back to it, and read the coverage (see [crate::interp::fuzz]).
 
 use ironic_core::bus::*;
+use ironic_core::bus::fastmem::RamGate;
+use ironic_core::bus::notify::Notifier;
 use ironic_core::dev::hlwd::irq::*;
+use ironic_core::metrics::{self, LockUser};
 use crate::back::*;
+use crate::interp::fuzz::{FuzzControl, FuzzRequest};
 
 use log::{info, error};
-use parking_lot::RwLock;
+use parking_lot::{RwLock, RwLockReadGuard, RwLockWriteGuard};
 use std::env::temp_dir;
 use std::path::PathBuf;
 use std::thread;
+use std::collections::{HashMap, VecDeque};
 use std::sync::Arc;
 use std::net::Shutdown;
-use std::io::{Read, Write};
+use std::io::{ErrorKind, Read, Write};
 
 
 #[cfg(target_family = "unix")]
@@ -32,6 +44,25 @@ pub enum Command {
     Message, 
     Ack, 
     MessageNoReturn,
+    /// Send a message without waiting for the response, tagged with an ID
+    /// (in place of the length).
+    Submit,
+    /// Send a number of messages (given in place of the length), each as a
+    /// pointer and an ID following the header.
+    SubmitBatch,
+    /// Wait for responses to messages, up to some number of them (given in
+    /// place of the length, or zero for no limit).
+    WaitCompletions,
+    /// Get the current value of every counter in
+    /// [ironic_core::metrics::METRICS], as text.
+    Metrics,
+    /// Save the current state of the machine as the reset point.
+    SetResetPoint,
+    /// Put the machine back in the state it was in at the reset point.
+    Reset,
+    /// Get the coverage counters (see [crate::interp::fuzz::CoverageMap])
+    /// since the last time, and clear them.
+    Coverage,
     Shutdown,
     Unimpl,
 }
@@ -43,6 +74,13 @@ impl Command {
             3 => Self::Message,
             4 => Self::Ack,
             5 => Self::MessageNoReturn,
+            6 => Self::Submit,
+            7 => Self::SubmitBatch,
+            8 => Self::WaitCompletions,
+            9 => Self::Metrics,
+            10 => Self::SetResetPoint,
+            11 => Self::Reset,
+            12 => Self::Coverage,
             255 => Self::Shutdown,
             _ => Self::Unimpl,
         }
@@ -69,6 +107,8 @@ impl SocketReq {
 
 pub const IPC_SOCK: &str = "ironic-ppc.sock";
 pub const BUF_LEN: usize = 0x10000;
+/// How long to wait for the ARM core to handle a request from a fuzzer.
+const FUZZ_TIMEOUT: Duration = Duration::from_secs(5);
 
 pub struct PpcBackend {
     /// Reference to the system bus.
@@ -78,23 +118,66 @@ pub struct PpcBackend {
     /// Output buffer for the socket.
     pub obuf: [u8; BUF_LEN],
     /// Counter to prevent infinite retry on the socket
-    socket_errors: u8
+    socket_errors: u8,
+    /// Notified when the PPC IRQ line is raised.
+    irq_notify: Arc<Notifier>,
+    /// Notified after changing IPC state, to wake up the ARM.
+    arm_wake: Arc<Notifier>,
+    /// Keeps the ARM off the fast path into guest RAM while we access it.
+    ram_gate: Arc<RamGate>,
+    /// Set when ARM-world acknowledges the last message we sent.
+    got_ack: bool,
+    /// Pointers in responses from ARM-world that haven't been sent to the
+    /// client yet.
+    completions: VecDeque<u32>,
+    /// IDs of submitted messages that are still in flight, by pointer.
+    inflight: HashMap<u32, u32>,
+    /// Where the socket is created.
+    pub socket_path: PathBuf,
+    /// Shared with the ARM core, when fuzzing.
+    pub fuzz: Option<Arc<FuzzControl>>,
 }
 impl PpcBackend {
     pub fn new(bus: Arc<RwLock<Bus>>) -> Self {
+        let (irq_notify, arm_wake, ram_gate) = {
+            let bus = bus.read();
+            (bus.ppc_irq_notify.clone(), bus.arm_wake.clone(), bus.ram_gate.clone())
+        };
         PpcBackend {
             bus,
             ibuf: [0; BUF_LEN],
             obuf: [0; BUF_LEN],
             socket_errors: 0,
+            irq_notify,
+            arm_wake,
+            ram_gate,
+            got_ack: false,
+            completions: VecDeque::new(),
+            inflight: HashMap::new(),
+            socket_path: Self::resolve_socket_path(),
+            fuzz: None,
         }
     }
 
-    fn recv(&mut self, client: &mut UnixStream) -> Option<usize> {
-        let res = client.read(&mut self.ibuf);
-        match res {
-            Ok(len) => if len == 0 { None } else { Some(len) },
-            Err(_) => None
+    fn write_bus(&self) -> RwLockWriteGuard<'_, Bus> {
+        metrics::write_bus(&self.bus, LockUser::Ppc)
+    }
+
+    fn read_bus(&self) -> RwLockReadGuard<'_, Bus> {
+        metrics::read_bus(&self.bus, LockUser::Ppc)
+    }
+
+    /// Block until the PPC IRQ line is raised, returning with the bus
+    /// locked.
+    fn wait_for_irq(&self) -> RwLockWriteGuard<'_, Bus> {
+        loop {
+            let seen = self.irq_notify.seq();
+            let bus = self.write_bus();
+            if bus.hlwd.irq.ppc_irq_output {
+                return bus;
+            }
+            drop(bus); // Release RwLock
+            self.irq_notify.wait(seen, None);
         }
     }
 }
@@ -133,158 +216,284 @@ impl PpcBackend {
             loop {
                 info!(target:"PPC", "waiting for command");
 
-                let res = self.wait_for_request(&mut client);
-                if let Some(req) = res {
-                    match req.cmd {
-                        Command::Ack => self.handle_ack(req)?,
-                        Command::HostRead => self.handle_read(&mut client, req)?,
-                        Command::HostWrite => self.handle_write(&mut client, req)?,
-                        Command::Message => {
-                            self.handle_message(&mut client, req)?;
-                            let armmsg = self.wait_for_resp();
-                            let _ = client.write(&u32::to_le_bytes(armmsg))?; // maybe FIXME: is it ok to ignore the # of bytes written here?
-                        },
-                        Command::MessageNoReturn => {
-                            self.handle_message(&mut client, req)?;
-                        },
-                        Command::Shutdown => {
-                            let _ = client.write(b"kk")?;
-                            break;
+                let req = match self.wait_for_request(&mut client)? {
+                    Some(req) => req,
+                    None => {
+                        info!(target: "PPC", "client disconnected");
+                        return Ok(());
+                    },
+                };
+                match req.cmd {
+                    Command::Ack => self.handle_ack(req)?,
+                    Command::HostRead => self.handle_read(&mut client, req)?,
+                    Command::HostWrite => self.handle_write(&mut client, req)?,
+                    Command::Message => {
+                        let ptr = req.addr;
+                        self.handle_message(&mut client, req)?;
+                        let armmsg = self.wait_for_resp(ptr);
+                        client.write_all(&u32::to_le_bytes(armmsg))?;
+                    },
+                    Command::MessageNoReturn => {
+                        self.handle_message(&mut client, req)?;
+                    },
+                    Command::Submit => {
+                        self.submit(req.addr, req.len);
+                        client.write_all(b"OK")?;
+                    },
+                    Command::SubmitBatch => {
+                        let mut entry = [0u8; 8];
+                        for _ in 0..req.len {
+                            client.read_exact(&mut entry)?;
+                            let ptr = u32::from_le_bytes(entry[0..4].try_into().unwrap());
+                            let id = u32::from_le_bytes(entry[4..8].try_into().unwrap());
+                            self.submit(ptr, id);
                         }
-                        Command::Unimpl => break,
+                        client.write_all(b"OK")?;
+                    },
+                    Command::WaitCompletions => self.handle_wait_completions(&mut client, req)?,
+                    Command::Metrics => self.handle_metrics(&mut client)?,
+                    Command::SetResetPoint => self.handle_fuzz_request(&mut client, FuzzRequest::SetResetPoint)?,
+                    Command::Reset => self.handle_fuzz_request(&mut client, FuzzRequest::Reset)?,
+                    Command::Coverage => self.handle_coverage(&mut client)?,
+                    Command::Shutdown => {
+                        client.write_all(b"kk")?;
+                        break;
                     }
+                    Command::Unimpl => break,
                 }
             }
             client.shutdown(Shutdown::Both)?;
         Ok(())
     }
 
-    /// Block until we get a response from ARM-world.
-    fn wait_for_resp(&mut self) -> u32 {
-        info!(target: "PPC", "waiting for response ...");
-        loop {
-            if self.bus.read().hlwd.irq.ppc_irq_output {
-                info!(target: "PPC", "got irq");
-                let mut bus = self.bus.write();
-
-                if bus.hlwd.ipc.state.ppc_ack {
-                    info!(target: "PPC", "got extra ACK");
-                    bus.hlwd.ipc.state.ppc_ack = false;
-                    bus.hlwd.irq.ppc_irq_status.unset(HollywoodIrq::PpcIpc);
-                    bus.hlwd.irq.update_irq_lines();
-                    continue
-                }
-
-                if bus.hlwd.ipc.state.ppc_req {
-                    let armmsg = bus.hlwd.ipc.arm_msg;
-                    info!(target: "PPC", "Got message from ARM {armmsg:08x}");
-                    bus.hlwd.ipc.state.ppc_req = false;
-                    bus.hlwd.ipc.state.arm_ack = true;
-                    bus.hlwd.irq.ppc_irq_status.unset(HollywoodIrq::PpcIpc);
-                    bus.hlwd.irq.update_irq_lines();
-                    return armmsg;
-                }
-
+    /// Block until ARM-world either acknowledges a message or responds to
+    /// one, and keep track of which.
+    fn poll_arm(&mut self) {
+        let armmsg = {
+            let mut bus = self.wait_for_irq();
+            info!(target: "PPC", "got irq");
+
+            if bus.hlwd.ipc.state.ppc_ack {
+                info!(target: "PPC", "got ACK");
+                bus.hlwd.ipc.state.ppc_ack = false;
+                bus.hlwd.irq.ppc_irq_status.unset(HollywoodIrq::PpcIpc);
+                bus.update_ppc_irq();
+                None
+            }
+            else if bus.hlwd.ipc.state.ppc_req {
+                let armmsg = bus.hlwd.ipc.arm_msg;
+                info!(target: "PPC", "Got message from ARM {armmsg:08x}");
+                bus.hlwd.ipc.state.ppc_req = false;
+                bus.hlwd.ipc.state.arm_ack = true;
+                bus.hlwd.irq.ppc_irq_status.unset(HollywoodIrq::PpcIpc);
+                bus.update_ppc_irq();
+                Some(armmsg)
+            }
+            else {
                 drop(bus); // Release RwLock
                 error!(target: "PPC", "Invalid IRQ state");
                 unreachable!("Invalid IRQ state. You forgot to update your IRQ lines somewhere!");
-            } else {
-                thread::sleep(std::time::Duration::from_millis(10));
             }
+        };
+        match armmsg {
+            Some(armmsg) => {
+                self.arm_wake.notify();
+                self.completions.push_back(armmsg);
+            },
+            None => self.got_ack = true,
+        }
+    }
+
+    /// Block until we get the response to a message sent with some pointer.
+    /// Responses to submitted messages are left for
+    /// [PpcBackend::handle_wait_completions]. Any other response is taken to
+    /// be for this message, in case ARM-world responds with another pointer.
+    fn wait_for_resp(&mut self, ptr: u32) -> u32 {
+        info!(target: "PPC", "waiting for response to {ptr:08x} ...");
+        loop {
+            let idx = self.completions.iter()
+                .position(|armmsg| *armmsg == ptr || !self.inflight.contains_key(armmsg));
+            if let Some(armmsg) = idx.and_then(|idx| self.completions.remove(idx)) {
+                return armmsg;
+            }
+            self.poll_arm();
         }
     }
 
     /// Block until we get an ACK from ARM-world.
     fn wait_for_ack(&mut self) {
         info!(target: "PPC", "waiting for ACK ...");
-        loop {
-            if self.bus.read().hlwd.irq.ppc_irq_output {
-                info!(target: "PPC", "got irq");
-                let mut bus = self.bus.write();
-
-                if bus.hlwd.ipc.state.ppc_ack {
-                    bus.hlwd.ipc.state.ppc_ack = false;
-                    info!(target: "PPC", "got ACK");
-                    bus.hlwd.irq.ppc_irq_status.unset(HollywoodIrq::PpcIpc);
-                    bus.hlwd.irq.update_irq_lines();
-                    break;
-                }
-                if bus.hlwd.ipc.state.ppc_req {
-                    let armmsg = bus.hlwd.ipc.arm_msg;
-                    info!(target: "PPC", "Got extra message from ARM {armmsg:08x}");
-                    bus.hlwd.ipc.state.ppc_req = false;
-                    bus.hlwd.ipc.state.arm_ack = true;
-                    bus.hlwd.irq.ppc_irq_status.unset(HollywoodIrq::PpcIpc);
-                    bus.hlwd.irq.update_irq_lines();
-                    continue;
-                }
-
-                drop(bus); // Release RwLock
-                error!(target: "PPC", "Invalid IRQ state");
-                unreachable!("Invalid IRQ state. You forgot to update your IRQ lines somewhere!")
-            } else {
-                thread::sleep(std::time::Duration::from_millis(10));
-            }
+        while !self.got_ack {
+            self.poll_arm();
         }
+        self.got_ack = false;
     }
 
-    /// Block until we receive some command message from a client.
-    fn wait_for_request(&mut self, client: &mut UnixStream) -> Option<SocketReq> {
-        let mut long_block = 0u8;
-        loop {
-            let try_recv = self.recv(client); // maybe FIXME: allow discarding recv length here?
-            // As we wait longer, increase the time we sleep
-            if try_recv.is_none() {
-                long_block = long_block.saturating_add(1);
-                std::thread::sleep(std::time::Duration::from_millis(5 * long_block as u64));
-            }
-            else {
-                break;
-            }
+    /// Block until we receive the header of some command message from a
+    /// client. Returns [None] once the client has disconnected.
+    fn wait_for_request(&mut self, client: &mut UnixStream) -> anyhow::Result<Option<SocketReq>> {
+        match client.read_exact(&mut self.ibuf[0..0xc]) {
+            Ok(()) => {},
+            Err(e) if e.kind() == ErrorKind::UnexpectedEof => return Ok(None),
+            Err(e) => return Err(e.into()),
         }
         let req = SocketReq::from_buf(
             &self.ibuf[0..0xc].try_into().unwrap()
         );
-        if req.len as usize > BUF_LEN - 0xc {
-            error!(target: "PPC", "Socket message exceeds BUF_LEN {BUF_LEN:x}");
-            panic!("Socket message exceeds BUF_LEN {BUF_LEN:x}");
+        Ok(Some(req))
+    }
+
+    /// The address of some chunk of a read or write, or [None] if the chunk
+    /// runs past the end of the physical address space.
+    fn chunk_addr(req: &SocketReq, done: usize, len: usize) -> Option<u32> {
+        let last = req.addr.checked_add((done + len - 1) as u32);
+        if last.is_none() {
+            error!(target: "PPC", "Access of {:x} bytes at {:08x} wraps around", req.len, req.addr);
         }
-        Some(req)
+        last.map(|_| req.addr + done as u32)
     }
 
-    /// Read from physical memory.
+    /// Read from physical memory. Large reads are sent in chunks, so that the
+    /// bus isn't locked while waiting on the socket. Reads that wrap around
+    /// the address space end the connection, since there's no way to tell
+    /// the client.
     pub fn handle_read(&mut self, client: &mut UnixStream, req: SocketReq) -> anyhow::Result<()> {
         info!(target: "PPC", "read {:x} bytes at {:08x}", req.len, req.addr);
-        self.bus.read().dma_read(req.addr,
-            &mut self.obuf[0..req.len as usize])?;
-        let _ = client.write(&self.obuf[0..req.len as usize])?; // maybe FIXME: is it ok to ignore the # of bytes written here?
+        let mut done = 0;
+        while done < req.len as usize {
+            let len = (req.len as usize - done).min(BUF_LEN);
+            let Some(addr) = Self::chunk_addr(&req, done, len) else {
+                client.shutdown(Shutdown::Both)?;
+                return Ok(());
+            };
+            {
+                let _pause = self.ram_gate.pause();
+                metrics::read_bus(&self.bus, LockUser::Ppc).dma_read(addr, &mut self.obuf[0..len])?;
+            }
+            client.write_all(&self.obuf[0..len])?;
+            done += len;
+        }
         Ok(())
     }
 
-    /// Write to physical memory.
+    /// Write to physical memory. The payload is received in chunks, like in
+    /// [PpcBackend::handle_read]. Writes that wrap around the address space
+    /// get "NO" back, and end the connection (the rest of the payload can't
+    /// be told apart from the next command).
     pub fn handle_write(&mut self, client: &mut UnixStream, req: SocketReq) -> anyhow::Result<()> {
         info!(target: "PPC", "write {:x} bytes at {:08x}", req.len, req.addr);
-        let data = &self.ibuf[0xc..(0xc + req.len as usize)];
-        self.bus.write().dma_write(req.addr, data)?;
-        let _ = client.write("OK".as_bytes())?; // maybe FIXME: is it ok to ignore the # of bytes written here?
+        let mut done = 0;
+        while done < req.len as usize {
+            let len = (req.len as usize - done).min(BUF_LEN - 0xc);
+            let Some(addr) = Self::chunk_addr(&req, done, len) else {
+                client.write_all(b"NO")?;
+                client.shutdown(Shutdown::Both)?;
+                return Ok(());
+            };
+            let data = &mut self.ibuf[0xc..(0xc + len)];
+            client.read_exact(data)?;
+            let _pause = self.ram_gate.pause();
+            metrics::write_bus(&self.bus, LockUser::Ppc).dma_write(addr, data)?;
+            done += len;
+        }
+        client.write_all("OK".as_bytes())?;
         Ok(())
     }
 
     /// Tell ARM-world that an IPC request is ready at the location indicated
     /// by the pointer in PPC_MSG.
     pub fn handle_message(&mut self, client: &mut UnixStream, req: SocketReq) -> anyhow::Result<()> {
-        let mut bus = self.bus.write();
-        bus.hlwd.ipc.ppc_msg = req.addr;
-        bus.hlwd.ipc.state.arm_req = true;
-        bus.hlwd.ipc.state.arm_ack = true;
-        let _ = client.write("OK".as_bytes())?; // maybe FIXME: is it ok to ignore the # of bytes written here?
+        {
+            let mut bus = self.write_bus();
+            bus.hlwd.ipc.ppc_msg = req.addr;
+            bus.hlwd.ipc.state.arm_req = true;
+            bus.hlwd.ipc.state.arm_ack = true;
+        }
+        self.arm_wake.notify();
+        client.write_all("OK".as_bytes())?;
+        Ok(())
+    }
+
+    /// Send a message to ARM-world without waiting for the response, and
+    /// wait until it's been acknowledged (when the mailbox is free for the
+    /// next one). Responses that arrive in the meantime are kept for later.
+    fn submit(&mut self, ptr: u32, id: u32) {
+        info!(target: "PPC", "submit {ptr:08x} (id {id:x})");
+        self.inflight.insert(ptr, id);
+        self.got_ack = false;
+        {
+            let mut bus = self.write_bus();
+            bus.hlwd.ipc.ppc_msg = ptr;
+            bus.hlwd.ipc.state.arm_req = true;
+            bus.hlwd.ipc.state.arm_ack = true;
+        }
+        self.arm_wake.notify();
+        self.wait_for_ack();
+    }
+
+    /// Send the responses to submitted messages, waiting for at least one
+    /// if any are still in flight. Each is sent as an ID and a pointer, after
+    /// the number of them.
+    pub fn handle_wait_completions(&mut self, client: &mut UnixStream, req: SocketReq) -> anyhow::Result<()> {
+        while self.completions.is_empty() && !self.inflight.is_empty() {
+            self.poll_arm();
+        }
+        let max = if req.len == 0 { usize::MAX } else { req.len as usize };
+        let count = self.completions.len().min(max);
+        let mut buf = Vec::with_capacity(4 + count * 8);
+        buf.extend_from_slice(&(count as u32).to_le_bytes());
+        for ptr in self.completions.drain(..count) {
+            // Messages sent without an ID are identified by their pointer
+            let id = self.inflight.remove(&ptr).unwrap_or(ptr);
+            buf.extend_from_slice(&id.to_le_bytes());
+            buf.extend_from_slice(&ptr.to_le_bytes());
+        }
+        client.write_all(&buf)?;
+        Ok(())
+    }
+
+    /// Send a snapshot of the metrics, as one `name value` pair per line
+    /// after the length of the text.
+    pub fn handle_metrics(&mut self, client: &mut UnixStream) -> anyhow::Result<()> {
+        let text = metrics::format_snapshot(&metrics::snapshot());
+        client.write_all(&(text.len() as u32).to_le_bytes())?;
+        client.write_all(text.as_bytes())?;
+        Ok(())
+    }
+
+    /// Ask the ARM core to set the reset point or go back to it, replying
+    /// with "OK" once it's done (or "NO" if it failed).
+    pub fn handle_fuzz_request(&mut self, client: &mut UnixStream, req: FuzzRequest) -> anyhow::Result<()> {
+        let res = match self.fuzz.as_deref() {
+            Some(fuzz) => fuzz.request(req, &self.arm_wake, FUZZ_TIMEOUT),
+            None => Err(anyhow::anyhow!("Fuzzing isn't enabled")),
+        };
+        match res {
+            Ok(()) => client.write_all(b"OK")?,
+            Err(reason) => {
+                error!(target: "PPC", "{reason:#}");
+                client.write_all(b"NO")?;
+            },
+        }
+        Ok(())
+    }
+
+    /// Send the coverage counters after their length (which is zero when
+    /// not fuzzing).
+    pub fn handle_coverage(&mut self, client: &mut UnixStream) -> anyhow::Result<()> {
+        let counts = self.fuzz.as_deref().map_or_else(Vec::new, |fuzz| fuzz.coverage.take());
+        client.write_all(&(counts.len() as u32).to_le_bytes())?;
+        client.write_all(&counts)?;
         Ok(())
     }
 
     pub fn handle_ack(&mut self, _req: SocketReq) -> anyhow::Result<()> {
-        let mut bus = self.bus.write();
-        let ppc_ctrl = bus.hlwd.ipc.read_handler(4)? & 0x3c;
-        bus.hlwd.ipc.write_handler(4, ppc_ctrl | 0x8)?;
+        {
+            let mut bus = self.write_bus();
+            let ppc_ctrl = bus.hlwd.ipc.read_handler(4)? & 0x3c;
+            bus.hlwd.ipc.write_handler(4, ppc_ctrl | 0x8)?;
+        }
+        self.arm_wake.notify();
         Ok(())
     }
 
@@ -294,10 +503,10 @@ impl PpcBackend {
 impl Backend for PpcBackend {
     fn run(&mut self) -> anyhow::Result<()> {
         info!(target: "PPC", "PPC backend thread started");
-        self.bus.write().hlwd.ipc.state.ppc_ctrl_write(0x36);
+        self.write_bus().hlwd.ipc.state.ppc_ctrl_write(0x36);
 
         loop {
-            if self.bus.read().hlwd.ppc_on {
+            if self.read_bus().hlwd.ppc_on {
                 info!(target: "PPC", "Broadway came online");
                 break;
             }
@@ -306,23 +515,26 @@ impl Backend for PpcBackend {
 
         // Block until we get an IRQ with an ACK/MSG
         self.wait_for_ack();
+        // Anything else that arrived during boot wasn't for us
+        self.completions.clear();
 
         // Send an extra ACK
-        self.bus.write().hlwd.ipc.state.arm_ack = true;
+        self.write_bus().hlwd.ipc.state.arm_ack = true;
+        self.arm_wake.notify();
         thread::sleep(std::time::Duration::from_millis(100));
 
         loop {
             // Try binding to the socket
-            let res = std::fs::remove_file(PpcBackend::resolve_socket_path());
+            let res = std::fs::remove_file(&self.socket_path);
             match res {
                 Ok(_) => {},
                 Err(_e) => {},
             }
-            let res = UnixListener::bind(PpcBackend::resolve_socket_path());
+            let res = UnixListener::bind(&self.socket_path);
             let sock = match res {
                 Ok(sock) => Some(sock),
                 Err(e) => {
-                    error!(target: "PPC", "Couldn't bind to {},\n{e:?}", PpcBackend::resolve_socket_path().to_string_lossy());
+                    error!(target: "PPC", "Couldn't bind to {},\n{e:?}", self.socket_path.to_string_lossy());
                     None
                 }
             };
@@ -0,0 +1,41 @@
+//! Execution checks for SWP and SWPB.
+
+#[path = "../../core/benches/common/mod.rs"]
+mod common;
+
+use ironic_backend::interp::dispatch::DispatchRes;
+use ironic_backend::interp::lut::INTERP_LUT;
+use ironic_core::cpu::Cpu;
+
+/// Somewhere in MEM1.
+const ADDR: u32 = 0x0000_1000;
+
+fn run(cpu: &mut Cpu, opcd: u32) {
+    let res = (INTERP_LUT.arm.lookup(opcd).0)(cpu, opcd);
+    assert!(matches!(res, DispatchRes::RetireOk), "{opcd:08x}: {res:?}");
+}
+
+#[test]
+fn swap() {
+    let mut cpu = Cpu::new(common::shared_bus());
+    cpu.reg[1u32] = ADDR;
+
+    // swp r0, r2, [r1]
+    cpu.write32(ADDR, 0x1122_3344).unwrap();
+    cpu.reg[2u32] = 0xdead_beef;
+    run(&mut cpu, 0xe101_0092);
+    assert_eq!(cpu.reg[0u32], 0x1122_3344);
+    assert_eq!(cpu.read32(ADDR).unwrap(), 0xdead_beef);
+
+    // swpb r0, r2, [r1] only swaps the low byte of r2
+    cpu.reg[2u32] = 0x0000_0155;
+    run(&mut cpu, 0xe141_0092);
+    assert_eq!(cpu.reg[0u32], 0xde);
+    assert_eq!(cpu.read32(ADDR).unwrap(), 0x55ad_beef);
+
+    // swp r0, r0, [r1] stores the old value of r0
+    cpu.reg[0u32] = 0x0bad_f00d;
+    run(&mut cpu, 0xe101_0090);
+    assert_eq!(cpu.reg[0u32], 0x55ad_beef);
+    assert_eq!(cpu.read32(ADDR).unwrap(), 0x0bad_f00d);
+}
@@ -0,0 +1,63 @@
+//! Benchmarks for decoding physical addresses, accessing memories, and
+//! dispatching scheduled work on the bus.
+
+mod common;
+
+use std::hint::black_box;
+
+use criterion::{criterion_group, criterion_main, BenchmarkId, Criterion, Throughput};
+
+use ironic_core::bus::task::{BusTask, Task};
+use ironic_core::mem::BigEndianMemory;
+
+/// Some addresses in MEM1, MEM2, MMIO, SRAM, and a hole.
+const ADDRS: [(&str, u32); 5] = [
+    ("mem1", 0x0000_1000),
+    ("mem2", 0x1000_0000),
+    ("mmio", 0x0d80_0000),
+    ("sram", 0xfff0_0000),
+    ("unmapped", 0x2000_0000),
+];
+
+fn decode_phys_addr(c: &mut Criterion) {
+    let bus = common::bus();
+    let mut group = c.benchmark_group("decode_phys_addr");
+    for (name, addr) in ADDRS {
+        group.bench_function(name, |b| b.iter(|| bus.decode_phys_addr(black_box(addr))));
+    }
+    group.finish();
+}
+
+fn memory(c: &mut Criterion) {
+    let mut mem = BigEndianMemory::new(0x0001_0000, None, false).unwrap();
+    let mut group = c.benchmark_group("BigEndianMemory");
+    group.bench_function("read8", |b| b.iter(|| mem.read::<u8>(black_box(0x1001)).unwrap()));
+    group.bench_function("read16", |b| b.iter(|| mem.read::<u16>(black_box(0x1002)).unwrap()));
+    group.bench_function("read32", |b| b.iter(|| mem.read::<u32>(black_box(0x1004)).unwrap()));
+    group.bench_function("write8", |b| b.iter(|| mem.write::<u8>(black_box(0x1001), 0x5a).unwrap()));
+    group.bench_function("write16", |b| b.iter(|| mem.write::<u16>(black_box(0x1002), 0x5aa5).unwrap()));
+    group.bench_function("write32", |b| b.iter(|| mem.write::<u32>(black_box(0x1004), 0xdead_beef).unwrap()));
+    group.finish();
+}
+
+/// Dispatch a queue of tasks that are all due on different cycles. The
+/// alarms are stale, so handling them costs nothing and this only measures
+/// the scheduler.
+fn drain_tasks(c: &mut Criterion) {
+    let mut bus = common::bus();
+    let mut group = c.benchmark_group("drain_tasks");
+    for depth in [16, 256, 4096] {
+        group.throughput(Throughput::Elements(depth as u64));
+        group.bench_with_input(BenchmarkId::from_parameter(depth), &depth, |b, &depth| b.iter(|| {
+            let start = bus.cycle;
+            for i in (0..depth).rev() {
+                bus.tasks.push(Task { kind: BusTask::Alarm(u32::MAX), target_cycle: start + i });
+            }
+            bus.catch_up(start + depth).unwrap();
+        }));
+    }
+    group.finish();
+}
+
+criterion_group!(benches, decode_phys_addr, memory, drain_tasks);
+criterion_main!(benches);
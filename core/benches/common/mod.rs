@@ -0,0 +1,46 @@
+//! Setup shared by the benchmarks.
+//!
+//! Creating a [Bus] needs the boot ROM, NAND, OTP and SEEPROM images in the
+//! working directory. The benchmarks don't run any guest code, so blank
+//! images in a scratch directory are enough. The NAND image is sparse, so it
+//! doesn't take up any space.
+
+#![allow(dead_code)]
+
+use std::fs::File;
+use std::path::PathBuf;
+use std::sync::Arc;
+
+use parking_lot::RwLock;
+
+use ironic_core::bus::Bus;
+
+/// The length of the NAND image, including the spare area of each page.
+const NAND_SIZE: u64 = 0x840 * 0x4_0000;
+
+/// Images that a bus is created from, and their lengths.
+const IMAGES: [(&str, u64); 4] = [
+    ("boot0.bin", 0x2000),
+    ("nand.bin", NAND_SIZE),
+    ("otp.bin", 0x80),
+    ("seeprom.bin", 0x100),
+];
+
+/// Create a bus from blank images. This changes the working directory.
+pub fn bus() -> Bus {
+    let dir: PathBuf = std::env::temp_dir().join("ironic-bench");
+    std::fs::create_dir_all(&dir).unwrap();
+    for (name, len) in IMAGES {
+        let path = dir.join(name);
+        if !path.exists() {
+            File::create(&path).unwrap().set_len(len).unwrap();
+        }
+    }
+    std::env::set_current_dir(&dir).unwrap();
+    Bus::new().unwrap()
+}
+
+/// Create a bus that can be shared with a CPU.
+pub fn shared_bus() -> Arc<RwLock<Bus>> {
+    Arc::new(RwLock::new(bus()))
+}
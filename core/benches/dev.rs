@@ -0,0 +1,99 @@
+//! Benchmarks for the DMA engines: AES, SHA, and reading NAND pages, along
+//! with computing the ECC for them.
+//!
+//! Commands that are offloaded (see [ironic_core::bus::offload]) complete on
+//! a later bus step, so each iteration runs the bus until the command is
+//! done.
+
+mod common;
+
+use std::hint::black_box;
+
+use criterion::{criterion_group, criterion_main, BenchmarkId, Criterion, Throughput};
+
+use ironic_core::bus::Bus;
+use ironic_core::bus::offload::CYCLES_PER_BLOCK;
+use ironic_core::dev::nand::util::{calc_ecc, calc_page_ecc};
+
+const AES_BASE: u32 = 0x0d02_0000;
+const SHA_BASE: u32 = 0x0d03_0000;
+const NAND_BASE: u32 = 0x0d01_0000;
+
+/// Source and destination buffers, in MEM2.
+const SRC: u32 = 0x1000_0000;
+const DST: u32 = 0x1010_0000;
+
+/// Command lengths on either side of the offload threshold, up to the
+/// largest command the AES engine takes.
+const LENS: [usize; 4] = [0x400, 0x1000, 0x4000, 0x10000];
+
+/// Run the bus until a command of some length is done.
+fn finish(bus: &mut Bus, len: usize) {
+    let end = bus.cycle + (len / 0x10) * CYCLES_PER_BLOCK + 1;
+    bus.catch_up(end).unwrap();
+}
+
+fn aes(c: &mut Criterion) {
+    let mut bus = common::bus();
+    for i in 0..4u32 {
+        bus.write32(AES_BASE + 0x0c, 0x0123_4567u32.wrapping_mul(i)).unwrap();
+        bus.write32(AES_BASE + 0x10, 0x89ab_cdefu32.wrapping_mul(i)).unwrap();
+    }
+    let mut group = c.benchmark_group("aes");
+    for (name, ctrl) in [("decrypt", 0x9800_0000), ("encrypt", 0x9000_0000)] {
+        for len in LENS {
+            let val = ctrl | ((len / 0x10) - 1) as u32;
+            group.throughput(Throughput::Bytes(len as u64));
+            group.bench_with_input(BenchmarkId::new(name, len), &len, |b, &len| b.iter(|| {
+                bus.write32(AES_BASE + 0x04, SRC).unwrap();
+                bus.write32(AES_BASE + 0x08, DST).unwrap();
+                bus.handle_task_aes(val).unwrap();
+                finish(&mut bus, len);
+            }));
+        }
+    }
+    group.finish();
+}
+
+fn sha(c: &mut Criterion) {
+    let mut bus = common::bus();
+    let mut group = c.benchmark_group("sha");
+    for len in LENS {
+        let val = 0x8000_0000 | ((len / 0x40) - 1) as u32;
+        group.throughput(Throughput::Bytes(len as u64));
+        group.bench_with_input(BenchmarkId::new("digest", len), &len, |b, &len| b.iter(|| {
+            bus.write32(SHA_BASE + 0x04, SRC).unwrap();
+            bus.handle_task_sha(val).unwrap();
+            finish(&mut bus, len);
+        }));
+    }
+    group.finish();
+}
+
+/// Read a page (and its spare area) into memory, computing the ECC.
+fn nand(c: &mut Criterion) {
+    let mut bus = common::bus();
+    bus.write32(NAND_BASE + 0x0c, 0x100).unwrap();
+    bus.write32(NAND_BASE + 0x10, DST).unwrap();
+    bus.write32(NAND_BASE + 0x14, DST + 0x800).unwrap();
+    let mut group = c.benchmark_group("nand");
+    group.throughput(Throughput::Bytes(0x840));
+    group.bench_function("read_page", |b| b.iter(|| {
+        bus.handle_task_nand(0x8000_0000).unwrap();
+        bus.handle_task_nand(0x8030_3840).unwrap();
+    }));
+    group.finish();
+}
+
+fn ecc(c: &mut Criterion) {
+    let page: Vec<u8> = (0..0x840u32).map(|i| (i.wrapping_mul(0x9e37_79b9) >> 24) as u8).collect();
+    let mut group = c.benchmark_group("ecc");
+    group.throughput(Throughput::Bytes(0x200));
+    group.bench_function("block", |b| b.iter(|| calc_ecc(black_box(&page))));
+    group.throughput(Throughput::Bytes(0x800));
+    group.bench_function("page", |b| b.iter(|| calc_page_ecc(black_box(&page))));
+    group.finish();
+}
+
+criterion_group!(benches, aes, sha, nand, ecc);
+criterion_main!(benches);
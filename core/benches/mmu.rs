@@ -0,0 +1,49 @@
+//! Benchmarks for translating virtual addresses.
+
+mod common;
+
+use std::hint::black_box;
+
+use criterion::{criterion_group, criterion_main, Criterion};
+
+use ironic_core::cpu::Cpu;
+use ironic_core::cpu::coproc::{ControlRegister, DACRegister};
+use ironic_core::cpu::mmu::prim::{Access, TLBReq};
+
+/// Where the first-level table is kept, in MEM1.
+const TTBR: u32 = 0x0010_0000;
+
+/// Identity-map the first 256MB with sections, and turn on the MMU.
+fn enable_mmu(cpu: &mut Cpu) {
+    {
+        let mut bus = cpu.bus.write();
+        for idx in 0..0x100u32 {
+            let desc = (idx << 20) | (0b11 << 10) | 0b10;
+            bus.mem1.write::<u32>((TTBR + (idx << 2)) as usize, desc).unwrap();
+        }
+    }
+    cpu.p15.write_ttbr(TTBR);
+    cpu.p15.c3_dacr = DACRegister(0b01);
+    cpu.p15.c1_ctrl = ControlRegister(1);
+}
+
+fn translate(c: &mut Criterion) {
+    let mut cpu = Cpu::new(common::shared_bus());
+    let mut group = c.benchmark_group("translate");
+    group.bench_function("mmu_off", |b| b.iter(|| {
+        cpu.translate(TLBReq::new(black_box(0x0123_4568), Access::Read)).unwrap()
+    }));
+
+    enable_mmu(&mut cpu);
+    group.bench_function("tlb_hit", |b| b.iter(|| {
+        cpu.translate(TLBReq::new(black_box(0x0123_4568), Access::Read)).unwrap()
+    }));
+    group.bench_function("walk", |b| b.iter(|| {
+        cpu.p15.clear_tlb();
+        cpu.translate(TLBReq::new(black_box(0x0123_4568), Access::Read)).unwrap()
+    }));
+    group.finish();
+}
+
+criterion_group!(benches, translate);
+criterion_main!(benches);
@@ -1,11 +1,24 @@
 pub mod prim;
+pub mod code;
 pub mod decode;
 pub mod dispatch;
+pub mod fastmem;
 pub mod mmio;
+pub mod notify;
+pub mod offload;
 pub mod task;
-use std::env::current_dir;
+pub mod watch;
+use std::env::{current_dir, temp_dir};
+use std::path::{Path, PathBuf};
+use std::sync::Arc;
 
 use crate::bus::task::*;
+use crate::bus::code::*;
+use crate::bus::decode::DecodeTable;
+use crate::bus::fastmem::RamGate;
+use crate::bus::notify::Notifier;
+use crate::bus::offload::Offload;
+use crate::bus::watch::WatchList;
 
 use crate::mem::*;
 use crate::dev::hlwd::*;
@@ -25,9 +38,6 @@ use gimli::EndianArcSlice;
 pub struct DebugInfo {
     pub debuginfo: Option<Dwarf<EndianArcSlice<BigEndian>>>,
     pub debug_frames: Option<DebugFrame<EndianArcSlice<BigEndian>>>,
-    pub last_pc: Option<u32>,
-    pub last_lr: Option<u32>,
-    pub last_sp: Option<u32>,
 }
 
 /// Implementation of an emulated bus.
@@ -56,20 +66,87 @@ pub struct Bus {
     pub rom_disabled: bool,
     /// True when the SRAM mirror is enabled.
     pub mirror_enabled: bool,
-
-    /// Queue for pending work on I/O devices.
-    pub tasks: Vec<Task>,
+    /// Table used to decode physical addresses.
+    pub decode: DecodeTable,
+
+    /// Pages of memory holding code cached by a backend.
+    pub code: CodeTracker,
+    /// Watchpoints set by a debugger.
+    pub watchpoints: WatchList,
+
+    /// Queue for pending work on I/O devices, ordered by the cycle it's due.
+    pub tasks: Scheduler,
+    /// AES/SHA commands running on worker threads.
+    pub offload: Offload,
     pub cycle: usize,
     pub debuginfo: Box<DebugInfo>,
+
+    /// Notified when the PPC IRQ line is raised.
+    pub ppc_irq_notify: Arc<Notifier>,
+    /// The state of the PPC IRQ line when it was last published.
+    pub ppc_irq_raised: bool,
+    /// Notified by the PPC side after changing IPC state, to wake up an idle
+    /// ARM core.
+    pub arm_wake: Arc<Notifier>,
+    /// Taken by other threads before accessing guest RAM, to keep the CPU off
+    /// the fast path (see [crate::bus::fastmem]).
+    pub ram_gate: Arc<RamGate>,
 }
+/// Names of the files that MEM1 and MEM2 are exported to (see
+/// [Bus::with_shared_ram]).
+pub const SHARED_MEM1: &str = "ironic-mem1";
+pub const SHARED_MEM2: &str = "ironic-mem2";
+
+/// The default directory for exported memories. This is `/dev/shm` where
+/// available, so that the files never have to touch the disk.
+pub fn shared_ram_dir() -> PathBuf {
+    let shm = PathBuf::from("/dev/shm");
+    if shm.is_dir() { shm } else { temp_dir() }
+}
+
+/// Options for creating a [Bus].
+#[derive(Default)]
+pub struct BusOptions<'a> {
+    /// Export MEM1 and MEM2 as files in this directory, which other processes
+    /// (i.e. PPC HLE clients) can map to access guest memory directly.
+    pub shared_ram: Option<&'a Path>,
+    /// Write changes to the SD card straight back to `sd.img`. Otherwise,
+    /// they're private to the process (as they are for every other memory
+    /// initialized from a file), and are lost when it exits.
+    pub write_back_sd: bool,
+    /// Keep track of the pages written to each memory, so that the machine
+    /// can be reset quickly (see [crate::mem::dirty]).
+    pub track_dirty_pages: bool,
+}
+
 impl Bus {
     pub fn new()-> anyhow::Result<Self> {
-        Ok(Bus {
+        Self::with_options(&BusOptions::default())
+    }
+
+    /// Create a bus, optionally exporting MEM1 and MEM2 as files in some
+    /// directory (see [BusOptions::shared_ram]).
+    pub fn with_shared_ram(dir: Option<&Path>) -> anyhow::Result<Self> {
+        Self::with_options(&BusOptions { shared_ram: dir, ..Default::default() })
+    }
+
+    pub fn with_options(opts: &BusOptions) -> anyhow::Result<Self> {
+        let (mem1, mem2) = match opts.shared_ram {
+            Some(dir) => (
+                BigEndianMemory::new_exported(0x0180_0000, &dir.join(SHARED_MEM1))?,
+                BigEndianMemory::new_exported(0x0400_0000, &dir.join(SHARED_MEM2))?,
+            ),
+            None => (
+                BigEndianMemory::new(0x0180_0000, None, false)?,
+                BigEndianMemory::new(0x0400_0000, None, false)?,
+            ),
+        };
+        let mut bus = Bus {
             mrom: BigEndianMemory::new(0x0000_2000, Some("./boot0.bin"), false)?,
             sram0: BigEndianMemory::new(0x0001_0000, None, false)?,
             sram1: BigEndianMemory::new(0x0001_0000, None, false)?,
-            mem1: BigEndianMemory::new(0x0180_0000, None, false)?,
-            mem2: BigEndianMemory::new(0x0400_0000, None, false)?,
+            mem1,
+            mem2,
 
             hlwd: Hollywood::new()?,
             nand: NandInterface::new("./nand.bin")?,
@@ -78,15 +155,39 @@ impl Bus {
             ehci: EhcInterface::new(),
             ohci0: OhcInterface { idx: 0, ..Default::default() },
             ohci1: OhcInterface { idx: 1, ..Default::default() },
-            sd0: SDInterface::default(),
+            sd0: SDInterface::new(opts.write_back_sd),
             sd1: WLANInterface::default(),
 
             rom_disabled: false,
             mirror_enabled: false,
-            tasks: Vec::new(),
+            decode: DecodeTable::new(),
+            code: CodeTracker::new(),
+            watchpoints: WatchList::new(),
+            tasks: Scheduler::new(),
+            offload: Offload::new(),
             cycle: 0,
             debuginfo: Box::default(),
-        })
+            ppc_irq_notify: Arc::new(Notifier::new()),
+            ppc_irq_raised: false,
+            arm_wake: Arc::new(Notifier::new()),
+            ram_gate: Arc::new(RamGate::new()),
+        };
+        if opts.track_dirty_pages {
+            bus.track_dirty_pages();
+        }
+        Ok(bus)
+    }
+
+    /// Start keeping track of dirty pages in every memory. This must be done
+    /// before the CPU is created, so that its fast path into guest RAM sees
+    /// the dirty pages.
+    pub fn track_dirty_pages(&mut self) {
+        for mem in [&mut self.mrom, &mut self.sram0, &mut self.sram1, &mut self.mem1, &mut self.mem2] {
+            mem.track_dirty_pages();
+        }
+        self.nand.data.track_dirty_pages();
+        self.hlwd.gpio.seeprom.track_dirty_pages();
+        self.sd0.track_dirty_pages();
     }
 
     pub fn install_debuginfo(&mut self, debuginfo: Dwarf<EndianArcSlice<BigEndian>>) {
@@ -97,12 +198,6 @@ impl Bus {
         self.debuginfo.debug_frames = Some(debug_frames);
     }
 
-    pub fn update_debug_location(&mut self, pc: Option<u32>, lr: Option<u32>, sp: Option<u32>) {
-        if let Some(pc) = pc { self.debuginfo.last_pc = Some(pc); }
-        if let Some(lr) = lr { self.debuginfo.last_lr = Some(lr); }
-        if let Some(sp) = sp { self.debuginfo.last_sp = Some(sp); }
-    } 
-
     pub fn dump_memory(&self, suffix: &'static str) -> anyhow::Result<std::path::PathBuf> {
         let dir = current_dir()?;
 
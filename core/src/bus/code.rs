@@ -0,0 +1,139 @@
+//! Tracking for pages that a backend has cached decoded code from.
+//!
+//! Backends that cache anything derived from guest code need to know when
+//! that code changes. Pages are identified by their backing memory (not by
+//! physical address), so writes through any alias of SRAM are still caught.
+
+use std::sync::Arc;
+use std::sync::atomic::AtomicU64;
+use std::sync::atomic::Ordering::Relaxed;
+
+use crate::bus::Bus;
+use crate::bus::prim::*;
+
+/// Size of a tracked page.
+pub const CODE_PAGE_SHIFT: u32 = 12;
+
+/// First page key for each memory device (indexed like [MemDevice]).
+const PAGE_BASE: [u32; 5] = [
+    0x0000, // MaskRom (2 pages)
+    0x0002, // Sram0 (16 pages)
+    0x0012, // Sram1 (16 pages)
+    0x0022, // Mem1 (0x1800 pages)
+    0x1822, // Mem2 (0x4000 pages)
+];
+const NUM_PAGES: usize = 0x5822;
+
+/// A unique identifier for a page of backing memory.
+pub type CodePageKey = u32;
+
+pub struct CodeTracker {
+    /// One bit for each page with cached code. This is shared with
+    /// [crate::bus::fastmem::GuestRam], which sends writes to these pages
+    /// down the slow path.
+    cached: Arc<[AtomicU64]>,
+    /// Pages written since they were cached, waiting to be collected.
+    dirty: Vec<CodePageKey>,
+    /// Incremented whenever previously-resolved code may no longer be valid,
+    /// either because a page was dirtied or because the physical memory map
+    /// has changed.
+    pub generation: u32,
+}
+impl Default for CodeTracker {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+impl CodeTracker {
+    pub fn new() -> Self {
+        CodeTracker {
+            cached: (0..NUM_PAGES.div_ceil(64)).map(|_| AtomicU64::new(0)).collect(),
+            dirty: Vec::new(),
+            generation: 0,
+        }
+    }
+
+    pub(crate) fn key(dev: MemDevice, off: usize) -> CodePageKey {
+        PAGE_BASE[dev as usize] + (off >> CODE_PAGE_SHIFT) as u32
+    }
+
+    /// Mark a page as containing cached code.
+    pub fn mark(&mut self, key: CodePageKey) {
+        let word = &self.cached[key as usize / 64];
+        word.store(word.load(Relaxed) | 1 << (key % 64), Relaxed);
+    }
+
+    /// Returns true if a page contains cached code.
+    #[inline(always)]
+    pub(crate) fn is_cached(bits: &[AtomicU64], key: CodePageKey) -> bool {
+        bits[key as usize / 64].load(Relaxed) & (1 << (key % 64)) != 0
+    }
+
+    /// Get a handle to the set of pages with cached code.
+    pub(crate) fn shared_bits(&self) -> Arc<[AtomicU64]> {
+        self.cached.clone()
+    }
+
+    /// Called on every write to memory. If the write touches any page with
+    /// cached code, stop tracking it and queue it for invalidation.
+    #[inline(always)]
+    pub fn notify_write(&mut self, dev: MemDevice, off: usize, len: usize) {
+        let first = Self::key(dev, off);
+        let last = Self::key(dev, off + len.max(1) - 1).min(NUM_PAGES as u32 - 1);
+        for key in first..=last {
+            let (word, bit) = (&self.cached[key as usize / 64], 1 << (key % 64));
+            let val = word.load(Relaxed);
+            if val & bit != 0 {
+                word.store(val & !bit, Relaxed);
+                self.dirty.push(key);
+                self.generation = self.generation.wrapping_add(1);
+            }
+        }
+    }
+
+    /// Called when the physical memory map changes.
+    pub fn notify_remap(&mut self) {
+        self.generation = self.generation.wrapping_add(1);
+    }
+
+    /// Stop tracking every page, and queue them all for invalidation.
+    pub fn invalidate_all(&mut self) {
+        for (idx, word) in self.cached.iter().enumerate() {
+            let mut val = word.swap(0, Relaxed);
+            while val != 0 {
+                self.dirty.push((idx * 64) as u32 + val.trailing_zeros());
+                val &= val - 1;
+            }
+        }
+        self.generation = self.generation.wrapping_add(1);
+    }
+
+    /// Take the list of pages dirtied since the last call.
+    pub fn take_dirty(&mut self) -> Vec<CodePageKey> {
+        std::mem::take(&mut self.dirty)
+    }
+}
+
+impl Bus {
+    /// Resolve the page of backing memory for some physical address, and
+    /// start tracking writes to it. Returns [None] for I/O regions.
+    pub fn track_code_page(&mut self, addr: u32) -> Option<CodePageKey> {
+        let handle = self.decode_phys_addr(addr)?;
+        match handle.dev {
+            Device::Mem(dev) => {
+                let key = CodeTracker::key(dev, (addr & handle.mask) as usize);
+                self.code.mark(key);
+                Some(key)
+            },
+            Device::Io(_) => None,
+        }
+    }
+
+    /// Drop anything cached from the code at some physical address (i.e.
+    /// when a debugger sets a breakpoint on it).
+    pub fn invalidate_code(&mut self, addr: u32) {
+        if let Some(DeviceHandle { dev: Device::Mem(dev), mask }) = self.decode_phys_addr(addr) {
+            self.code.notify_write(dev, (addr & mask) as usize, 1);
+        }
+    }
+}
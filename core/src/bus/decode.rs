@@ -3,6 +3,10 @@ use crate::dev::*;
 use crate::bus::*;
 use crate::bus::prim::*;
 
+use std::sync::Arc;
+use std::sync::atomic::{AtomicU32, AtomicU64};
+use std::sync::atomic::Ordering::Relaxed;
+
 /// Declare a constant handle to some memory device.
 macro_rules! decl_mem_handle { 
     ($name:ident, $id:ident, $mask:expr) => {
@@ -45,40 +49,228 @@ decl_io_handle!(DI_HANDLE, Di,      0x0000_03ff);
 decl_io_handle!(EXI_HANDLE, Exi,    0x0000_03ff);
 
 
-impl Bus {
-    /// Decode a physical address into some handle for a particlar device.
-    pub fn decode_phys_addr(&self, addr: u32) -> Option<DeviceHandle> {
-        let hi_bits = (addr & 0xffff_0000) >> 16;
-        match hi_bits {
-            0x0d40 |
-            0x0d41 |
-            0xfff0 |
-            0xfff1 |
-            0xfffe |
-            0xffff => self.resolve_sram(addr),
-
-            0x0d01 => Some(NAND_HANDLE),
-            0x0d02 => Some(AES_HANDLE),
-            0x0d03 => Some(SHA_HANDLE),
-            0x0d04 => Some(EHCI_HANDLE),
-            0x0d05 => Some(OHCI0_HANDLE),
-            0x0d06 => Some(OHCI1_HANDLE),
-            0x0d07 => Some(SDHC0_HANDLE),
-            0x0d08 => Some(SDHC1_HANDLE),
+/// Number of entries in a [DecodeTable] (one for each 64KiB page).
+const DECODE_PAGES: usize = 0x1_0000;
 
-            0x0d00 | 0x0d80 |
-            0x0d8b => self.resolve_hlwd(addr),
+/// Pages whose mapping depends on [Bus::rom_disabled] and [Bus::mirror_enabled].
+const SRAM_PAGES: [u32; 6] = [0x0d40, 0x0d41, 0xfff0, 0xfff1, 0xfffe, 0xffff];
 
-            0x0000..=0x017f => Some(MEM1_HANDLE),
-            0x1000..=0x13ff => Some(MEM2_HANDLE),
+/// Every device that can appear in a [DecodeTable], indexed by the device ID
+/// in each entry. Memory devices come first, in the same order as [MemDevice].
+const DEVICES: [Device; 20] = {
+    use MemDevice::*;
+    use IoDevice::*;
+    [
+        Device::Mem(MaskRom), Device::Mem(Sram0), Device::Mem(Sram1),
+        Device::Mem(Mem1), Device::Mem(Mem2),
+        Device::Io(Nand), Device::Io(Aes), Device::Io(Sha), Device::Io(Ehci),
+        Device::Io(Ohci0), Device::Io(Ohci1), Device::Io(Sdhc0), Device::Io(Sdhc1),
+        Device::Io(Hlwd), Device::Io(Ahb), Device::Io(Ddr), Device::Io(Di),
+        Device::Io(Si), Device::Io(Exi), Device::Io(Mi),
+    ]
+};
+const MEM_DEVICES: [MemDevice; 5] = [
+    MemDevice::MaskRom, MemDevice::Sram0, MemDevice::Sram1,
+    MemDevice::Mem1, MemDevice::Mem2,
+];
 
-            _ => None,
+// Entries in a [DecodeTable] are packed into 64 bits:
+//
+// - `[31:0]`:  mask for the device handle
+// - `[47:32]`: the last offset in the page mapped to the device
+// - `[55:48]`: index of the device in [DEVICES]
+// - `[62:56]`: kind of entry
+// - `[63]`:    set when the page has a watchpoint (see [crate::bus::watch])
+
+/// Nothing is mapped in this page.
+const KIND_UNMAPPED: u64 = 0;
+/// The page is mapped to a single device.
+const KIND_DEVICE: u64 = 1;
+/// The page is split between devices, and has to be decoded the slow way.
+const KIND_SPLIT: u64 = 2;
+/// Mask for the kind of entry, after shifting it down.
+const KIND_MASK: u64 = 0x7f;
+/// Set in the entry for a page with a watchpoint. Entries with this bit
+/// don't look like [KIND_DEVICE] on the fast path, so every access to the
+/// page goes through the bus.
+const FLAG_WATCHED: u64 = 1 << 63;
+
+/// The result of looking up an address in a [DecodeTable].
+enum Decoded { Unmapped, Device(DeviceHandle), Split }
+
+/// A flat table for decoding physical addresses, with one entry for each
+/// 64KiB page.
+///
+/// Only the entries for SRAM and the mask ROM ever change, and they're
+/// rewritten whenever the mapping changes (see [Bus::remap]). The entries are
+/// atomic so that the table can be shared with [crate::bus::fastmem::GuestRam].
+pub struct DecodeTable {
+    entries: Arc<[AtomicU64]>,
+    /// Incremented every time the table changes.
+    generation: Arc<AtomicU32>,
+}
+
+impl DecodeTable {
+    pub fn new() -> Self {
+        let entries = (0..DECODE_PAGES as u32)
+            .map(|page| AtomicU64::new(decode_page(false, false, page)))
+            .collect();
+        DecodeTable { entries, generation: Arc::new(AtomicU32::new(0)) }
+    }
+
+    /// Rebuild the entries for pages in the SRAM/ROM regions.
+    pub fn remap(&self, rom_disabled: bool, mirror_enabled: bool) {
+        for page in SRAM_PAGES {
+            let entry = decode_page(rom_disabled, mirror_enabled, page);
+            let watched = self.entries[page as usize].load(Relaxed) & FLAG_WATCHED;
+            self.entries[page as usize].store(entry | watched, Relaxed);
+        }
+        self.generation.fetch_add(1, Relaxed);
+    }
+
+    /// Take some page off the fast path (or put it back), when it gains (or
+    /// loses) a watchpoint.
+    pub(crate) fn set_watched(&self, page: u32, watched: bool) {
+        let entry = &self.entries[page as usize & (DECODE_PAGES - 1)];
+        if watched {
+            entry.fetch_or(FLAG_WATCHED, Relaxed);
+        } else {
+            entry.fetch_and(!FLAG_WATCHED, Relaxed);
+        }
+    }
+
+    /// Get a reference to the table entries, for lock-free lookups.
+    pub(crate) fn shared(&self) -> Arc<[AtomicU64]> {
+        self.entries.clone()
+    }
+
+    /// Get a reference to the generation counter, for lock-free lookups.
+    pub(crate) fn shared_generation(&self) -> Arc<AtomicU32> {
+        self.generation.clone()
+    }
+
+    #[inline(always)]
+    fn lookup(&self, addr: u32) -> Decoded {
+        let entry = self.entries[(addr >> 16) as usize].load(Relaxed);
+        match (entry >> 56) & KIND_MASK {
+            KIND_DEVICE if (addr & 0xffff) as u64 <= (entry >> 32) & 0xffff => {
+                Decoded::Device(DeviceHandle {
+                    dev: DEVICES[((entry >> 48) & 0xff) as usize],
+                    mask: entry as u32,
+                })
+            },
+            KIND_SPLIT => Decoded::Split,
+            _ => Decoded::Unmapped,
+        }
+    }
+
+    /// Resolve a physical address to a memory device and offset, using the
+    /// [DecodeTable::shared] entries. Returns [None] for anything else.
+    #[inline(always)]
+    pub(crate) fn lookup_mem(entries: &[AtomicU64], addr: u32) -> Option<(MemDevice, usize)> {
+        Self::unpack_mem(entries[(addr >> 16) as usize].load(Relaxed), addr)
+    }
+
+    /// Like [DecodeTable::lookup_mem], but for instruction fetches, which
+    /// don't trigger watchpoints.
+    #[inline(always)]
+    pub(crate) fn lookup_fetch(entries: &[AtomicU64], addr: u32) -> Option<(MemDevice, usize)> {
+        Self::unpack_mem(entries[(addr >> 16) as usize].load(Relaxed) & !FLAG_WATCHED, addr)
+    }
+
+    #[inline(always)]
+    fn unpack_mem(entry: u64, addr: u32) -> Option<(MemDevice, usize)> {
+        let id = ((entry >> 48) & 0xff) as usize;
+        if entry >> 56 != KIND_DEVICE || id >= MEM_DEVICES.len()
+        || (addr & 0xffff) as u64 > (entry >> 32) & 0xffff {
+            return None;
+        }
+        Some((MEM_DEVICES[id], (addr & entry as u32) as usize))
+    }
+}
+
+/// Pack a [DecodeTable] entry for a page mapped to some device, up to (and
+/// including) the offset `limit`.
+fn pack_entry(handle: DeviceHandle, limit: u32) -> u64 {
+    let id = DEVICES.iter().position(|dev| *dev == handle.dev).unwrap() as u64;
+    (KIND_DEVICE << 56) | (id << 48) | ((limit as u64) << 32) | handle.mask as u64
+}
+
+/// Build the [DecodeTable] entry for some page.
+fn decode_page(rom_disabled: bool, mirror_enabled: bool, page: u32) -> u64 {
+    match page {
+        0x0d40 |
+        0x0d41 |
+        0xfff0 |
+        0xfff1 |
+        0xfffe |
+        0xffff => scan_page(page, |addr| resolve_sram_mapping(rom_disabled, mirror_enabled, addr)),
+
+        0x0d01 => pack_entry(NAND_HANDLE, 0xffff),
+        0x0d02 => pack_entry(AES_HANDLE, 0xffff),
+        0x0d03 => pack_entry(SHA_HANDLE, 0xffff),
+        0x0d04 => pack_entry(EHCI_HANDLE, 0xffff),
+        0x0d05 => pack_entry(OHCI0_HANDLE, 0xffff),
+        0x0d06 => pack_entry(OHCI1_HANDLE, 0xffff),
+        0x0d07 => pack_entry(SDHC0_HANDLE, 0xffff),
+        0x0d08 => pack_entry(SDHC1_HANDLE, 0xffff),
+
+        0x0d00 | 0x0d80 |
+        0x0d8b => KIND_SPLIT << 56,
+
+        0x0000..=0x017f => pack_entry(MEM1_HANDLE, 0xffff),
+        0x1000..=0x13ff => pack_entry(MEM2_HANDLE, 0xffff),
+
+        _ => KIND_UNMAPPED << 56,
+    }
+}
+
+/// Build the [DecodeTable] entry for a page in the SRAM/ROM regions.
+///
+/// These are either mapped to a single device from the start of the page
+/// up to some 4KiB boundary, or not at all. Anything else is left to the
+/// slow path.
+fn scan_page(page: u32, resolve: impl Fn(u32) -> Option<DeviceHandle>) -> u64 {
+    let base = page << 16;
+    let first = match resolve(base) {
+        Some(handle) => handle,
+        None => return KIND_UNMAPPED << 56,
+    };
+    let mut limit = 0xffff;
+    for off in (0x1000..0x1_0000).step_by(0x1000) {
+        match resolve(base + off) {
+            Some(handle) if handle == first && limit == 0xffff => {},
+            None if limit == 0xffff => limit = off - 1,
+            None => {},
+            Some(_) => return KIND_SPLIT << 56,
+        }
+    }
+    pack_entry(first, limit)
+}
+
+impl Bus {
+    /// Decode a physical address into some handle for a particlar device.
+    #[inline(always)]
+    pub fn decode_phys_addr(&self, addr: u32) -> Option<DeviceHandle> {
+        match self.decode.lookup(addr) {
+            Decoded::Device(handle) => Some(handle),
+            Decoded::Unmapped => None,
+            Decoded::Split => self.decode_split(addr),
         }
     }
 }
 
 /// These are helper functions for decoding physical addresses.
 impl Bus {
+    /// Decode a physical address in a page with more than one device.
+    fn decode_split(&self, addr: u32) -> Option<DeviceHandle> {
+        match (addr & 0xffff_0000) >> 16 {
+            0x0d00 | 0x0d80 |
+            0x0d8b => self.resolve_hlwd(addr),
+            _ => self.resolve_sram(addr),
+        }
+    }
+
     /// Resolve a physical address associated with the Hollywood MMIO region.
     fn resolve_hlwd(&self, addr: u32) -> Option<DeviceHandle> {
         match addr {
@@ -95,12 +287,18 @@ impl Bus {
 
     /// Resolve a physical address associated with SRAM or the mask ROM.
     fn resolve_sram(&self, addr: u32) -> Option<DeviceHandle> {
-        match (!self.rom_disabled, self.mirror_enabled) {
-            (true,  false) => resolve_rom_nomir(addr),
-            (true,  true)  => resolve_rom_mir(addr),
-            (false, true)  => resolve_norom_mir(addr),
-            (false, false) => resolve_norom_nomir(addr),
-        }
+        resolve_sram_mapping(self.rom_disabled, self.mirror_enabled, addr)
+    }
+}
+
+/// Resolve a physical address in the SRAM/mask ROM regions, given the state
+/// of the ROM and SRAM mirror mappings.
+fn resolve_sram_mapping(rom_disabled: bool, mirror_enabled: bool, addr: u32) -> Option<DeviceHandle> {
+    match (!rom_disabled, mirror_enabled) {
+        (true,  false) => resolve_rom_nomir(addr),
+        (true,  true)  => resolve_rom_mir(addr),
+        (false, true)  => resolve_norom_mir(addr),
+        (false, false) => resolve_norom_nomir(addr),
     }
 }
 
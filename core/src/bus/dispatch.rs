@@ -7,6 +7,31 @@ use anyhow::bail;
 use crate::bus::*;
 use crate::bus::prim::*;
 
+/// Borrow the memory device for some [MemDevice] on a bus. This is a macro
+/// so that the borrow only covers that device, and the rest of the bus can
+/// be used at the same time (i.e. for DMA between memory and a device).
+macro_rules! ram_device {
+    (mut $bus:expr, $dev:expr) => {
+        match $dev {
+            MemDevice::MaskRom  => &mut $bus.mrom,
+            MemDevice::Sram0    => &mut $bus.sram0,
+            MemDevice::Sram1    => &mut $bus.sram1,
+            MemDevice::Mem1     => &mut $bus.mem1,
+            MemDevice::Mem2     => &mut $bus.mem2,
+        }
+    };
+    ($bus:expr, $dev:expr) => {
+        match $dev {
+            MemDevice::MaskRom  => &$bus.mrom,
+            MemDevice::Sram0    => &$bus.sram0,
+            MemDevice::Sram1    => &$bus.sram1,
+            MemDevice::Mem1     => &$bus.mem1,
+            MemDevice::Mem2     => &$bus.mem2,
+        }
+    };
+}
+pub(crate) use ram_device;
+
 /// Top-level read/write functions for performing physical memory accesses.
 impl Bus {
     /// Perform a 32-bit physical memory read.
@@ -58,6 +83,18 @@ impl Bus {
         self.do_dma_read(addr, buf)
     }
 
+    /// Borrow the memory backing some physical range, for DMA reads without
+    /// copying. The range must be contiguous in a single memory device.
+    pub fn dma_view(&self, addr: u32, len: usize) -> anyhow::Result<&[u8]> {
+        let (dev, off) = self.resolve_dma_read(addr)?;
+        ram_device!(self, dev).view(off, len)
+    }
+    /// Mutably borrow the memory backing some physical range, for DMA writes
+    /// without copying. The whole range is treated as written.
+    pub fn dma_view_mut(&mut self, addr: u32, len: usize) -> anyhow::Result<&mut [u8]> {
+        let (dev, off) = self.resolve_dma_write(addr, len)?;
+        ram_device!(mut self, dev).view_mut(off, len)
+    }
 }
 
 impl Bus {
@@ -115,6 +152,8 @@ impl Bus {
     fn do_mem_write(&mut self, dev: MemDevice, off: usize, msg: BusPacket) -> anyhow::Result<()> {
         use MemDevice::*;
         use BusPacket::*;
+        let len = match msg { Word(_) => 4, Half(_) => 2, Byte(_) => 1 };
+        self.code.notify_write(dev, off, len);
         let target_ref = match dev {
             MaskRom => { bail!("Writes on mask ROM are unsupported"); },
             Sram0   => &mut self.sram0,
@@ -132,6 +171,61 @@ impl Bus {
 }
 
 impl Bus {
+    /// Copy between two physical ranges in memory, without an intermediate
+    /// buffer.
+    pub fn dma_copy(&mut self, src: u32, dst: u32, len: usize) -> anyhow::Result<()> {
+        if src == dst {
+            return Ok(());
+        }
+        let (src_dev, src_off) = self.resolve_dma_read(src)?;
+        let (dst_dev, dst_off) = self.resolve_dma_write(dst, len)?;
+        let mut mems = [&mut self.mrom, &mut self.sram0, &mut self.sram1, &mut self.mem1, &mut self.mem2];
+        if src_dev == dst_dev {
+            return mems[dst_dev as usize].copy_within(src_off, dst_off, len);
+        }
+        let [src_mem, dst_mem] = mems.get_disjoint_mut([src_dev as usize, dst_dev as usize]).unwrap();
+        dst_mem.view_mut(dst_off, len)?.copy_from_slice(src_mem.view(src_off, len)?);
+        Ok(())
+    }
+
+    /// Fill a physical range in memory with some byte.
+    pub fn dma_fill(&mut self, addr: u32, len: usize, val: u8) -> anyhow::Result<()> {
+        let (dev, off) = self.resolve_dma_write(addr, len)?;
+        ram_device!(mut self, dev).memset(off, len, val)
+    }
+
+    /// Resolve the source of a DMA read from memory.
+    pub(crate) fn resolve_dma_read(&self, addr: u32) -> anyhow::Result<(MemDevice, usize)> {
+        let (dev, off) = self.resolve_dma(addr)?;
+        if dev == MemDevice::MaskRom {
+            bail!("Bus error: DMA read on mask ROM");
+        }
+        Ok((dev, off))
+    }
+
+    /// Resolve the target of a DMA write to memory, and note that some range
+    /// is about to be written.
+    pub(crate) fn resolve_dma_write(&mut self, addr: u32, len: usize) -> anyhow::Result<(MemDevice, usize)> {
+        let (dev, off) = self.resolve_dma(addr)?;
+        if dev == MemDevice::MaskRom {
+            bail!("Bus error: DMA write on mask ROM");
+        }
+        self.code.notify_write(dev, off, len);
+        Ok((dev, off))
+    }
+
+    /// Resolve the target of a DMA access to some memory device and offset.
+    pub(crate) fn resolve_dma(&self, addr: u32) -> anyhow::Result<(MemDevice, usize)> {
+        let handle = match self.decode_phys_addr(addr) {
+            Some(val) => val,
+            None => { bail!("Unresolved physical address {addr:08x}"); }
+        };
+        match handle.dev {
+            Device::Mem(dev) => Ok((dev, (addr & handle.mask) as usize)),
+            _ => { bail!("Bus error: DMA on memory-mapped I/O region"); },
+        }
+    }
+
     /// Dispatch a DMA write to some memory device.
     fn do_dma_write(&mut self, addr: u32, buf: &[u8]) -> anyhow::Result<()> {
         use MemDevice::*;
@@ -144,13 +238,16 @@ impl Bus {
 
         let off = (addr & handle.mask) as usize;
         match handle.dev {
-            Device::Mem(dev) => { match dev {
-                MaskRom => { bail!("Bus error: DMA write on mask ROM"); },
-                Sram0   => self.sram0.write_buf(off, buf)?,
-                Sram1   => self.sram1.write_buf(off, buf)?,
-                Mem1    => self.mem1.write_buf(off, buf)?,
-                Mem2    => self.mem2.write_buf(off, buf)?,
-            }},
+            Device::Mem(dev) => {
+                self.code.notify_write(dev, off, buf.len());
+                match dev {
+                    MaskRom => { bail!("Bus error: DMA write on mask ROM"); },
+                    Sram0   => self.sram0.write_buf(off, buf)?,
+                    Sram1   => self.sram1.write_buf(off, buf)?,
+                    Mem1    => self.mem1.write_buf(off, buf)?,
+                    Mem2    => self.mem2.write_buf(off, buf)?,
+                }
+            },
             _ => { bail!("Bus error: DMA write on memory-mapped I/O region"); },
         }
         Ok(())
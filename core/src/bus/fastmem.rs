@@ -0,0 +1,382 @@
+//! Lock-free access to guest RAM.
+//!
+//! Nearly every CPU load and store targets plain memory (MEM1, MEM2, SRAM or
+//! the mask ROM), and taking the [Bus] lock for each of them is expensive.
+//! A [GuestRam] holds raw pointers to the backing storage for these devices,
+//! so that the CPU can access them directly. Anything else (MMIO, writes to
+//! the mask ROM, writes to pages with cached code, unaligned accesses) still
+//! goes through the locked bus, as do loads and stores to pages with
+//! watchpoints (see [crate::bus::watch]).
+//!
+//! ## Concurrency
+//! The bus is shared between the thread running the ARM core and the threads
+//! serving PPC HLE requests (and the panic/ctrl-c handlers, which dump memory).
+//! The rules for sharing guest RAM are:
+//!
+//! - The backing storage for each memory device is allocated once in
+//!   [Bus::new] and is never moved or resized. A [GuestRam] holds a reference
+//!   to the bus, so the storage outlives it.
+//! - The fast path is only used by the thread running the ARM core, and only
+//!   in the slices between bus steps (see [GuestRam::enter]).
+//! - Other threads access memory through the bus with the lock held, and
+//!   without atomics. Before touching guest RAM, they keep the CPU off the
+//!   fast path with [RamGate::pause], which waits for the current slice to
+//!   end. Slices started in the meantime go through the bus for every
+//!   access, so the fast path never runs at the same time as another thread
+//!   using guest RAM.
+//! - The thread running the ARM core also accesses memory through the bus
+//!   (for DMA, snapshots and so on), but never at the same time as the fast
+//!   path.
+//! - Clients that map the exported memories (see [Bus::with_shared_ram]) are
+//!   other processes. Nothing stops them from writing anywhere, at any time,
+//!   and their writes are never seen by the bus. In particular, they don't
+//!   invalidate cached code (see [crate::bus::code]), so exporting memory
+//!   can't be combined with the cached interpreter or the JIT.
+//! - Any state that affects how an access is routed is published to the fast
+//!   path by the bus: the physical address decode table (see
+//!   [crate::bus::decode]), the set of pages holding cached code (see
+//!   [crate::bus::code]), and the set of dirty pages when fast resets are
+//!   enabled (see [crate::mem::dirty]). Only the thread running the ARM core
+//!   writes through the fast path, so pages can't become clean under it.
+
+use std::sync::Arc;
+use std::sync::atomic::{AtomicBool, AtomicU8, AtomicU16, AtomicU32, AtomicU64};
+use std::sync::atomic::Ordering::{Relaxed, Release, SeqCst};
+
+use parking_lot::RwLock;
+
+use crate::bus::Bus;
+use crate::bus::code::CodeTracker;
+use crate::bus::decode::DecodeTable;
+use crate::bus::notify::Notifier;
+use crate::bus::prim::*;
+use crate::mem::BigEndianMemory;
+use crate::mem::dirty::DirtyPages;
+
+/// Widths supported on the fast path.
+pub trait RamWidth: Copy {
+    /// Load a big-endian value from some aligned pointer.
+    ///
+    /// # Safety
+    /// `ptr` must be valid and aligned for a value of this width.
+    unsafe fn load(ptr: *mut u8) -> Self;
+    /// Store a big-endian value to some aligned pointer.
+    ///
+    /// # Safety
+    /// `ptr` must be valid and aligned for a value of this width.
+    unsafe fn store(ptr: *mut u8, val: Self);
+}
+
+macro_rules! impl_ramwidth {
+    ($type:ident, $atomic:ident) => {
+        impl RamWidth for $type {
+            #[inline(always)]
+            unsafe fn load(ptr: *mut u8) -> Self {
+                let atomic = unsafe { $atomic::from_ptr(ptr as *mut $type) };
+                $type::from_be(atomic.load(Relaxed))
+            }
+            #[inline(always)]
+            unsafe fn store(ptr: *mut u8, val: Self) {
+                let atomic = unsafe { $atomic::from_ptr(ptr as *mut $type) };
+                atomic.store(val.to_be(), Relaxed)
+            }
+        }
+    };
+}
+impl_ramwidth!(u32, AtomicU32);
+impl_ramwidth!(u16, AtomicU16);
+impl_ramwidth!(u8, AtomicU8);
+
+/// Keeps the CPU off the fast path while other threads access guest RAM.
+///
+/// This is a handshake between the CPU, which marks itself as active for
+/// each slice on the fast path, and the other threads, which mark themselves
+/// as waiting. Whoever comes second backs off: the CPU runs the slice
+/// through the bus, or the other thread waits for the slice to end.
+#[derive(Default)]
+pub struct RamGate {
+    /// True while the CPU is in a slice on the fast path.
+    active: AtomicBool,
+    /// Number of threads that are waiting to access guest RAM, or doing so.
+    waiting: AtomicU32,
+    /// Notified when the CPU leaves the fast path.
+    left: Notifier,
+}
+
+/// Keeps the CPU off the fast path until it's dropped.
+pub struct RamPause<'a> {
+    gate: &'a RamGate,
+}
+impl Drop for RamPause<'_> {
+    fn drop(&mut self) {
+        self.gate.waiting.fetch_sub(1, Release);
+    }
+}
+
+impl RamGate {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Wait for the CPU to leave the fast path, and keep it off until the
+    /// returned guard is dropped. This must be called without the bus lock
+    /// held, since the CPU may need the bus to finish its slice.
+    pub fn pause(&self) -> RamPause<'_> {
+        self.waiting.fetch_add(1, SeqCst);
+        loop {
+            let seen = self.left.seq();
+            if !self.active.load(SeqCst) {
+                break;
+            }
+            self.left.wait(seen, None);
+        }
+        RamPause { gate: self }
+    }
+}
+
+/// Raw pointer to the backing storage for a memory device.
+#[derive(Clone, Copy)]
+struct RawMem {
+    ptr: *mut u8,
+    /// Length of the storage, or zero if it can't be used on the fast path.
+    len: usize,
+}
+impl RawMem {
+    fn new(mem: &mut BigEndianMemory) -> Self {
+        // Writes must not be skipped by the write tracking, and accesses must
+        // be aligned in host memory to be done atomically.
+        let tracked = mem.tracks_writes();
+        let data: &mut [u8] = &mut mem.data;
+        let usable = !tracked && (data.as_ptr() as usize) % 4 == 0;
+        RawMem { ptr: data.as_mut_ptr(), len: if usable { data.len() } else { 0 } }
+    }
+}
+
+/// A lock-free view of guest RAM. See the module-level documentation.
+pub struct GuestRam {
+    /// Storage for each memory device (indexed like [MemDevice]).
+    mem: [RawMem; 5],
+    /// The physical address decode table, shared with the bus.
+    decode: Arc<[AtomicU64]>,
+    /// Generation of the decode table, shared with the bus.
+    decode_gen: Arc<AtomicU32>,
+    /// Pages with cached code, shared with the bus.
+    code: Arc<[AtomicU64]>,
+    /// Dirty pages for each memory device that tracks them, shared with the
+    /// memory. The first write to each clean page goes through the bus.
+    dirty: [Option<Arc<[AtomicU64]>>; 5],
+    /// Shared with the bus, for other threads to keep the CPU off the fast
+    /// path.
+    gate: Arc<RamGate>,
+    /// True while the CPU is allowed on the fast path (see
+    /// [GuestRam::enter]).
+    enabled: bool,
+    /// Keeps the backing storage alive.
+    _bus: Arc<RwLock<Bus>>,
+}
+
+// SAFETY: see the module-level documentation.
+unsafe impl Send for GuestRam {}
+unsafe impl Sync for GuestRam {}
+
+impl GuestRam {
+    pub fn new(bus: &Arc<RwLock<Bus>>) -> Self {
+        let mut guard = bus.write();
+        let b = &mut *guard;
+        let mem = [
+            RawMem::new(&mut b.mrom),
+            RawMem::new(&mut b.sram0),
+            RawMem::new(&mut b.sram1),
+            RawMem::new(&mut b.mem1),
+            RawMem::new(&mut b.mem2),
+        ];
+        let dirty = [
+            b.mrom.dirty_bits(),
+            b.sram0.dirty_bits(),
+            b.sram1.dirty_bits(),
+            b.mem1.dirty_bits(),
+            b.mem2.dirty_bits(),
+        ];
+        let decode = b.decode.shared();
+        let decode_gen = b.decode.shared_generation();
+        let code = b.code.shared_bits();
+        let gate = b.ram_gate.clone();
+        drop(guard);
+        GuestRam { mem, decode, decode_gen, code, dirty, gate, enabled: false, _bus: bus.clone() }
+    }
+
+    /// Start using the fast path, at the start of a slice, unless another
+    /// thread is accessing guest RAM (in which case every access in the slice
+    /// goes through the bus).
+    pub fn enter(&mut self) {
+        let gate = &self.gate;
+        gate.active.store(true, SeqCst);
+        if gate.waiting.load(SeqCst) != 0 {
+            gate.active.store(false, SeqCst);
+            gate.left.notify();
+            self.enabled = false;
+            return;
+        }
+        self.enabled = true;
+    }
+
+    /// Stop using the fast path, at the end of a slice (or before blocking).
+    pub fn leave(&mut self) {
+        if !self.enabled {
+            return;
+        }
+        self.enabled = false;
+        self.gate.active.store(false, SeqCst);
+        self.gate.left.notify();
+    }
+
+    /// Returns true while the fast path can be used.
+    #[inline(always)]
+    pub fn enabled(&self) -> bool {
+        self.enabled
+    }
+
+    /// Resolve a physical address to some memory device and offset.
+    #[inline(always)]
+    fn resolve(&self, addr: u32) -> Option<(MemDevice, usize)> {
+        if !self.enabled {
+            return None;
+        }
+        DecodeTable::lookup_mem(&self.decode, addr)
+    }
+
+    /// Get a pointer for an aligned access of `size` bytes to some device.
+    #[inline(always)]
+    fn ptr(&self, dev: MemDevice, off: usize, size: usize) -> Option<*mut u8> {
+        let mem = self.mem[dev as usize];
+        if off % size != 0 || off + size > mem.len {
+            return None;
+        }
+        // SAFETY: in bounds of the storage
+        Some(unsafe { mem.ptr.add(off) })
+    }
+
+    /// Returns the generation of the physical memory map. Pointers from
+    /// [GuestRam::page_ptr] are only valid while this stays the same.
+    #[inline(always)]
+    pub fn generation(&self) -> u32 {
+        self.decode_gen.load(Relaxed)
+    }
+
+    /// Get a pointer to the 4KiB page of guest RAM containing some physical
+    /// address, for fetching instructions. Returns [None] if the page isn't
+    /// on the fast path.
+    pub fn page_ptr(&self, addr: u32) -> Option<*mut u8> {
+        if !self.enabled {
+            return None;
+        }
+        let (dev, off) = DecodeTable::lookup_fetch(&self.decode, addr & !0xfff)?;
+        self.ptr(dev, off, 0x1000)
+    }
+
+    /// Read from guest RAM at some physical address. Returns [None] if the
+    /// access needs to go through the bus.
+    #[inline(always)]
+    pub fn read<T: RamWidth>(&self, addr: u32) -> Option<T> {
+        let (dev, off) = self.resolve(addr)?;
+        let ptr = self.ptr(dev, off, size_of::<T>())?;
+        // SAFETY: aligned and in bounds of the storage
+        Some(unsafe { T::load(ptr) })
+    }
+
+    /// Returns true if the 4KiB page at some offset in a device can be
+    /// written through the fast path.
+    #[inline(always)]
+    fn writable(&self, dev: MemDevice, off: usize) -> bool {
+        if dev == MemDevice::MaskRom
+        || CodeTracker::is_cached(&self.code, CodeTracker::key(dev, off)) {
+            return false;
+        }
+        match self.dirty[dev as usize].as_deref() {
+            Some(bits) => DirtyPages::is_dirty(bits, off),
+            None => true,
+        }
+    }
+
+    /// Get a pointer for a run of aligned words, which must not cross a 4KiB
+    /// page.
+    #[inline(always)]
+    fn block_ptr(&self, dev: MemDevice, off: usize, words: usize) -> Option<*mut u8> {
+        let mem = self.mem[dev as usize];
+        if off % 4 != 0 || off + words * 4 > mem.len {
+            return None;
+        }
+        // SAFETY: in bounds of the storage
+        Some(unsafe { mem.ptr.add(off) })
+    }
+
+    /// Write to guest RAM at some physical address. Returns false if the
+    /// access needs to go through the bus.
+    #[inline(always)]
+    pub fn write<T: RamWidth>(&self, addr: u32, val: T) -> bool {
+        let (dev, off) = match self.resolve(addr) {
+            Some(res) => res,
+            None => return false,
+        };
+        if !self.writable(dev, off) {
+            return false;
+        }
+        match self.ptr(dev, off, size_of::<T>()) {
+            Some(ptr) => {
+                // SAFETY: aligned and in bounds of the storage
+                unsafe { T::store(ptr, val) };
+                true
+            },
+            None => false,
+        }
+    }
+}
+
+/// Block transfers, for runs of words that don't cross a 4KiB page. Each run
+/// is either entirely on the fast path or not at all.
+impl GuestRam {
+    /// Read consecutive words from guest RAM at some physical address.
+    /// Returns false if the run needs to go through the bus.
+    #[inline(always)]
+    pub fn read_block(&self, addr: u32, vals: &mut [u32]) -> bool {
+        let Some((dev, off)) = self.resolve(addr) else {
+            return false;
+        };
+        let Some(ptr) = self.block_ptr(dev, off, vals.len()) else {
+            return false;
+        };
+        for (idx, val) in vals.iter_mut().enumerate() {
+            // SAFETY: aligned and in bounds of the storage
+            *val = unsafe { u32::load(ptr.add(idx * 4)) };
+        }
+        true
+    }
+
+    /// Write consecutive words to guest RAM at some physical address.
+    /// Returns false if the run needs to go through the bus.
+    #[inline(always)]
+    pub fn write_block(&self, addr: u32, vals: &[u32]) -> bool {
+        let Some((dev, off)) = self.resolve(addr) else {
+            return false;
+        };
+        if !self.writable(dev, off) {
+            return false;
+        }
+        let Some(ptr) = self.block_ptr(dev, off, vals.len()) else {
+            return false;
+        };
+        for (idx, val) in vals.iter().enumerate() {
+            // SAFETY: aligned and in bounds of the storage
+            unsafe { u32::store(ptr.add(idx * 4), *val) };
+        }
+        true
+    }
+}
+
+impl Bus {
+    /// Called after changing [Bus::rom_disabled] or [Bus::mirror_enabled].
+    pub fn remap(&mut self) {
+        self.decode.remap(self.rom_disabled, self.mirror_enabled);
+        self.code.notify_remap();
+    }
+}
@@ -4,6 +4,8 @@ use anyhow::bail;
 use crate::bus::*;
 use crate::bus::prim::*;
 use crate::bus::task::*;
+use crate::dev::hlwd::TimerInterface;
+use crate::metrics::METRICS;
 
 /// Interface used by the bus to perform some access on an I/O device.
 pub trait MmioDevice {
@@ -20,6 +22,7 @@ impl Bus {
     /// Dispatch a physical read access to some memory-mapped I/O device.
     pub fn do_mmio_read(&self, dev: IoDevice, off: usize, width: BusWidth) -> anyhow::Result<BusPacket> {
         use IoDevice::*;
+        METRICS.mmio_read(dev);
         match (width, dev) {
             (BusWidth::W, Nand)  => self.nand.read(off),
             (BusWidth::W, Aes)   => self.aes.read(off),
@@ -30,6 +33,9 @@ impl Bus {
             (BusWidth::W, Sdhc0) => self.sd0.read(off),
             (BusWidth::W, Sdhc1) => self.sd1.read(off),
 
+            (BusWidth::W, Hlwd) if off == 0x010 => {
+                Ok(BusPacket::Word(TimerInterface::value(self.cycle)))
+            },
             (BusWidth::W, Hlwd)  => self.hlwd.read(off),
             (BusWidth::W, Ahb)   => self.hlwd.ahb.read(off),
             (BusWidth::W, Di)    => self.hlwd.di.read(off),
@@ -44,6 +50,7 @@ impl Bus {
     pub fn do_mmio_write(&mut self, dev: IoDevice, off: usize, msg: BusPacket) -> anyhow::Result<()> {
         use IoDevice::*;
         use BusPacket::*;
+        METRICS.mmio_write(dev);
         let task = match (msg, dev) {
             (Word(val), Nand)  => self.nand.write(off, val),
             (Word(val), Aes)   => self.aes.write(off, val),
@@ -64,11 +71,12 @@ impl Bus {
 
             _ => { bail!("Unsupported write {msg:?} for {dev:?} at {off:x}"); },
         };
+        self.publish_ppc_irq();
         match task {
             // If the device returned some task, schedule it
             Ok(task) => {
                 if let Some(t) = task {
-                    self.tasks.push(Task { kind: t, target_cycle: self.cycle }); // All types get scheduled on this cycle
+                    self.tasks.push(Task { kind: t, target_cycle: self.cycle }); // All types get scheduled on the next step
                     Ok(())
                 }
                 else {Ok(())}
@@ -79,34 +87,70 @@ impl Bus {
 }
 
 
+/// Maximum number of cycles between bus steps. This bounds the time taken to
+/// notice changes that don't schedule anything on the bus (i.e. IPC requests
+/// from the PPC side).
+pub const MAX_SLICE_CYCLES: usize = 0x400;
+
 impl Bus {
     /// Emulate a slice of work on the system bus.
-    pub fn step(&mut self, cpu_cycle: usize) -> anyhow::Result<()> {
-        self.handle_step_hlwd(cpu_cycle)?;
-        if !self.tasks.is_empty() {
-            self.drain_tasks()?;
-        }
+    pub fn step(&mut self) -> anyhow::Result<()> {
+        self.handle_step_hlwd()?;
+        self.drain_tasks()?;
+        self.publish_ppc_irq();
         self.cycle += 1;
         Ok(())
     }
 
+    /// Number of cycles that the CPU can run for, after the last step, until
+    /// a step with scheduled work is due. This is always at least 1, and at
+    /// most [MAX_SLICE_CYCLES].
+    pub fn cycles_until_event(&self) -> usize {
+        match self.tasks.next_due() {
+            Some(due) => (due + 1).saturating_sub(self.cycle).clamp(1, MAX_SLICE_CYCLES),
+            None => MAX_SLICE_CYCLES,
+        }
+    }
+
+    /// Emulate the bus steps up until some cycle, only doing work on the
+    /// steps where something is scheduled. Changes to IPC state made by the
+    /// PPC side in the meantime are picked up on the next full step.
+    pub fn catch_up(&mut self, end: usize) -> anyhow::Result<()> {
+        while self.cycle < end {
+            match self.tasks.next_due() {
+                Some(due) if due < end => {
+                    self.cycle = self.cycle.max(due);
+                    self.drain_tasks()?;
+                    self.cycle += 1;
+                },
+                _ => self.cycle = end,
+            }
+        }
+        self.publish_ppc_irq();
+        Ok(())
+    }
+
     /// Dispatch all of the pending tasks on the Bus.
     fn drain_tasks(&mut self) -> anyhow::Result<()> {
-        let mut idx = 0;
-        while idx != self.tasks.len() {
-            if self.tasks[idx].target_cycle <= self.cycle {
-                let task = self.tasks.remove(idx);
-                match task.kind {
-                    BusTask::Nand(x) => self.handle_task_nand(x)?,
-                    BusTask::Aes(x) => self.handle_task_aes(x)?,
-                    BusTask::Sha(x) => self.handle_task_sha(x)?,
-                    BusTask::Mi{kind, data} => self.handle_task_mi(kind, data)?,
-                    BusTask::SetRomDisabled(x) => self.rom_disabled = x,
-                    BusTask::SetMirrorEnabled(x) => self.mirror_enabled = x,
-                    BusTask::SDHC(task) => self.handle_task_sdhc(task),
-                }
-            } else {
-                idx += 1;
+        while let Some(kind) = self.tasks.pop_due(self.cycle) {
+            let _timer = METRICS.start_task(&kind);
+            match kind {
+                BusTask::Nand(x) => self.handle_task_nand(x)?,
+                BusTask::Aes(x) => self.handle_task_aes(x)?,
+                BusTask::Sha(x) => self.handle_task_sha(x)?,
+                BusTask::Mi{kind, data} => self.handle_task_mi(kind, data)?,
+                BusTask::SetRomDisabled(x) => {
+                    self.rom_disabled = x;
+                    self.remap();
+                },
+                BusTask::SetMirrorEnabled(x) => {
+                    self.mirror_enabled = x;
+                    self.remap();
+                },
+                BusTask::ScheduleAlarm => self.schedule_alarm(),
+                BusTask::Alarm(alarm_gen) => self.handle_alarm(alarm_gen),
+                BusTask::SDHC(task) => self.handle_task_sdhc(task)?,
+                BusTask::Offloaded(engine, x) => self.handle_task_offloaded(engine, x)?,
             }
         }
         Ok(())
@@ -0,0 +1,74 @@
+//! Wakeups between the threads sharing the bus.
+//!
+//! The PPC HLE thread waits for the PPC IRQ line, and the ARM core idles
+//! until the PPC side changes something. Rather than polling the bus (and
+//! taking its lock) on a timer, each of them waits on a [Notifier].
+
+use std::time::Duration;
+
+use parking_lot::{Condvar, Mutex};
+
+use crate::bus::Bus;
+
+/// Wakes up threads waiting for something to happen.
+///
+/// Each notification bumps a sequence number. Waiters remember the last one
+/// they've seen, so that a notification between checking for some condition
+/// and starting to wait is never missed.
+#[derive(Default)]
+pub struct Notifier {
+    seq: Mutex<u64>,
+    cond: Condvar,
+}
+
+impl Notifier {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Wake up everyone waiting.
+    pub fn notify(&self) {
+        *self.seq.lock() += 1;
+        self.cond.notify_all();
+    }
+
+    /// The current sequence number.
+    pub fn seq(&self) -> u64 {
+        *self.seq.lock()
+    }
+
+    /// Block until a notification after `seen`, or until some timeout has
+    /// passed. Returns the new sequence number.
+    pub fn wait(&self, seen: u64, timeout: Option<Duration>) -> u64 {
+        let mut seq = self.seq.lock();
+        while *seq == seen {
+            match timeout {
+                Some(timeout) => {
+                    if self.cond.wait_for(&mut seq, timeout).timed_out() {
+                        break;
+                    }
+                },
+                None => self.cond.wait(&mut seq),
+            }
+        }
+        *seq
+    }
+}
+
+impl Bus {
+    /// Notify the PPC side if the PPC IRQ line has been raised since the
+    /// last call. Called whenever the line might have changed.
+    pub fn publish_ppc_irq(&mut self) {
+        let line = self.hlwd.irq.ppc_irq_output;
+        if line && !self.ppc_irq_raised {
+            self.ppc_irq_notify.notify();
+        }
+        self.ppc_irq_raised = line;
+    }
+
+    /// Recompute the IRQ lines after changing IRQ state from the PPC side.
+    pub fn update_ppc_irq(&mut self) {
+        self.hlwd.irq.update_irq_lines();
+        self.publish_ppc_irq();
+    }
+}
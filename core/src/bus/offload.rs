@@ -0,0 +1,245 @@
+//! Running large AES and SHA commands on other threads.
+//!
+//! Both engines work by DMA: the guest starts a command, carries on, and
+//! gets an IRQ (or sees the busy bit in `ctrl` go away) when it's done.
+//! Hashing and encryption commands of at least [OFFLOAD_BYTES] are sent to a
+//! worker thread for each engine when they start, and complete
+//! [CYCLES_PER_BLOCK] bus cycles per 16 bytes later. The CPU keeps running in
+//! the meantime, so the host time spent on them runs on another core.
+//!
+//! Everything else completes straight away, since handing it off costs more
+//! than doing it. Waking a worker takes about 3us on the CPU thread, and the
+//! input and output are copied (about 0.1us per 4KiB). With SHA-NI and
+//! AES-NI, 4KiB takes about 4us to hash, 3us to encrypt, but only 0.4us to
+//! decrypt (CBC decryption runs blocks in parallel), so even the largest
+//! decryption (64KiB, 8us) isn't worth offloading.
+//!
+//! SDHC and NAND transfers aren't offloaded either: they're a copy between
+//! guest RAM and the card or NAND image, which a worker would need a copy of
+//! anyway (and NAND commands depend on the one before being done).
+//!
+//! Workers never touch guest memory: the input is copied out when a command
+//! starts, and the output is written back on the CPU thread when it
+//! completes (waiting for the worker, if it isn't done yet). The source and
+//! destination belong to the engine in the meantime, like on hardware. When
+//! a command completes only depends on its length, so emulation stays
+//! deterministic.
+
+use std::sync::Arc;
+use std::sync::mpsc::{self, Sender};
+
+use anyhow::bail;
+use bincode::{Decode, Encode};
+use log::error;
+use parking_lot::{Condvar, Mutex, MutexGuard};
+
+use crate::bus::Bus;
+use crate::bus::task::*;
+use crate::dev::aes::aes_cbc;
+use crate::dev::sha::util::Sha1State;
+use crate::snapshot::{get, put, Snapshot};
+
+/// SHA and AES encryption commands at least this long are run by a worker.
+pub const OFFLOAD_BYTES: usize = 0x4000;
+
+/// Time taken by the engines for each 16 bytes of an offloaded command, in
+/// bus cycles (about 25MB/s, like SDHC DMA).
+pub const CYCLES_PER_BLOCK: usize = 160;
+
+/// A DMA engine that runs commands on a worker.
+#[derive(Clone, Copy, Debug, PartialEq, Eq, Encode, Decode)]
+pub enum Engine { Aes, Sha }
+
+/// Some work for a worker, along with a copy of its input.
+pub enum Job {
+    Aes { cipher: aes::Aes128, iv: [u8; 0x10], decrypt: bool, data: Vec<u8> },
+    Sha { state: Sha1State, data: Vec<u8> },
+}
+
+/// The result of a [Job].
+#[derive(Clone, Encode, Decode)]
+pub enum JobOutput {
+    /// The output, and the last 16 bytes of input (for the IV buffer).
+    Aes { data: Vec<u8>, last: [u8; 0x10] },
+    Sha(Sha1State),
+}
+
+impl Job {
+    fn run(self) -> JobOutput {
+        match self {
+            Job::Aes { cipher, iv, decrypt, mut data } => {
+                let mut last = [0u8; 0x10];
+                last.copy_from_slice(&data[data.len() - 0x10..]);
+                aes_cbc(cipher, &iv, decrypt, &mut data);
+                JobOutput::Aes { data, last }
+            },
+            Job::Sha { mut state, data } => {
+                state.update(&data);
+                JobOutput::Sha(state)
+            },
+        }
+    }
+}
+
+/// Where a worker leaves the result of a job.
+#[derive(Default)]
+struct Slot {
+    out: Mutex<Option<JobOutput>>,
+    done: Condvar,
+}
+impl Slot {
+    fn ready(out: JobOutput) -> Arc<Self> {
+        Arc::new(Slot { out: Mutex::new(Some(out)), done: Condvar::new() })
+    }
+
+    fn fill(&self, out: JobOutput) {
+        *self.out.lock() = Some(out);
+        self.done.notify_one();
+    }
+
+    /// Wait for the result.
+    fn wait(&self) -> MutexGuard<'_, Option<JobOutput>> {
+        let mut out = self.out.lock();
+        while out.is_none() {
+            self.done.wait(&mut out);
+        }
+        out
+    }
+}
+
+/// A command that an engine is busy with.
+struct InFlight {
+    slot: Arc<Slot>,
+    /// The cycle that the command completes on.
+    due: usize,
+}
+
+/// The workers, and the commands they're busy with.
+#[derive(Default)]
+pub struct Offload {
+    /// Started on the first command for each engine (or by
+    /// [Offload::start_workers]).
+    workers: [Option<Sender<(Job, Arc<Slot>)>>; 2],
+    busy: [Option<InFlight>; 2],
+}
+
+impl Offload {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// The cycle that some engine's current command completes on, if it's
+    /// busy with one.
+    pub fn busy_until(&self, engine: Engine) -> Option<usize> {
+        self.busy[engine as usize].as_ref().map(|f| f.due)
+    }
+
+    /// Start the workers for both engines now, instead of on their first
+    /// command. Threads inherit the CPU affinity of the thread that starts
+    /// them, so this lets them run elsewhere when the CPU thread is pinned.
+    pub fn start_workers(&mut self) {
+        for engine in [Engine::Aes, Engine::Sha] {
+            let worker = &mut self.workers[engine as usize];
+            if worker.is_none() {
+                *worker = spawn_worker(engine);
+            }
+        }
+    }
+
+    fn submit(&mut self, engine: Engine, job: Job, due: usize) {
+        let slot = Arc::new(Slot::default());
+        let worker = &mut self.workers[engine as usize];
+        if worker.is_none() {
+            *worker = spawn_worker(engine);
+        }
+        let job = match worker {
+            Some(tx) => match tx.send((job, slot.clone())) {
+                Ok(()) => None,
+                Err(mpsc::SendError((job, _))) => Some(job),
+            },
+            None => Some(job),
+        };
+        // Without a worker, just do the work now.
+        if let Some(job) = job {
+            slot.fill(job.run());
+        }
+        self.busy[engine as usize] = Some(InFlight { slot, due });
+    }
+
+    /// Take the result of some engine's current command, waiting for it if
+    /// needed.
+    fn take(&mut self, engine: Engine) -> Option<JobOutput> {
+        let inflight = self.busy[engine as usize].take()?;
+        inflight.slot.wait().take()
+    }
+}
+
+fn spawn_worker(engine: Engine) -> Option<Sender<(Job, Arc<Slot>)>> {
+    let (tx, rx) = mpsc::channel::<(Job, Arc<Slot>)>();
+    let res = std::thread::Builder::new().name(format!("{engine:?}Worker")).spawn(move || {
+        while let Ok((job, slot)) = rx.recv() {
+            slot.fill(job.run());
+        }
+    });
+    match res {
+        Ok(_) => Some(tx),
+        Err(err) => {
+            error!(target: "Other", "Failed to start {engine:?} worker, running commands inline: {err}");
+            None
+        },
+    }
+}
+
+/// Commands in flight are saved along with their results, so that they
+/// complete the same way after restoring.
+impl Snapshot for Offload {
+    fn save(&self, w: &mut dyn std::io::Write) -> anyhow::Result<()> {
+        let busy: Vec<Option<(usize, JobOutput)>> = self.busy.iter().map(|f| f.as_ref().map(|f| {
+            (f.due, f.slot.wait().clone().unwrap())
+        })).collect();
+        put(w, &busy)
+    }
+    fn restore(&mut self, r: &mut dyn std::io::Read) -> anyhow::Result<()> {
+        let busy: Vec<Option<(usize, JobOutput)>> = get!(r);
+        for (dst, saved) in self.busy.iter_mut().zip(busy) {
+            *dst = saved.map(|(due, out)| InFlight { slot: Slot::ready(out), due });
+        }
+        Ok(())
+    }
+}
+
+impl Bus {
+    /// Send some command off to a worker. It completes with
+    /// [BusTask::Offloaded] once the engine would be done with it.
+    pub(crate) fn start_offload(&mut self, engine: Engine, val: u32, len: usize, job: Job) {
+        let due = self.cycle + (len / 0x10) * CYCLES_PER_BLOCK;
+        self.offload.submit(engine, job, due);
+        self.tasks.push(Task { kind: BusTask::Offloaded(engine, val), target_cycle: due });
+    }
+
+    /// If some engine is still busy, put off starting a command until it's
+    /// done. Returns true if the command was put off.
+    pub(crate) fn defer_while_busy(&mut self, engine: Engine, task: BusTask) -> bool {
+        match self.offload.busy_until(engine) {
+            Some(due) => {
+                self.tasks.push(Task { kind: task, target_cycle: due });
+                true
+            },
+            None => false,
+        }
+    }
+
+    /// Write back the result of an offloaded command and complete it.
+    pub fn handle_task_offloaded(&mut self, engine: Engine, val: u32) -> anyhow::Result<()> {
+        let Some(out) = self.offload.take(engine) else {
+            bail!("{engine:?} command {val:08x} completed, but wasn't in flight");
+        };
+        match out {
+            JobOutput::Aes { data, last } => self.complete_aes_job(val, &data, last),
+            JobOutput::Sha(state) => {
+                self.complete_sha_job(val, state);
+                Ok(())
+            },
+        }
+    }
+}
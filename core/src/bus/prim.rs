@@ -50,14 +50,14 @@ impl_accesswidth!(u8);
 
 
 /// Handle to a target for some physical memory access.
-#[derive(Debug, Clone, Copy)]
+#[derive(Debug, Clone, Copy, PartialEq)]
 pub struct DeviceHandle {
     pub dev: Device,
     pub mask: u32,
 }
 
 /// Some kind of target device for a physical memory access.
-#[derive(Debug, Clone, Copy)]
+#[derive(Debug, Clone, Copy, PartialEq)]
 pub enum Device { Mem(MemDevice), Io(IoDevice) }
 
 /// Different kinds of memory devices that support physical memory accesses.
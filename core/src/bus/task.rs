@@ -1,12 +1,17 @@
+use std::cmp::Ordering;
+use std::collections::BinaryHeap;
+use bincode::{Decode, Encode};
+
 use super::SDHCTask;
+use super::offload::Engine;
 
 
 /// Some type of indirect access (from memory interface to the DDR interface).
-#[derive(Debug)]
+#[derive(Debug, Encode, Decode)]
 pub enum IndirAccess { Read, Write }
 
 /// Representing some device and piece of work to-be-completed by the bus.
-#[derive(Debug)]
+#[derive(Debug, Encode, Decode)]
 pub enum BusTask {
     /// A NAND interface command.
     Nand(u32),
@@ -20,16 +25,96 @@ pub enum BusTask {
     /// Change the state of the SRAM mappings
     SetMirrorEnabled(bool),
 
+    /// The alarm register was written, and the alarm needs to be scheduled.
+    ScheduleAlarm,
+    /// The timer has reached the alarm value. Alarms from before the last
+    /// write to the alarm register (with an older generation) are ignored.
+    Alarm(u32),
+
     /// A read/write access request on the DDR interface.
     Mi { kind: IndirAccess, data: u16 },
 
     // SD Host Controller
     SDHC(SDHCTask),
+
+    /// An AES/SHA command (with the given `ctrl` value) that was sent to a
+    /// worker is done (see [crate::bus::offload]).
+    Offloaded(Engine, u32),
 }
 
 /// An entry kept by the [Bus], representing some task to-be-completed.
+#[derive(Encode, Decode)]
 pub struct Task {
     pub kind: BusTask,
     pub target_cycle: usize,
 }
 
+/// A task in a [Scheduler].
+#[derive(Encode, Decode)]
+struct Entry {
+    task: Task,
+    /// Order in which the task was scheduled.
+    seq: u64,
+}
+impl Entry {
+    fn key(&self) -> (usize, u64) {
+        (self.task.target_cycle, self.seq)
+    }
+}
+impl PartialEq for Entry {
+    fn eq(&self, other: &Self) -> bool {
+        self.key() == other.key()
+    }
+}
+impl Eq for Entry {}
+impl PartialOrd for Entry {
+    fn partial_cmp(&self, other: &Self) -> Option<Ordering> {
+        Some(self.cmp(other))
+    }
+}
+impl Ord for Entry {
+    /// Reversed, so that the earliest task is at the top of the heap.
+    fn cmp(&self, other: &Self) -> Ordering {
+        other.key().cmp(&self.key())
+    }
+}
+
+/// A queue of tasks, ordered by the cycle they're due on.
+///
+/// Tasks due on the same cycle are completed in the order they were
+/// scheduled.
+#[derive(Default, Encode, Decode)]
+pub struct Scheduler {
+    heap: BinaryHeap<Entry>,
+    /// Sequence number for the next task.
+    seq: u64,
+}
+impl Scheduler {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Schedule some task.
+    pub fn push(&mut self, task: Task) {
+        self.heap.push(Entry { task, seq: self.seq });
+        self.seq += 1;
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.heap.is_empty()
+    }
+
+    /// The cycle that the next task is due on.
+    pub fn next_due(&self) -> Option<usize> {
+        self.heap.peek().map(|e| e.task.target_cycle)
+    }
+
+    /// Take the next task due on or before some cycle.
+    pub fn pop_due(&mut self, cycle: usize) -> Option<BusTask> {
+        if self.next_due()? <= cycle {
+            self.heap.pop().map(|e| e.task.kind)
+        } else {
+            None
+        }
+    }
+}
@@ -0,0 +1,106 @@
+//! Watchpoints on guest memory, for debuggers.
+//!
+//! Watchpoints are kept by physical address. Each page (of the
+//! [crate::bus::decode::DecodeTable]) with a watchpoint is taken off the fast
+//! path into guest RAM, so that loads and stores to it go through the bus
+//! and are checked there (see [crate::cpu::Cpu::read32]). Accesses to every
+//! other page cost as much as they do without a debugger.
+//!
+//! Instruction fetches and DMA don't trigger watchpoints, and neither do
+//! accesses through other aliases of the same memory.
+
+use std::ops::RangeInclusive;
+
+use crate::bus::Bus;
+
+/// The kind of access that triggers a watchpoint.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum WatchKind { Write, Read, Access }
+
+impl WatchKind {
+    fn matches(self, write: bool) -> bool {
+        match self {
+            WatchKind::Write => write,
+            WatchKind::Read => !write,
+            WatchKind::Access => true,
+        }
+    }
+}
+
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub struct Watchpoint {
+    /// The (virtual) address that the debugger asked for.
+    pub vaddr: u32,
+    /// Where `vaddr` was mapped when the watchpoint was set.
+    pub paddr: u32,
+    pub len: u32,
+    pub kind: WatchKind,
+}
+
+impl Watchpoint {
+    /// The decode table pages covered by the watchpoint.
+    fn pages(&self) -> RangeInclusive<u32> {
+        let last = self.paddr.saturating_add(self.len.max(1) - 1);
+        (self.paddr >> 16)..=(last >> 16)
+    }
+}
+
+/// Every watchpoint on the bus.
+#[derive(Default)]
+pub struct WatchList {
+    list: Vec<Watchpoint>,
+}
+
+impl WatchList {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    #[inline(always)]
+    pub fn is_empty(&self) -> bool {
+        self.list.is_empty()
+    }
+
+    /// Find a watchpoint triggered by some access.
+    pub fn hit(&self, paddr: u32, len: u32, write: bool) -> Option<Watchpoint> {
+        let end = paddr as u64 + len as u64;
+        self.list.iter().find(|wp| {
+            wp.kind.matches(write) && (paddr as u64) < wp.paddr as u64 + wp.len as u64
+            && (wp.paddr as u64) < end
+        }).copied()
+    }
+}
+
+impl Bus {
+    pub fn add_watchpoint(&mut self, wp: Watchpoint) {
+        for page in wp.pages() {
+            self.decode.set_watched(page, true);
+        }
+        self.watchpoints.list.push(wp);
+    }
+
+    /// Remove the watchpoint on some (virtual) address. Returns false if
+    /// there wasn't one.
+    pub fn remove_watchpoint(&mut self, vaddr: u32, len: u32, kind: WatchKind) -> bool {
+        let list = &mut self.watchpoints.list;
+        let Some(idx) = list.iter().position(|wp| wp.vaddr == vaddr && wp.len == len && wp.kind == kind) else {
+            return false;
+        };
+        let wp = list.remove(idx);
+        for page in wp.pages() {
+            if !list.iter().any(|other| other.pages().contains(&page)) {
+                self.decode.set_watched(page, false);
+            }
+        }
+        true
+    }
+
+    /// Remove every watchpoint.
+    pub fn clear_watchpoints(&mut self) {
+        for wp in std::mem::take(&mut self.watchpoints.list) {
+            for page in wp.pages() {
+                self.decode.set_watched(page, false);
+            }
+        }
+    }
+}
@@ -6,11 +6,15 @@ pub mod psr;
 pub mod mmu;
 pub mod alu;
 
+use std::cell::Cell;
 use std::sync::Arc;
 use parking_lot::RwLock;
 
 use crate::bus::*;
+use crate::bus::fastmem::GuestRam;
+use crate::bus::watch::Watchpoint;
 use crate::cpu::excep::*;
+use crate::dbg::profile::SharedProfile;
 
 /// Result after exiting the emulated CPU.
 pub enum CpuRes {
@@ -27,6 +31,10 @@ pub enum CpuRes {
 /// Container for ARMv5-compatible CPU state.
 pub struct Cpu {
     pub bus: Arc<RwLock<Bus>>,
+    /// Lock-free access to guest RAM.
+    pub ram: GuestRam,
+    /// Pointer to the current page of code.
+    pub fetch: mmu::fetch::FetchWindow,
     /// The CPU's register file.
     pub reg: reg::RegisterFile,
     /// The system control co-processor.
@@ -37,23 +45,85 @@ pub struct Cpu {
     pub scratch: u32,
     pub dbg_on: bool,
 
+    /// Number of CPU cycles elapsed (one for each instruction).
+    pub cycle: usize,
     /// Whether or not an interrupt request is currently asserted.
     pub irq_input: bool,
+    /// Set when the CPU is waiting for an interrupt. Backends skip ahead in
+    /// time (instead of executing instructions) until the IRQ line is
+    /// asserted.
+    pub halted: bool,
+    /// Set when the CPU writes to the bus through the slow path, which may
+    /// have scheduled work on the bus (or changed the state of the IRQ
+    /// line), or hits a watchpoint. Backends complete a bus step before the
+    /// next instruction.
+    pub bus_sync: Cell<bool>,
+    /// The virtual address of the last load or store, when tracing.
+    pub last_access: Cell<Option<u32>>,
+    /// Set while a trace is being kept, so that loads and stores record
+    /// [Cpu::last_access] (they always do when `dbg_on` is set).
+    pub trace_access: bool,
+    /// The last watchpoint hit by a load or store, until a debugger takes it.
+    pub watch_hit: Cell<Option<Watchpoint>>,
+
+    /// The profiler, if guest code is being profiled.
+    pub profile: Option<SharedProfile>,
+    /// The cycle at which the profiler takes its next sample.
+    pub profile_next: usize,
 }
 impl Cpu {
     pub fn new(bus: Arc<RwLock<Bus>>) -> Self {
         Cpu {
+            ram: GuestRam::new(&bus),
+            fetch: mmu::fetch::FetchWindow::new(),
             bus,
             reg: reg::RegisterFile::new(),
             p15: coproc::SystemControl::new(),
             scratch: 0,
+            cycle: 0,
             irq_input: false,
+            halted: false,
+            bus_sync: Cell::new(false),
+            last_access: Cell::new(None),
+            trace_access: false,
+            watch_hit: Cell::new(None),
             current_exception: None,
             dbg_on: false,
+            profile: None,
+            profile_next: usize::MAX,
         }
     }
+
+    /// Start sampling guest code into some profile.
+    pub fn attach_profile(&mut self, profile: SharedProfile) {
+        self.profile_next = self.cycle + profile.lock().interval;
+        self.profile = Some(profile);
+    }
+
+    /// Take a profiler sample. Backends call this once `cycle` has reached
+    /// `profile_next`.
+    pub fn sample_profile(&mut self) {
+        let Some(profile) = &self.profile else {
+            self.profile_next = usize::MAX;
+            return;
+        };
+        let mut profile = profile.lock();
+        // Running far past the sample point means the CPU was halted, and
+        // that time doesn't belong to whatever code happens to run next.
+        if self.cycle - self.profile_next < profile.interval {
+            profile.sample(self.read_fetch_pc(), self.reg[reg::Reg::Lr]);
+        }
+        self.profile_next = self.cycle + profile.interval;
+    }
 }
 
+// Snapshots are taken between instructions, so there's never a pending bus
+// sync to save.
+crate::snapshot::impl_snapshot!(Cpu,
+    encode: [reg, current_exception, scratch, cycle, irq_input, halted],
+    nested: [p15],
+);
+
 /// Helper functions/conventions for transforming CPU state.
 impl Cpu {
     /// Read the program counter (from the context of the fetch stage).
@@ -166,6 +166,18 @@ pub fn shift_by_imm(rm: u32, sop: u32, simm: u32, c_in: bool) -> (u32, bool) {
     }
 }
 
+/// Shift the value of Rm by some immediate, where the shift type is known
+/// at compile-time (see [shift_by_imm]).
+#[inline(always)]
+pub fn shift_imm<const STYPE: u32>(rm: u32, simm: u32, c_in: bool) -> (u32, bool) {
+    match STYPE {
+        0b00 => lsl(rm, (simm & 0xff) as u8, c_in),
+        0b01 => lsr_imm(rm, (simm & 0xff) as u8, c_in),
+        0b10 => asr_imm(rm, (simm & 0xff) as u8, c_in),
+        _ => ror_imm(rm, (simm & 0xff) as u8, c_in),
+    }
+}
+
 /// Shift the value of Rm by the value of Rs.
 pub fn shift_by_reg(rm: u32, sop: u32, rs: u32, c_in: bool) -> (u32, bool) {
     use ShiftType::*;
@@ -1,13 +1,11 @@
 //! Coprocessor register definitions and functionality.
 
-use std::{cell::RefCell, collections::HashMap, sync::Arc, hash::BuildHasherDefault};
-use parking_lot::RwLock;
-
-use crate::bus::Bus;
-use fxhash::FxHasher32;
+use crate::cpu::mmu::tlb::SoftTlb;
+use crate::snapshot::{get, put, Snapshot};
+use bincode::{Decode, Encode};
 
 /// The system control register (p15 register 1).
-#[derive(Copy, Clone)]
+#[derive(Copy, Clone, Encode, Decode)]
 #[repr(transparent)]
 pub struct ControlRegister(pub u32);
 impl ControlRegister {
@@ -24,7 +22,7 @@ impl ControlRegister {
 }
 
 /// Domain access control register (DACR).
-#[derive(Copy, Clone)]
+#[derive(Copy, Clone, Encode, Decode)]
 #[repr(transparent)]
 pub struct DACRegister(pub u32);
 impl DACRegister {
@@ -106,8 +104,34 @@ pub struct SystemControl {
     pub c5_ifsr: u32,
     /// Fault address register (data)
     pub c6_dfar: u32,
-    /// Holds a cache of L1 MMU translations
-    l1_tlb: RefCell<HashMap<u32, u32, BuildHasherDefault<FxHasher32>>>,
+    /// Holds a cache of complete MMU translations
+    pub tlb: Box<SoftTlb>,
+    /// Set by a wait-for-interrupt operation, until the CPU is halted.
+    pub wait_for_interrupt: bool,
+}
+
+/// The TLB isn't saved, it's flushed on restore.
+impl Snapshot for SystemControl {
+    fn save(&self, w: &mut dyn std::io::Write) -> anyhow::Result<()> {
+        put(w, &self.c1_ctrl)?;
+        put(w, &self.c2_ttbr0)?;
+        put(w, &self.c3_dacr)?;
+        put(w, &self.c5_dfsr)?;
+        put(w, &self.c5_ifsr)?;
+        put(w, &self.c6_dfar)?;
+        put(w, &self.wait_for_interrupt)
+    }
+    fn restore(&mut self, r: &mut dyn std::io::Read) -> anyhow::Result<()> {
+        self.c1_ctrl = get!(r);
+        self.c2_ttbr0 = get!(r);
+        self.c3_dacr = get!(r);
+        self.c5_dfsr = get!(r);
+        self.c5_ifsr = get!(r);
+        self.c6_dfar = get!(r);
+        self.wait_for_interrupt = get!(r);
+        self.clear_tlb();
+        Ok(())
+    }
 }
 
 impl Default for SystemControl {
@@ -125,7 +149,8 @@ impl SystemControl {
             c5_dfsr: 0,
             c5_ifsr: 0,
             c6_dfar: 0,
-            l1_tlb: RefCell::new(HashMap::with_hasher(BuildHasherDefault::<FxHasher32>::default())),
+            tlb: Box::new(SoftTlb::new()),
+            wait_for_interrupt: false,
         }
     }
 
@@ -189,6 +214,7 @@ impl SystemControl {
 
             AccessControl => match (crm, opcd2) {
                 (0, 0) => {
+                    self.clear_tlb(); // Cached entries were validated against the old domains
                     self.c3_dacr = DACRegister(val);
                 },
                 _ => panic!("Unimpl P15 write {:08x} {:?} crm={} opcd2={}",
@@ -209,7 +235,7 @@ impl SystemControl {
 
             CacheControl => match (crm, opcd2) {
                 (0, 4) => { // wait for interrupt
-                    // This isn't implemented currently. Since interrupts are serviced immediately, we should be able to no-op right?
+                    self.wait_for_interrupt = true;
                 },
                 (5, 0) => {}, // Invalidate entire icache
                 (6, 0) => {}, // Invalidate entire dcache
@@ -242,22 +268,7 @@ impl SystemControl {
         self.c2_ttbr0
     }
 
-    /// Perform the actual L1 lookup
-    /// Technically this is an MMU operation, but having it here is easier for now.
-    pub fn l1_fetch(&self, addr: u32, bus: &Arc<RwLock<Bus>>) -> anyhow::Result<u32> {
-        let mut tlb_inner = self.l1_tlb.borrow_mut();
-        let val = match tlb_inner.get(&addr) {
-            Some(val) => *val, // TLB hit
-            None => { // miss
-                let val = bus.read().read32(addr)?;
-                tlb_inner.insert(addr, val);
-                val
-            },
-        };
-        Ok(val)
-    }
-
     pub fn clear_tlb(&self) {
-        self.l1_tlb.borrow_mut().clear();
+        self.tlb.flush();
     }
 }
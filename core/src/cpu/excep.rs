@@ -1,13 +1,15 @@
 //! Implementation of exception behavior.
 
 use anyhow::bail;
+use bincode::{Decode, Encode};
 
 use crate::cpu::*;
 use crate::dbg::ios;
+use crate::metrics::METRICS;
 use crate::cpu::reg::*;
 
 /// Different types of exceptions.
-#[derive(Debug, Clone, Copy, PartialEq)]
+#[derive(Debug, Clone, Copy, PartialEq, Encode, Decode)]
 pub enum ExceptionType {
     //Reset,
     Undef(u32),
@@ -75,7 +77,7 @@ impl Cpu {
 
     /// Change CPU state to reflect the fact that we've entered an exception.
     pub fn generate_exception(&mut self, e: ExceptionType) -> anyhow::Result<()> {
-        let old_cpsr = self.reg.cpsr;
+        let old_cpsr = self.reg.cpsr.get();
         let target_mode = CpuMode::from(e);
         let target_pc = ExceptionType::get_vector(e);
 
@@ -83,8 +85,13 @@ impl Cpu {
         let return_pc = self.read_fetch_pc().wrapping_add(
             ExceptionType::get_pc_off(e, self.reg.cpsr.thumb()));
 
+        METRICS.exception(e);
         if let ExceptionType::Undef(opcd) = e {
             ios::log_syscall(self, opcd);
+            if let Some(profile) = &self.profile
+            && let Some(idx) = ios::syscall_idx(opcd) {
+                profile.lock().syscall(idx);
+            }
         }
 
 
@@ -1,51 +1,260 @@
 //! Implementation of the memory-management unit.
 
+pub mod fetch;
 pub mod prim;
+pub mod tlb;
 
 use crate::cpu::mmu::prim::*;
+use crate::cpu::mmu::tlb::*;
+use crate::bus::Bus;
+use crate::bus::fastmem::RamWidth;
 use crate::cpu::Cpu;
+use crate::metrics::{self, LockUser};
+
+use parking_lot::RwLockWriteGuard;
 
 use anyhow::{bail, Context};
 
 /// These are the top-level "public" functions providing read/write accesses.
+/// Accesses to RAM skip the bus lock (see [crate::bus::fastmem]), except in
+/// pages with watchpoints (see [crate::bus::watch]).
 impl Cpu {
+    /// Keep the address of some load or store, if anything is tracing.
+    #[inline(always)]
+    fn note_access(&self, addr: u32) {
+        if self.trace_access || self.dbg_on {
+            self.last_access.set(Some(addr));
+        }
+    }
+
     pub fn read32(&self, addr: u32) -> anyhow::Result<u32> {
+        self.note_access(addr);
         let paddr = self.translate(TLBReq::new(addr, Access::Read))?;
-        let res = self.bus.read().read32(paddr)?;
+        if let Some(res) = self.ram.read::<u32>(paddr) {
+            return Ok(res);
+        }
+        let bus = self.sync_bus()?;
+        let res = bus.read32(paddr)?;
+        self.check_watch(&bus, paddr, 4, false);
         Ok(res)
     }
     pub fn read16(&self, addr: u32) -> anyhow::Result<u16> {
+        self.note_access(addr);
         let paddr = self.translate(TLBReq::new(addr, Access::Read))?;
-        let res = self.bus.read().read16(paddr)?;
+        if let Some(res) = self.ram.read::<u16>(paddr) {
+            return Ok(res);
+        }
+        let bus = self.sync_bus()?;
+        let res = bus.read16(paddr)?;
+        self.check_watch(&bus, paddr, 2, false);
         Ok(res)
     }
     pub fn read8(&self, addr: u32) -> anyhow::Result<u8> {
+        self.note_access(addr);
         let paddr = self.translate(TLBReq::new(addr, Access::Read))?;
-        let res = self.bus.read().read8(paddr)?;
+        if let Some(res) = self.ram.read::<u8>(paddr) {
+            return Ok(res);
+        }
+        let bus = self.sync_bus()?;
+        let res = bus.read8(paddr)?;
+        self.check_watch(&bus, paddr, 1, false);
         Ok(res)
     }
 
     pub fn write32(&mut self, addr: u32, val: u32) -> anyhow::Result<()> {
+        self.note_access(addr);
         let paddr = self.translate(TLBReq::new(addr, Access::Write))?;
-        self.bus.write().write32(paddr, val)
+        if self.ram.write::<u32>(paddr, val) {
+            return Ok(());
+        }
+        self.bus_sync.set(true);
+        let mut bus = self.sync_bus()?;
+        bus.write32(paddr, val)?;
+        self.check_watch(&bus, paddr, 4, true);
+        Ok(())
     }
     pub fn write16(&mut self, addr: u32, val: u32) -> anyhow::Result<()> {
+        self.note_access(addr);
         let paddr = self.translate(TLBReq::new(addr, Access::Write))?;
-        self.bus.write().write16(paddr, val as u16)
+        if self.ram.write::<u16>(paddr, val as u16) {
+            return Ok(());
+        }
+        self.bus_sync.set(true);
+        let mut bus = self.sync_bus()?;
+        bus.write16(paddr, val as u16)?;
+        self.check_watch(&bus, paddr, 2, true);
+        Ok(())
     }
     pub fn write8(&mut self, addr: u32, val: u32) -> anyhow::Result<()> {
+        self.note_access(addr);
         let paddr = self.translate(TLBReq::new(addr, Access::Write))?;
-        self.bus.write().write8(paddr, val as u8)
+        if self.ram.write::<u8>(paddr, val as u8) {
+            return Ok(());
+        }
+        self.bus_sync.set(true);
+        let mut bus = self.sync_bus()?;
+        bus.write8(paddr, val as u8)?;
+        self.check_watch(&bus, paddr, 1, true);
+        Ok(())
+    }
+}
+
+/// Block transfers (for LDM/STM, and PUSH/POP in Thumb) are split into runs
+/// of words that don't cross a page, and each run is translated once. Runs in
+/// RAM are copied directly, and anything else takes the bus once per run.
+impl Cpu {
+    /// The number of words in the run starting at some address, out of the
+    /// `left` words still to be transferred.
+    #[inline(always)]
+    fn block_run(vaddr: u32, left: usize) -> usize {
+        if vaddr & 3 != 0 {
+            return 1;
+        }
+        (((0x1000 - (vaddr & 0xfff)) / 4) as usize).min(left)
+    }
+
+    /// Read consecutive words, starting at some virtual address.
+    pub fn read_block32(&self, addr: u32, vals: &mut [u32]) -> anyhow::Result<()> {
+        let mut done = 0;
+        while done < vals.len() {
+            let vaddr = addr.wrapping_add(done as u32 * 4);
+            let len = Self::block_run(vaddr, vals.len() - done);
+            let run = &mut vals[done..done + len];
+            let paddr = self.translate(TLBReq::new(vaddr, Access::Read))?;
+            if !self.ram.read_block(paddr, run) {
+                let bus = self.sync_bus()?;
+                for (idx, val) in run.iter_mut().enumerate() {
+                    let paddr = paddr.wrapping_add(idx as u32 * 4);
+                    *val = bus.read32(paddr)?;
+                    self.check_watch(&bus, paddr, 4, false);
+                }
+            }
+            done += len;
+        }
+        if !vals.is_empty() {
+            self.note_access(addr.wrapping_add(done as u32 * 4 - 4));
+        }
+        Ok(())
+    }
+
+    /// Write consecutive words, starting at some virtual address.
+    pub fn write_block32(&mut self, addr: u32, vals: &[u32]) -> anyhow::Result<()> {
+        let mut done = 0;
+        while done < vals.len() {
+            let vaddr = addr.wrapping_add(done as u32 * 4);
+            let len = Self::block_run(vaddr, vals.len() - done);
+            let run = &vals[done..done + len];
+            let paddr = self.translate(TLBReq::new(vaddr, Access::Write))?;
+            if !self.ram.write_block(paddr, run) {
+                self.bus_sync.set(true);
+                let mut bus = self.sync_bus()?;
+                for (idx, val) in run.iter().enumerate() {
+                    let paddr = paddr.wrapping_add(idx as u32 * 4);
+                    bus.write32(paddr, *val)?;
+                    self.check_watch(&bus, paddr, 4, true);
+                }
+            }
+            done += len;
+        }
+        if !vals.is_empty() {
+            self.note_access(addr.wrapping_add(done as u32 * 4 - 4));
+        }
+        Ok(())
+    }
+}
+
+/// Instruction fetches go through the [fetch::FetchWindow] when possible.
+impl Cpu {
+    #[inline(always)]
+    pub fn fetch32(&self, addr: u32) -> anyhow::Result<u32> {
+        if addr & 3 == 0 {
+            if let Some(ptr) = self.fetch_ptr(addr) {
+                // SAFETY: aligned and in bounds of the page
+                return Ok(unsafe { u32::load(ptr) });
+            }
+        }
+        // Fetches aren't loads, as far as the trace is concerned
+        let last = self.last_access.get();
+        let res = self.read32(addr);
+        self.last_access.set(last);
+        res
+    }
+    #[inline(always)]
+    pub fn fetch16(&self, addr: u32) -> anyhow::Result<u16> {
+        if addr & 1 == 0 {
+            if let Some(ptr) = self.fetch_ptr(addr) {
+                // SAFETY: aligned and in bounds of the page
+                return Ok(unsafe { u16::load(ptr) });
+            }
+        }
+        let last = self.last_access.get();
+        let res = self.read16(addr);
+        self.last_access.set(last);
+        res
+    }
+
+    /// Get a pointer to some virtual address in guest RAM, moving the fetch
+    /// window if necessary.
+    #[inline(always)]
+    fn fetch_ptr(&self, addr: u32) -> Option<*mut u8> {
+        if !self.ram.enabled() {
+            return None;
+        }
+        let tlb_gen = self.p15.tlb.generation();
+        let map_gen = self.ram.generation();
+        let is_priv = self.reg.cpsr.mode().is_privileged();
+        if let Some(ptr) = self.fetch.lookup(addr, tlb_gen, map_gen, is_priv) {
+            return Some(ptr);
+        }
+        self.fill_fetch_window(addr, tlb_gen, map_gen, is_priv)
+    }
+
+    #[cold]
+    fn fill_fetch_window(&self, addr: u32, tlb_gen: u32, map_gen: u32, is_priv: bool) -> Option<*mut u8> {
+        let paddr = self.translate(TLBReq::new(addr, Access::Read)).ok()?;
+        // Only use translations that apply to the whole page.
+        if self.p15.c1_ctrl.mmu_enabled()
+        && self.p15.tlb.lookup(VirtAddr(addr), &Access::Read, is_priv).is_none() {
+            return None;
+        }
+        let page = self.ram.page_ptr(paddr)?;
+        self.fetch.fill(addr, page, tlb_gen, map_gen, is_priv);
+        self.fetch.lookup(addr, tlb_gen, map_gen, is_priv)
+    }
+}
+
+impl Cpu {
+    /// Take the bus for an access that can't use the fast path, bringing the
+    /// bus clock up to date with the CPU first (bus steps between instructions
+    /// may be deferred by the backend).
+    fn sync_bus(&self) -> anyhow::Result<RwLockWriteGuard<'_, Bus>> {
+        let mut bus = metrics::write_bus(&self.bus, LockUser::Cpu);
+        bus.catch_up(self.cycle + 1)?;
+        Ok(bus)
+    }
+
+    /// Check an access through the slow path against the watchpoints on the
+    /// bus. A hit ends the slice, so that the backend can stop for the
+    /// debugger after this instruction.
+    #[inline(always)]
+    fn check_watch(&self, bus: &Bus, paddr: u32, len: u32, write: bool) {
+        if bus.watchpoints.is_empty() {
+            return;
+        }
+        if let Some(wp) = bus.watchpoints.hit(paddr, len, write) {
+            self.watch_hit.set(Some(wp));
+            self.bus_sync.set(true);
+        }
     }
 }
 
 /// These are the functions used to perform virtual-to-physical translation.
 impl Cpu {
     /// Resolve a section descriptor, returning a physical address.
-    fn resolve_section(&self, req: TLBReq, d: SectionDescriptor) -> anyhow::Result<u32> {
+    fn resolve_section(&self, req: TLBReq, d: SectionDescriptor) -> anyhow::Result<Translation> {
         let ctx = self.get_ctx(d.domain());
         if ctx.validate(&req, d.ap()) {
-            Ok(d.base_addr() | req.vaddr.section_idx())
+            Ok(Translation { paddr: d.base_addr() | req.vaddr.section_idx(), cacheable: true })
         } else {
             bail!("resolve_section: Domain access faults are unimplemented, vaddr={:08x}", req.vaddr.0)
         }
@@ -53,7 +262,7 @@ impl Cpu {
 
     /// Resolve a coarse descriptor, returning a physical address.
     #[allow(unreachable_patterns)]
-    fn resolve_coarse(&self, req: TLBReq, d: CoarseDescriptor) -> anyhow::Result<u32> {
+    fn resolve_coarse(&self, req: TLBReq, d: CoarseDescriptor) -> anyhow::Result<Translation> {
         let desc = match self.l2_fetch(req.vaddr, L1Descriptor::Coarse(d)) {
             Ok(val) => val,
             Err(reason) => return Err(reason),
@@ -62,7 +271,12 @@ impl Cpu {
             L2Descriptor::SmallPage(entry) => {
                 let ctx = self.get_ctx(d.domain());
                 if ctx.validate(&req, entry.get_ap(req.vaddr)) {
-                    Ok(entry.base_addr() | req.vaddr.small_page_idx())
+                    // Subpage permissions are finer than the TLB, so only
+                    // cache pages where they're all the same.
+                    Ok(Translation {
+                        paddr: entry.base_addr() | req.vaddr.small_page_idx(),
+                        cacheable: entry.uniform_ap(),
+                    })
                 } else {
                     dbg!(self.p15.c3_dacr.domain(d.domain()));
                     bail!("resolve_coarse: Domain access faults are unimplemented, vaddr={:08x}", req.vaddr.0)
@@ -85,7 +299,10 @@ impl Cpu {
     /// Given some virtual address, return the first-level PTE.
     fn l1_fetch(&self, vaddr: VirtAddr) -> anyhow::Result<L1Descriptor> {
         let addr = (self.p15.read_ttbr() & 0xffff_c000) | vaddr.l1_idx() << 2;
-        let val = self.p15.l1_fetch(addr, &self.bus)?;
+        let val = match self.ram.read::<u32>(addr) {
+            Some(val) => val,
+            None => self.bus.read().read32(addr)?,
+        };
 
         let res = L1Descriptor::from_u32(val);
         if let L1Descriptor::Fault(_) = res {
@@ -104,22 +321,44 @@ impl Cpu {
             },
             _ => bail!("l2_fetch requires an L1::Coarse descriptor"),
         };
-        let val = self.bus.read().read32(addr)?;
+        let val = match self.ram.read::<u32>(addr) {
+            Some(val) => val,
+            None => self.bus.read().read32(addr)?,
+        };
 
         L2Descriptor::from_u32_checked(val).with_context(|| format!("l2_fetch: VirtualAddr: 0x{:x} L1Descriptor: {d:?}", vaddr.0))
     }
 
+    /// Walk the page tables for some request.
+    fn walk(&self, req: TLBReq) -> anyhow::Result<Translation> {
+        match self.l1_fetch(req.vaddr)? {
+            L1Descriptor::Section(entry) => self.resolve_section(req, entry),
+            L1Descriptor::Coarse(entry) => self.resolve_coarse(req, entry),
+            other => bail!("TLB first-level descriptor {other:?} unimplemented"),
+        }
+    }
+
     /// Translate a virtual address into a physical address.
     pub fn translate(&self, req: TLBReq) -> anyhow::Result<u32> {
-        if self.p15.c1_ctrl.mmu_enabled() {
-            match self.l1_fetch(req.vaddr)? {
-                L1Descriptor::Section(entry) => Ok(self.resolve_section(req, entry)?),
-                L1Descriptor::Coarse(entry) => self.resolve_coarse(req, entry),
-                other => bail!("TLB first-level descriptor {other:?} unimplemented"),
-            }
-        } else {
-            Ok(req.vaddr.0)
+        if !self.p15.c1_ctrl.mmu_enabled() {
+            return Ok(req.vaddr.0);
+        }
+        let vaddr = req.vaddr;
+        let is_priv = self.reg.cpsr.mode().is_privileged();
+        if let Some(ppage) = self.p15.tlb.lookup(vaddr, &req.kind, is_priv) {
+            self.p15.tlb.count(true);
+            return Ok(ppage | (vaddr.0 & !TLB_PAGE_MASK));
         }
+        self.p15.tlb.count(false);
+
+        // Debug accesses skip permission checks, so they must never fill
+        // entries that normal accesses will hit on.
+        let is_debug = req.kind == Access::Debug;
+        let kind = if req.kind == Access::Write { Access::Write } else { Access::Read };
+        let res = self.walk(req)?;
+        if res.cacheable && !is_debug {
+            self.p15.tlb.insert(vaddr, &kind, is_priv, res.paddr);
+        }
+        Ok(res.paddr)
     }
 }
-
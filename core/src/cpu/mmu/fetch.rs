@@ -0,0 +1,75 @@
+//! A window for instruction fetches.
+//!
+//! Straight-line code fetches from the same page over and over, so instead
+//! of translating and decoding every fetch, we keep a pointer to the backing
+//! storage for the current page of code (see [crate::bus::fastmem]).
+//!
+//! The window holds a pointer (not a copy), so writes to the page are always
+//! observed. It goes stale when the translation might change (a TLB flush, or
+//! a change in privilege level), or when the physical memory map changes.
+
+use std::cell::Cell;
+use std::ptr::null_mut;
+
+/// Bit set in [FetchWindow::tag] when the window is valid.
+const FETCH_VALID: u32 = 0x0000_0001;
+
+/// Mask for the page-granular part of an address.
+pub const FETCH_PAGE_MASK: u32 = 0xffff_f000;
+
+/// Pointer to the backing storage for the current page of code.
+pub struct FetchWindow {
+    /// The page-aligned virtual address with [FETCH_VALID] set, or zero.
+    tag: Cell<u32>,
+    /// Pointer to the start of the page in host memory.
+    ptr: Cell<*mut u8>,
+    /// TLB generation when the window was filled.
+    tlb_gen: Cell<u32>,
+    /// Guest memory map generation when the window was filled.
+    map_gen: Cell<u32>,
+    /// Privilege level when the window was filled.
+    is_priv: Cell<bool>,
+}
+
+// SAFETY: the pointer is only ever dereferenced by the owning CPU, and guest
+// RAM is never moved or freed (see [crate::bus::fastmem]).
+unsafe impl Send for FetchWindow {}
+
+impl Default for FetchWindow {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+impl FetchWindow {
+    pub fn new() -> Self {
+        FetchWindow {
+            tag: Cell::new(0),
+            ptr: Cell::new(null_mut()),
+            tlb_gen: Cell::new(0),
+            map_gen: Cell::new(0),
+            is_priv: Cell::new(false),
+        }
+    }
+
+    /// Returns a pointer to some virtual address, if it falls in the window.
+    #[inline(always)]
+    pub fn lookup(&self, vaddr: u32, tlb_gen: u32, map_gen: u32, is_priv: bool) -> Option<*mut u8> {
+        if self.tag.get() != (vaddr & FETCH_PAGE_MASK) | FETCH_VALID
+        || self.tlb_gen.get() != tlb_gen || self.map_gen.get() != map_gen
+        || self.is_priv.get() != is_priv {
+            return None;
+        }
+        // SAFETY: the offset is within the page
+        Some(unsafe { self.ptr.get().add((vaddr & !FETCH_PAGE_MASK) as usize) })
+    }
+
+    /// Move the window to the page containing some virtual address.
+    pub fn fill(&self, vaddr: u32, ptr: *mut u8, tlb_gen: u32, map_gen: u32, is_priv: bool) {
+        self.tag.set((vaddr & FETCH_PAGE_MASK) | FETCH_VALID);
+        self.ptr.set(ptr);
+        self.tlb_gen.set(tlb_gen);
+        self.map_gen.set(map_gen);
+        self.is_priv.set(is_priv);
+    }
+}
@@ -9,7 +9,7 @@ use log::error;
 use crate::cpu::coproc::DomainMode;
 
 /// Some kind of memory access (used for determining permissions).
-#[derive(Debug, PartialEq)]
+#[derive(Debug, Clone, Copy, PartialEq)]
 pub enum Access { Read, Write, Debug }
 
 /// Token for a request to the MMU, to translate a virtual address.
@@ -196,6 +196,12 @@ impl SmallPageDescriptor {
         ((self.0 >> 4) >> ((vaddr.0 >> 9) & 0b0110)) & 0b11
     }
 
+    /// Returns true if all four subpages share the same access protection bits.
+    pub fn uniform_ap(&self) -> bool {
+        let ap = self.ap0();
+        self.ap1() == ap && self.ap2() == ap && self.ap3() == ap
+    }
+
     pub fn base_addr(&self) -> u32 { self.0 & Self::ADDR_MASK }
     pub fn ap3(&self) -> u32 { (self.0 & Self::AP3_MASK) >> 10 }
     pub fn ap2(&self) -> u32 { (self.0 & Self::AP2_MASK) >> 8 }
@@ -0,0 +1,131 @@
+//! A software TLB caching complete virtual-to-physical translations.
+
+use std::cell::Cell;
+
+use crate::cpu::mmu::prim::{Access, VirtAddr};
+
+/// The number of entries in each direct-mapped way of the TLB.
+pub const TLB_ENTRIES: usize = 512;
+
+/// Bit set in [TlbEntry::tag] when the entry holds a valid translation.
+const TLB_VALID: u32 = 0x0000_0001;
+
+/// Mask for the page-granular part of an address.
+pub const TLB_PAGE_MASK: u32 = 0xffff_f000;
+
+/// A single cached translation.
+///
+/// The tag is the page-aligned virtual address with [TLB_VALID] set, so an
+/// all-zero entry never matches anything.
+#[derive(Copy, Clone, Default)]
+struct TlbEntry {
+    tag: u32,
+    ppage: u32,
+}
+
+/// The result of walking the page tables for some request.
+pub struct Translation {
+    /// The resulting physical address.
+    pub paddr: u32,
+    /// Whether or not the permissions for this translation apply to the
+    /// whole 4K page (and can therefore be cached).
+    pub cacheable: bool,
+}
+
+/// Direct-mapped, page-granular cache of the final physical page base for
+/// some virtual page.
+///
+/// Permission checks are folded into the entries: there is a separate set of
+/// entries for each kind of access and each privilege level, and only
+/// translations that passed validation are ever inserted. Any change to the
+/// state used for validation (p15 r1, r2, r3) must flush the whole thing.
+pub struct SoftTlb {
+    /// Entries indexed by [SoftTlb::way], then by virtual page number.
+    entries: [[Cell<TlbEntry>; TLB_ENTRIES]; 4],
+    /// Incremented on every flush, so that anything derived from a cached
+    /// translation can tell when it goes stale.
+    generation: Cell<u32>,
+    /// Lookups that hit and missed since the last [SoftTlb::take_counts].
+    hits: Cell<u64>,
+    misses: Cell<u64>,
+}
+
+impl Default for SoftTlb {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+impl SoftTlb {
+    pub fn new() -> Self {
+        SoftTlb {
+            entries: std::array::from_fn(|_| std::array::from_fn(|_| Cell::new(TlbEntry::default()))),
+            generation: Cell::new(0),
+            hits: Cell::new(0),
+            misses: Cell::new(0),
+        }
+    }
+
+    /// Count the result of a lookup for a translation.
+    #[inline(always)]
+    pub fn count(&self, hit: bool) {
+        let counter = if hit { &self.hits } else { &self.misses };
+        counter.set(counter.get() + 1);
+    }
+
+    /// Returns the number of hits and misses counted since the last call.
+    pub fn take_counts(&self) -> (u64, u64) {
+        (self.hits.take(), self.misses.take())
+    }
+
+    /// Select the set of entries for a particular kind of access.
+    /// Out-of-band (debug) accesses ignore permissions, so they can share
+    /// the read entries.
+    #[inline(always)]
+    fn way(kind: &Access, is_priv: bool) -> usize {
+        let k = match kind {
+            Access::Read | Access::Debug => 0,
+            Access::Write => 1,
+        };
+        (k << 1) | is_priv as usize
+    }
+
+    #[inline(always)]
+    fn slot(&self, vaddr: VirtAddr, kind: &Access, is_priv: bool) -> &Cell<TlbEntry> {
+        let idx = (vaddr.0 >> 12) as usize & (TLB_ENTRIES - 1);
+        &self.entries[Self::way(kind, is_priv)][idx]
+    }
+
+    /// Returns the physical page base for some virtual address, if present.
+    #[inline(always)]
+    pub fn lookup(&self, vaddr: VirtAddr, kind: &Access, is_priv: bool) -> Option<u32> {
+        let entry = self.slot(vaddr, kind, is_priv).get();
+        if entry.tag == (vaddr.0 & TLB_PAGE_MASK) | TLB_VALID {
+            Some(entry.ppage)
+        } else {
+            None
+        }
+    }
+
+    /// Cache a translation that has already passed validation.
+    pub fn insert(&self, vaddr: VirtAddr, kind: &Access, is_priv: bool, paddr: u32) {
+        self.slot(vaddr, kind, is_priv).set(TlbEntry {
+            tag: (vaddr.0 & TLB_PAGE_MASK) | TLB_VALID,
+            ppage: paddr & TLB_PAGE_MASK,
+        });
+    }
+
+    pub fn generation(&self) -> u32 {
+        self.generation.get()
+    }
+
+    /// Invalidate all entries.
+    pub fn flush(&self) {
+        self.generation.set(self.generation.get().wrapping_add(1));
+        for way in self.entries.iter() {
+            for entry in way.iter() {
+                entry.set(TlbEntry::default());
+            }
+        }
+    }
+}
@@ -1,11 +1,13 @@
 //! Helpers for dealing with program status registers.
 
 use anyhow::bail;
+use bincode::{Decode, Encode};
 
+use crate::cpu::alu::{add_generic, sub_generic};
 use crate::cpu::reg::CpuMode;
 
 /// Program status register.
-#[derive(Debug, Copy, Clone, PartialEq)]
+#[derive(Debug, Copy, Clone, PartialEq, Encode, Decode)]
 #[repr(transparent)]
 pub struct Psr(pub u32);
 impl Psr {
@@ -39,8 +41,166 @@ impl Psr {
 }
 
 
+/// The last operation that set the condition flags, along with its inputs.
+/// Most flags are overwritten before anything reads them, so they're only
+/// computed when they're needed.
+#[derive(Debug, Copy, Clone, PartialEq, Encode, Decode)]
+pub enum FlagOp {
+    /// The condition flags in the PSR are up-to-date.
+    None,
+    /// Addition (sets N, Z, C, and V).
+    Add { a: u32, b: u32 },
+    /// Subtraction (sets N, Z, C, and V).
+    Sub { a: u32, b: u32 },
+    /// Some logical operation with a result and the carry from the shifter
+    /// (sets N, Z, and C).
+    Logic { res: u32, c: bool },
+}
+
+impl FlagOp {
+    fn n(&self) -> Option<bool> {
+        match *self {
+            FlagOp::None => None,
+            FlagOp::Add { a, b } => Some(a.wrapping_add(b) & 0x8000_0000 != 0),
+            FlagOp::Sub { a, b } => Some(a.wrapping_sub(b) & 0x8000_0000 != 0),
+            FlagOp::Logic { res, .. } => Some(res & 0x8000_0000 != 0),
+        }
+    }
+    fn z(&self) -> Option<bool> {
+        match *self {
+            FlagOp::None => None,
+            FlagOp::Add { a, b } => Some(a.wrapping_add(b) == 0),
+            FlagOp::Sub { a, b } => Some(a == b),
+            FlagOp::Logic { res, .. } => Some(res == 0),
+        }
+    }
+    fn c(&self) -> Option<bool> {
+        match *self {
+            FlagOp::None => None,
+            FlagOp::Add { a, b } => Some(a.checked_add(b).is_none()),
+            FlagOp::Sub { a, b } => Some(a >= b),
+            FlagOp::Logic { c, .. } => Some(c),
+        }
+    }
+    fn v(&self) -> Option<bool> {
+        match *self {
+            FlagOp::Add { a, b } => Some((a as i32).checked_add(b as i32).is_none()),
+            FlagOp::Sub { a, b } => Some((a as i32).checked_sub(b as i32).is_none()),
+            FlagOp::None | FlagOp::Logic { .. } => None,
+        }
+    }
+}
+
+/// The current program status register, with lazily-evaluated condition
+/// flags (see [FlagOp]). Reading a flag computes it from the last operation,
+/// and anything that needs the whole register (MRS, exceptions, and mode
+/// switches) goes through [Cpsr::get], so this behaves like a plain [Psr].
+#[derive(Debug, Copy, Clone, Encode, Decode)]
+pub struct Cpsr {
+    psr: Psr,
+    op: FlagOp,
+}
+
+impl PartialEq for Cpsr {
+    fn eq(&self, other: &Self) -> bool {
+        self.get() == other.get()
+    }
+}
+
+impl From<Psr> for Cpsr {
+    fn from(psr: Psr) -> Self {
+        Cpsr { psr, op: FlagOp::None }
+    }
+}
+
+impl Cpsr {
+    /// The value of the register, with all of the flags computed.
+    pub fn get(&self) -> Psr {
+        let mut psr = self.psr;
+        match self.op {
+            FlagOp::None => {},
+            FlagOp::Add { a, b } => {
+                let (_, n, z, c, v) = add_generic(a, b);
+                psr.set_n(n); psr.set_z(z); psr.set_c(c); psr.set_v(v);
+            },
+            FlagOp::Sub { a, b } => {
+                let (_, n, z, c, v) = sub_generic(a, b);
+                psr.set_n(n); psr.set_z(z); psr.set_c(c); psr.set_v(v);
+            },
+            FlagOp::Logic { res, c } => {
+                psr.set_n(res & 0x8000_0000 != 0); psr.set_z(res == 0); psr.set_c(c);
+            },
+        }
+        psr
+    }
+
+    /// The bits of the register other than the condition flags, which are
+    /// always up-to-date.
+    pub fn control(&self) -> u32 {
+        self.psr.0 & 0x0fff_ffff
+    }
+
+    /// Replace the value of the register.
+    pub fn set(&mut self, psr: Psr) {
+        *self = Cpsr::from(psr);
+    }
+
+    /// Write the pending flags (if any) back into the register.
+    fn flush(&mut self) {
+        if self.op != FlagOp::None {
+            self.psr = self.get();
+            self.op = FlagOp::None;
+        }
+    }
+
+    /// Set N, Z, C, and V from the addition `a + b`.
+    #[inline(always)]
+    pub fn set_add_flags(&mut self, a: u32, b: u32) {
+        self.op = FlagOp::Add { a, b };
+    }
+
+    /// Set N, Z, C, and V from the subtraction `a - b`.
+    #[inline(always)]
+    pub fn set_sub_flags(&mut self, a: u32, b: u32) {
+        self.op = FlagOp::Sub { a, b };
+    }
+
+    /// Set N and Z from the result of some logical operation, and C from
+    /// the carry out of the shifter. V is left alone.
+    #[inline(always)]
+    pub fn set_logic_flags(&mut self, res: u32, c: bool) {
+        if let Some(v) = self.op.v() {
+            self.psr.set_v(v);
+        }
+        self.op = FlagOp::Logic { res, c };
+    }
+
+    pub fn mode(&self) -> CpuMode { self.psr.mode() }
+    pub fn thumb(&self) -> bool { self.psr.thumb() }
+    pub fn fiq_disable(&self) -> bool { self.psr.fiq_disable() }
+    pub fn irq_disable(&self) -> bool { self.psr.irq_disable() }
+
+    pub fn q(&self) -> bool { self.psr.q() }
+    pub fn v(&self) -> bool { self.op.v().unwrap_or_else(|| self.psr.v()) }
+    pub fn c(&self) -> bool { self.op.c().unwrap_or_else(|| self.psr.c()) }
+    pub fn z(&self) -> bool { self.op.z().unwrap_or_else(|| self.psr.z()) }
+    pub fn n(&self) -> bool { self.op.n().unwrap_or_else(|| self.psr.n()) }
+
+    pub fn set_mode(&mut self, mode: CpuMode) { self.psr.set_mode(mode); }
+    pub fn set_thumb(&mut self, val: bool) { self.psr.set_thumb(val); }
+    pub fn set_fiq_disable(&mut self, val: bool) { self.psr.set_fiq_disable(val); }
+    pub fn set_irq_disable(&mut self, val: bool) { self.psr.set_irq_disable(val); }
+
+    pub fn set_q(&mut self, val: bool) { self.psr.set_q(val); }
+    pub fn set_v(&mut self, val: bool) { self.flush(); self.psr.set_v(val); }
+    pub fn set_c(&mut self, val: bool) { self.flush(); self.psr.set_c(val); }
+    pub fn set_z(&mut self, val: bool) { self.flush(); self.psr.set_z(val); }
+    pub fn set_n(&mut self, val: bool) { self.flush(); self.psr.set_n(val); }
+}
+
+
 /// Saved program status registers.
-#[derive(Debug, Copy, Clone, PartialEq)]
+#[derive(Debug, Copy, Clone, PartialEq, Encode, Decode)]
 pub struct SavedStatusBank {
     /// SVC mode saved program status register.
     pub svc: Psr,
@@ -1,6 +1,7 @@
 //! CPU register definitions.
 
 use anyhow::bail;
+use bincode::{Decode, Encode};
 
 use crate::cpu::psr::*;
 
@@ -66,7 +67,7 @@ impl TryFrom<u32> for Cond {
 }
 
 /// The set of banked registers for all operating modes.
-#[derive(Debug, Copy, Clone, Default, PartialEq)]
+#[derive(Debug, Copy, Clone, Default, PartialEq, Encode, Decode)]
 pub struct RegisterBank {
     pub sys: [u32; 2],
     pub svc: [u32; 2],
@@ -77,7 +78,7 @@ pub struct RegisterBank {
 }
 
 /// Top-level container for register state.
-#[derive(Copy, Clone, PartialEq)]
+#[derive(Copy, Clone, PartialEq, Encode, Decode)]
 #[repr(C)]
 pub struct RegisterFile {
     /// The currently-active set of general-purpose registers.
@@ -87,7 +88,7 @@ pub struct RegisterFile {
     /// The set of banked registers.
     pub bank: RegisterBank,
     /// The current program status register.
-    pub cpsr: Psr,
+    pub cpsr: Cpsr,
     /// The saved program status registers.
     pub spsr: SavedStatusBank,
 }
@@ -108,7 +109,7 @@ impl RegisterFile {
         RegisterFile {
             r: [0; 15],
             pc: 0xffff_0000 + 8,
-            cpsr: init_cpsr,
+            cpsr: Cpsr::from(init_cpsr),
             bank: RegisterBank::default(),
             spsr: SavedStatusBank::new(),
         }
@@ -126,7 +127,7 @@ impl RegisterFile {
             //    self.pc, current_mode, target.mode());
             self.swap_bank(current_mode, target.mode());
         }
-        self.cpsr = target;
+        self.cpsr.set(target);
     }
 }
 
@@ -219,16 +220,24 @@ impl RegisterFile {
             MI => self.cpsr.n(), PL => !self.cpsr.n(),
             VS => self.cpsr.v(), VC => !self.cpsr.v(),
 
-            HI => self.cpsr.c() && !self.cpsr.z(), 
-            LS => !self.cpsr.c() || self.cpsr.z(),
-
-            GE => self.cpsr.n() == self.cpsr.v(), 
-            LT => self.cpsr.n() != self.cpsr.v(),
-
-            GT => !self.cpsr.z() && (self.cpsr.n() == self.cpsr.v()), 
-            LE => self.cpsr.z() || (self.cpsr.n() != self.cpsr.v()),
             AL |
             UNC => true,
+
+            // These need more than one flag, so compute them all at once.
+            _ => {
+                let psr = self.cpsr.get();
+                match cond {
+                    HI => psr.c() && !psr.z(),
+                    LS => !psr.c() || psr.z(),
+
+                    GE => psr.n() == psr.v(),
+                    LT => psr.n() != psr.v(),
+
+                    GT => !psr.z() && (psr.n() == psr.v()),
+                    LE => psr.z() || (psr.n() != psr.v()),
+                    _ => unreachable!(),
+                }
+            },
         }
     }
 }
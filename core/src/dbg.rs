@@ -1 +1,3 @@
 pub mod ios;
+pub mod location;
+pub mod profile;
@@ -171,10 +171,21 @@ pub fn get_syscall_desc(idx: u32) -> Option<SyscallDef> {
 }
 
 
+/// Get the index of the IOS syscall made by some undefined instruction, if
+/// it's a syscall (`0xe600_0010 | idx << 5`) at all.
+pub fn syscall_idx(opcd: u32) -> Option<u32> {
+    if opcd & 0xff00_001f != 0xe600_0010 {
+        return None;
+    }
+    Some((opcd & 0x00ff_ffe0) >> 5)
+}
+
 /// Resolve information about an IOS syscall and its arguments.
 pub fn log_syscall(cpu: &mut Cpu, opcd: u32) {
     // Get the syscall index (and ignore some)
-    let idx = (opcd & 0x00ff_ffe0) >> 5;
+    let Some(idx) = syscall_idx(opcd) else {
+        return;
+    };
     let res = get_syscall_desc(idx);
     if res.is_none() {
         return;
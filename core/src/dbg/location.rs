@@ -0,0 +1,60 @@
+//! Lazily-captured CPU location for crash dumps.
+//!
+//! Rather than copying the PC and friends somewhere after every instruction,
+//! a backend registers the register file it's running with, and the location
+//! is only read when something (i.e. the panic hook) actually asks for it.
+
+use std::cell::Cell;
+
+use crate::cpu::reg::RegisterFile;
+
+thread_local! {
+    /// The register file for the CPU running on this thread.
+    static CURRENT: Cell<*const RegisterFile> = const { Cell::new(std::ptr::null()) };
+}
+
+/// Where the CPU was when a location was captured.
+#[derive(Debug, Clone, Copy)]
+pub struct DebugLocation {
+    /// The program counter (from the context of the fetch stage).
+    pub pc: u32,
+    pub lr: u32,
+    pub sp: u32,
+}
+
+/// Keeps a register file registered with [track] until dropped.
+pub struct LocationGuard(());
+impl Drop for LocationGuard {
+    fn drop(&mut self) {
+        CURRENT.with(|cur| cur.set(std::ptr::null()));
+    }
+}
+
+/// Register the register file for the CPU running on this thread.
+///
+/// # Safety
+/// The register file must not be moved or dropped while the returned guard
+/// is alive.
+pub unsafe fn track(reg: &RegisterFile) -> LocationGuard {
+    CURRENT.with(|cur| cur.set(reg));
+    LocationGuard(())
+}
+
+/// Capture the current location of the CPU running on this thread (if any).
+///
+/// This is meant to be called from a panic hook, while the CPU is stopped.
+pub fn capture() -> Option<DebugLocation> {
+    let reg = CURRENT.with(|cur| cur.get());
+    if reg.is_null() {
+        return None;
+    }
+    // SAFETY: registered with track(), so this points to a live register
+    // file, which isn't being mutated while this thread is in here.
+    let reg = unsafe { &*reg };
+    let pc_adj = if reg.cpsr.thumb() { 4 } else { 8 };
+    Some(DebugLocation {
+        pc: reg.pc.wrapping_sub(pc_adj),
+        lr: reg.r[14],
+        sp: reg.r[13],
+    })
+}
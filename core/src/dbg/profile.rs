@@ -0,0 +1,147 @@
+//! A sampling profiler for guest code.
+//!
+//! Every [Profile::interval] instructions, the backend records the PC and LR
+//! of the CPU. IOS syscalls are counted as they're made. At exit, samples are
+//! grouped by function (see [Symbolizer]) and written out as a report, and
+//! optionally as folded stacks (`caller;function count`, one per line) for
+//! flamegraph tools. The caller is taken from the LR, which is only a guess
+//! for code that has already made calls of its own.
+
+use std::collections::HashMap;
+use std::fs::File;
+use std::io::{BufWriter, Write};
+use std::sync::Arc;
+
+use anyhow::Context;
+use parking_lot::Mutex;
+
+use crate::dbg::ios::{get_syscall_desc, ExecutionCtx};
+
+/// A [Profile] shared between the CPU and whoever writes the report.
+pub type SharedProfile = Arc<Mutex<Profile>>;
+
+/// Looks up the name of the function containing some address.
+pub type Symbolizer<'a> = dyn Fn(u32) -> Option<String> + 'a;
+
+#[derive(Default)]
+pub struct Profile {
+    /// Number of instructions between samples.
+    pub interval: usize,
+    /// Number of samples for each PC and LR.
+    samples: HashMap<(u32, u32), u64>,
+    /// Number of calls to each syscall.
+    syscalls: HashMap<u32, u64>,
+    total: u64,
+}
+
+impl Profile {
+    pub fn new(interval: usize) -> Self {
+        Profile { interval: interval.max(1), ..Default::default() }
+    }
+
+    pub fn new_shared(interval: usize) -> SharedProfile {
+        Arc::new(Mutex::new(Self::new(interval)))
+    }
+
+    /// Record a sample.
+    pub fn sample(&mut self, pc: u32, lr: u32) {
+        *self.samples.entry((pc, lr)).or_default() += 1;
+        self.total += 1;
+    }
+
+    /// Record a call to some syscall.
+    pub fn syscall(&mut self, idx: u32) {
+        *self.syscalls.entry(idx).or_default() += 1;
+    }
+
+    /// Name some address, falling back to the IOS module it's in.
+    fn name(symbolize: &Symbolizer, addr: u32) -> String {
+        symbolize(addr).unwrap_or_else(|| format!("[{:?}] {addr:08x}", ExecutionCtx::from(addr)))
+    }
+
+    /// Count the samples in each function, most samples first.
+    fn by_function(&self, symbolize: &Symbolizer) -> Vec<(String, u64)> {
+        let mut funcs: HashMap<String, u64> = HashMap::new();
+        for (&(pc, _), &count) in self.samples.iter() {
+            *funcs.entry(Self::name(symbolize, pc)).or_default() += count;
+        }
+        let mut funcs: Vec<_> = funcs.into_iter().collect();
+        funcs.sort_by(|a, b| b.1.cmp(&a.1).then_with(|| a.0.cmp(&b.0)));
+        funcs
+    }
+
+    /// Write a report with the time spent in each function, and the number
+    /// of calls to each syscall.
+    pub fn write_report(&self, path: &str, symbolize: &Symbolizer) -> anyhow::Result<()> {
+        let mut f = BufWriter::new(File::create(path)
+            .context(format!("Couldn't create profile report {path}"))?);
+        writeln!(f, "# {} samples, one every {} instructions", self.total, self.interval)?;
+        writeln!(f, "{:>10} {:>7}  function", "samples", "%")?;
+        for (name, count) in self.by_function(symbolize) {
+            let pct = 100.0 * count as f64 / self.total.max(1) as f64;
+            writeln!(f, "{count:>10} {pct:>6.2}%  {name}")?;
+        }
+
+        let mut syscalls: Vec<_> = self.syscalls.iter().collect();
+        syscalls.sort_by(|a, b| b.1.cmp(a.1).then_with(|| a.0.cmp(b.0)));
+        writeln!(f)?;
+        writeln!(f, "{:>10}  syscall", "calls")?;
+        for (&idx, &count) in syscalls {
+            let name = get_syscall_desc(idx).map_or("??", |desc| desc.name);
+            writeln!(f, "{count:>10}  {name} ({idx:#x})")?;
+        }
+        f.flush()?;
+        Ok(())
+    }
+
+    /// Write the samples as folded stacks.
+    pub fn write_folded(&self, path: &str, symbolize: &Symbolizer) -> anyhow::Result<()> {
+        let mut stacks: HashMap<String, u64> = HashMap::new();
+        for (&(pc, lr), &count) in self.samples.iter() {
+            let stack = format!("{};{}", Self::name(symbolize, lr), Self::name(symbolize, pc));
+            *stacks.entry(stack).or_default() += count;
+        }
+        let mut stacks: Vec<_> = stacks.into_iter().collect();
+        stacks.sort();
+        let mut f = BufWriter::new(File::create(path)
+            .context(format!("Couldn't create folded stacks {path}"))?);
+        for (stack, count) in stacks {
+            writeln!(f, "{stack} {count}")?;
+        }
+        f.flush()?;
+        Ok(())
+    }
+}
+
+/// Function names read from a symbol map. Each line has the start address
+/// of a symbol (in hex) first and its name last, so the output of `nm` works.
+pub struct SymbolMap {
+    /// Sorted by address.
+    syms: Vec<(u32, String)>,
+}
+
+impl SymbolMap {
+    pub fn from_file(path: &str) -> anyhow::Result<Self> {
+        let text = std::fs::read_to_string(path)
+            .context(format!("Couldn't read symbol map {path}"))?;
+        let mut syms = Vec::new();
+        for line in text.lines() {
+            let mut words = line.split_whitespace();
+            let (Some(addr), Some(name)) = (words.next(), words.last()) else {
+                continue;
+            };
+            let addr = addr.trim_start_matches("0x");
+            if let Ok(addr) = u32::from_str_radix(addr, 16) {
+                syms.push((addr, name.to_owned()));
+            }
+        }
+        syms.sort();
+        Ok(SymbolMap { syms })
+    }
+
+    /// The name of the closest symbol at or before some address.
+    pub fn lookup(&self, addr: u32) -> Option<&str> {
+        let idx = self.syms.partition_point(|(start, _)| *start <= addr);
+        idx.checked_sub(1).map(|idx| self.syms[idx].1.as_str())
+    }
+}
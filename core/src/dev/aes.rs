@@ -2,10 +2,10 @@
 extern crate aes;
 extern crate cbc;
 
-use aes::cipher::{block_padding::NoPadding, BlockDecryptMut, BlockEncryptMut, KeyIvInit};
+use aes::cipher::{block_padding::NoPadding, BlockDecryptMut, BlockEncryptMut, InnerIvInit, KeyInit};
 use anyhow::{bail};
 use log::log_enabled;
-use log::{debug, trace};
+use log::{debug, trace, warn};
 
 type Aes128CbcEnc = cbc::Encryptor<aes::Aes128>;
 type Aes128CbcDec = cbc::Decryptor<aes::Aes128>;
@@ -15,14 +15,16 @@ use std::collections::VecDeque;
 use crate::bus::*;
 use crate::bus::prim::*;
 use crate::bus::mmio::*;
+use crate::bus::offload::*;
 use crate::bus::task::*;
 use crate::dev::hlwd::irq::*;
+use crate::snapshot::{get, put, Snapshot};
 
 /// Representing a command to the AES interface.
 #[derive(Debug)]
 pub struct AesCommand {
     /// The length of the request
-    len: usize,
+    pub len: usize,
     /// Toggle between encryption/decryption modes
     decrypt: bool,
     /// Enable AES functionality
@@ -53,18 +55,67 @@ pub struct AesInterface {
     key_fifo: VecDeque<u8>,
     iv_fifo: VecDeque<u8>,
     iv_buffer: [u8; 0x10],
+    /// The expanded key schedule for the current key, built on the first
+    /// command after the key FIFO changes.
+    cipher: Option<aes::Aes128>,
 }
 impl AesInterface {
     pub fn new() -> Self {
+        if !host_has_aes() {
+            warn!(target: "AES", "Host has no AES instructions, AES commands will be slow");
+        }
         AesInterface {
             ctrl: 0, 
             src: 0,
             dst: 0,
             key_fifo: VecDeque::with_capacity(0x10),
             iv_fifo: VecDeque::with_capacity(0x10),
-            iv_buffer: [0; 0x10]
+            iv_buffer: [0; 0x10],
+            cipher: None,
         }
     }
+
+    /// Get the cipher for the current contents of the key FIFO.
+    fn cipher(&mut self) -> &aes::Aes128 {
+        let key = self.key_fifo.as_slices().0;
+        self.cipher.get_or_insert_with(|| {
+            debug!(target: "AES", "AES key={key:02x?}");
+            aes::Aes128::new_from_slice(key).unwrap()
+        })
+    }
+}
+
+/// The key schedule is rebuilt after restoring.
+impl Snapshot for AesInterface {
+    fn save(&self, w: &mut dyn std::io::Write) -> anyhow::Result<()> {
+        put(w, &self.ctrl)?;
+        put(w, &self.src)?;
+        put(w, &self.dst)?;
+        put(w, &self.key_fifo)?;
+        put(w, &self.iv_fifo)?;
+        put(w, &self.iv_buffer)
+    }
+    fn restore(&mut self, r: &mut dyn std::io::Read) -> anyhow::Result<()> {
+        self.ctrl = get!(r);
+        self.src = get!(r);
+        self.dst = get!(r);
+        self.key_fifo = get!(r);
+        self.iv_fifo = get!(r);
+        self.iv_buffer = get!(r);
+        self.cipher = None;
+        Ok(())
+    }
+}
+
+/// Returns true if the host has instructions for AES, which the aes crate
+/// uses when they're available (see `.cargo/config.toml` for AArch64).
+fn host_has_aes() -> bool {
+    #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+    return is_x86_feature_detected!("aes");
+    #[cfg(target_arch = "aarch64")]
+    return std::arch::is_aarch64_feature_detected!("aes");
+    #[allow(unreachable_code)]
+    false
 }
 
 impl MmioDevice for AesInterface {
@@ -72,8 +123,8 @@ impl MmioDevice for AesInterface {
 
     fn read(&self, off: usize) -> anyhow::Result<BusPacket> {
         match off {
-            //0x00 => BusPacket::Word(self.ctrl),
-            0x00 => Ok(BusPacket::Word(0)),
+            // Only the busy bit, for commands still running on a worker
+            0x00 => Ok(BusPacket::Word(self.ctrl & 0x8000_0000)),
             _ => bail!("Unhandled AES interface read {off:x}"),
         }
     }
@@ -99,6 +150,7 @@ impl MmioDevice for AesInterface {
                     self.key_fifo.push_back(*b);
                 }
                 self.key_fifo.make_contiguous();
+                self.cipher = None;
             },
             0x10 => {
                 if self.iv_fifo.len() == 0x10 {
@@ -118,14 +170,30 @@ impl MmioDevice for AesInterface {
     }
 }
 
+/// Decrypt/encrypt some buffer in place.
+pub(crate) fn aes_cbc(cipher: aes::Aes128, iv: &[u8; 0x10], decrypt: bool, buf: &mut [u8]) {
+    let len = buf.len();
+    match decrypt {
+        true => {
+            let cipher_dec = Aes128CbcDec::inner_iv_slice_init(cipher, iv).unwrap();
+            cipher_dec.decrypt_padded_mut::<NoPadding>(buf).unwrap();
+        },
+        false => {
+            let cipher_enc = Aes128CbcEnc::inner_iv_slice_init(cipher, iv).unwrap();
+            cipher_enc.encrypt_padded_mut::<NoPadding>(buf, len).unwrap();
+        },
+    };
+}
+
 impl Bus {
     pub fn handle_task_aes(&mut self, val: u32) -> anyhow::Result<()> {
+        if self.defer_while_busy(Engine::Aes, BusTask::Aes(val)) {
+            return Ok(());
+        }
         let cmd = AesCommand::from(val);
 
-        // Read data from the source address
-        let mut aes_inbuf = vec![0u8; cmd.len];
-        self.dma_read(self.aes.src, &mut aes_inbuf)?;
         if log_enabled!(target: "AES", log::Level::Trace) {
+            let aes_inbuf = self.dma_view(self.aes.src, cmd.len)?;
             let mut msg = format!("AES DMA Buffer dump: {} bytes\n", aes_inbuf.len());
             for chunk in aes_inbuf.chunks(8) {
                 let mut space = false;
@@ -140,39 +208,55 @@ impl Bus {
         }
 
         if cmd.use_aes {
-            // Build the right AES cipher for this request
-            let key = self.aes.key_fifo.as_slices().0;
             let mut iv = [0u8; 0x10];
             if cmd.chain_iv {
                 iv.copy_from_slice(&self.aes.iv_buffer);
             } else {
                 iv.copy_from_slice(self.aes.iv_fifo.as_slices().0);
             }
-
-            debug!(target: "AES", "AES key={key:02x?}");
             debug!(target: "AES", "AES iv={iv:02x?}");
             debug!(target: "AES", "AES Decrypt src={:08x} dst={:08x} len={:08x}", self.aes.src, self.aes.dst, cmd.len);
 
-            // Decrypt/encrypt the data, then DMA write to memory
-            let aes_outbuf = match cmd.decrypt {
-                true => {
-                    let cipher_dec = Aes128CbcDec::new_from_slices(key, &iv).unwrap();
-                    cipher_dec.decrypt_padded_vec_mut::<NoPadding>(&aes_inbuf).unwrap()
-                },
-                false => {
-                    let cipher_enc = Aes128CbcEnc::new_from_slices(key, &iv).unwrap();
-                    cipher_enc.encrypt_padded_vec_mut::<NoPadding>(&aes_inbuf)
-                },
-            };
-
-            self.dma_write(self.aes.dst, &aes_outbuf)?;
-
-            // Update IV buffer with the last 16 bytes of data
-            self.aes.iv_buffer.copy_from_slice(&aes_inbuf[(cmd.len - 0x10)..]);
+            // Cloning the cipher only clones the expanded key schedule
+            let cipher = self.aes.cipher().clone();
+
+            // Large encryptions run on a worker, and complete later on
+            // (decryption is fast enough to always do here)
+            if !cmd.decrypt && cmd.len >= OFFLOAD_BYTES {
+                let data = self.dma_view(self.aes.src, cmd.len)?.to_vec();
+                self.start_offload(Engine::Aes, val, cmd.len, Job::Aes { cipher, iv, decrypt: cmd.decrypt, data });
+                return Ok(());
+            }
+
+            // Keep the last 16 bytes of input for the IV buffer, since the
+            // input may be overwritten
+            let mut last = [0u8; 0x10];
+            last.copy_from_slice(&self.dma_view(self.aes.src, cmd.len)?[(cmd.len - 0x10)..]);
+
+            // Decrypt/encrypt the data in place at the destination
+            self.dma_copy(self.aes.src, self.aes.dst, cmd.len)?;
+            let buf = self.dma_view_mut(self.aes.dst, cmd.len)?;
+            aes_cbc(cipher, &iv, cmd.decrypt, buf);
+
+            self.aes.iv_buffer = last;
         } else {
-            self.dma_write(self.aes.dst, &aes_inbuf)?;
+            self.dma_copy(self.aes.src, self.aes.dst, cmd.len)?;
         }
+        self.complete_aes(&cmd);
+        Ok(())
+    }
 
+    /// Write back the output of a command that ran on a worker, and complete
+    /// it.
+    pub(crate) fn complete_aes_job(&mut self, val: u32, data: &[u8], last: [u8; 0x10]) -> anyhow::Result<()> {
+        let cmd = AesCommand::from(val);
+        self.dma_view_mut(self.aes.dst, cmd.len)?.copy_from_slice(data);
+        self.aes.iv_buffer = last;
+        self.complete_aes(&cmd);
+        Ok(())
+    }
+
+    fn complete_aes(&mut self, cmd: &AesCommand) {
         // Update the source/destination registers exposed over MMIO
         self.aes.dst += cmd.len as u32;
         self.aes.src += cmd.len as u32;
@@ -183,8 +267,5 @@ impl Bus {
         if cmd.irq { 
             self.hlwd.irq.assert(HollywoodIrq::Aes);
         }
-        Ok(())
     }
 }
-
-
@@ -1,13 +1,14 @@
 
 use anyhow::bail;
 use anyhow::ensure;
+use bincode::{Decode, Encode};
 
 use crate::bus::prim::*;
 use crate::bus::mmio::*;
 use crate::bus::task::*;
 
 /// Representing the SHA interface.
-#[derive(Default)]
+#[derive(Default, Encode, Decode)]
 pub struct EhcInterface {
     pub unk_a4: u32,
     pub unk_b0: u32,
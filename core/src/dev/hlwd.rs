@@ -2,6 +2,7 @@ use crate::bus::*;
 use crate::bus::prim::*;
 use crate::bus::mmio::*;
 use crate::bus::task::*;
+use bincode::{Decode, Encode};
 
 use anyhow::bail;
 use log::{error, warn, info};
@@ -20,35 +21,33 @@ pub mod irq;
 pub mod ipc;
 
 /// The timer/alarm interface.
-#[derive(Default, Debug, Clone)]
+///
+/// The timer isn't stepped; its value is derived from the bus cycle count
+/// whenever it's read, and the alarm is scheduled on the bus.
+#[derive(Default, Debug, Clone, Encode, Decode)]
 pub struct TimerInterface {
-    pub timer: u32,
     pub alarm: u32,
-
-    pub cpu_cycle_prev: usize,
+    /// Incremented on every write to the alarm register.
+    pub alarm_gen: u32,
 }
 impl TimerInterface {
     /// Timer period (some fraction of the CPU clock).
     pub const CPU_CLK_DIV: usize = 128;
 
-    pub fn step(&mut self, current_cpu_cycle: usize) -> bool {
-        // Fine as long as bus steps are interleaved with CPU steps I guess?
-        if current_cpu_cycle - self.cpu_cycle_prev >= Self::CPU_CLK_DIV {
-            self.timer += 1;
-            self.cpu_cycle_prev = current_cpu_cycle;
-            if self.timer == self.alarm {
-                info!(target: "HLWD", "alarm IRQ {:08x}", self.timer);
-                return true;
-            } else {
-                return false;
-            }
-        }
-        false
+    /// The number of times the timer has been incremented after some
+    /// number of bus cycles.
+    pub fn ticks(cycle: usize) -> usize {
+        cycle / Self::CPU_CLK_DIV
+    }
+
+    /// The value of the timer after some number of bus cycles.
+    pub fn value(cycle: usize) -> u32 {
+        Self::ticks(cycle) as u32
     }
 }
 
 /// Various clocking registers.
-#[derive(Debug, Clone)]
+#[derive(Debug, Clone, Encode, Decode)]
 pub struct ClockInterface {
     pub sys: u32,       // 0x1b0
     pub sys_ext: u32,   // 0x1b4
@@ -76,14 +75,14 @@ impl Default for ClockInterface {
 
 
 /// Various bus control registers (?)
-#[derive(Default, Debug, Clone)]
+#[derive(Default, Debug, Clone, Encode, Decode)]
 pub struct BusCtrlInterface {
     pub srnprot: u32,
     pub ahbprot: u32,
     pub aipprot: u32,
 }
 
-#[derive(Default, Debug, Clone)]
+#[derive(Default, Debug, Clone, Encode, Decode)]
 pub struct ArbCfgInterface {
     pub m0: u32,
     pub m1: u32,
@@ -145,7 +144,7 @@ impl ArbCfgInterface {
 
 
 /// Unknown interface (probably related to the AHB).
-#[derive(Default, Debug, Clone)]
+#[derive(Default, Debug, Clone, Encode, Decode)]
 pub struct AhbInterface {
     pub unk_08: u32,
     pub unk_10: u32,
@@ -212,6 +211,14 @@ pub struct Hollywood {
     pub usb_frc_rst: u32,
     pub ppc_on: bool,
 }
+crate::snapshot::impl_snapshot!(Hollywood,
+    encode: [
+        task, ipc, timer, busctrl, pll, otp, irq, exi, di, mi, ahb, ddr, arb,
+        reset_ahb, clocks, resets, compat, spare0, spare1, io_str_ctrl0,
+        io_str_ctrl1, usb_frc_rst, ppc_on,
+    ],
+    nested: [gpio],
+);
 impl Hollywood {
     pub fn new() -> anyhow::Result<Self> {
         // TODO: Where do the initial values for these registers matter?
@@ -252,7 +259,8 @@ impl MmioDevice for Hollywood {
     fn read(&self, off: usize) -> anyhow::Result<BusPacket> {
         let val = match off {
             0x000..=0x00c   => self.ipc.read_handler(off)?,
-            0x010           => self.timer.timer,
+            // NOTE: The timer (0x010) is handled by the bus, which knows the
+            // current cycle.
             0x014           => self.timer.alarm,
             0x030..=0x05c   => self.irq.read_handler(off - 0x30)?,
             0x060           => self.busctrl.srnprot,
@@ -289,8 +297,8 @@ impl MmioDevice for Hollywood {
         match off {
             0x000..=0x00c => self.ipc.write_handler(off, val)?,
             0x014 => {
-                info!(target: "HLWD", "alarm={val:08x} (timer={:08x})", self.timer.timer);
                 self.timer.alarm = val;
+                return Ok(Some(BusTask::ScheduleAlarm));
             },
             0x030..=0x05c => self.irq.write_handler(off - 0x30, val)?,
             0x060 => {
@@ -420,19 +428,15 @@ impl MmioDevice for Hollywood {
 
 }
 
-#[derive(Copy, Clone, Debug, PartialEq)]
+#[derive(Copy, Clone, Debug, PartialEq, Encode, Decode)]
 pub enum HlwdTask { 
     GpioOutput(u32) 
 }
 
 impl Bus {
-    pub fn handle_step_hlwd(&mut self, cpu_cycle: usize) -> anyhow::Result<()> {
+    pub fn handle_step_hlwd(&mut self) -> anyhow::Result<()> {
 
         // Potentially assert an IRQ
-        let timer_irq = self.hlwd.timer.step(cpu_cycle);
-        if timer_irq {
-            self.hlwd.irq.assert(irq::HollywoodIrq::Timer);
-        }
         if self.hlwd.ipc.assert_ppc_irq() {
             self.hlwd.irq.assert(irq::HollywoodIrq::PpcIpc);
         }
@@ -448,6 +452,34 @@ impl Bus {
         }
         Ok(())
     }
+
+    /// Schedule the alarm IRQ for the next time the timer reaches the value
+    /// in the alarm register.
+    pub fn schedule_alarm(&mut self) {
+        let timer = &mut self.hlwd.timer;
+        timer.alarm_gen = timer.alarm_gen.wrapping_add(1);
+        info!(target: "HLWD", "alarm={:08x} (timer={:08x})",
+            timer.alarm, TimerInterface::value(self.cycle));
+
+        // The alarm fires on the increment that makes the timer equal to
+        // the alarm value (so, after wrapping around if already equal).
+        let ticks = TimerInterface::ticks(self.cycle);
+        let delta = match timer.alarm.wrapping_sub(ticks as u32) {
+            0 => u32::MAX as usize + 1,
+            delta => delta as usize,
+        };
+        // Fire on the step which completes the cycle where it's incremented
+        let target_cycle = (ticks + delta) * TimerInterface::CPU_CLK_DIV - 1;
+        self.tasks.push(Task { kind: BusTask::Alarm(timer.alarm_gen), target_cycle });
+    }
+
+    /// Handle an alarm scheduled by [Bus::schedule_alarm].
+    pub fn handle_alarm(&mut self, alarm_gen: u32) {
+        if alarm_gen == self.hlwd.timer.alarm_gen {
+            info!(target: "HLWD", "alarm IRQ {:08x}", self.hlwd.timer.alarm);
+            self.hlwd.irq.assert(irq::HollywoodIrq::Timer);
+        }
+    }
 }
 
 
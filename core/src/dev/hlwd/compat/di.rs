@@ -1,11 +1,12 @@
 use anyhow::bail;
+use bincode::{Decode, Encode};
 
 use crate::bus::mmio::*;
 use crate::bus::prim::*;
 use crate::bus::task::*;
 
 /// Legacy disc drive interface.
-#[derive(Default, Debug, Clone)]
+#[derive(Default, Debug, Clone, Encode, Decode)]
 #[allow(dead_code)]
 pub struct DriveInterface {
     disr: u32,
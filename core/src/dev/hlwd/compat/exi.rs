@@ -1,13 +1,14 @@
 pub mod device;
 use anyhow::bail;
 use device::*;
+use bincode::{Decode, Encode};
 
 use crate::bus::mmio::*;
 use crate::bus::prim::*;
 use crate::bus::task::*;
 
 /// Representing user-configurable EXI clock freqencies.
-#[derive(Debug, Clone, Copy)]
+#[derive(Debug, Clone, Copy, Encode, Decode)]
 pub enum EXIFreq {
     Clk1Mhz, Clk2Mhz, Clk4Mhz, Clk8Mhz, Clk16Mhz, Clk32Mhz, Undef
 }
@@ -27,7 +28,7 @@ impl From<u32> for EXIFreq {
 }
 
 /// Representing an EXI transfer type.
-#[derive(Debug, Clone, Copy)]
+#[derive(Debug, Clone, Copy, Encode, Decode)]
 pub enum EXITransfer {
     Read, Write, ReadWrite, Undef,
 }
@@ -45,7 +46,7 @@ impl From<u32> for EXITransfer {
 
 /// Container for the state associated with an EXI channel, determined by the 
 /// current value of the channel's status and control registers.
-#[derive(Debug, Clone, Copy)]
+#[derive(Debug, Clone, Copy, Encode, Decode)]
 pub struct ChannelState {
     /// Device connected flag
     pub ext: bool,
@@ -110,7 +111,7 @@ impl ChannelState {
 }
 
 /// Representing a single channel on the external interface.
-#[derive(Debug, Clone)]
+#[derive(Debug, Clone, Encode, Decode)]
 pub struct EXIChannel {
     /// Channel index
     idx: usize,
@@ -183,7 +184,7 @@ impl EXIChannel {
 
 
 /// Legacy external interface (EXI).
-#[derive(Debug, Clone)]
+#[derive(Debug, Clone, Encode, Decode)]
 pub struct EXInterface {
     /// EXI Channel 0 state
     pub chan0: Box<EXIChannel>,
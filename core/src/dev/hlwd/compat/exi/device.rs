@@ -1,6 +1,8 @@
 
+use bincode::{Decode, Encode};
+
 /// Representing a particular EXI device.
-#[derive(Debug, Clone, Copy)]
+#[derive(Debug, Clone, Copy, Encode, Decode)]
 pub enum EXIDeviceKind {
     CardSlotA,
     CardSlotB,
@@ -2,9 +2,10 @@ use crate::bus::prim::*;
 use crate::bus::mmio::*;
 use crate::bus::task::*;
 use crate::bus::Bus;
+use bincode::{Decode, Encode};
 
 /// Legacy memory interface.
-#[derive(Clone)]
+#[derive(Clone, Encode, Decode)]
 pub struct MemInterface {
     pub reg: [u16; 0x40],
     pub ddr_data: u16,
@@ -1,4 +1,5 @@
 use anyhow::bail;
+use bincode::{Decode, Encode};
 
 use crate::bus::prim::*;
 use crate::bus::mmio::*;
@@ -7,7 +8,7 @@ use crate::bus::task::*;
 const DDR_REG_LEN: usize = 0xca + 1;
 const SEQ_REG_LEN: usize = 0x4c + 1;
 
-#[derive(Clone)]
+#[derive(Clone, Encode, Decode)]
 pub struct DdrInterface {
     pub ddr_reg: Box<[u16; DDR_REG_LEN]>,
     pub seq_reg: Box<[u16; SEQ_REG_LEN]>,
@@ -2,6 +2,7 @@
 pub mod seeprom;
 use anyhow::bail;
 use log::{info, error};
+use bincode::{Decode, Encode};
 
 use crate::dev::hlwd::gpio::seeprom::*;
 use crate::dev::hlwd::*;
@@ -34,6 +35,7 @@ pub struct GpioInterface {
 
     pub seeprom: SeepromState,
 }
+crate::snapshot::impl_snapshot!(GpioInterface, encode: [arm, ppc], nested: [seeprom]);
 impl GpioInterface {
     pub fn new() -> anyhow::Result<Self> {
         Ok(GpioInterface {
@@ -66,7 +68,7 @@ impl GpioInterface {
 
 
 /// ARM-facing GPIO pin state.
-#[derive(Default, Debug, Clone)]
+#[derive(Default, Debug, Clone, Encode, Decode)]
 #[allow(dead_code)]
 pub struct ArmGpio {
     en: u32,
@@ -119,7 +121,7 @@ impl ArmGpio {
 }
 
 /// PowerPC-facing GPIO pin state.
-#[derive(Default, Debug, Clone)]
+#[derive(Default, Debug, Clone, Encode, Decode)]
 #[allow(dead_code)]
 pub struct PpcGpio {
     output: u32,
@@ -1,11 +1,12 @@
 #![allow(clippy::unusual_byte_groupings)]
 use crate::dev::hlwd::gpio::*;
 use crate::mem::*;
+use bincode::{Decode, Encode};
 
 use log::{debug, info};
 
 /// Set of commands to/states of the SEEPROM state machine.
-#[derive(Debug, Clone, Copy, PartialEq)]
+#[derive(Debug, Clone, Copy, PartialEq, Encode, Decode)]
 pub enum SeepromOp { 
     Ewds, Wral, Eral, Ewen, Ext, Write, Read, Erase, Init
 }
@@ -54,6 +55,10 @@ pub struct SeepromState {
     pub addr: Option<usize>,
     pub write_buffer: Option<u16>,
 }
+crate::snapshot::impl_snapshot!(SeepromState,
+    encode: [in_buf, num_bits, out_buf, opcd, wren, addr, write_buffer],
+    nested: [data],
+);
 impl SeepromState {
     pub fn new() -> anyhow::Result<Self> {
         Ok(SeepromState {
@@ -70,6 +75,11 @@ impl SeepromState {
 }
 
 impl SeepromState {
+    /// Start keeping track of dirty pages in the SEEPROM.
+    pub fn track_dirty_pages(&mut self) {
+        self.data.track_dirty_pages();
+    }
+
     pub fn reset(&mut self) {
         self.in_buf = 0;
         self.out_buf = None;
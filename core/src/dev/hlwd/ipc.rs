@@ -2,8 +2,9 @@
 //use crate::dev::hlwd::irq::*;
 use anyhow::bail;
 use log::debug;
+use bincode::{Decode, Encode};
 
-#[derive(Clone, Default, Debug)]
+#[derive(Clone, Default, Debug, Encode, Decode)]
 pub struct MailboxState {
     pub ppc_req: bool,
     pub ppc_ack: bool,
@@ -67,7 +68,7 @@ impl MailboxState {
 }
 
 /// The inter-processor communication interface.
-#[derive(Clone, Debug, Default)]
+#[derive(Clone, Debug, Default, Encode, Decode)]
 pub struct IpcInterface {
     pub ppc_msg: u32,
     pub arm_msg: u32,
@@ -1,5 +1,6 @@
 use anyhow::bail;
 use log::{debug, error, info};
+use bincode::{Decode, Encode};
 
 
 #[derive(Debug, Copy, Clone)]
@@ -27,7 +28,7 @@ pub enum HollywoodIrq {
     ArmIpc  = 0x8000_0000,
 }
 
-#[derive(Debug, Default, Clone)]
+#[derive(Debug, Default, Clone, Encode, Decode)]
 #[repr(transparent)]
 pub struct IrqBits(pub u32);
 impl IrqBits {
@@ -63,7 +64,7 @@ impl IrqBits {
     pub fn armipc(&self) -> bool    { (self.0 & 0x8000_0000) != 0 }
 }
 
-#[derive(Debug, Default, Clone)]
+#[derive(Debug, Default, Clone, Encode, Decode)]
 pub struct IrqInterface {
     /// Output IRQ line to the ARM side; set true when any IRQ is asserted
     pub arm_irq_output: bool,
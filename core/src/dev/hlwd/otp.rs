@@ -2,10 +2,12 @@
 use std::io::Read;
 use std::fs::File;
 use crate::bus::prim::AccessWidth;
+use bincode::{Decode, Encode};
 
 use log::{debug, trace, log_enabled};
 
 /// One-time programmable memory device/interface.
+#[derive(Encode, Decode)]
 pub struct OtpInterface {
     /// Bits fused to the device.
     data: Box<[u8; 0x80]>,
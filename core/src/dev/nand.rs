@@ -1,11 +1,13 @@
 pub mod util;
 use anyhow::bail;
 use log::info;
+use bincode::{Decode, Encode};
 
 use crate::dev::nand::util::*;
 
 use crate::mem::*;
 use crate::bus::*;
+use crate::bus::dispatch::ram_device;
 use crate::bus::prim::*;
 use crate::bus::mmio::*;
 use crate::bus::task::*;
@@ -105,7 +107,7 @@ pub enum NandState {
 }
 
 /// Set of registers exposed by the NAND interface.
-#[derive(Clone, Copy)]
+#[derive(Clone, Copy, Encode, Decode)]
 pub struct NandRegisters {
     pub ctrl: u32,
     pub cfg: u32,
@@ -129,6 +131,7 @@ pub struct NandInterface {
     /// Set of registers associated with this interface.
     pub reg: NandRegisters,
 }
+crate::snapshot::impl_snapshot!(NandInterface, encode: [reg], nested: [data]);
 impl NandInterface {
     /// Create a new instance of the NAND interface.
     pub fn new(filename: &str) -> anyhow::Result<Self> {
@@ -264,45 +267,37 @@ impl Bus {
             }
             len = 0x840;
         }
-        // Read the source data from the NAND
-        let mut local_buf = vec![0; len];
-
         let off = reg.addr2 as usize * NAND_PAGE_LEN;
-        self.nand.read_data(off, &mut local_buf)?;
+        let (data_dev, data_off) = self.resolve_dma_write(reg.databuf, 0x800)?;
+        let (spare_dev, spare_off) = self.resolve_dma_write(reg.eccbuf, len - 0x800)?;
 
-        //info!(target: "Other", "{:?}", local_buf.hex_dump());
-        // Do the DMA writes to memory
-        self.dma_write(reg.databuf, &local_buf[..0x800])?;
-        self.dma_write(reg.eccbuf, &local_buf[0x800..])?;
+        // Copy the page straight from the NAND into memory
+        let page = self.nand.data.view(off, len)?;
+        ram_device!(mut self, data_dev).view_mut(data_off, 0x800)?
+            .copy_from_slice(&page[..0x800]);
+        ram_device!(mut self, spare_dev).view_mut(spare_off, len - 0x800)?
+            .copy_from_slice(&page[0x800..]);
 
         // Compute and write the ECC bytes for the data
-        for i in 0..4 {
-            let addr = (reg.eccbuf ^ 0x40) + (i as u32 * 4);
-            let new_ecc = calc_ecc(&mut local_buf[(i * 0x200)..]);
-            // let old_ecc = self.read32(addr);
-            //info!(target: "Other", "NND old_ecc={:08x} new_ecc={:08x}", old_ecc, new_ecc);
-            self.write32(addr, new_ecc)?;
-        }
-        Ok(())
+        let ecc = calc_page_ecc(page);
+        self.dma_write(reg.eccbuf ^ 0x40, &ecc)
     }
 
     /// Write a NAND page (its okay that this is a mess, for now..)
     fn nand_write_page(&mut self, cmd: &NandCmd, reg: &NandRegisters) -> anyhow::Result<()> {
-        // Read from memory
-        let mut local_buf = vec![0; cmd.len as usize];
-        self.dma_read(reg.databuf, &mut local_buf)?;
-
+        let len = cmd.len as usize;
         let off = (reg.current_page as usize * NAND_PAGE_LEN) + 
             reg.current_poff as usize;
-        self.nand.write_data(off, &local_buf)?;
+
+        // Copy the data straight from memory into the NAND
+        let (dev, src_off) = self.resolve_dma_read(reg.databuf)?;
+        let src = ram_device!(self, dev).view(src_off, len)?;
+        self.nand.data.view_mut(off, len)?.copy_from_slice(src);
 
         if cmd.ecc {
             assert!(cmd.len == 0x800);
-            for i in 0..4 {
-                let addr = (reg.eccbuf ^ 0x40) + (i as u32 * 4);
-                let new_ecc = calc_ecc(&mut local_buf[(i * 0x200)..]);
-                self.write32(addr, new_ecc)?;
-            }
+            let ecc = calc_page_ecc(src);
+            self.dma_write(reg.eccbuf ^ 0x40, &ecc)?;
         }
         Ok(())
     }
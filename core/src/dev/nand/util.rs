@@ -1,36 +1,159 @@
+//! Computing the ECC for NAND pages.
+//!
+//! The ECC for each 512-byte block is a Hamming code, made up of column
+//! parities (over the bits of all bytes XOR'ed together) and line parities
+//! (over the bytes whose index has some bit set or cleared). Since the parity
+//! of a XOR of bytes is the XOR of their parities, the line parities for set
+//! index bits are just the bits of the XOR of the indices of every byte with
+//! odd parity, and the ones for cleared index bits follow from the overall
+//! parity. This is done eight bytes at a time.
+
+/// For each mask of bytes in a word, the XOR of the index of each byte.
+const INDEX_XOR: [u8; 256] = {
+    let mut table = [0u8; 256];
+    let mut mask = 0;
+    while mask < 256 {
+        let mut idx = 0;
+        while idx < 8 {
+            if mask & (1 << idx) != 0 {
+                table[mask] ^= idx as u8;
+            }
+            idx += 1;
+        }
+        mask += 1;
+    }
+    table
+};
 
 pub fn parity(input: u8) -> u8 { 
     (input.count_ones() % 2) as u8 
 }
 
-pub fn calc_ecc(data: &mut [u8]) -> u32 {
-    let mut a = [[0u8; 2]; 12];
-    let mut a0 = 0u32;
-    let mut a1 = 0u32;
-
-    for (idx, data) in data.iter().enumerate().take(512) {
-        for j in 0..9 {
-            a[3 + j][(idx >> j) & 1] ^= data;
-        }
-    }
+/// Compute the ECC for the first 512 bytes of some data.
+pub fn calc_ecc(data: &[u8]) -> u32 {
+    let mut total = 0u64;
+    let mut odd_idx = 0u32;
+    for (word_idx, word) in data[..512].chunks_exact(8).enumerate() {
+        let word = u64::from_le_bytes(word.try_into().unwrap());
+        total ^= word;
 
-    let x: u8 = a[3][0] ^ a[3][1];
-    a[0][0] = x & 0x55;
-    a[0][1] = x & 0xaa;
-    a[1][0] = x & 0x33;
-    a[1][1] = x & 0xcc;
-    a[2][0] = x & 0x0f;
-    a[2][1] = x & 0xf0;
+        // Get the parity of each byte in bit 0, then gather them into a
+        // mask with bit N set for byte N.
+        let mut p = word ^ (word >> 4);
+        p ^= p >> 2;
+        p ^= p >> 1;
+        p &= 0x0101_0101_0101_0101;
+        let mask = (p.wrapping_mul(0x0102_0408_1020_4080) >> 56) as usize;
 
-    for (idx, aj) in a.iter_mut().enumerate() {
-        aj[0] = parity(aj[0]);
-        aj[1] = parity(aj[1]);
-        a0 |= (aj[0] as u32) << idx;
-        a1 |= (aj[1] as u32) << idx;
+        odd_idx ^= INDEX_XOR[mask] as u32;
+        if mask.count_ones() & 1 != 0 {
+            odd_idx ^= (word_idx as u32) << 3;
+        }
     }
+    let x = total.to_le_bytes().iter().fold(0, |acc, b| acc ^ b);
 
+    // Column parities, then line parities
+    let mut a0 = parity(x & 0x55) as u32
+        | (parity(x & 0x33) as u32) << 1
+        | (parity(x & 0x0f) as u32) << 2;
+    let mut a1 = parity(x & 0xaa) as u32
+        | (parity(x & 0xcc) as u32) << 1
+        | (parity(x & 0xf0) as u32) << 2;
+    let all = if parity(x) != 0 { 0x1ff } else { 0 };
+    a0 |= ((odd_idx ^ all) & 0x1ff) << 3;
+    a1 |= (odd_idx & 0x1ff) << 3;
 
     (a0 & 0x0000_00ff) << 24 | (a0 & 0x0000_ff00) << 8 |
     (a1 & 0x0000_00ff) << 8  | (a1 & 0x0000_ff00) >> 8
 }
 
+/// Compute the ECC words for each 512-byte block in a 2KiB page, in the
+/// same order (and byte order) as they're written to memory.
+pub fn calc_page_ecc(page: &[u8]) -> [u8; 0x10] {
+    let mut res = [0u8; 0x10];
+    for i in 0..4 {
+        let ecc = calc_ecc(&page[(i * 0x200)..]);
+        res[(i * 4)..(i * 4) + 4].copy_from_slice(&ecc.to_be_bytes());
+    }
+    res
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    /// The bit-at-a-time version of [calc_ecc], which follows the
+    /// definition of each parity directly.
+    fn calc_ecc_reference(data: &[u8]) -> u32 {
+        let mut a = [[0u8; 2]; 12];
+        let mut a0 = 0u32;
+        let mut a1 = 0u32;
+
+        for (idx, data) in data.iter().enumerate().take(512) {
+            for j in 0..9 {
+                a[3 + j][(idx >> j) & 1] ^= data;
+            }
+        }
+
+        let x: u8 = a[3][0] ^ a[3][1];
+        a[0][0] = x & 0x55;
+        a[0][1] = x & 0xaa;
+        a[1][0] = x & 0x33;
+        a[1][1] = x & 0xcc;
+        a[2][0] = x & 0x0f;
+        a[2][1] = x & 0xf0;
+
+        for (idx, aj) in a.iter_mut().enumerate() {
+            aj[0] = parity(aj[0]);
+            aj[1] = parity(aj[1]);
+            a0 |= (aj[0] as u32) << idx;
+            a1 |= (aj[1] as u32) << idx;
+        }
+
+        (a0 & 0x0000_00ff) << 24 | (a0 & 0x0000_ff00) << 8 |
+        (a1 & 0x0000_00ff) << 8  | (a1 & 0x0000_ff00) >> 8
+    }
+
+    fn check(data: &[u8]) {
+        assert_eq!(calc_ecc(data), calc_ecc_reference(data), "block {data:02x?}");
+    }
+
+    #[test]
+    fn ecc_matches_reference_on_patterns() {
+        for fill in [0x00, 0xff, 0x55, 0xaa, 0x01, 0x80] {
+            check(&[fill; 512]);
+        }
+        // Every single-bit flip, on both blank patterns
+        for fill in [0x00, 0xff] {
+            for bit in 0..512 * 8 {
+                let mut data = [fill; 512];
+                data[bit / 8] ^= 1 << (bit % 8);
+                check(&data);
+            }
+        }
+    }
+
+    #[test]
+    fn ecc_matches_reference_on_random_blocks() {
+        // xorshift64, so that failures are reproducible
+        let mut state = 0x9e37_79b9_7f4a_7c15u64;
+        let mut data = [0u8; 512];
+        for _ in 0..1000 {
+            for byte in data.iter_mut() {
+                state ^= state << 13;
+                state ^= state >> 7;
+                state ^= state << 17;
+                *byte = state as u8;
+            }
+            check(&data);
+        }
+    }
+
+    #[test]
+    fn ecc_ignores_data_past_the_block() {
+        let mut data = [0xa5u8; 0x840];
+        let ecc = calc_ecc(&data);
+        data[512..].fill(0x3c);
+        assert_eq!(calc_ecc(&data), ecc);
+    }
+}
@@ -1,12 +1,13 @@
 
 use anyhow::bail;
 use log::debug;
+use bincode::{Decode, Encode};
 
 use crate::bus::prim::*;
 use crate::bus::mmio::*;
 use crate::bus::task::*;
 
-#[derive(Default)]
+#[derive(Default, Encode, Decode)]
 pub struct OhcInterface {
     pub idx: usize,
 
@@ -7,17 +7,24 @@ use log::debug;
 use log::error;
 use log::log_enabled;
 use log::trace;
+use bincode::{Decode, Encode};
 
 use crate::bus::prim::*;
 use crate::bus::mmio::*;
 use crate::bus::task::*;
 use crate::bus::Bus;
+use crate::bus::dispatch::ram_device;
 use card::*;
 
 /// Changing this to false will disable DMA support
 const SDHC_ENABLE_DMA: bool = true;
 
-#[derive(Debug)]
+/// Time taken by the card to start a DMA transfer, in bus cycles.
+const DMA_SETUP_CYCLES: usize = 1000;
+/// Time taken to move each block over DMA, in bus cycles (about 25MB/s).
+const DMA_BLOCK_CYCLES: usize = 5000;
+
+#[derive(Debug, Encode, Decode)]
 pub enum SDHCTask {
     RaiseInt,
     SendBufReadReady,
@@ -25,6 +32,9 @@ pub enum SDHCTask {
     IOPoll,
     DoDMARead,
     DoDMAWrite,
+    /// A DMA transfer has finished, leaving some number of blocks and the
+    /// address to continue from.
+    DMAComplete { block_count: u32, sysaddr: u32 },
 }
 
 #[derive(Debug, Copy, Clone)]
@@ -381,6 +391,10 @@ pub struct SDInterface {
     card_available: bool,
     tx_status: CardTXStatus,
 }
+crate::snapshot::impl_snapshot!(SDInterface,
+    encode: [register_file, pending_interrupt_flags, insert_raised, first_ack, card_available, tx_status],
+    nested: [card],
+);
 
 impl SDInterface {
     fn raw_read(&self, off: usize) -> u32 {
@@ -583,7 +597,7 @@ impl SDInterface {
     }
     fn dma_int(&mut self) -> bool {
         const DMA_INT: u32 = 1 << 3;
-        match self.tx_status {
+        match self.card.tx_status {
             CardTXStatus::None |
             CardTXStatus::MultiReadPending |
             CardTXStatus::MultiReadInProgress |
@@ -601,7 +615,21 @@ impl SDInterface {
 
 impl Default for SDInterface {
     fn default() -> Self {
-        let (card, card_available) = Card::try_new();
+        Self::new(false)
+    }
+}
+
+impl SDInterface {
+    /// Start keeping track of dirty pages on the card.
+    pub fn track_dirty_pages(&mut self) {
+        self.card.backing_mem.get_mut().track_dirty_pages();
+    }
+
+    /// Create the interface, with the card backed by `sd.img` (if there is
+    /// one). Writes to the card are only written back to the image when
+    /// `write_back` is set.
+    pub fn new(write_back: bool) -> Self {
+        let (card, card_available) = Card::try_new(write_back);
         let mut new = Self { register_file: [0;256], pending_interrupt_flags: 0, insert_raised: false, first_ack: false, card, card_available, tx_status: CardTXStatus::None };
         // Fill HWInit registers
         // Capabilities Register
@@ -670,7 +698,7 @@ impl MmioDevice for SDInterface {
     }
 }
 
-#[derive(Default)]
+#[derive(Default, Encode, Decode)]
 pub struct WLANInterface {
     pub unk_24: u32,
     pub unk_40: u32,
@@ -696,7 +724,7 @@ impl MmioDevice for WLANInterface {
 
 
 impl Bus {
-    pub(crate) fn handle_task_sdhc(&mut self, task: SDHCTask) {
+    pub(crate) fn handle_task_sdhc(&mut self, task: SDHCTask) -> anyhow::Result<()> {
         use super::hlwd::irq::HollywoodIrq;
         match task {
             SDHCTask::RaiseInt => {
@@ -729,84 +757,20 @@ impl Bus {
                     },
                 }
             },
-            SDHCTask::DoDMARead => {
-                let sysaddr = self.sd0.raw_read(SDRegisters::SystemAddress.base_offset());
-                let buff_boundry = 0x1000u32 << ((self.sd0.raw_read(SDRegisters::BlockSize.base_offset()) & 0x7000) >> 12);
-                let stop_addr = match sysaddr.checked_add(buff_boundry) { // mini always sets 512k boundry size, even if that would overrun the address space
-                    Some(x) => (x + 1) & !(buff_boundry - 1),
-                    None => u32::MAX,
-                };
-                let mut block_count = self.sd0.raw_read(SDRegisters::BlockCount.base_offset() & 0xffff_fffc) >> 16;
-                let mut current_addr = sysaddr;
-                debug!(target: "SDHC", "Starting DMA Read Tx to sysaddr: {sysaddr:x}");
-                let mut local_buf = vec![0;512];
-                while current_addr+512 < stop_addr && block_count > 0 {
-                    let offset = self.sd0.card.rw_index.load(std::sync::atomic::Ordering::Relaxed);
-                    self.sd0.card.backing_mem.lock().read_buf(offset, &mut local_buf).unwrap();
-                    self.dma_write(current_addr, &local_buf).unwrap();
-                    self.sd0.card.rw_index.store(offset + 512, std::sync::atomic::Ordering::Relaxed);
-                    local_buf.fill(0);
-                    block_count -= 1;
-                    current_addr += 512;
-                }
-                let send_dma_int = current_addr >= stop_addr;
-                let send_tx_complete = block_count == 0;
-                debug!(target: "SDHC", "DMA Transfer completed after {} blocks. Reached DMA Boundry: {send_dma_int}. Reached Block Count: {send_tx_complete}", (current_addr-sysaddr) / 512);
+            SDHCTask::DoDMARead => self.sdhc_dma(false)?,
+            SDHCTask::DoDMAWrite => self.sdhc_dma(true)?,
+            SDHCTask::DMAComplete { block_count, sysaddr } => {
                 self.sd0.setreg(SDRegisters::BlockCount, block_count);
-                self.sd0.setreg(SDRegisters::SystemAddress, current_addr);
-                if send_tx_complete { // TX Complete has higher priority than DMA complete. Never send both!
+                self.sd0.setreg(SDRegisters::SystemAddress, sysaddr);
+                if block_count == 0 { // TX Complete has higher priority than DMA complete. Never send both!
                     if self.sd0.tx_complete() {
                         self.hlwd.irq.assert(HollywoodIrq::Sdhc);
                     }
                 }
-                else if send_dma_int {
-                    if self.sd0.dma_int() {
-                        self.hlwd.irq.assert(HollywoodIrq::Sdhc);
-                    }
-                }
-                else {
-                    unreachable!("SDHC DMA Logic Error");
+                else if self.sd0.dma_int() {
+                    self.hlwd.irq.assert(HollywoodIrq::Sdhc);
                 }
             },
-            SDHCTask::DoDMAWrite => {
-                let sysaddr: u32 = self.sd0.raw_read(SDRegisters::SystemAddress.base_offset());
-                let buff_boundry = 0x1000u32 << ((self.sd0.raw_read(SDRegisters::BlockSize.base_offset()) & 0x7000) >> 12);
-                let stop_addr = match sysaddr.checked_add(buff_boundry) { // mini always sets 512k boundry size, even if that would overrun the address space
-                    Some(x) => (x + 1) & !(buff_boundry - 1),
-                    None => u32::MAX,
-                };
-                let mut block_count = self.sd0.raw_read(SDRegisters::BlockCount.base_offset() & 0xffff_fffc) >> 16;
-                let mut current_addr = sysaddr;
-                debug!(target: "SDHC", "Starting DMA Write Tx from sysaddr: {sysaddr:x}");
-                let mut local_buf = vec![0;512];
-                while current_addr+512 < stop_addr && block_count > 0 {
-                    self.dma_read(current_addr, &mut local_buf).unwrap();
-                    let offset = self.sd0.card.rw_index.load(std::sync::atomic::Ordering::Relaxed);
-                    self.sd0.card.backing_mem.lock().write_buf(offset, &local_buf).unwrap();
-                    self.sd0.card.rw_index.store(offset + 512, std::sync::atomic::Ordering::Relaxed);
-                    local_buf.fill(0);
-                    block_count -= 1;
-                    current_addr += 512;
-                }
-                let send_dma_int = current_addr >= stop_addr;
-                let send_tx_complete = block_count == 0;
-                debug!(target: "SDHC", "DMA Transfer completed after {} blocks. Reached DMA Boundry: {send_dma_int}. Reached Block Count: {send_tx_complete}", (current_addr-sysaddr) / 512);
-                self.sd0.setreg(SDRegisters::BlockCount, block_count);
-                self.sd0.setreg(SDRegisters::SystemAddress, current_addr);
-                if send_tx_complete { // TX Complete has higher priority than DMA complete. Never send both!
-                    if self.sd0.tx_complete() {
-                        self.hlwd.irq.assert(HollywoodIrq::Sdhc);
-                    }
-                }
-                else if send_dma_int {
-                    if self.sd0.dma_int() {
-                        self.hlwd.irq.assert(HollywoodIrq::Sdhc);
-                    }
-                }
-                else {
-                    unreachable!("SDHC DMA Logic Error");
-                }
-            }
             SDHCTask::IOPoll => {
                 let rw_index = self.sd0.card.rw_index.load(std::sync::atomic::Ordering::Relaxed);
                 trace!(target: "SDHC", "SDHC IOPOLL {} {}", rw_index, self.sd0.card.rw_stop);
@@ -856,5 +820,47 @@ impl Bus {
                 }
             },
         }
+        Ok(())
+    }
+
+    /// Move as many blocks as possible (up to the block count or the next
+    /// DMA boundary) between the card and memory at once. The registers are
+    /// updated and the interrupt is raised once the transfer would have
+    /// finished on the real bus.
+    fn sdhc_dma(&mut self, to_card: bool) -> anyhow::Result<()> {
+        let sysaddr = self.sd0.raw_read(SDRegisters::SystemAddress.base_offset());
+        let buff_boundry = 0x1000u32 << ((self.sd0.raw_read(SDRegisters::BlockSize.base_offset()) & 0x7000) >> 12);
+        let stop_addr = match sysaddr.checked_add(buff_boundry) { // mini always sets 512k boundry size, even if that would overrun the address space
+            Some(x) => (x + 1) & !(buff_boundry - 1),
+            None => u32::MAX,
+        };
+        let block_count = self.sd0.raw_read(SDRegisters::BlockCount.base_offset() & 0xffff_fffc) >> 16;
+        let blocks = block_count.min((stop_addr - sysaddr) / 512);
+        let len = blocks as usize * 512;
+        let offset = self.sd0.card.rw_index.load(std::sync::atomic::Ordering::Relaxed);
+        debug!(target: "SDHC", "Starting DMA {} Tx of {blocks} blocks at sysaddr: {sysaddr:x}", match to_card { true => "Write", false => "Read" });
+
+        if len != 0 {
+            if to_card {
+                let (dev, off) = self.resolve_dma_read(sysaddr)?;
+                let src = ram_device!(self, dev).view(off, len)?;
+                self.sd0.card.backing_mem.get_mut().view_mut(offset, len)?.copy_from_slice(src);
+            }
+            else {
+                let (dev, off) = self.resolve_dma_write(sysaddr, len)?;
+                let src = self.sd0.card.backing_mem.get_mut().view(offset, len)?;
+                ram_device!(mut self, dev).view_mut(off, len)?.copy_from_slice(src);
+            }
+        }
+        self.sd0.card.rw_index.store(offset + len, std::sync::atomic::Ordering::Relaxed);
+
+        let block_count = block_count - blocks;
+        let sysaddr = sysaddr + len as u32;
+        debug!(target: "SDHC", "DMA Transfer completed after {blocks} blocks. Reached DMA Boundry: {}. Reached Block Count: {}", block_count != 0, block_count == 0);
+        self.tasks.push(Task {
+            kind: BusTask::SDHC(SDHCTask::DMAComplete { block_count, sysaddr }),
+            target_cycle: self.cycle + DMA_SETUP_CYCLES + blocks as usize * DMA_BLOCK_CYCLES,
+        });
+        Ok(())
     }
 }
@@ -1,9 +1,11 @@
 use std::{num::NonZeroU16, sync::atomic::AtomicUsize};
-use log::{debug, error};
+use log::{debug, error, warn};
+use bincode::{Decode, Encode};
 
 use crate::mem::BigEndianMemory;
+use crate::snapshot::{get, put, Snapshot};
 
-#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Encode, Decode)]
 /// The Transaction State of the emulated SD card.
 /// The SD Interface and Bus Tasks will check and update this as I/O is performed on the card
 pub(super) enum CardTXStatus {
@@ -94,7 +96,54 @@ pub(super) struct Card {
 }
 
 impl Card {
-    pub(super) fn try_new() -> (Self, bool) {
+    fn save_regs(&self, w: &mut dyn std::io::Write) -> anyhow::Result<()> {
+        put(w, &self.state)?;
+        put(w, &self.acmd)?;
+        put(w, &self.ocr)?;
+        put(w, &self.cid)?;
+        put(w, &self.rca)?;
+        put(w, &self.csd)?;
+        put(w, &self.selected)?;
+        put(w, &self.rw_index.load(std::sync::atomic::Ordering::Relaxed))?;
+        put(w, &self.rw_stop)?;
+        put(w, &self.tx_status)
+    }
+    fn restore_regs(&mut self, r: &mut dyn std::io::Read) -> anyhow::Result<()> {
+        self.state = get!(r);
+        self.acmd = get!(r);
+        self.ocr = get!(r);
+        self.cid = get!(r);
+        self.rca = get!(r);
+        self.csd = get!(r);
+        self.selected = get!(r);
+        *self.rw_index.get_mut() = get!(r);
+        self.rw_stop = get!(r);
+        self.tx_status = get!(r);
+        Ok(())
+    }
+}
+
+impl Snapshot for Card {
+    fn save(&self, w: &mut dyn std::io::Write) -> anyhow::Result<()> {
+        self.save_regs(w)?;
+        self.backing_mem.lock().save(w)
+    }
+    fn restore(&mut self, r: &mut dyn std::io::Read) -> anyhow::Result<()> {
+        self.restore_regs(r)?;
+        self.backing_mem.get_mut().restore(r)
+    }
+    fn save_reset_point(&self, w: &mut dyn std::io::Write) -> anyhow::Result<()> {
+        self.save_regs(w)?;
+        self.backing_mem.lock().save_reset_point(w)
+    }
+    fn restore_reset_point(&mut self, r: &mut dyn std::io::Read) -> anyhow::Result<()> {
+        self.restore_regs(r)?;
+        self.backing_mem.get_mut().restore_reset_point(r)
+    }
+}
+
+impl Card {
+    pub(super) fn try_new(write_back: bool) -> (Self, bool) {
         const FILENAME: &str = "sd.img";
         let mut len = 0usize;
         let backing_mem: BigEndianMemory;
@@ -102,7 +151,18 @@ impl Card {
         if let Ok(f) = std::fs::File::open(FILENAME)
         && let Ok(metadata) = f.metadata() {
             len = metadata.len() as usize;
-            backing_mem = BigEndianMemory::new(len, Some(FILENAME), false).unwrap_or_else(|_|{
+            // Writes are only kept until the emulator exits, unless they
+            // should go straight back to the image (and we can open it for
+            // writing).
+            let mem = if write_back {
+                BigEndianMemory::new_write_back(FILENAME).or_else(|err| {
+                    warn!(target: "SDHC", "{err:#}, writes to the SD card won't be saved");
+                    BigEndianMemory::new(len, Some(FILENAME), false)
+                })
+            } else {
+                BigEndianMemory::new(len, Some(FILENAME), false)
+            };
+            backing_mem = mem.unwrap_or_else(|_|{
                 card_inserted = false;
                 BigEndianMemory::new(len, None, false).unwrap()
             });
@@ -251,7 +311,7 @@ pub(super) enum Response {
 }
 
 #[allow(dead_code)]
-#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Encode, Decode)]
 #[repr(u8)]
 /// Card States as defined in Part 1
 pub(super) enum CardState {
@@ -291,7 +351,7 @@ impl CardState {
     }
 }
 
-#[derive(Debug, Clone, Copy, PartialEq, Eq, PartialOrd, Ord)]
+#[derive(Debug, Clone, Copy, PartialEq, Eq, PartialOrd, Ord, Encode, Decode)]
 struct OcrReg(u32);
 
 impl Default for OcrReg {
@@ -301,7 +361,7 @@ impl Default for OcrReg {
 }
 
 
-#[derive(Debug, Clone, Copy, PartialEq, Eq, PartialOrd, Ord)]
+#[derive(Debug, Clone, Copy, PartialEq, Eq, PartialOrd, Ord, Encode, Decode)]
 /// Operation Condition Register of the emulated SD card.
 /// Mostly does not matter.
 struct CidReg(u128);
@@ -316,7 +376,7 @@ impl Default for CidReg {
     }
 }
 
-#[derive(Debug, Clone, Copy, PartialEq, Eq, PartialOrd, Ord)]
+#[derive(Debug, Clone, Copy, PartialEq, Eq, PartialOrd, Ord, Encode, Decode)]
 /// Card Specific Data Register of the emulated SD card.
 /// Defines to the Host Driver what kind of card we are and what we support.
 struct CsdReg(u128);
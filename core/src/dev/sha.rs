@@ -3,15 +3,17 @@ pub mod util;
 
 use anyhow::bail;
 use log::{debug, trace, log_enabled};
+use bincode::{Decode, Encode};
 
 use crate::bus::*;
 use crate::bus::prim::*;
 use crate::bus::mmio::*;
+use crate::bus::offload::*;
 use crate::bus::task::*;
 use crate::dev::hlwd::irq::*;
 
 pub struct ShaCommand {
-    len: u32,
+    pub len: u32,
     irq: bool,
 }
 impl From<u32> for ShaCommand {
@@ -24,7 +26,7 @@ impl From<u32> for ShaCommand {
 }
 
 /// Representing the SHA interface.
-#[derive(Default)]
+#[derive(Default, Encode, Decode)]
 pub struct ShaInterface {
     ctrl: u32,
     src: u32,
@@ -57,7 +59,8 @@ impl MmioDevice for ShaInterface {
 
     fn read(&self, off: usize) -> anyhow::Result<BusPacket> {
         let val = match off {
-            0x00 => 0, //self.ctrl,
+            // Only the busy bit, for commands still running on a worker
+            0x00 => self.ctrl & 0x8000_0000,
             0x08 => self.state.digest[0],
             0x0c => self.state.digest[1],
             0x10 => self.state.digest[2],
@@ -91,10 +94,12 @@ impl MmioDevice for ShaInterface {
 
 impl Bus {
     pub fn handle_task_sha(&mut self, val: u32) -> anyhow::Result<()> {
+        if self.defer_while_busy(Engine::Sha, BusTask::Sha(val)) {
+            return Ok(());
+        }
         let cmd = ShaCommand::from(val);
 
-        let mut sha_buf = vec![0u8; cmd.len as usize];
-        self.dma_read(self.sha.src, &mut sha_buf)?;
+        let sha_buf = self.dma_view(self.sha.src, cmd.len as usize)?;
         if log_enabled!(target: "SHA", log::Level::Trace) {
             let mut msg = format!("SHA DMA Buffer dump: {} bytes\n", sha_buf.len());
             for chunk in sha_buf.chunks(8) {
@@ -109,9 +114,26 @@ impl Bus {
             trace!(target: "SHA", "{msg}");
         }
 
-        self.sha.state.update(&sha_buf);
-
         debug!(target: "SHA", "SHA Digest addr={:08x} len={:08x}", self.sha.src, cmd.len);
+
+        // Large commands run on a worker, and complete later on
+        if cmd.len as usize >= OFFLOAD_BYTES {
+            let data = sha_buf.to_vec();
+            self.start_offload(Engine::Sha, val, cmd.len as usize, Job::Sha { state: self.sha.state, data });
+            return Ok(());
+        }
+
+        // Hash straight out of guest memory
+        let mut state = self.sha.state;
+        state.update(sha_buf);
+        self.complete_sha_job(val, state);
+        Ok(())
+    }
+
+    /// Complete a command with the new state of the engine.
+    pub(crate) fn complete_sha_job(&mut self, val: u32, state: util::Sha1State) {
+        let cmd = ShaCommand::from(val);
+        self.sha.state = state;
         debug!(target: "SHA", "SHA buffer {:02x?}", self.sha.state.digest);
 
         // Mark the command as completed
@@ -121,7 +143,6 @@ impl Bus {
         if cmd.irq { 
             self.hlwd.irq.assert(HollywoodIrq::Sha);
         }
-        Ok(())
     }
 }
 
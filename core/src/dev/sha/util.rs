@@ -11,23 +11,27 @@
 //! not sure what the hardware behavior is (either the SHA engine disregards 
 //! messages which aren't a multiple of 64-bytes long, or it always performs 
 //! DMA reads in 64-byte chunks).
+//!
+//! When the host has them, the SHA extensions (SHA-NI on x86, or the ARMv8
+//! cryptography extensions) are used for the compression function.
 
 use std::{sync::atomic::{AtomicU8, Ordering::{Acquire, Release, AcqRel}}};
+use bincode::{Decode, Encode};
 
 const K: [u32; 4] = [ 0x5a82_7999, 0x6ed9_eba1, 0x8f1b_bcdc, 0xca62_c1d6, ];
 
 // Rust is annoying re: fn pointers.
-// Technically this entire thing could be an AtomicPtr<unsafe fn(&mut Sha1State)>
+// Technically this entire thing could be an AtomicPtr<unsafe fn(&mut [u32; 5], &[u8])>
 // But no, that breaks everything.
 const STATE_UNTOUCHED: u8 = 0;
 const STATE_IN_MODIFICATION: u8 = 1;
 const STATE_STEADY: u8 = 2;
 static FN_PTR_STATE: AtomicU8 = AtomicU8::new(STATE_UNTOUCHED);
-static mut PROCESS_MSG_FN: unsafe fn(&mut Sha1State) = Sha1State::process_message_scalar;
+static mut COMPRESS_FN: unsafe fn(&mut [u32; 5], &[u8]) = compress_scalar;
 
+#[derive(Clone, Copy, Encode, Decode)]
 pub struct Sha1State {
     pub digest: [u32; 5],
-    pub buf: [u8; 64],
 }
 
 impl Default for Sha1State {
@@ -38,28 +42,21 @@ impl Default for Sha1State {
 
 impl Sha1State {
     pub fn new() -> Self {
-        init_process_msg_fn_ptr();
+        init_compress_fn_ptr();
         while FN_PTR_STATE.load(Acquire) != STATE_STEADY {
             std::hint::spin_loop();
         }
-        Sha1State { digest: [0; 5], buf: [0; 64] }
+        Sha1State { digest: [0; 5] }
     }
     pub fn reset(&mut self) {
         self.digest = [0; 5];
-        self.buf = [0; 64];
     }
 }
 
 impl Sha1State {
+    /// Process some message, which must be a multiple of 64 bytes long.
     pub fn update(&mut self, input: &[u8]) {
         debug_assert!(input.len() & 63 == 0);
-        for chunk in input.chunks_exact(64) {
-            self.buf.copy_from_slice(chunk);
-            self.process_message();
-        }
-    }
-
-    fn process_message(&mut self) {
         // SAFETY:
         // Accessing a static mut
         //   The static is only ever written one time by Self::new, protected by an atomic flag
@@ -68,134 +65,216 @@ impl Sha1State {
         //   due to the use of #[target_feature] to enable optimizations, the initialization
         //   of the fn ptr does the proper feature checks to ensure the target_feature is present
         //   on the current CPU
-        unsafe { PROCESS_MSG_FN(self) };
+        unsafe { COMPRESS_FN(&mut self.digest, input) };
     }
+}
 
-    #[cfg(target_arch = "aarch64")]
-    #[target_feature(enable = "neon")]
-    #[target_feature(enable = "sve2")]
-    unsafe fn process_message_aarch_neon_sve2(&mut self) {
-        self.process_message_scalar()
+/// Compress each 64-byte block of the input with the ARMv8 SHA1 instructions.
+#[cfg(target_arch = "aarch64")]
+#[target_feature(enable = "neon")]
+#[target_feature(enable = "sha2")]
+unsafe fn compress_aarch_sha(digest: &mut [u32; 5], input: &[u8]) {
+    use std::arch::aarch64::*;
+    unsafe {
+        let mut abcd = vld1q_u32(digest.as_ptr());
+        let mut e0 = digest[4];
+        for block in input.chunks_exact(64) {
+            let (abcd_saved, e0_saved) = (abcd, e0);
+            let ptr = block.as_ptr();
+            let mut msg = [
+                vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(ptr))),
+                vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(ptr.add(16)))),
+                vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(ptr.add(32)))),
+                vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(ptr.add(48)))),
+            ];
+            let mut e = e0;
+            // Four rounds at a time, with the schedule for the next words
+            // computed as we go.
+            for quad in 0..20 {
+                let wk = vaddq_u32(msg[quad % 4], vdupq_n_u32(K[quad / 5]));
+                let e_next = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+                abcd = match quad / 5 {
+                    0 => vsha1cq_u32(abcd, e, wk),
+                    2 => vsha1mq_u32(abcd, e, wk),
+                    _ => vsha1pq_u32(abcd, e, wk),
+                };
+                e = e_next;
+                if quad < 16 {
+                    msg[quad % 4] = vsha1su1q_u32(
+                        vsha1su0q_u32(msg[quad % 4], msg[(quad + 1) % 4], msg[(quad + 2) % 4]),
+                        msg[(quad + 3) % 4]
+                    );
+                }
+            }
+            abcd = vaddq_u32(abcd, abcd_saved);
+            e0 = e.wrapping_add(e0_saved);
+        }
+        vst1q_u32(digest.as_mut_ptr(), abcd);
+        digest[4] = e0;
     }
+}
 
-
-    #[cfg(target_arch = "aarch64")]
-    #[target_feature(enable = "neon")]
-    unsafe fn process_message_aarch_neon(&mut self) {
-        self.process_message_scalar()
+/// Compress each 64-byte block of the input with the x86 SHA extensions.
+#[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+#[target_feature(enable = "sha")]
+#[target_feature(enable = "sse2")]
+#[target_feature(enable = "ssse3")]
+#[target_feature(enable = "sse4.1")]
+unsafe fn compress_ia_sha(digest: &mut [u32; 5], input: &[u8]) {
+    #[cfg(target_arch = "x86")]
+    use std::arch::x86::*;
+    #[cfg(target_arch = "x86_64")]
+    use std::arch::x86_64::*;
+    unsafe {
+        // The instructions want the words in A-B-C-D order from the top of
+        // the register, and the message words in big-endian order.
+        let mask = _mm_set_epi64x(0x0001_0203_0405_0607, 0x0809_0a0b_0c0d_0e0f);
+        let mut abcd = _mm_shuffle_epi32(_mm_loadu_si128(digest.as_ptr() as *const __m128i), 0x1b);
+        let mut e0 = _mm_set_epi32(digest[4] as i32, 0, 0, 0);
+        for block in input.chunks_exact(64) {
+            let (abcd_saved, e0_saved) = (abcd, e0);
+            let ptr = block.as_ptr() as *const __m128i;
+            let mut msg = [
+                _mm_shuffle_epi8(_mm_loadu_si128(ptr), mask),
+                _mm_shuffle_epi8(_mm_loadu_si128(ptr.add(1)), mask),
+                _mm_shuffle_epi8(_mm_loadu_si128(ptr.add(2)), mask),
+                _mm_shuffle_epi8(_mm_loadu_si128(ptr.add(3)), mask),
+            ];
+            // The value of A before the last four rounds, which becomes E.
+            let mut e_prev = abcd;
+            let e = _mm_add_epi32(e0, msg[0]);
+            abcd = _mm_sha1rnds4_epu32(abcd, e, 0);
+            // Four rounds at a time, with the schedule for the next words
+            // computed as we go.
+            for quad in 1..20 {
+                let m = msg[quad % 4];
+                let e = _mm_sha1nexte_epu32(e_prev, m);
+                e_prev = abcd;
+                abcd = match quad / 5 {
+                    0 => _mm_sha1rnds4_epu32(abcd, e, 0),
+                    1 => _mm_sha1rnds4_epu32(abcd, e, 1),
+                    2 => _mm_sha1rnds4_epu32(abcd, e, 2),
+                    _ => _mm_sha1rnds4_epu32(abcd, e, 3),
+                };
+                if (3..=18).contains(&quad) {
+                    msg[(quad + 1) % 4] = _mm_sha1msg2_epu32(msg[(quad + 1) % 4], m);
+                }
+                if (2..=17).contains(&quad) {
+                    msg[(quad + 2) % 4] = _mm_xor_si128(msg[(quad + 2) % 4], m);
+                }
+                if quad <= 16 {
+                    msg[(quad + 3) % 4] = _mm_sha1msg1_epu32(msg[(quad + 3) % 4], m);
+                }
+            }
+            e0 = _mm_sha1nexte_epu32(e_prev, e0_saved);
+            abcd = _mm_add_epi32(abcd, abcd_saved);
+        }
+        _mm_storeu_si128(digest.as_mut_ptr() as *mut __m128i, _mm_shuffle_epi32(abcd, 0x1b));
+        digest[4] = _mm_extract_epi32(e0, 3) as u32;
     }
+}
 
-    #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
-    #[target_feature(enable = "avx2")]
-    #[target_feature(enable = "fma")]
-    unsafe fn process_message_ia_avx2_and_fma(&mut self) {
-        self.process_message_scalar()
+/// Compress each 64-byte block of the input.
+fn compress_scalar(digest: &mut [u32; 5], input: &[u8]) {
+    for block in input.chunks_exact(64) {
+        compress_block_scalar(digest, block);
     }
+}
 
-    #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
-    #[target_feature(enable = "sse4.2")]
-    unsafe fn process_message_ia_sse42(&mut self) {
-        self.process_message_scalar()
+#[inline(always)]
+fn compress_block_scalar(digest: &mut [u32; 5], block: &[u8]) {
+    let mut a = digest[0];
+    let mut b = digest[1];
+    let mut c = digest[2];
+    let mut d = digest[3];
+    let mut e = digest[4];
+
+    let mut w = [0u32; 80];
+    for (idx, wb) in block.chunks(4).enumerate() {
+        let mut word = [0u8; 4];
+        word.copy_from_slice(wb);
+        let word = u32::from_be_bytes(word);
+        w[idx] = word;
     }
 
-    #[inline(always)]
-    fn process_message_scalar(&mut self) {
-        let mut a = self.digest[0];
-        let mut b = self.digest[1];
-        let mut c = self.digest[2];
-        let mut d = self.digest[3];
-        let mut e = self.digest[4];
+    for t in 16..80 {
+        let word = w[t-3] ^ w[t-8] ^ w[t-14] ^ w[t-16];
+        w[t] = word.rotate_left(1);
+    }
 
-        let mut w = [0u32; 80];
-        for (idx, wb) in self.buf.chunks(4).enumerate() {
-            let mut word = [0u8; 4];
-            word.copy_from_slice(wb);
-            let word = u32::from_be_bytes(word);
-            w[idx] = word;
-        }
+    for t in 0..20 {
+        let temp = a.rotate_left(5)
+            .wrapping_add((b & c) | ((!b) & d))
+            .wrapping_add(e)
+            .wrapping_add(w[t])
+            .wrapping_add(K[0]);
 
-        for t in 16..80 {
-            let word = w[t-3] ^ w[t-8] ^ w[t-14] ^ w[t-16];
-            w[t] = word.rotate_left(1);
-        }
+        e = d;
+        d = c;
+        c = b.rotate_left(30);
+        b = a;
+        a = temp;
+    }
 
-        for t in 0..20 {
-            let temp = a.rotate_left(5)
-                .wrapping_add((b & c) | ((!b) & d))
-                .wrapping_add(e)
-                .wrapping_add(w[t])
-                .wrapping_add(K[0]);
-
-            e = d;
-            d = c;
-            c = b.rotate_left(30);
-            b = a;
-            a = temp;
-        }
+    for t in 20..40 {
+        let temp = a.rotate_left(5)
+            .wrapping_add(b ^ c ^ d)
+            .wrapping_add(e)
+            .wrapping_add(w[t])
+            .wrapping_add(K[1]);
 
-        for t in 20..40 {
-            let temp = a.rotate_left(5)
-                .wrapping_add(b ^ c ^ d)
-                .wrapping_add(e)
-                .wrapping_add(w[t])
-                .wrapping_add(K[1]);
-
-            e = d;
-            d = c;
-            c = b.rotate_left(30);
-            b = a;
-            a = temp;
-        }
+        e = d;
+        d = c;
+        c = b.rotate_left(30);
+        b = a;
+        a = temp;
+    }
 
-        for t in 40..60 {
-            let temp = a.rotate_left(5)
-                .wrapping_add((b & c) | (b & d) | (c & d))
-                .wrapping_add(e)
-                .wrapping_add(w[t])
-                .wrapping_add(K[2]);
-
-            e = d;
-            d = c;
-            c = b.rotate_left(30);
-            b = a;
-            a = temp;
-        }
+    for t in 40..60 {
+        let temp = a.rotate_left(5)
+            .wrapping_add((b & c) | (b & d) | (c & d))
+            .wrapping_add(e)
+            .wrapping_add(w[t])
+            .wrapping_add(K[2]);
 
-        for t in 60..80 {
-            let temp = a.rotate_left(5)
-                .wrapping_add(b ^ c ^ d)
-                .wrapping_add(e)
-                .wrapping_add(w[t])
-                .wrapping_add(K[3]);
-
-            e = d;
-            d = c;
-            c = b.rotate_left(30);
-            b = a;
-            a = temp;
-        }
+        e = d;
+        d = c;
+        c = b.rotate_left(30);
+        b = a;
+        a = temp;
+    }
 
-        self.digest[0] = self.digest[0].wrapping_add(a);
-        self.digest[1] = self.digest[1].wrapping_add(b);
-        self.digest[2] = self.digest[2].wrapping_add(c);
-        self.digest[3] = self.digest[3].wrapping_add(d);
-        self.digest[4] = self.digest[4].wrapping_add(e);
+    for t in 60..80 {
+        let temp = a.rotate_left(5)
+            .wrapping_add(b ^ c ^ d)
+            .wrapping_add(e)
+            .wrapping_add(w[t])
+            .wrapping_add(K[3]);
 
+        e = d;
+        d = c;
+        c = b.rotate_left(30);
+        b = a;
+        a = temp;
     }
+
+    digest[0] = digest[0].wrapping_add(a);
+    digest[1] = digest[1].wrapping_add(b);
+    digest[2] = digest[2].wrapping_add(c);
+    digest[3] = digest[3].wrapping_add(d);
+    digest[4] = digest[4].wrapping_add(e);
 }
 
 #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
-fn init_process_msg_fn_ptr() {
+fn init_compress_fn_ptr() {
     if FN_PTR_STATE.compare_exchange(STATE_UNTOUCHED, STATE_IN_MODIFICATION, AcqRel, Acquire).is_ok() {
         unsafe {
-            if is_x86_feature_detected!("avx2") && is_x86_feature_detected!("fma") {
-                PROCESS_MSG_FN = Sha1State::process_message_ia_avx2_and_fma;
-            }
-            else if is_x86_feature_detected!("sse4.2") {
-                PROCESS_MSG_FN = Sha1State::process_message_ia_sse42;
+            if is_x86_feature_detected!("sha") && is_x86_feature_detected!("ssse3")
+            && is_x86_feature_detected!("sse4.1") {
+                COMPRESS_FN = compress_ia_sha;
             }
             else {
-                PROCESS_MSG_FN = Sha1State::process_message_scalar;
+                COMPRESS_FN = compress_scalar;
             }
         }
         FN_PTR_STATE.store(STATE_STEADY, Release);
@@ -204,18 +283,15 @@ fn init_process_msg_fn_ptr() {
 
 
 #[cfg(target_arch = "aarch64")]
-fn init_process_msg_fn_ptr() {
+fn init_compress_fn_ptr() {
     use std::arch::is_aarch64_feature_detected;
     if FN_PTR_STATE.compare_exchange(STATE_UNTOUCHED, STATE_IN_MODIFICATION, AcqRel, Acquire).is_ok() {
         unsafe {
-            if is_aarch64_feature_detected!("sve2") {
-                PROCESS_MSG_FN = Sha1State::process_message_aarch_neon_sve2;
-            }
-            else if is_aarch64_feature_detected!("neon") {
-                PROCESS_MSG_FN = Sha1State::process_message_aarch_neon;
+            if is_aarch64_feature_detected!("neon") && is_aarch64_feature_detected!("sha2") {
+                COMPRESS_FN = compress_aarch_sha;
             }
             else {
-                PROCESS_MSG_FN = Sha1State::process_message_scalar;
+                COMPRESS_FN = compress_scalar;
             }
         }
         FN_PTR_STATE.store(STATE_STEADY, Release);
@@ -223,11 +299,11 @@ fn init_process_msg_fn_ptr() {
 }
 
 #[cfg(not(any(target_arch = "x86", target_arch = "x86_64", target_arch = "aarch64")))]
-fn init_process_msg_fn_ptr() {
+fn init_compress_fn_ptr() {
     if FN_PTR_STATE.compare_exchange(STATE_UNTOUCHED, STATE_IN_MODIFICATION, AcqRel, Acquire).is_ok() {
         unsafe {
-            PROCESS_MSG_FN = Sha1State::process_message_scalar;
+            COMPRESS_FN = compress_scalar;
         }
         FN_PTR_STATE.store(STATE_STEADY, Release);
     }
-}
\ No newline at end of file
+}
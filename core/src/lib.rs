@@ -11,4 +11,8 @@ pub mod dev;
 pub mod bus;
 /// Implementation of runtime debugging features.
 pub mod dbg;
+/// Saving and restoring the state of the machine.
+pub mod snapshot;
+/// Counters describing the behaviour of the emulator at runtime.
+pub mod metrics;
 
@@ -5,17 +5,25 @@ use std::fs::File;
 use std::io::Read;
 use std::io::Write;
 use std::mem;
-use std::sync::atomic::AtomicBool;
-use std::sync::atomic::Ordering::Relaxed;
 use std::ops::{Deref, DerefMut};
+use std::sync::Arc;
+use std::sync::atomic::AtomicU64;
 use memmap::{MmapMut, MmapOptions};
 
-use iset::IntervalMap;
 use anyhow::{bail, Context};
 use log::{error, debug};
 use bincode::{config, Decode, Encode};
+use parking_lot::Mutex;
 
 use crate::bus::prim::AccessWidth;
+use crate::snapshot::{get, put, Snapshot};
+
+pub mod dirty;
+pub mod journal;
+pub mod writeback;
+use dirty::DirtyPages;
+use journal::WriteJournal;
+use writeback::WriteBack;
 
 /// The real backing memory, either a Vec, or a memory mapped file
 pub enum BackingMem {
@@ -53,18 +61,22 @@ impl BackingMem {
 pub struct BigEndianMemory {
     /// Vector of bytes with the contents of this memory device.
     pub data: BackingMem,
-    /// Hash of initial data (used for write tracking)
-    hash: u32,
-    /// Holds all writes so they can be replayed next time the emulator launches
-    writes: Option<IntervalMap<usize, Vec<u8>>>,
-    /// write_index
-    pub write_index: u8,
-    already_wrote: AtomicBool,
+    /// Keeps track of writes, so they can be replayed next time the emulator
+    /// launches.
+    journal: Option<Mutex<WriteJournal>>,
+    /// Set when the memory is mapped shared with its file, and writes go
+    /// straight back to it.
+    write_back: Option<WriteBack>,
+    /// Keeps track of the pages written since the reset point, when fast
+    /// resets are enabled (see [dirty]).
+    dirty: Option<Mutex<DirtyPages>>,
+    /// The file used to initialize this memory, if any.
+    path: Option<String>,
 }
 impl BigEndianMemory {
     pub fn new(len: usize, init_fn: Option<&str>, track_writes: bool) -> anyhow::Result<Self> {
         let hash: u32;
-        let data = if let Some(filename) = init_fn { unsafe {
+        let mut data = if let Some(filename) = init_fn { unsafe {
             let mut f = File::open(filename)?;
             if let Ok(map) = MmapOptions::new().map_copy(&f) {
                 hash = crc32fast::hash(&*map);
@@ -81,66 +93,65 @@ impl BigEndianMemory {
             hash = 0xDEADC0DE;
             BackingMem::Local(vec![0u8; len])
         };
-        let writes: Option<IntervalMap<usize, Vec<u8>>> = if track_writes {
+        let journal = if track_writes {
+            let filename = init_fn.context("Write tracking needs a backing file")?;
             debug!(target: "MEMSAVE", "BEMemory: Writes Enabled, hash: {hash}");
-            Some(IntervalMap::new())
+            Some(Mutex::new(WriteJournal::open(hash, filename, &mut data)?))
         }
         else {
             None
         };
-        let mut res = BigEndianMemory { data, hash, writes, write_index: 0, already_wrote: AtomicBool::new(true)};
-        if track_writes {
-            if let Ok((write_index, mpfs)) = BigEndianMemory::get_patchfiles(hash) {
-                res.write_index = write_index.checked_add(1).unwrap();
-                for mpf in mpfs {
-                    res.patch(mpf)?;
-                }
-            }
-        }
-        Ok(res)
+        let path = init_fn.map(str::to_owned);
+        Ok(BigEndianMemory { data, journal, write_back: None, dirty: None, path })
     }
 
-    /// Get the patches to apply persistent writes
-    /// Returns the highest numbered patch file, so this time around we can write to n+1
-    fn get_patchfiles(hash: u32) -> anyhow::Result<(u8, Vec<MemoryPatchFile>)> {
-        let dir = match std::fs::read_dir(format!("./saved-writes/{hash}/")) {
-            Ok(dir) => dir,
-            Err(err) => {
-                // handle no directory by creating it and trying again
-                match err.raw_os_error() {
-                    Some(2) => {
-                        std::fs::create_dir_all(format!("./saved-writes/{hash}/"))?;
-                        std::fs::read_dir(format!("./saved-writes/{hash}/"))?
-                    },
-                    Some(_) | None => { return Err(err).context(format!("Failed to open directory ./saved-writes/{hash}/ for get_patchfiles")) }
-                }
-            },
-        };
-        // Get all files saved to the directory that matches our hash and who's filenames can be parsed into a u8
-        // deserialize them, and save their filename with
-        let mut pfs: Vec<(u8, MemoryPatchFile)> = dir.filter_map(|maybe_entry|{
-            if let Ok(entry) = maybe_entry {
-                debug!(target: "MEMSAVE", "Candidate entry: {:?}", entry.path());
-                if let Ok(num) = entry.file_name().to_string_lossy().into_owned().parse::<u8>() {
-                    let mpf = MemoryPatchFile::from_file(entry.path());
-                    debug!(target: "MEMSAVE", "Found MemoryPatchFile: {num} {:?}", entry.path());
-                    Some((num, mpf))
-                }
-                else {
-                    None
-                }
-            }
-            else {
-                error!(target: "MEMSAVE", "Unable to read ./saved-writes/{hash}/");
-                None
-            }
-        }).collect();
-        // Sort by filename
-        pfs.sort_by(|a, b| {
-            a.0.cmp(&b.0)
-        });
-        let max = pfs.iter().map(|x|x.0).max().unwrap_or(0);
-        Ok((max, pfs.iter().map(|x|x.1.clone()).collect()))
+    /// Create a memory that's mapped shared with some file, so that writes
+    /// go straight back to it (see [writeback]).
+    pub fn new_write_back(filename: &str) -> anyhow::Result<Self> {
+        let (write_back, map) = WriteBack::open(filename)?;
+        Ok(BigEndianMemory {
+            data: BackingMem::Mapped(map),
+            journal: None,
+            write_back: Some(write_back),
+            dirty: None,
+            path: Some(filename.to_owned()),
+        })
+    }
+
+    /// Create a memory backed by a new file, which is mapped shared so that
+    /// other processes can access the contents while we're running. The file
+    /// is truncated first.
+    pub fn new_exported(len: usize, filename: &Path) -> anyhow::Result<Self> {
+        let f = std::fs::OpenOptions::new().read(true).write(true).create(true).truncate(true)
+            .open(filename)
+            .context(format!("Couldn't create {}", filename.display()))?;
+        f.set_len(len as u64)?;
+        let map = unsafe { MmapOptions::new().len(len).map_mut(&f) }
+            .context(format!("Couldn't map {}", filename.display()))?;
+        debug!(target: "Other", "Exported memory to {}", filename.display());
+        Ok(BigEndianMemory { data: BackingMem::Mapped(map), journal: None, write_back: None, dirty: None, path: None })
+    }
+
+    /// Returns true if writes to this device are being saved.
+    pub fn tracks_writes(&self) -> bool {
+        self.journal.is_some()
+    }
+
+    /// Start keeping track of dirty pages, so that this memory can be reset
+    /// quickly (see [Snapshot::restore_reset_point]). The reset point is set whenever
+    /// [Snapshot::save_reset_point] is called.
+    pub fn track_dirty_pages(&mut self) {
+        self.dirty = Some(Mutex::new(DirtyPages::new(self.data.len())));
+    }
+
+    /// Get a handle to the set of dirty pages, if they're being tracked.
+    pub fn dirty_bits(&self) -> Option<Arc<[AtomicU64]>> {
+        self.dirty.as_ref().map(|dirty| dirty.lock().shared_bits())
+    }
+
+    /// Take the offsets of the pages put back by resets since the last call.
+    pub fn take_reset_pages(&mut self) -> Vec<usize> {
+        self.dirty.as_mut().map_or_else(Vec::new, |dirty| dirty.get_mut().take_reset())
     }
 
     pub fn dump(&self, filename: &impl AsRef<Path>) -> anyhow::Result<()> {
@@ -151,38 +162,17 @@ impl BigEndianMemory {
         Ok(())
     }
 
-    fn patch(&mut self, patchfile: MemoryPatchFile) -> anyhow::Result<()> {
-        if self.hash != patchfile.hash {
-            bail!("Mismatched patch file!");
-        }
-        let temp = std::mem::take(&mut self.writes); // Or else the subsequent calls to write_buf will double-count these writes.
-        for range in patchfile.ranges {
-            debug!(target: "MEMSAVE", "Patching memory at offset {}: #{} bytes", range.offset, &range.data.len());
-            self.write_buf(range.offset, &range.data)?;
-        }
-        self.writes = temp;
-        Ok(())
-    }
-
+    /// Save all writes since the last call to the journal.
     pub fn dump_writes(&self) -> anyhow::Result<()> {
-        if self.writes.is_none() {
-            bail!("dump_writes but writes not enabled!");
-        }
-        if self.already_wrote.load(Relaxed) {
+        let mut journal = match self.journal.as_ref() {
+            Some(journal) => journal.lock(),
+            None => bail!("dump_writes but writes not enabled!"),
+        };
+        if !journal.is_dirty() {
             debug!(target: "MEMSAVE", "dump_writes but already wrote the latest changes!");
             return Ok(());
         }
-        self.already_wrote.store(true, Relaxed);
-        let patches: Vec<MemoryPatch> = self.writes.as_ref().unwrap().iter(..).map(|x|{
-            MemoryPatch { offset: x.0.start, data: x.1.clone() }
-        }).collect();
-        let mut mpf = MemoryPatchFile {
-            hash: self.hash,
-            ranges: patches,
-        };
-        mpf.merge_adjacent_ranges();
-        mpf.to_file(format!("./saved-writes/{}/{}", self.hash, self.write_index).into())?;
-        Ok(())
+        journal.flush(&self.data)
     }
 }
 
@@ -194,6 +184,24 @@ impl fmt::Debug for BigEndianMemory {
 
 /// Generic reads and writes.
 impl BigEndianMemory {
+    /// Called before writing to some range of this memory.
+    fn mark(&mut self, off: usize, len: usize) {
+        if let Some(dirty) = self.dirty.as_mut() {
+            dirty.get_mut().mark(&self.data, off, len);
+        }
+        self.mark_backing(off, len);
+    }
+
+    /// Let the journal or the file know about a write to some range.
+    fn mark_backing(&mut self, off: usize, len: usize) {
+        if let Some(journal) = self.journal.as_mut() {
+            journal.get_mut().mark(off, len);
+        }
+        if let Some(write_back) = self.write_back.as_ref() {
+            write_back.schedule();
+        }
+    }
+
     pub fn read<T: AccessWidth>(&self, off: usize) -> anyhow::Result<T> {
         let src_len = mem::size_of::<T>();
         if off + src_len > self.data.len() {
@@ -207,9 +215,7 @@ impl BigEndianMemory {
         if off + src_slice.len() > self.data.len() {
             bail!("Out-of-bounds write at {off:x}");
         }
-        if self.writes.is_some() {
-            self.handle_write_tracking(off, src_slice)
-        }
+        self.mark(off, src_slice.len());
         self.data[off..off + src_slice.len()].copy_from_slice(src_slice);
         Ok(())
     }
@@ -228,63 +234,181 @@ impl BigEndianMemory {
         if off + src.len() > self.data.len() {
             bail!("OOB bulk write on BigEndianMemory, offset {off:x}");
         }
-        if self.writes.is_some() {
-            self.handle_write_tracking(off, src);
-        }
+        self.mark(off, src.len());
         self.data[off..off + src.len()].copy_from_slice(src);
         Ok(())
     }
+    /// Borrow some range of this memory.
+    pub fn view(&self, off: usize, len: usize) -> anyhow::Result<&[u8]> {
+        if off + len > self.data.len() {
+            bail!("OOB view on BigEndianMemory, offset {off:x}");
+        }
+        Ok(&self.data[off..off + len])
+    }
+    /// Mutably borrow some range of this memory. The whole range is treated
+    /// as written.
+    pub fn view_mut(&mut self, off: usize, len: usize) -> anyhow::Result<&mut [u8]> {
+        if off + len > self.data.len() {
+            bail!("OOB view on BigEndianMemory, offset {off:x}");
+        }
+        self.mark(off, len);
+        Ok(&mut self.data[off..off + len])
+    }
+    /// Copy between two (possibly overlapping) ranges of this memory.
+    pub fn copy_within(&mut self, src: usize, dst: usize, len: usize) -> anyhow::Result<()> {
+        if src.max(dst) + len > self.data.len() {
+            bail!("OOB copy on BigEndianMemory, offset {src:x} to {dst:x}");
+        }
+        self.mark(dst, len);
+        self.data.copy_within(src..src + len, dst);
+        Ok(())
+    }
     pub fn memset(&mut self, off: usize, len: usize, val: u8) -> anyhow::Result<()> {
         if off + len > self.data.len() {
             bail!("OOB memset on BigEndianMemory, offset {off:x}");
         }
-        if self.writes.is_some() {
-            self.handle_write_tracking(off, &(vec![val; len]));
+        self.mark(off, len);
+        self.data[off..off + len].fill(val);
+        Ok(())
+    }
+}
+
+/// Granularity for comparing memory with its backing file in snapshots.
+const SNAPSHOT_CHUNK: usize = 0x1000;
+
+/// Call some function with each chunk of a file (padded with zeroes).
+fn for_each_file_chunk(path: &str, len: usize, mut func: impl FnMut(usize, &mut [u8]) -> anyhow::Result<()>) -> anyhow::Result<()> {
+    let mut file = std::io::BufReader::new(File::open(path)
+        .context(format!("Couldn't open {path} to compare with memory"))?);
+    let mut buf = vec![0u8; SNAPSHOT_CHUNK];
+    for off in (0..len).step_by(SNAPSHOT_CHUNK) {
+        let chunk = &mut buf[..SNAPSHOT_CHUNK.min(len - off)];
+        let mut filled = 0;
+        while filled < chunk.len() {
+            match file.read(&mut chunk[filled..])? {
+                0 => break,
+                n => filled += n,
+            }
+        }
+        chunk[filled..].fill(0);
+        func(off, chunk)?;
+    }
+    Ok(())
+}
+
+/// How the contents of a memory are saved in a snapshot.
+#[derive(Encode, Decode, PartialEq, Eq, Debug, Clone, Copy)]
+enum SnapshotContents {
+    /// All of the contents.
+    Whole,
+    /// The chunks that differ from the backing file.
+    Patches,
+    /// Only a hash of the contents: the backing file is written back to, and
+    /// is the only copy.
+    External(u32),
+}
+
+/// Memories without a backing file are saved whole. Otherwise, only the
+/// chunks that differ from the file are saved, and restoring rewrites any
+/// chunks that differ from the snapshot (through write tracking, if enabled).
+/// Either way, the contents are restored in place. Memories that are written
+/// back to their file aren't saved at all, but they can only be restored
+/// while the file is the same as when the snapshot was taken.
+impl Snapshot for BigEndianMemory {
+    fn save(&self, w: &mut dyn Write) -> anyhow::Result<()> {
+        put(w, &self.data.len())?;
+        let path = match (self.path.as_ref(), self.write_back.is_some()) {
+            (_, true) => return put(w, &SnapshotContents::External(crc32fast::hash(&self.data))),
+            (Some(path), false) => path,
+            (None, false) => {
+                put(w, &SnapshotContents::Whole)?;
+                w.write_all(&self.data)?;
+                return Ok(());
+            },
+        };
+        put(w, &SnapshotContents::Patches)?;
+        let mut patches: Vec<MemoryPatch> = Vec::new();
+        for_each_file_chunk(path, self.data.len(), |off, chunk| {
+            let cur = &self.data[off..off + chunk.len()];
+            if cur != chunk {
+                match patches.last_mut() {
+                    Some(last) if last.offset + last.data.len() == off => last.data.extend_from_slice(cur),
+                    _ => patches.push(MemoryPatch { offset: off, data: cur.to_vec() }),
+                }
+            }
+            Ok(())
+        })?;
+        put(w, &patches)
+    }
+
+    /// Memories that track dirty pages only save their length here (having
+    /// copies of the pages that change after this point instead).
+    fn save_reset_point(&self, w: &mut dyn Write) -> anyhow::Result<()> {
+        let Some(dirty) = self.dirty.as_ref() else {
+            return self.save(w);
+        };
+        dirty.lock().clear();
+        put(w, &self.data.len())
+    }
+
+    fn restore_reset_point(&mut self, r: &mut dyn Read) -> anyhow::Result<()> {
+        let Some(dirty) = self.dirty.as_mut() else {
+            return self.restore(r);
+        };
+        let len: usize = get!(r);
+        if len != self.data.len() {
+            bail!("Reset point has memory of size {len:x}, expected {:x}", self.data.len());
         }
-        for d in &mut self.data[off..off+len] {
-            *d = val;
+        for off in dirty.get_mut().restore(&mut self.data) {
+            self.mark_backing(off, dirty::DIRTY_PAGE);
         }
         Ok(())
     }
 
-    fn handle_write_tracking(&mut self, off: usize, data: &[u8]) {
-        use std::cmp::*;
-        self.already_wrote.store(false, Relaxed);
-        let writes = self.writes.as_mut().unwrap();
-        // Check if we have a write in this range already
-        if writes.has_overlap(off..off+data.len()) {
-            // ok find the overlapping range
-            let (found_range, _) = writes.iter(off..off+data.len()).next().unwrap();
-            // calculate new combined range
-            let new_range = min(found_range.start, off)..max(found_range.end, off+data.len());
-            // if the new writes are entirely inside an existing range, just modify the data in place.
-            if found_range == new_range {
-                let existing_data = writes.get_mut(found_range.start..found_range.end).unwrap();
-                let inner_offset = off - found_range.start;
-                existing_data[inner_offset..(inner_offset+data.len())].copy_from_slice(data);
-                return;
+    fn restore(&mut self, r: &mut dyn Read) -> anyhow::Result<()> {
+        let len: usize = get!(r);
+        let contents: SnapshotContents = get!(r);
+        if len != self.data.len() {
+            bail!("Snapshot has memory of size {len:x}, expected {:x}", self.data.len());
+        }
+        match (contents, self.write_back.is_some()) {
+            (SnapshotContents::External(hash), true) => {
+                if crc32fast::hash(&self.data) != hash {
+                    bail!("{} has changed since the snapshot was taken", self.path.as_deref().unwrap_or_default());
+                }
+                return Ok(());
+            },
+            (SnapshotContents::External(_), false) | (_, true) => {
+                bail!("Snapshot doesn't match how memory is backed ({contents:?})");
+            },
+            (SnapshotContents::Whole, false) => {
+                self.mark(0, len);
+                r.read_exact(&mut self.data)?;
+                return Ok(());
+            },
+            (SnapshotContents::Patches, false) => {},
+        }
+        let path = match self.path.clone() {
+            Some(path) => path,
+            None => bail!("Snapshot expects memory initialized from a file"),
+        };
+        let patches: Vec<MemoryPatch> = get!(r);
+        let mut next = 0;
+        for_each_file_chunk(&path, len, |off, chunk| {
+            let end = off + chunk.len();
+            while next < patches.len() && patches[next].offset + patches[next].data.len() <= off {
+                next += 1;
             }
-            // Not the case... so the range has to grow, but it's immutable in the tree
-            // So we have to pop it, modify the range+data, then re-insert
-            let found_data = writes.remove(found_range.clone()).unwrap();
-            let mut temp: Vec<u8> = vec![0; new_range.len()];
-            if found_range.start == new_range.start {
-                // grow right
-                temp[0..found_data.len()].copy_from_slice(&found_data);
-                let offset_start = off - found_range.start;
-                temp[offset_start..(offset_start+data.len())].copy_from_slice(data);
+            for patch in patches[next..].iter().take_while(|p| p.offset < end) {
+                let (start, stop) = (patch.offset.max(off), (patch.offset + patch.data.len()).min(end));
+                chunk[start - off..stop - off]
+                    .copy_from_slice(&patch.data[start - patch.offset..stop - patch.offset]);
             }
-            else {
-                // grow left
-                temp[(new_range.start - found_range.start)..found_range.len()].copy_from_slice(&found_data);
-                temp[0..data.len()].copy_from_slice(data);
+            if self.data[off..end] != *chunk {
+                self.write_buf(off, chunk)?;
             }
-            writes.insert(new_range, temp);
-        }
-        else {
-            // trivial case, just a new range
-            writes.insert(off..off+data.len(), data.to_vec());
-        }
+            Ok(())
+        })
     }
 }
 
@@ -294,6 +418,8 @@ pub struct MemoryPatch {
     pub data: Vec<u8>,
 }
 
+/// A set of writes saved by older versions, only read to move them into the
+/// journal.
 #[derive(Encode, Decode, PartialEq, Debug, Clone)]
 pub struct MemoryPatchFile {
     hash: u32,
@@ -309,40 +435,4 @@ impl MemoryPatchFile {
         debug!(target: "MEMSAVE", "decoded MemoryPatchFile: hash: {} # of ranges: {}", res.hash, res.ranges.len());
         res
     }
-
-    pub fn to_file(&self, path: std::path::PathBuf) -> anyhow::Result<()> {
-        use std::io::BufWriter;
-        use lz4_flex::frame::*;
-        let bytes = bincode::encode_to_vec(self, config::standard())?;
-        let mut file = std::fs::File::create(&path)?;
-        let mut writer = BufWriter::new(&mut file);
-        let mut encoder = FrameEncoder::new(&mut writer);
-        encoder.write_all(&bytes)?;
-        encoder.finish()?;
-        drop(writer);
-        file.flush()?;
-        let real_size = bytes.len() as f64;
-        let written = file.metadata()?.len() as f64;
-        debug!(target: "MEMSAVE", "encoded MemoryPatchFile to {path:?}, size {:.1}k compressed to {:.1}k. ({:.2}%)", (real_size/1024f64), (written/1024f64), (written/real_size));
-        Ok(())
-    }
-    pub fn merge_adjacent_ranges(&mut self) {
-        fn adjacent(a: &MemoryPatch, b: &MemoryPatch) -> bool {
-            a.offset + a.data.len() == b.offset
-        }
-        let mut done = false;
-        while !done {
-            let mut found = false;
-            for i in 0..(self.ranges.len()-1) {
-                if adjacent(&self.ranges[i], &self.ranges[i+1]) {
-                    found = true;
-                    let extend = std::mem::take(&mut self.ranges[i+1].data);
-                    self.ranges[i+1].offset = 0xDEADC0DE;
-                    self.ranges[i].data.extend(extend.iter());
-                }
-            }
-            self.ranges.retain(|x|x.offset != 0xDEADC0DE);
-            if !found { done = true; }
-        }
-    }
 }
@@ -0,0 +1,97 @@
+//! Tracking the pages of a memory written since some point, so that they can
+//! be put back quickly (i.e. between runs of a fuzzer).
+//!
+//! The first write to each page after the reset point saves a copy of the
+//! page, and sets its bit in a bitmap. Resetting only copies back the pages
+//! that were saved, so its cost depends on how much was written rather than
+//! on the size of the memory.
+//!
+//! The bitmap is shared with [crate::bus::fastmem::GuestRam], which sends the
+//! first write to each page down the slow path (where the page is saved), and
+//! writes to dirty pages through the fast path as usual.
+
+use std::sync::Arc;
+use std::sync::atomic::AtomicU64;
+use std::sync::atomic::Ordering::Relaxed;
+
+/// Granularity of dirty page tracking.
+pub const DIRTY_PAGE_SHIFT: u32 = 12;
+pub const DIRTY_PAGE: usize = 1 << DIRTY_PAGE_SHIFT;
+
+pub struct DirtyPages {
+    /// One bit for each page written since the reset point.
+    bits: Arc<[AtomicU64]>,
+    /// The contents of each dirty page at the reset point, by offset.
+    saved: Vec<(usize, Box<[u8]>)>,
+    /// Offsets of the pages put back by the last reset, waiting to be
+    /// collected (see [DirtyPages::take_reset]).
+    reset: Vec<usize>,
+}
+
+impl DirtyPages {
+    pub fn new(len: usize) -> Self {
+        DirtyPages {
+            bits: (0..len.div_ceil(DIRTY_PAGE).div_ceil(64)).map(|_| AtomicU64::new(0)).collect(),
+            saved: Vec::new(),
+            reset: Vec::new(),
+        }
+    }
+
+    /// Returns true if a page has been written since the reset point.
+    #[inline(always)]
+    pub fn is_dirty(bits: &[AtomicU64], off: usize) -> bool {
+        let page = off >> DIRTY_PAGE_SHIFT;
+        bits[page / 64].load(Relaxed) & (1 << (page % 64)) != 0
+    }
+
+    /// Get a handle to the set of dirty pages.
+    pub fn shared_bits(&self) -> Arc<[AtomicU64]> {
+        self.bits.clone()
+    }
+
+    /// Called before writing to some range of the memory, while `data` still
+    /// has the old contents. Saves any pages in the range that are clean.
+    #[inline(always)]
+    pub fn mark(&mut self, data: &[u8], off: usize, len: usize) {
+        let first = off >> DIRTY_PAGE_SHIFT;
+        let last = (off + len.max(1) - 1) >> DIRTY_PAGE_SHIFT;
+        for page in first..=last {
+            let (word, bit) = (&self.bits[page / 64], 1 << (page % 64));
+            let val = word.load(Relaxed);
+            if val & bit == 0 {
+                word.store(val | bit, Relaxed);
+                let start = page << DIRTY_PAGE_SHIFT;
+                let end = (start + DIRTY_PAGE).min(data.len());
+                self.saved.push((start, data[start..end].into()));
+            }
+        }
+    }
+
+    /// Make the current contents the reset point.
+    pub fn clear(&mut self) {
+        for word in self.bits.iter() {
+            word.store(0, Relaxed);
+        }
+        self.saved.clear();
+    }
+
+    /// Go back to the reset point, after which every page is clean again.
+    /// Returns the offsets of the pages that were put back.
+    pub fn restore(&mut self, data: &mut [u8]) -> Vec<usize> {
+        let mut pages = Vec::with_capacity(self.saved.len());
+        for (off, page) in self.saved.drain(..) {
+            data[off..off + page.len()].copy_from_slice(&page);
+            pages.push(off);
+        }
+        for word in self.bits.iter() {
+            word.store(0, Relaxed);
+        }
+        self.reset.extend_from_slice(&pages);
+        pages
+    }
+
+    /// Take the offsets of the pages put back since the last call.
+    pub fn take_reset(&mut self) -> Vec<usize> {
+        std::mem::take(&mut self.reset)
+    }
+}
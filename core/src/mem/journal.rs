@@ -0,0 +1,315 @@
+//! Persistent writes to memories initialized from a file (i.e. NAND).
+//!
+//! The original file is never modified. Instead, each page written during a
+//! session is appended to a journal in `./saved-writes/{hash}/`, where `hash`
+//! identifies the original contents. On start-up, the memory is mapped from
+//! the latest checkpoint image (or the original file), and the journal is
+//! replayed on top of it.
+//!
+//! Once the journal grows past [COMPACT_THRESHOLD], it's set aside and folded
+//! into the checkpoint by a background thread. If that gets interrupted, it
+//! starts over the next time the memory is loaded: replaying a page more
+//! than once is harmless.
+//!
+//! ## Format
+//! A journal starts with [JOURNAL_MAGIC] and the hash of the original file.
+//! Each record is a header (page index, length, and the CRC32 of both along
+//! with the data, all little-endian `u32`) followed by the contents of the
+//! page. A torn record at the end of the journal (from a crash while it was
+//! being written) is discarded.
+
+use std::fs::{self, File, OpenOptions};
+use std::io::{BufWriter, ErrorKind, Seek, SeekFrom, Write};
+use std::path::{Path, PathBuf};
+
+use anyhow::{bail, Context};
+use log::{debug, error, info};
+use memmap::{Mmap, MmapMut, MmapOptions};
+
+use crate::mem::{BackingMem, MemoryPatchFile};
+
+/// Identifies a journal file.
+pub const JOURNAL_MAGIC: [u8; 8] = *b"IRONJRNL";
+
+/// Granularity of writes in the journal.
+pub const JOURNAL_PAGE: usize = 0x1000;
+
+/// Size of a journal (in bytes) after which it's folded into the checkpoint.
+pub const COMPACT_THRESHOLD: u64 = 0x0400_0000;
+
+const FILE_HEADER_LEN: usize = 12;
+const RECORD_HEADER_LEN: usize = 12;
+
+const JOURNAL: &str = "journal";
+/// A journal that's being folded into the checkpoint.
+const OLD_JOURNAL: &str = "journal.old";
+const CHECKPOINT: &str = "checkpoint";
+/// A new checkpoint, until it's been completely written.
+const NEW_CHECKPOINT: &str = "checkpoint.new";
+
+/// The journal for some memory device.
+pub struct WriteJournal {
+    dir: PathBuf,
+    file: BufWriter<File>,
+    /// Pages written since the last flush, one bit per page.
+    dirty: Vec<u64>,
+    num_dirty: usize,
+}
+
+impl WriteJournal {
+    /// Open the journal for some memory, replacing its contents with the
+    /// latest saved state.
+    pub fn open(hash: u32, base: &str, data: &mut BackingMem) -> anyhow::Result<Self> {
+        let dir = PathBuf::from(format!("./saved-writes/{hash}/"));
+        fs::create_dir_all(&dir).context(format!("Failed to create directory {}", dir.display()))?;
+
+        if let Some(map) = map_checkpoint(&dir.join(CHECKPOINT), data.len())? {
+            debug!(target: "MEMSAVE", "Mapped checkpoint for {base}");
+            *data = BackingMem::Mapped(map);
+        }
+        let num_pages = data.len().div_ceil(JOURNAL_PAGE);
+        let mut dirty = vec![0u64; num_pages.div_ceil(64)];
+        let mut num_dirty = 0;
+
+        // Patch files from older versions come before anything else
+        let legacy = legacy_patchfiles(&dir);
+        for (_, path) in legacy.iter() {
+            let mpf = MemoryPatchFile::from_file(path.clone());
+            if mpf.hash != hash {
+                bail!("Mismatched patch file {}!", path.display());
+            }
+            for range in mpf.ranges {
+                let end = range.offset + range.data.len();
+                if end > data.len() {
+                    bail!("Patch file {} is out of bounds", path.display());
+                }
+                data[range.offset..end].copy_from_slice(&range.data);
+                mark_pages(&mut dirty, &mut num_dirty, range.offset, range.data.len());
+            }
+        }
+
+        let old = dir.join(OLD_JOURNAL);
+        let cur = dir.join(JOURNAL);
+        let old_exists = replay(&old, hash, data)?.is_some();
+        let mut valid = replay(&cur, hash, data)?.unwrap_or(0);
+
+        // Set the journal aside for compaction if it's too large (unless
+        // the last compaction didn't finish, in which case that goes first).
+        let rotate = !old_exists && valid as u64 > COMPACT_THRESHOLD;
+        if rotate {
+            fs::rename(&cur, &old).context("Failed to set aside the journal for compaction")?;
+            valid = 0;
+        }
+        if old_exists || rotate {
+            spawn_compaction(dir.clone(), PathBuf::from(base), hash);
+        }
+
+        // Start appending after the last valid record
+        let mut file = OpenOptions::new().create(true).write(true).truncate(false).open(&cur)
+            .context(format!("Failed to open journal {}", cur.display()))?;
+        file.set_len(valid as u64)?;
+        file.seek(SeekFrom::End(0))?;
+        let mut file = BufWriter::new(file);
+        if valid == 0 {
+            file.write_all(&JOURNAL_MAGIC)?;
+            file.write_all(&hash.to_le_bytes())?;
+        }
+
+        let mut res = WriteJournal { dir, file, dirty, num_dirty };
+        if !legacy.is_empty() {
+            res.flush(data)?;
+            for (_, path) in legacy.iter() {
+                fs::remove_file(path)?;
+            }
+            info!(target: "MEMSAVE", "Moved {} patch files into {}", legacy.len(), cur.display());
+        }
+        Ok(res)
+    }
+
+    /// Note that some range of the memory was written.
+    #[inline]
+    pub fn mark(&mut self, off: usize, len: usize) {
+        mark_pages(&mut self.dirty, &mut self.num_dirty, off, len);
+    }
+
+    /// Returns true if there are pages that haven't been saved yet.
+    pub fn is_dirty(&self) -> bool {
+        self.num_dirty != 0
+    }
+
+    /// Append every page written since the last flush to the journal.
+    pub fn flush(&mut self, data: &[u8]) -> anyhow::Result<()> {
+        if self.num_dirty == 0 {
+            return Ok(());
+        }
+        for (idx, word) in self.dirty.iter_mut().enumerate() {
+            while *word != 0 {
+                let page = idx * 64 + word.trailing_zeros() as usize;
+                *word &= *word - 1;
+                let off = page * JOURNAL_PAGE;
+                let buf = &data[off..(off + JOURNAL_PAGE).min(data.len())];
+                self.file.write_all(&(page as u32).to_le_bytes())?;
+                self.file.write_all(&(buf.len() as u32).to_le_bytes())?;
+                self.file.write_all(&record_crc(page, buf).to_le_bytes())?;
+                self.file.write_all(buf)?;
+            }
+        }
+        debug!(target: "MEMSAVE", "Saved {} pages to {}", self.num_dirty, self.dir.display());
+        self.num_dirty = 0;
+        self.file.flush()?;
+        self.file.get_ref().sync_data()?;
+        Ok(())
+    }
+}
+
+fn mark_pages(dirty: &mut [u64], num_dirty: &mut usize, off: usize, len: usize) {
+    if len == 0 {
+        return;
+    }
+    for page in off / JOURNAL_PAGE..=(off + len - 1) / JOURNAL_PAGE {
+        let bit = 1u64 << (page % 64);
+        if dirty[page / 64] & bit == 0 {
+            dirty[page / 64] |= bit;
+            *num_dirty += 1;
+        }
+    }
+}
+
+fn record_crc(page: usize, buf: &[u8]) -> u32 {
+    let mut hasher = crc32fast::Hasher::new();
+    hasher.update(&(page as u32).to_le_bytes());
+    hasher.update(&(buf.len() as u32).to_le_bytes());
+    hasher.update(buf);
+    hasher.finalize()
+}
+
+/// Call some function with each valid record in a journal. Returns the
+/// length of the valid part of the journal.
+fn for_each_record(journal: &[u8], hash: u32,
+    mut func: impl FnMut(usize, &[u8]) -> anyhow::Result<()>) -> anyhow::Result<usize>
+{
+    if journal.len() < FILE_HEADER_LEN {
+        return Ok(0);
+    }
+    if journal[..8] != JOURNAL_MAGIC || journal[8..12] != hash.to_le_bytes() {
+        bail!("Mismatched journal!");
+    }
+    let field = |off: usize| u32::from_le_bytes(journal[off..off + 4].try_into().unwrap()) as usize;
+    let mut off = FILE_HEADER_LEN;
+    while off + RECORD_HEADER_LEN <= journal.len() {
+        let (page, len, crc) = (field(off), field(off + 4), field(off + 8) as u32);
+        let start = off + RECORD_HEADER_LEN;
+        if len > JOURNAL_PAGE || start + len > journal.len() {
+            break;
+        }
+        let buf = &journal[start..start + len];
+        if record_crc(page, buf) != crc {
+            break;
+        }
+        func(page, buf)?;
+        off = start + len;
+    }
+    if off != journal.len() {
+        error!(target: "MEMSAVE", "Discarding {} bytes at the end of a journal", journal.len() - off);
+    }
+    Ok(off)
+}
+
+/// Apply the records in a journal to some memory. Returns the length of the
+/// valid part of the journal, or [None] if it doesn't exist.
+fn replay(path: &Path, hash: u32, data: &mut [u8]) -> anyhow::Result<Option<usize>> {
+    let file = match File::open(path) {
+        Ok(file) => file,
+        Err(err) if err.kind() == ErrorKind::NotFound => return Ok(None),
+        Err(err) => return Err(err).context(format!("Failed to open journal {}", path.display())),
+    };
+    // SAFETY: nobody else writes to the journal while we're using it
+    let map = unsafe { Mmap::map(&file)? };
+    let mut num_records = 0;
+    let valid = for_each_record(&map, hash, |page, buf| {
+        let off = page * JOURNAL_PAGE;
+        if off + buf.len() > data.len() {
+            bail!("Journal {} is out of bounds", path.display());
+        }
+        data[off..off + buf.len()].copy_from_slice(buf);
+        num_records += 1;
+        Ok(())
+    }).context(format!("Failed to replay journal {}", path.display()))?;
+    debug!(target: "MEMSAVE", "Replayed {num_records} pages from {}", path.display());
+    Ok(Some(valid))
+}
+
+/// Map a checkpoint image, if there is one.
+fn map_checkpoint(path: &Path, len: usize) -> anyhow::Result<Option<MmapMut>> {
+    let file = match File::open(path) {
+        Ok(file) => file,
+        Err(err) if err.kind() == ErrorKind::NotFound => return Ok(None),
+        Err(err) => return Err(err).context(format!("Failed to open checkpoint {}", path.display())),
+    };
+    if file.metadata()?.len() != len as u64 {
+        error!(target: "MEMSAVE", "Ignoring checkpoint {} with the wrong size", path.display());
+        return Ok(None);
+    }
+    // SAFETY: the checkpoint is only written during compaction, and only
+    // with pages that were already replayed into (and so copied out of)
+    // this private mapping.
+    Ok(Some(unsafe { MmapOptions::new().map_copy(&file)? }))
+}
+
+/// Find numbered patch files saved by older versions, in order.
+fn legacy_patchfiles(dir: &Path) -> Vec<(u8, PathBuf)> {
+    let mut pfs: Vec<(u8, PathBuf)> = match fs::read_dir(dir) {
+        Ok(entries) => entries.filter_map(|entry| {
+            let entry = entry.ok()?;
+            let num = entry.file_name().to_string_lossy().parse::<u8>().ok()?;
+            Some((num, entry.path()))
+        }).collect(),
+        Err(_) => Vec::new(),
+    };
+    pfs.sort_by_key(|x| x.0);
+    pfs
+}
+
+fn spawn_compaction(dir: PathBuf, base: PathBuf, hash: u32) {
+    let res = std::thread::Builder::new().name("JournalCompaction".to_owned()).spawn(move || {
+        match compact(&dir, &base, hash) {
+            Ok(()) => info!(target: "MEMSAVE", "Compacted journal in {}", dir.display()),
+            Err(err) => error!(target: "MEMSAVE", "Failed to compact journal in {}: {err:#}", dir.display()),
+        }
+    });
+    if let Err(err) = res {
+        error!(target: "MEMSAVE", "Failed to start journal compaction: {err}");
+    }
+}
+
+/// Fold the old journal into the checkpoint (making a new one from the
+/// original file if needed), then remove it.
+fn compact(dir: &Path, base: &Path, hash: u32) -> anyhow::Result<()> {
+    let old = dir.join(OLD_JOURNAL);
+    let checkpoint = dir.join(CHECKPOINT);
+    let target = if checkpoint.exists() {
+        checkpoint.clone()
+    } else {
+        let new = dir.join(NEW_CHECKPOINT);
+        fs::copy(base, &new).context(format!("Failed to copy {}", base.display()))?;
+        new
+    };
+    let mut file = OpenOptions::new().write(true).open(&target)?;
+    let journal = File::open(&old)?;
+    // SAFETY: nobody writes to the old journal
+    let map = unsafe { Mmap::map(&journal)? };
+    for_each_record(&map, hash, |page, buf| {
+        file.seek(SeekFrom::Start((page * JOURNAL_PAGE) as u64))?;
+        file.write_all(buf)?;
+        Ok(())
+    })?;
+    file.sync_all()?;
+    drop(file);
+    if target != checkpoint {
+        fs::rename(&target, &checkpoint)?;
+    }
+    drop(map);
+    drop(journal);
+    fs::remove_file(&old)?;
+    Ok(())
+}
@@ -0,0 +1,61 @@
+//! Memories that are written straight back to their file (i.e. the SD card).
+//!
+//! The file is mapped shared, so writes land in the page cache and the file
+//! always has the current contents. A background thread syncs the file to
+//! disk shortly after each burst of writes, so that the emulator never waits
+//! on the disk, and writes survive the host going down soon after.
+
+use std::fs::{File, OpenOptions};
+use std::sync::mpsc::{self, Receiver, SyncSender};
+use std::time::Duration;
+
+use anyhow::Context;
+use log::{debug, error};
+use memmap::{MmapMut, MmapOptions};
+
+/// How long to wait for more writes before syncing the file.
+const FLUSH_DELAY: Duration = Duration::from_millis(250);
+
+/// Handle to the flusher thread for some memory.
+pub struct WriteBack {
+    /// Wakes up the flusher. Holds at most one request, since a single sync
+    /// covers everything written before it.
+    tx: SyncSender<()>,
+}
+
+impl WriteBack {
+    /// Map some file for writing back, and start the thread that flushes it.
+    pub fn open(filename: &str) -> anyhow::Result<(Self, MmapMut)> {
+        let f = OpenOptions::new().read(true).write(true).open(filename)
+            .context(format!("Couldn't open {filename} for writing"))?;
+        let map = unsafe { MmapOptions::new().map_mut(&f) }
+            .context(format!("Couldn't map {filename}"))?;
+        let (tx, rx) = mpsc::sync_channel(1);
+        let name = filename.to_owned();
+        std::thread::Builder::new().name("WriteBack".to_owned())
+            .spawn(move || flusher(f, &name, rx))?;
+        debug!(target: "MEMSAVE", "Writing back to {filename}");
+        Ok((WriteBack { tx }, map))
+    }
+
+    /// Ask for the file to be synced soon. Never blocks.
+    pub fn schedule(&self) {
+        // Either the flusher already has a pending request, or it's gone (and
+        // has already logged why).
+        let _ = self.tx.try_send(());
+    }
+}
+
+fn flusher(f: File, name: &str, rx: Receiver<()>) {
+    while rx.recv().is_ok() {
+        std::thread::sleep(FLUSH_DELAY);
+        let _ = rx.try_recv();
+        if let Err(err) = f.sync_data() {
+            error!(target: "MEMSAVE", "Failed to write back {name}: {err}");
+        }
+    }
+    // The memory was dropped: catch anything written since the last sync.
+    if let Err(err) = f.sync_data() {
+        error!(target: "MEMSAVE", "Failed to write back {name}: {err}");
+    }
+}
@@ -0,0 +1,237 @@
+//! Counters describing what the emulator is doing at runtime, for spotting
+//! pathological guest behaviour (i.e. loops polling MMIO registers) and
+//! contention on the bus lock.
+//!
+//! Counters live in a single global registry ([METRICS]) of relaxed atomics,
+//! so that any thread can update them (or take a [snapshot]) without locking
+//! anything. Counters on the hottest paths are kept by their owner instead,
+//! and published once per slice (see [Metrics::publish_tlb]).
+
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::time::Instant;
+
+use parking_lot::{RwLock, RwLockReadGuard, RwLockWriteGuard};
+
+use crate::bus::Bus;
+use crate::bus::offload::Engine;
+use crate::bus::prim::IoDevice;
+use crate::bus::task::BusTask;
+use crate::cpu::excep::ExceptionType;
+use crate::dev::aes::AesCommand;
+use crate::dev::nand::NandCmd;
+use crate::dev::sha::ShaCommand;
+
+/// Every kind of I/O device, in the order of their counters.
+const IO_DEVICES: [IoDevice; 15] = {
+    use IoDevice::*;
+    [Nand, Aes, Sha, Ehci, Ohci0, Ohci1, Sdhc0, Sdhc1, Hlwd, Ahb, Ddr, Di, Si, Exi, Mi]
+};
+
+/// Names of each kind of [BusTask], in the order of their counters.
+const TASK_KINDS: [&str; 10] = [
+    "Nand", "Aes", "Sha", "SetRomDisabled", "SetMirrorEnabled",
+    "ScheduleAlarm", "Alarm", "Mi", "SDHC", "Offloaded",
+];
+
+/// Names of each kind of [ExceptionType], in the order of their counters.
+const EXCEPTIONS: [&str; 6] = ["Undef", "Swi", "Pabt", "Dabt", "Irq", "Fiq"];
+
+/// Threads that take the bus lock.
+#[derive(Debug, Clone, Copy)]
+pub enum LockUser { Cpu, Ppc }
+const LOCK_USERS: [LockUser; 2] = [LockUser::Cpu, LockUser::Ppc];
+
+const ZERO: AtomicU64 = AtomicU64::new(0);
+
+/// Counters for one kind of [BusTask].
+pub struct TaskCounters {
+    pub count: AtomicU64,
+    /// Bytes moved by DMA (for tasks where that's known up front).
+    pub bytes: AtomicU64,
+    /// Host time spent completing the tasks.
+    pub nanos: AtomicU64,
+}
+
+/// Times a [BusTask] while it's being completed.
+pub struct TaskTimer {
+    counters: &'static TaskCounters,
+    bytes: u64,
+    start: Instant,
+}
+impl Drop for TaskTimer {
+    fn drop(&mut self) {
+        bump(&self.counters.count, 1);
+        bump(&self.counters.bytes, self.bytes);
+        bump(&self.counters.nanos, self.start.elapsed().as_nanos() as u64);
+    }
+}
+
+/// Counters for one [LockUser].
+pub struct LockCounters {
+    pub acquired: AtomicU64,
+    /// Number of times the lock was already held by someone else.
+    pub contended: AtomicU64,
+    /// Host time spent waiting for the lock.
+    pub wait_nanos: AtomicU64,
+}
+
+pub struct Metrics {
+    pub mmio_reads: [AtomicU64; IO_DEVICES.len()],
+    pub mmio_writes: [AtomicU64; IO_DEVICES.len()],
+    pub tasks: [TaskCounters; TASK_KINDS.len()],
+    pub tlb_hits: AtomicU64,
+    pub tlb_misses: AtomicU64,
+    pub exceptions: [AtomicU64; EXCEPTIONS.len()],
+    pub locks: [LockCounters; LOCK_USERS.len()],
+}
+
+pub static METRICS: Metrics = Metrics {
+    mmio_reads: [ZERO; IO_DEVICES.len()],
+    mmio_writes: [ZERO; IO_DEVICES.len()],
+    tasks: [const { TaskCounters { count: ZERO, bytes: ZERO, nanos: ZERO } }; TASK_KINDS.len()],
+    tlb_hits: ZERO,
+    tlb_misses: ZERO,
+    exceptions: [ZERO; EXCEPTIONS.len()],
+    locks: [const { LockCounters { acquired: ZERO, contended: ZERO, wait_nanos: ZERO } }; LOCK_USERS.len()],
+};
+
+fn bump(counter: &AtomicU64, val: u64) {
+    counter.fetch_add(val, Ordering::Relaxed);
+}
+
+impl Metrics {
+    pub fn mmio_read(&self, dev: IoDevice) {
+        bump(&self.mmio_reads[dev as usize], 1);
+    }
+
+    pub fn mmio_write(&self, dev: IoDevice) {
+        bump(&self.mmio_writes[dev as usize], 1);
+    }
+
+    /// Start timing a task, which is counted when the timer is dropped.
+    pub fn start_task(&'static self, task: &BusTask) -> TaskTimer {
+        let (idx, bytes) = match task {
+            BusTask::Nand(x) => (0, NandCmd::new(*x).map_or(0, |cmd| cmd.len as u64)),
+            BusTask::Aes(x) => (1, AesCommand::from(*x).len as u64),
+            BusTask::Sha(x) => (2, ShaCommand::from(*x).len as u64),
+            BusTask::SetRomDisabled(_) => (3, 0),
+            BusTask::SetMirrorEnabled(_) => (4, 0),
+            BusTask::ScheduleAlarm => (5, 0),
+            BusTask::Alarm(_) => (6, 0),
+            BusTask::Mi { .. } => (7, 0),
+            BusTask::SDHC(_) => (8, 0),
+            BusTask::Offloaded(engine, x) => (9, match engine {
+                Engine::Aes => AesCommand::from(*x).len as u64,
+                Engine::Sha => ShaCommand::from(*x).len as u64,
+            }),
+        };
+        TaskTimer { counters: &self.tasks[idx], bytes, start: Instant::now() }
+    }
+
+    pub fn exception(&self, e: ExceptionType) {
+        let idx = match e {
+            ExceptionType::Undef(_) => 0,
+            ExceptionType::Swi => 1,
+            ExceptionType::Pabt => 2,
+            ExceptionType::Dabt => 3,
+            ExceptionType::Irq => 4,
+            ExceptionType::Fiq => 5,
+        };
+        bump(&self.exceptions[idx], 1);
+    }
+
+    /// Add the TLB lookups counted by the CPU since the last call.
+    pub fn publish_tlb(&self, hits: u64, misses: u64) {
+        bump(&self.tlb_hits, hits);
+        bump(&self.tlb_misses, misses);
+    }
+
+    /// Count an acquisition of the bus lock, timing the wait if someone else
+    /// is holding it.
+    fn lock<G>(&self, user: LockUser, try_lock: impl FnOnce() -> Option<G>, lock: impl FnOnce() -> G) -> G {
+        let counters = &self.locks[user as usize];
+        bump(&counters.acquired, 1);
+        if let Some(guard) = try_lock() {
+            return guard;
+        }
+        let start = Instant::now();
+        let guard = lock();
+        bump(&counters.contended, 1);
+        bump(&counters.wait_nanos, start.elapsed().as_nanos() as u64);
+        guard
+    }
+}
+
+/// Take the bus for writing, counting the time spent waiting.
+pub fn write_bus(bus: &RwLock<Bus>, user: LockUser) -> RwLockWriteGuard<'_, Bus> {
+    METRICS.lock(user, || bus.try_write(), || bus.write())
+}
+
+/// Take the bus for reading, counting the time spent waiting.
+pub fn read_bus(bus: &RwLock<Bus>, user: LockUser) -> RwLockReadGuard<'_, Bus> {
+    METRICS.lock(user, || bus.try_read(), || bus.read())
+}
+
+/// The current value of every counter, by name.
+pub fn snapshot() -> Vec<(String, u64)> {
+    let get = |counter: &AtomicU64| counter.load(Ordering::Relaxed);
+    let mut res = Vec::new();
+    for (idx, dev) in IO_DEVICES.iter().enumerate() {
+        res.push((format!("mmio.{dev:?}.reads"), get(&METRICS.mmio_reads[idx])));
+        res.push((format!("mmio.{dev:?}.writes"), get(&METRICS.mmio_writes[idx])));
+    }
+    for (name, counters) in TASK_KINDS.iter().zip(METRICS.tasks.iter()) {
+        res.push((format!("task.{name}.count"), get(&counters.count)));
+        res.push((format!("task.{name}.bytes"), get(&counters.bytes)));
+        res.push((format!("task.{name}.nanos"), get(&counters.nanos)));
+    }
+    res.push(("tlb.hits".to_owned(), get(&METRICS.tlb_hits)));
+    res.push(("tlb.misses".to_owned(), get(&METRICS.tlb_misses)));
+    for (name, counter) in EXCEPTIONS.iter().zip(METRICS.exceptions.iter()) {
+        res.push((format!("exception.{name}"), get(counter)));
+    }
+    for (user, counters) in LOCK_USERS.iter().zip(METRICS.locks.iter()) {
+        res.push((format!("lock.{user:?}.acquired"), get(&counters.acquired)));
+        res.push((format!("lock.{user:?}.contended"), get(&counters.contended)));
+        res.push((format!("lock.{user:?}.wait_nanos"), get(&counters.wait_nanos)));
+    }
+    res
+}
+
+/// Format a [snapshot] as text, with one `name value` pair per line.
+pub fn format_snapshot(snap: &[(String, u64)]) -> String {
+    snap.iter().map(|(name, val)| format!("{name} {val}\n")).collect()
+}
+
+/// Summarize the change in counters between two [snapshot]s in a line.
+pub fn summary(prev: &[(String, u64)], cur: &[(String, u64)]) -> String {
+    let delta: Vec<(&str, u64)> = cur.iter().zip(prev.iter())
+        .map(|((name, new), (_, old))| (name.as_str(), new - old))
+        .collect();
+    let sum = |prefix: &str, suffix: &str| -> u64 {
+        delta.iter()
+            .filter(|(name, _)| name.starts_with(prefix) && name.ends_with(suffix))
+            .map(|(_, val)| val).sum()
+    };
+    let get = |name: &str| sum(name, "");
+
+    // The device with the most accesses is the likeliest to be polled.
+    let busiest = IO_DEVICES.iter()
+        .map(|dev| (dev, sum(&format!("mmio.{dev:?}."), "")))
+        .max_by_key(|(_, count)| *count)
+        .filter(|(_, count)| *count > 0);
+    let busiest = match busiest {
+        Some((dev, count)) => format!("{dev:?} {count}"),
+        None => "none".to_owned(),
+    };
+    let (hits, misses) = (get("tlb.hits"), get("tlb.misses"));
+    let hit_rate = 100.0 * hits as f64 / (hits + misses).max(1) as f64;
+    format!("mmio {}r/{}w (busiest {busiest}), tasks {} ({}us), tlb {hit_rate:.1}% hits, \
+        exceptions {}, lock waits cpu {}us/{}, ppc {}us/{}",
+        sum("mmio.", ".reads"), sum("mmio.", ".writes"),
+        sum("task.", ".count"), sum("task.", ".nanos") / 1000,
+        get("exception."),
+        get("lock.Cpu.wait_nanos") / 1000, get("lock.Cpu.contended"),
+        get("lock.Ppc.wait_nanos") / 1000, get("lock.Ppc.contended"),
+    )
+}
@@ -0,0 +1,274 @@
+//! Saving and restoring the state of the whole machine.
+//!
+//! A snapshot file starts with [SNAPSHOT_MAGIC] and [SNAPSHOT_VERSION],
+//! followed by a single LZ4 frame with the state of each part of the machine
+//! (the backend, the CPU, and the bus along with every device and memory),
+//! in the order they were saved.
+//!
+//! Most state is plain data, encoded with bincode. Memories are restored in
+//! place: the lock-free paths into guest RAM (see [crate::bus::fastmem]) hold
+//! pointers to their backing storage, which must never move. Memories that
+//! are initialized from a file only store the parts that differ from it.
+//!
+//! A reset point (see [save_reset_point]) is a snapshot kept in memory, for
+//! going back to the same state over and over (i.e. between runs of a
+//! fuzzer). Memories that track dirty pages (see [crate::mem::dirty]) aren't
+//! saved in a reset point, and only put back the pages written since.
+//!
+//! Anything outside of the emulated machine (for instance, the state of PPC
+//! HLE clients) isn't part of a snapshot. Neither are the contents of the SD
+//! card when they're written straight back to `sd.img` (with
+//! [crate::bus::BusOptions::write_back_sd]): only a hash of them is kept,
+//! and the snapshot can't be restored once `sd.img` has changed.
+
+use std::fs::File;
+use std::io::{BufReader, BufWriter, Read, Write};
+
+use anyhow::bail;
+use bincode::{config, Encode};
+use log::info;
+
+use crate::bus::Bus;
+use crate::bus::prim::MemDevice;
+use crate::dev::ehci::EhcInterface;
+use crate::dev::ohci::OhcInterface;
+use crate::dev::sdhc::WLANInterface;
+use crate::dev::sha::ShaInterface;
+use crate::mem::dirty::DIRTY_PAGE;
+
+/// Identifies a snapshot file.
+pub const SNAPSHOT_MAGIC: [u8; 8] = *b"IRONSNAP";
+
+/// Version of the snapshot format. Bump this whenever the saved state of
+/// anything changes.
+pub const SNAPSHOT_VERSION: u32 = 5;
+
+/// Some part of the machine that can be saved into a snapshot.
+pub trait Snapshot {
+    /// Write the current state.
+    fn save(&self, w: &mut dyn Write) -> anyhow::Result<()>;
+    /// Replace the current state with previously-saved state.
+    fn restore(&mut self, r: &mut dyn Read) -> anyhow::Result<()>;
+
+    /// Write the state needed to come back to this point with
+    /// [Snapshot::restore_reset_point]. This is the same as [Snapshot::save], except for
+    /// parts that keep track of their own changes.
+    fn save_reset_point(&self, w: &mut dyn Write) -> anyhow::Result<()> {
+        self.save(w)
+    }
+    /// Go back to the state written by [Snapshot::save_reset_point].
+    fn restore_reset_point(&mut self, r: &mut dyn Read) -> anyhow::Result<()> {
+        self.restore(r)
+    }
+}
+
+/// Encode some plain data into a snapshot.
+pub fn put<T: Encode>(mut w: &mut dyn Write, val: &T) -> anyhow::Result<()> {
+    bincode::encode_into_std_write(val, &mut w, config::standard())?;
+    Ok(())
+}
+
+/// Decode some plain data from a snapshot, with the type inferred from the
+/// destination.
+#[macro_export]
+macro_rules! snapshot_get {
+    ($r:expr) => {{
+        let mut r: &mut dyn ::std::io::Read = $r;
+        ::bincode::decode_from_std_read(&mut r, ::bincode::config::standard())?
+    }};
+}
+pub use crate::snapshot_get as get;
+
+/// Implement [Snapshot] for a struct by saving each of its fields in order.
+/// Fields listed under `encode` are plain data, and fields listed under
+/// `nested` implement [Snapshot] themselves.
+#[macro_export]
+macro_rules! impl_snapshot {
+    ($ty:ty, encode: [$($field:ident),* $(,)?] $(, nested: [$($nested:ident),* $(,)?])? $(,)?) => {
+        impl $crate::snapshot::Snapshot for $ty {
+            fn save(&self, w: &mut dyn ::std::io::Write) -> ::anyhow::Result<()> {
+                $( $crate::snapshot::put(w, &self.$field)?; )*
+                $($( self.$nested.save(w)?; )*)?
+                Ok(())
+            }
+            fn restore(&mut self, r: &mut dyn ::std::io::Read) -> ::anyhow::Result<()> {
+                $( self.$field = $crate::snapshot::get!(r); )*
+                $($( self.$nested.restore(r)?; )*)?
+                Ok(())
+            }
+            fn save_reset_point(&self, w: &mut dyn ::std::io::Write) -> ::anyhow::Result<()> {
+                $( $crate::snapshot::put(w, &self.$field)?; )*
+                $($( self.$nested.save_reset_point(w)?; )*)?
+                Ok(())
+            }
+            fn restore_reset_point(&mut self, r: &mut dyn ::std::io::Read) -> ::anyhow::Result<()> {
+                $( self.$field = $crate::snapshot::get!(r); )*
+                $($( self.$nested.restore_reset_point(r)?; )*)?
+                Ok(())
+            }
+        }
+    };
+}
+pub use crate::impl_snapshot;
+
+/// Write a snapshot file containing some parts of the machine.
+pub fn save_file(path: &str, parts: &[&dyn Snapshot]) -> anyhow::Result<()> {
+    use lz4_flex::frame::FrameEncoder;
+    let mut file = BufWriter::new(File::create(path)?);
+    file.write_all(&SNAPSHOT_MAGIC)?;
+    file.write_all(&SNAPSHOT_VERSION.to_le_bytes())?;
+    let mut encoder = FrameEncoder::new(file);
+    for part in parts {
+        part.save(&mut encoder)?;
+    }
+    encoder.finish()?.flush()?;
+    info!(target: "Other", "Saved snapshot to {path}");
+    Ok(())
+}
+
+/// Restore some parts of the machine from a snapshot file. The parts must be
+/// the same (and in the same order) as when the file was saved.
+pub fn restore_file(path: &str, parts: &mut [&mut dyn Snapshot]) -> anyhow::Result<()> {
+    use lz4_flex::frame::FrameDecoder;
+    let mut file = BufReader::new(File::open(path)?);
+    let mut magic = [0u8; 8];
+    let mut version = [0u8; 4];
+    file.read_exact(&mut magic)?;
+    file.read_exact(&mut version)?;
+    if magic != SNAPSHOT_MAGIC {
+        bail!("{path} isn't a snapshot file");
+    }
+    let version = u32::from_le_bytes(version);
+    if version != SNAPSHOT_VERSION {
+        bail!("Snapshot {path} has version {version}, expected {SNAPSHOT_VERSION}");
+    }
+    let mut decoder = FrameDecoder::new(file);
+    for part in parts.iter_mut() {
+        part.restore(&mut decoder)?;
+    }
+    info!(target: "Other", "Restored snapshot from {path}");
+    Ok(())
+}
+
+/// Save a reset point with some parts of the machine (see
+/// [Snapshot::save_reset_point]).
+pub fn save_reset_point(parts: &[&dyn Snapshot]) -> anyhow::Result<Vec<u8>> {
+    let mut buf = Vec::new();
+    for part in parts {
+        part.save_reset_point(&mut buf)?;
+    }
+    Ok(buf)
+}
+
+/// Go back to a reset point. The parts must be the same (and in the same
+/// order) as when it was saved.
+pub fn restore_reset_point(mut point: &[u8], parts: &mut [&mut dyn Snapshot]) -> anyhow::Result<()> {
+    for part in parts.iter_mut() {
+        part.restore_reset_point(&mut point)?;
+    }
+    Ok(())
+}
+
+/// Implement [Snapshot] for types that are saved as plain data.
+macro_rules! impl_snapshot_plain {
+    ($($ty:ty),* $(,)?) => {
+        $(
+            impl Snapshot for $ty {
+                fn save(&self, w: &mut dyn Write) -> anyhow::Result<()> {
+                    put(w, self)
+                }
+                fn restore(&mut self, r: &mut dyn Read) -> anyhow::Result<()> {
+                    *self = get!(r);
+                    Ok(())
+                }
+            }
+        )*
+    };
+}
+impl_snapshot_plain!(bool, u8, u16, u32, u64, usize, String);
+impl_snapshot_plain!(ShaInterface, EhcInterface, OhcInterface, WLANInterface);
+
+/// Which of the [Snapshot] methods to use for the parts of the bus.
+#[derive(Clone, Copy, PartialEq)]
+enum BusSnapshot { Whole, ResetPoint }
+
+impl Bus {
+    fn save_parts(&self, w: &mut dyn Write, kind: BusSnapshot) -> anyhow::Result<()> {
+        let parts: [&dyn Snapshot; 14] = [
+            &self.mrom, &self.sram0, &self.sram1, &self.mem1, &self.mem2,
+            &self.hlwd, &self.nand, &self.aes, &self.sha, &self.ehci,
+            &self.ohci0, &self.ohci1, &self.sd0, &self.sd1,
+        ];
+        for part in parts {
+            match kind {
+                BusSnapshot::Whole => part.save(w)?,
+                BusSnapshot::ResetPoint => part.save_reset_point(w)?,
+            }
+        }
+
+        put(w, &self.rom_disabled)?;
+        put(w, &self.mirror_enabled)?;
+        put(w, &self.tasks)?;
+        self.offload.save(w)?;
+        put(w, &self.cycle)?;
+        Ok(())
+    }
+
+    fn restore_parts(&mut self, r: &mut dyn Read, kind: BusSnapshot) -> anyhow::Result<()> {
+        let parts: [&mut dyn Snapshot; 14] = [
+            &mut self.mrom, &mut self.sram0, &mut self.sram1, &mut self.mem1, &mut self.mem2,
+            &mut self.hlwd, &mut self.nand, &mut self.aes, &mut self.sha, &mut self.ehci,
+            &mut self.ohci0, &mut self.ohci1, &mut self.sd0, &mut self.sd1,
+        ];
+        for part in parts {
+            match kind {
+                BusSnapshot::Whole => part.restore(r)?,
+                BusSnapshot::ResetPoint => part.restore_reset_point(r)?,
+            }
+        }
+
+        self.rom_disabled = get!(r);
+        self.mirror_enabled = get!(r);
+        self.tasks = get!(r);
+        self.offload.restore(r)?;
+        self.cycle = get!(r);
+
+        // Everything that was derived from the old contents of memory (or
+        // the old memory map) is stale now. After a reset, that's only the
+        // pages that were put back.
+        match kind {
+            BusSnapshot::Whole => self.code.invalidate_all(),
+            BusSnapshot::ResetPoint => {
+                for (dev, mem) in [
+                    (MemDevice::MaskRom, &mut self.mrom),
+                    (MemDevice::Sram0, &mut self.sram0),
+                    (MemDevice::Sram1, &mut self.sram1),
+                    (MemDevice::Mem1, &mut self.mem1),
+                    (MemDevice::Mem2, &mut self.mem2),
+                ] {
+                    for off in mem.take_reset_pages() {
+                        self.code.notify_write(dev, off, DIRTY_PAGE);
+                    }
+                }
+            },
+        }
+        self.remap();
+        self.ppc_irq_raised = false;
+        Ok(())
+    }
+}
+
+impl Snapshot for Bus {
+    fn save(&self, w: &mut dyn Write) -> anyhow::Result<()> {
+        self.save_parts(w, BusSnapshot::Whole)
+    }
+    fn restore(&mut self, r: &mut dyn Read) -> anyhow::Result<()> {
+        self.restore_parts(r, BusSnapshot::Whole)
+    }
+    fn save_reset_point(&self, w: &mut dyn Write) -> anyhow::Result<()> {
+        self.save_parts(w, BusSnapshot::ResetPoint)
+    }
+    fn restore_reset_point(&mut self, r: &mut dyn Read) -> anyhow::Result<()> {
+        self.restore_parts(r, BusSnapshot::ResetPoint)
+    }
+}
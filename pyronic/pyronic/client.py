@@ -57,8 +57,8 @@ class IPCClient(object):
     IPC_IOCTL   = 6
     IPC_IOCTLV  = 7
 
-    def __init__(self, filename="/tmp/ironic-ppc.sock"):
-        self.sock = IronicSocket()
+    def __init__(self, filename="/tmp/ironic-ppc.sock", shared_ram=None):
+        self.sock = IronicSocket(filename, shared_ram)
         self.mem = PPCMemory(self.sock)
 
     def alloc_buf(self, buf, paddr=None):
@@ -99,6 +99,52 @@ class IPCClient(object):
         response_ptr = self.sock.recv_ipcmsg()
         return MemHandle(self.sock, response_ptr, 0x20)
 
+    def guest_ipc_submit(self, ipcmsg: IPCMsg, reqid=None):
+        """ Send an IPC request without waiting for the response. Returns
+        the ID of the request (its address, unless one is given) """
+        return self.guest_ipc_batch([ipcmsg], [reqid])[0]
+
+    def guest_ipc_batch(self, ipcmsgs, reqids=None):
+        """ Send a list of IPC requests without waiting for the responses,
+        returning their IDs as in guest_ipc_submit() """
+        if reqids == None:
+            reqids = [None] * len(ipcmsgs)
+        entries = []
+        for (ipcmsg, reqid) in zip(ipcmsgs, reqids):
+            buf = self.alloc_buf(ipcmsg.to_buffer())
+            entries.append((buf.paddr, buf.paddr if reqid == None else reqid))
+        self.sock.send_batch(entries)
+        return [reqid for (_, reqid) in entries]
+
+    def guest_ipc_wait(self, limit=0):
+        """ Block until some submitted requests have completed, returning
+        a list of (ID, handle to the response), possibly out of order. The
+        list is empty if no requests are in flight """
+        return [(reqid, MemHandle(self.sock, ptr, 0x20))
+                for (reqid, ptr) in self.sock.recv_completions(limit)]
+
+    def metrics(self):
+        """ Get a snapshot of the emulator's metrics (MMIO accesses per
+        device, bus tasks, TLB lookups, exceptions, and bus lock waits) """
+        return self.sock.recv_metrics()
+
+    def set_reset_point(self):
+        """ Save the current state of the machine (when running with
+        `--fuzz`), so that it can be restored quickly with reset() """
+        self.sock.send_fuzz_request(IronicSocket.IRONIC_SET_RESET_POINT)
+        self.reset_cursor = self.mem.cursor
+
+    def reset(self):
+        """ Put the machine back in the state it was in when
+        set_reset_point() was called """
+        self.sock.send_fuzz_request(IronicSocket.IRONIC_RESET)
+        self.mem.cursor = self.reset_cursor
+
+    def coverage(self):
+        """ Get the branch coverage counters (an AFL-style map of edges
+        between branch targets) since the last call, and clear them """
+        return self.sock.recv_coverage()
+
     def IOSOpen(self, inpath, mode=0):
         buf = self.alloc_buf(inpath.encode('utf-8') + b'\x00')
         msg = IPCMsg(self.IPC_OPEN, fd=0, args=[buf.paddr, mode])
@@ -0,0 +1,44 @@
+import mmap
+import os
+
+class SharedRam(object):
+    """ Guest MEM1/MEM2, mapped from the files exported by the emulator when
+    it's started with `--shared-ram`.
+
+    Accesses through this mapping bypass the emulator entirely. They aren't
+    ordered against the ARM, so (just like on real hardware) only touch
+    buffers that ARM-world isn't using until the next IPC message. Don't
+    use this to patch ARM code: the emulator won't notice that it changed.
+    """
+    REGIONS = [
+        (0x00000000, 0x01800000, "ironic-mem1"),
+        (0x10000000, 0x04000000, "ironic-mem2"),
+    ]
+
+    def __init__(self, dirname="/dev/shm"):
+        self.maps = []
+        for base, size, name in self.REGIONS:
+            with open(os.path.join(dirname, name), "r+b") as f:
+                self.maps.append((base, size, mmap.mmap(f.fileno(), size)))
+
+    def lookup(self, paddr, size):
+        """ Find the mapping and offset for some physical range """
+        for base, rsize, m in self.maps:
+            if base <= paddr and paddr + size <= base + rsize:
+                return m, paddr - base
+        return None, None
+
+    def read(self, paddr, size):
+        """ Read from guest memory, or return None if it isn't mapped """
+        m, off = self.lookup(paddr, size)
+        if m == None:
+            return None
+        return m[off:off+size]
+
+    def write(self, paddr, buf):
+        """ Write to guest memory, returning False if it isn't mapped """
+        m, off = self.lookup(paddr, len(buf))
+        if m == None:
+            return False
+        m[off:off+len(buf)] = buf
+        return True
@@ -1,5 +1,6 @@
 import socket
 from struct import pack, unpack
+from pyronic.shm import SharedRam
 WRITE_LIMIT = 10000 - 12 # back/src/ppc.rs const BUF_LEN=100000 subtract message header 12 bytes
 
 class IronicSocket(object):
@@ -9,11 +10,30 @@ class IronicSocket(object):
     IRONIC_MSG     = 3
     IRONIC_ACK     = 4
     IRONIC_MSGNORET= 5
+    IRONIC_SUBMIT  = 6
+    IRONIC_BATCH   = 7
+    IRONIC_WAIT    = 8
+    IRONIC_METRICS = 9
+    IRONIC_SET_RESET_POINT = 10
+    IRONIC_RESET   = 11
+    IRONIC_COVERAGE= 12
     IRONIC_QUIT    = 255
 
-    def __init__(self, filename="/tmp/ironic-ppc.sock"):
+    def __init__(self, filename="/tmp/ironic-ppc.sock", shared_ram=None):
         self.socket = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
         self.socket.connect(filename)
+        # Guest memory exported by the emulator (with `--shared-ram`), used
+        # instead of the socket for reads and writes where possible
+        self.ram = SharedRam(shared_ram) if shared_ram != None else None
+
+    def recv_exact(self, size):
+        """ Receive exactly 'size' bytes from the server """
+        buf = bytearray()
+        while len(buf) != size:
+            chunk = self.socket.recv(size - len(buf))
+            assert len(chunk) != 0
+            buf += chunk
+        return bytes(buf)
 
     def close(self): 
         msg = bytearray()
@@ -24,30 +44,34 @@ class IronicSocket(object):
 
     def send_guestread(self, paddr, size):
         """ Send a guest read command to the server """
+        if self.ram != None:
+            resp = self.ram.read(paddr, size)
+            if resp != None:
+                return resp
         msg = bytearray()
         msg += pack("<LLL", self.IRONIC_READ, paddr, size)
-        self.socket.send(msg)
-        resp = self.socket.recv(size)
-        assert len(resp) == size
-        return resp
+        self.socket.sendall(msg)
+        return self.recv_exact(size)
 
     def handle_large_guestwrite(self, paddr, buf):
         offset = 0
         while offset != len(buf):
             next_offset = min(len(buf), offset+WRITE_LIMIT)
-            self.send_guestwrite(offset, buf[offset:next_offset])
+            self.send_guestwrite(paddr + offset, buf[offset:next_offset])
             offset = next_offset
         pass
 
     def send_guestwrite(self, paddr, buf):
         """ Send a guest write command to the server """
+        if self.ram != None and self.ram.write(paddr, buf):
+            return
         if len(buf) > WRITE_LIMIT:
             self.handle_large_guestwrite(paddr, buf)
             return
         msg = bytearray()
         msg += pack("<LLL", self.IRONIC_WRITE, paddr, len(buf))
         msg += buf
-        self.socket.send(msg)
+        self.socket.sendall(msg)
         resp = self.socket.recv(2)
         assert resp.decode('utf-8') == "OK"
 
@@ -67,6 +91,68 @@ class IronicSocket(object):
         assert resp.decode('utf-8') == "OK"
 
 
+    def send_submit(self, ptr, reqid):
+        """ Send an IPC message without waiting for the response """
+        msg = bytearray()
+        msg += pack("<LLL", self.IRONIC_SUBMIT, ptr, reqid)
+        self.socket.sendall(msg)
+        resp = self.recv_exact(2)
+        assert resp.decode('utf-8') == "OK"
+
+    def send_batch(self, entries):
+        """ Send a list of (pointer, ID) IPC messages without waiting for
+        the responses """
+        msg = bytearray()
+        msg += pack("<LLL", self.IRONIC_BATCH, 0, len(entries))
+        for (ptr, reqid) in entries:
+            msg += pack("<LL", ptr, reqid)
+        self.socket.sendall(msg)
+        resp = self.recv_exact(2)
+        assert resp.decode('utf-8') == "OK"
+
+    def recv_completions(self, limit=0):
+        """ Wait for responses to submitted messages (at most 'limit' of
+        them, unless zero) and return them as a list of (ID, pointer) """
+        msg = bytearray()
+        msg += pack("<LLL", self.IRONIC_WAIT, 0, limit)
+        self.socket.sendall(msg)
+        count = unpack("<L", self.recv_exact(4))[0]
+        buf = self.recv_exact(count * 8)
+        return [unpack("<LL", buf[i*8:(i+1)*8]) for i in range(count)]
+
+    def recv_metrics(self):
+        """ Get the current value of every counter in the emulator, as a
+        dictionary of name to value """
+        msg = bytearray()
+        msg += pack("<LLL", self.IRONIC_METRICS, 0, 0)
+        self.socket.sendall(msg)
+        size = unpack("<L", self.recv_exact(4))[0]
+        text = self.recv_exact(size).decode('utf-8')
+        res = {}
+        for line in text.splitlines():
+            (name, val) = line.split(" ")
+            res[name] = int(val)
+        return res
+
+    def send_fuzz_request(self, cmd):
+        """ Ask the emulator to set its reset point or go back to it (with
+        `--fuzz`), and wait for it to be done """
+        msg = bytearray()
+        msg += pack("<LLL", cmd, 0, 0)
+        self.socket.sendall(msg)
+        resp = self.recv_exact(2)
+        if resp.decode('utf-8') != "OK":
+            raise RuntimeError("Emulator failed to handle fuzzer request")
+
+    def recv_coverage(self):
+        """ Get the branch coverage counters since the last call, as bytes
+        (empty when the emulator isn't fuzzing) """
+        msg = bytearray()
+        msg += pack("<LLL", self.IRONIC_COVERAGE, 0, 0)
+        self.socket.sendall(msg)
+        size = unpack("<L", self.recv_exact(4))[0]
+        return bytes(self.recv_exact(size))
+
     def recv_ipcmsg(self):
         """ Wait for the server to respond with a pointer to an IPC message """
         res_buf = self.socket.recv(4)
@@ -1,5 +1,7 @@
 #![deny(unsafe_op_in_unsafe_fn)]
 
+mod runner;
+
 use addr2line::Context;
 use gimli::BigEndian;
 use gimli::EndianSlice;
@@ -7,6 +9,12 @@ use ironic_core::bus::*;
 use ironic_backend::interp::*;
 use ironic_backend::back::*;
 use ironic_backend::ppc::*;
+use ironic_backend::interp::trace::TraceBuffer;
+use ironic_backend::interp::fuzz::{FuzzControl, Fuzzer};
+use ironic_backend::interp::debug::Debugger;
+use ironic_backend::gdb::GdbServer;
+use ironic_core::dbg::profile::{Profile, SharedProfile, SymbolMap};
+use ironic_core::metrics;
 use log::info;
 use log::{debug, error};
 use strum::VariantNames;
@@ -25,6 +33,17 @@ Example usage for --logging
  Set base log level to WARN but override SHA to DEBUG: --logging warn,sha:debug
  Set base log level to ERROR but override SHA to TRACE and AES to DEBUG: --logging ERROR,sha:trace,aes:DEBUG";
 
+/// The kinds of CPU backend that can be selected.
+#[derive(clap::ValueEnum, Clone, Copy, Debug, PartialEq)]
+enum BackendKind {
+    /// Interpret every instruction from scratch
+    Interp,
+    /// Interpret from a cache of decoded instructions
+    Cached,
+    /// Compile blocks of guest code into host code
+    Jit,
+}
+
 #[derive(Parser, Debug)]
 struct Args {
     /// Path to a custom kernel ELF
@@ -36,16 +55,136 @@ struct Args {
     /// Define log levels for the program
     #[clap(long, default_value="info")]
     logging: String,
+    /// Which CPU backend to use
+    #[clap(short, long, value_enum, default_value_t=BackendKind::Interp)]
+    backend: BackendKind,
+    /// Save a snapshot to this file once the kernel has been reached
+    #[clap(long)]
+    save_state: Option<String>,
+    /// Restore a snapshot from this file before starting
+    #[clap(long)]
+    load_state: Option<String>,
+    /// Export MEM1 and MEM2 as shared memory for PPC HLE clients
+    #[clap(long)]
+    shared_ram: bool,
+    /// Save writes to the SD card back to sd.img (snapshots taken before it changes can't be restored after)
+    #[clap(long)]
+    sd_write_back: bool,
+    /// Profile guest code, and write a report of the hottest functions to this file
+    #[clap(long)]
+    profile: Option<String>,
+    /// Also write the profile as folded stacks (for flamegraph tools) to this file
+    #[clap(long)]
+    profile_folded: Option<String>,
+    /// Number of instructions between profiler samples
+    #[clap(long, default_value_t=1000)]
+    profile_interval: usize,
+    /// Symbol map used to name functions in the profile (lines of "<hex address> ... <name>")
+    #[clap(long)]
+    symbols: Option<String>,
+    /// Boot to the kernel with logging off, then report the time and instructions per second for each boot stage
+    #[clap(long)]
+    boot_bench: bool,
+    /// Keep a trace of this many of the most recent instructions, written to trace.txt on errors and on Ctrl-C
+    #[clap(long)]
+    trace: Option<usize>,
+    /// Log a summary of the emulator's metrics every this many seconds
+    #[clap(long)]
+    metrics: Option<u64>,
+    /// Load more hooks on guest addresses (patches and HLE replacements) from this file
+    #[clap(long)]
+    hooks: Option<String>,
+    /// Let PPC HLE clients set a reset point, reset to it quickly, and read branch coverage (for fuzzing)
+    #[clap(long)]
+    fuzz: bool,
+    /// Listen for GDB on this port on localhost (plus the index of the instance, with --instances)
+    #[clap(long)]
+    gdb: Option<u16>,
+    /// Run this many instances of the emulator (with the rest of the arguments), sharing the images in this directory
+    #[clap(long)]
+    instances: Option<usize>,
+    /// Directory containing the directory of each instance
+    #[clap(long, default_value="instances")]
+    instance_dir: String,
+    /// Pin the CPU thread of each instance to a core
+    #[clap(long)]
+    pin_cores: bool,
+    /// Run as some instance started by --instances
+    #[clap(long, hide=true)]
+    instance: Option<usize>,
+}
+
+/// Where (and how) the profile is written out at exit.
+struct ProfileOutput {
+    profile: SharedProfile,
+    report: Option<String>,
+    folded: Option<String>,
+    symbols: Option<SymbolMap>,
 }
 
 fn main() -> anyhow::Result<()> {
-    let args = Args::parse();
-    handle_logging_argument(args.logging)?;
+    let mut args = Args::parse();
+    if args.sd_write_back && (args.instances.is_some() || args.instance.is_some()) {
+        anyhow::bail!("--sd-write-back can't be used with --instances, since they share sd.img");
+    }
+    if let Some(count) = args.instances {
+        return runner::run_instances(&args, count);
+    }
+    let instance = match args.instance {
+        Some(idx) => Some(runner::enter_instance(&mut args, idx)?),
+        None => None,
+    };
+    let boot_bench = args.boot_bench;
+    if args.fuzz && !args.ppc_hle {
+        anyhow::bail!("--fuzz needs the PPC HLE server (--ppc-hle)");
+    }
+    if args.shared_ram && args.backend != BackendKind::Interp {
+        anyhow::bail!("--shared-ram needs the interpreter backend, since writes from clients don't invalidate cached code");
+    }
+    if args.fuzz && args.shared_ram {
+        anyhow::bail!("--fuzz can't be used with --shared-ram, since writes from clients wouldn't be reset");
+    }
+    handle_logging_argument(if boot_bench { "off".to_owned() } else { args.logging })?;
     let custom_kernel = args.custom_kernel.clone();
     let enable_ppc_hle = args.ppc_hle;
+    let backend_kind = args.backend;
+    let save_state = args.save_state.clone();
+    let load_state = args.load_state.clone();
+    let hooks = args.hooks.clone();
+    let profile_out = if args.profile.is_some() || args.profile_folded.is_some() {
+        let symbols = match args.symbols.as_deref() {
+            Some(path) => Some(SymbolMap::from_file(path)?),
+            None => None,
+        };
+        Some(Arc::new(ProfileOutput {
+            profile: Profile::new_shared(args.profile_interval),
+            report: args.profile.clone(),
+            folded: args.profile_folded.clone(),
+            symbols,
+        }))
+    } else {
+        None
+    };
 
     // The bus is shared between any threads we spin up
-    let bus = match Bus::new() {
+    let shared_ram = match (args.shared_ram, instance.as_ref()) {
+        (false, _) => None,
+        (true, None) => Some(shared_ram_dir()),
+        (true, Some(instance)) => {
+            let dir = shared_ram_dir().join(format!("ironic-{}", instance.idx));
+            std::fs::create_dir_all(&dir)?;
+            Some(dir)
+        },
+    };
+    if let Some(dir) = shared_ram.as_ref() {
+        info!(target: "Other", "Exporting MEM1 and MEM2 to {}", dir.display());
+    }
+    let bus_opts = BusOptions {
+        shared_ram: shared_ram.as_deref(),
+        write_back_sd: args.sd_write_back,
+        track_dirty_pages: args.fuzz,
+    };
+    let bus = match Bus::with_options(&bus_opts) {
         Ok(val) => val,
         Err(reason) => {
             println!("Failed to construct emulator Bus: {reason}");
@@ -55,6 +194,25 @@ fn main() -> anyhow::Result<()> {
 
     let bus = Arc::new(RwLock::new(bus));
 
+    // The trace is owned by the CPU thread, but it can be asked to dump it
+    let trace = args.trace.map(|len| TraceBuffer::new(len, "trace.txt"));
+    let trace_requests = trace.as_ref().map(|trace| trace.requests.clone());
+
+    // Fuzzing is driven by PPC HLE clients, on the CPU thread
+    let fuzz = args.fuzz.then(|| Arc::new(FuzzControl::new()));
+    let emu_fuzz = fuzz.clone();
+
+    // The GDB server relays packets to the CPU thread, which serves them
+    // while it's stopped
+    let gdb_port = args.gdb.map(|port| port + instance.as_ref().map_or(0, |instance| instance.idx as u16));
+    let (gdb_server, gdb_link) = match gdb_port {
+        Some(port) => {
+            let (server, link) = GdbServer::new(&bus, port);
+            (Some(server), Some(link))
+        },
+        None => (None, None),
+    };
+
     // Setup panic hook
     // We try to avoid panics inside the emulator, but it can happen so try to dump guest memory.
     let panic_bus = bus.clone();
@@ -80,17 +238,21 @@ fn main() -> anyhow::Result<()> {
                 }
                 println!("@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@");
                 match bus.nand.data.dump_writes() {
-                    Ok(_) => println!("NAND WRITES DUMPED TO {}", bus.nand.data.write_index),
+                    Ok(_) => println!("NAND WRITES SAVED TO JOURNAL"),
                     Err(e) => println!("FAILED TO DUMP NAND WRITE DATA: {e}"),
                 }
                 // Attempt a debuginfo enhanced crashdump.
                 if bus.debuginfo.debuginfo.is_none() {
-                    println!("Debug location never saved to bus, can not continue crashdump");
+                    println!("No debug info installed on the bus, can not continue crashdump");
                     break 'attempt_fancy_crashdump;
                 }
-                let pc = bus.debuginfo.last_pc.unwrap();
-                let lr = bus.debuginfo.last_lr.unwrap();
-                let _sp = bus.debuginfo.last_sp.unwrap();
+                let (pc, lr) = match ironic_core::dbg::location::capture() {
+                    Some(loc) => (loc.pc, loc.lr),
+                    None => {
+                        println!("CPU location unavailable, can not continue crashdump");
+                        break 'attempt_fancy_crashdump;
+                    },
+                };
                 if let Some(ref debuginfo) = bus.debuginfo.debuginfo {
                     let debuginfo_b = debuginfo.borrow(|section|{
                         EndianSlice::new(section, BigEndian)
@@ -109,8 +271,16 @@ fn main() -> anyhow::Result<()> {
 
     // Setup Ctrl-C handler
     let ctrl_c_bus = bus.clone();
+    let ctrl_c_profile = profile_out.clone();
+    let ctrl_c_trace = trace_requests.clone();
     ctrlc::set_handler(move ||{
         debug!(target: "MEMSAVE", "BEMemory Ctrl-C handler. Good luck!");
+        // This needs the CPU thread to take the bus, so do it first
+        if let Some(requests) = ctrl_c_trace.as_deref() {
+            if !requests.dump(Duration::new(5, 0)) {
+                println!("CPU thread didn't dump its trace in 5 seconds, it's stuck!");
+            }
+        }
         let bus = match ctrl_c_bus.try_read_for(Duration::new(5, 0)) {
             Some(b) => b,
             None => {
@@ -123,6 +293,9 @@ fn main() -> anyhow::Result<()> {
             Ok(_) => info!(target: "MEMSAVE", "NAND writes saved sucessfully"),
             Err(e) => error!(target: "MEMSAVE", "NAND writes failed to save {e}"),
         }
+        if let Some(out) = ctrl_c_profile.as_deref() {
+            write_profile(&bus, out);
+        }
         // We are now responsible for terminating the program
         // TODO: cleanup nicely?
         std::process::exit(0);
@@ -130,26 +303,135 @@ fn main() -> anyhow::Result<()> {
 
     // Fork off the backend thread
     let emu_bus = bus.clone();
+    let emu_profile = profile_out.as_ref().map(|out| out.profile.clone());
     let ppc_early_on = custom_kernel.is_some() && enable_ppc_hle;
+    let pin_core = instance.as_ref().filter(|_| args.pin_cores).map(|instance| instance.idx);
+    if pin_core.is_some() {
+        // Workers started later by the CPU thread would be pinned with it
+        bus.write().offload.start_workers();
+    }
     let emu_thread = Builder::new().name("EmuThread".to_owned()).spawn(move || {
+        if let Some(idx) = pin_core {
+            if let Err(reason) = runner::pin_to_core(idx) {
+                println!("{reason:#}, instance {idx} won't be pinned");
+            }
+        }
+        if backend_kind == BackendKind::Jit {
+            let res = ironic_backend::jit::JitBackend::new(emu_bus, custom_kernel, ppc_early_on)
+                .and_then(|mut back| {
+                    back.interp.save_state_path = save_state;
+                    if let Some(path) = load_state.as_deref() {
+                        back.interp.load_state(path)?;
+                    }
+                    if let Some(profile) = emu_profile {
+                        back.interp.cpu.attach_profile(profile);
+                    }
+                    if boot_bench {
+                        back.interp.start_bench(BootStatus::IOSKernel);
+                    }
+                    if let Some(trace) = trace {
+                        back.interp.attach_trace(trace);
+                    }
+                    back.interp.fuzz = emu_fuzz.map(Fuzzer::new);
+                    back.interp.debug = gdb_link.map(Debugger::new);
+                    if let Some(path) = hooks.as_deref() {
+                        back.interp.hooks.load_file(path)?;
+                    }
+                    let res = back.run();
+                    Ok((res, back.interp.report_bench()))
+                });
+            match res {
+                Ok((res, bench_ok)) => {
+                    if let Err(reason) = res {
+                        println!("JitBackend returned an Err: {reason}");
+                    }
+                    return bench_ok;
+                },
+                Err(reason) => println!("JitBackend returned an Err: {reason}"),
+            }
+            return false;
+        }
         let mut back = InterpBackend::new(emu_bus, custom_kernel, ppc_early_on);
+        if backend_kind == BackendKind::Cached {
+            back.block_cache = Some(ironic_backend::interp::block::BlockCache::new());
+        }
+        back.save_state_path = save_state;
+        if let Some(path) = load_state.as_deref() {
+            if let Err(reason) = back.load_state(path) {
+                println!("Failed to restore snapshot: {reason:#}");
+                return false;
+            }
+        }
+        if let Some(profile) = emu_profile {
+            back.cpu.attach_profile(profile);
+        }
+        if boot_bench {
+            back.start_bench(BootStatus::IOSKernel);
+        }
+        if let Some(trace) = trace {
+            back.attach_trace(trace);
+        }
+        back.fuzz = emu_fuzz.map(Fuzzer::new);
+        back.debug = gdb_link.map(Debugger::new);
+        if let Some(path) = hooks.as_deref() {
+            if let Err(reason) = back.hooks.load_file(path) {
+                println!("Failed to load hooks: {reason:#}");
+                return false;
+            }
+        }
         if let Err(reason) = back.run() {
             println!("InterpBackend returned an Err: {reason}");
         };
+        back.report_bench()
     }).unwrap();
 
+    // Fork off the metrics thread
+    if let Some(secs) = args.metrics {
+        let _ = Builder::new().name("MetricsThread".to_owned()).spawn(move || {
+            let mut prev = metrics::snapshot();
+            loop {
+                std::thread::sleep(Duration::from_secs(secs.max(1)));
+                let cur = metrics::snapshot();
+                info!(target: "Other", "Metrics: {}", metrics::summary(&prev, &cur));
+                prev = cur;
+            }
+        }).unwrap();
+    }
+
+    // Fork off the GDB server thread
+    if let Some(mut server) = gdb_server {
+        let _ = Builder::new().name("GdbThread".to_owned()).spawn(move || {
+            if let Err(reason) = server.run() {
+                println!("GDB server returned an Err: {reason:#}");
+            }
+        }).unwrap();
+    }
+
     // Fork off the PPC HLE thread
     if enable_ppc_hle {
         let ppc_bus = bus.clone();
+        let socket_path = instance.as_ref().map(|instance| instance.dir.join(IPC_SOCK));
         let _ = Some(Builder::new().name("IpcThread".to_owned()).spawn(move || {
             let mut back = PpcBackend::new(ppc_bus);
+            if let Some(path) = socket_path {
+                back.socket_path = path;
+            }
+            back.fuzz = fuzz;
             if let Err(reason) = back.run(){
                 println!("PPC Backend returned an Err: {reason}");
             };
         }).unwrap());
     }
 
-    let _ = emu_thread.join();
+    let bench_ok = emu_thread.join().unwrap_or(false);
+    if boot_bench {
+        // Don't dump memory or persist NAND writes, so that every run boots
+        // from the same state.
+        if let Some(out) = profile_out.as_deref() {
+            write_profile(&bus.read(), out);
+        }
+        process::exit(if bench_ok { 0 } else { 1 });
+    }
 
     let bus_ref = bus.read();
     match bus_ref.dump_memory("bin") {
@@ -164,6 +446,9 @@ fn main() -> anyhow::Result<()> {
         Ok(_) => info!(target: "MEMSAVE", "NAND writes saved sucessfully"),
         Err(e) => error!(target: "MEMSAVE", "NAND writes failed to save {e}"),
     }
+    if let Some(out) = profile_out.as_deref() {
+        write_profile(&bus_ref, out);
+    }
     println!("Bus cycles elapsed: {}", bus_ref.cycle);
     process::exit(0);
 
@@ -176,6 +461,7 @@ enum LogTarget {
     AES,
     DEBUG_PORT,
     EXI,
+    GDB,
     HLWD,
     IPC,
     IRQ,
@@ -274,6 +560,36 @@ fn enhanced_crashdump(addr2line_ctx: Context<EndianSlice<BigEndian>>, pc: u32, l
     Ok(())
 }
 
+/// Write out the profile, naming functions with the symbol map (if any) or
+/// the debug info for the custom kernel.
+fn write_profile(bus: &Bus, out: &ProfileOutput) {
+    let addr2line_ctx = bus.debuginfo.debuginfo.as_ref().and_then(|debuginfo| {
+        let debuginfo_b = debuginfo.borrow(|section| EndianSlice::new(section, BigEndian));
+        addr2line::Context::from_dwarf(debuginfo_b).ok()
+    });
+    let symbolize = |addr: u32| -> Option<String> {
+        if let Some(name) = out.symbols.as_ref().and_then(|syms| syms.lookup(addr)) {
+            return Some(name.to_owned());
+        }
+        let mut frames = addr2line_ctx.as_ref()?.find_frames(addr as u64).skip_all_loads().ok()?;
+        let func = frames.next().ok()??.function?;
+        Some(func.demangle().ok()?.into_owned())
+    };
+    let profile = out.profile.lock();
+    if let Some(path) = out.report.as_deref() {
+        match profile.write_report(path, &symbolize) {
+            Ok(_) => info!(target: "Other", "Wrote profile to {path}"),
+            Err(e) => error!(target: "Other", "Failed to write profile: {e:#}"),
+        }
+    }
+    if let Some(path) = out.folded.as_deref() {
+        match profile.write_folded(path, &symbolize) {
+            Ok(_) => info!(target: "Other", "Wrote folded stacks to {path}"),
+            Err(e) => error!(target: "Other", "Failed to write folded stacks: {e:#}"),
+        }
+    }
+}
+
 fn fmt_location(loc: Option<addr2line::Location>) -> String {
     if let Some(real_loc) = loc {
         format!("{}:{}:{}", real_loc.file.unwrap_or("??"), real_loc.line.unwrap_or(0), real_loc.column.unwrap_or(0))
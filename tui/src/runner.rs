@@ -0,0 +1,155 @@
+//! Running many instances of the emulator from one set of images.
+//!
+//! The emulator reads its images from (and writes its state to) the working
+//! directory. Each instance is a separate process running in its own
+//! directory (`<instance-dir>/<index>/`), which has links to the images in
+//! the original working directory. Images are always mapped copy-on-write,
+//! so instances share the pages they haven't written to, and anything that
+//! an instance writes (the NAND journal in `saved-writes/`, memory dumps,
+//! traces, and so on) ends up in its own directory.
+
+use std::fs::{self, File};
+use std::path::{Path, PathBuf};
+use std::process::{Command, Stdio};
+
+use anyhow::{bail, Context};
+
+use crate::Args;
+
+/// Images that are shared between instances.
+const SHARED_IMAGES: [&str; 5] = ["boot0.bin", "otp.bin", "seeprom.bin", "nand.bin", "sd.img"];
+
+/// Name of the file in an instance's directory with its output.
+const OUTPUT: &str = "output.txt";
+
+/// An instance of the emulator started by [run_instances].
+pub struct Instance {
+    pub idx: usize,
+    /// The instance's directory, which is also the working directory.
+    pub dir: PathBuf,
+}
+
+fn instance_dir(base: &Path, args: &Args, idx: usize) -> PathBuf {
+    base.join(&args.instance_dir).join(idx.to_string())
+}
+
+/// Start some number of instances with the same arguments as this process,
+/// and wait for all of them to exit.
+pub fn run_instances(args: &Args, count: usize) -> anyhow::Result<()> {
+    let exe = std::env::current_exe()?;
+    let base = std::env::current_dir()?;
+
+    // Pass everything else through as-is
+    let mut child_args = Vec::new();
+    let mut argv = std::env::args().skip(1);
+    while let Some(arg) = argv.next() {
+        if arg == "--instances" {
+            argv.next();
+        } else if !arg.starts_with("--instances=") {
+            child_args.push(arg);
+        }
+    }
+
+    let mut children = Vec::new();
+    for idx in 0..count {
+        let dir = instance_dir(&base, args, idx);
+        fs::create_dir_all(&dir).context(format!("Couldn't create directory {}", dir.display()))?;
+        let output = File::create(dir.join(OUTPUT))?;
+        let child = Command::new(&exe)
+            .args(&child_args)
+            .arg("--instance").arg(idx.to_string())
+            .stdin(Stdio::null())
+            .stdout(output.try_clone()?)
+            .stderr(output)
+            .spawn()
+            .context(format!("Couldn't start instance {idx}"))?;
+        children.push(child);
+    }
+    println!("Started {count} instances in {}, with their output in */{OUTPUT}",
+        base.join(&args.instance_dir).display());
+
+    let mut failed = 0;
+    for (idx, mut child) in children.into_iter().enumerate() {
+        let status = child.wait()?;
+        println!("Instance {idx} exited ({status})");
+        if !status.success() {
+            failed += 1;
+        }
+    }
+    if failed != 0 {
+        bail!("{failed} of {count} instances failed");
+    }
+    Ok(())
+}
+
+/// Set up this process as an instance started by [run_instances]: link the
+/// images into its directory, and move into it.
+pub fn enter_instance(args: &mut Args, idx: usize) -> anyhow::Result<Instance> {
+    let base = std::env::current_dir()?;
+    let dir = instance_dir(&base, args, idx);
+    fs::create_dir_all(&dir).context(format!("Couldn't create directory {}", dir.display()))?;
+
+    // Files named on the command line are relative to where we started
+    for path in [&mut args.custom_kernel, &mut args.load_state, &mut args.symbols, &mut args.hooks]
+        .into_iter().flatten()
+    {
+        *path = base.join(&*path).to_string_lossy().into_owned();
+    }
+
+    for name in SHARED_IMAGES {
+        let (src, dst) = (base.join(name), dir.join(name));
+        if src.exists() && fs::symlink_metadata(&dst).is_err() {
+            link(&src, &dst).context(format!("Couldn't link {} to {}", src.display(), dst.display()))?;
+        }
+    }
+    std::env::set_current_dir(&dir)?;
+    Ok(Instance { idx, dir })
+}
+
+#[cfg(unix)]
+fn link(src: &Path, dst: &Path) -> std::io::Result<()> {
+    std::os::unix::fs::symlink(src, dst)
+}
+#[cfg(windows)]
+fn link(src: &Path, dst: &Path) -> std::io::Result<()> {
+    std::os::windows::fs::symlink_file(src, dst)
+}
+
+/// Pin the calling thread (i.e. the CPU thread of an instance) to a core.
+/// The core is picked by the instance's index, from the cores that this
+/// process is allowed to run on. Other threads aren't affected, so device
+/// workers and the PPC HLE thread still run on any of them.
+#[cfg(target_os = "linux")]
+pub fn pin_to_core(idx: usize) -> anyhow::Result<()> {
+    let size = std::mem::size_of::<libc::cpu_set_t>();
+    // SAFETY: the sets are plain data, and are only read and written by the
+    // kernel.
+    let allowed = unsafe {
+        let mut set: libc::cpu_set_t = std::mem::zeroed();
+        if libc::sched_getaffinity(0, size, &mut set) != 0 {
+            bail!("Couldn't get the allowed cores: {}", std::io::Error::last_os_error());
+        }
+        set
+    };
+    let cores: Vec<usize> = (0..libc::CPU_SETSIZE as usize)
+        .filter(|&core| unsafe { libc::CPU_ISSET(core, &allowed) })
+        .collect();
+    if cores.is_empty() {
+        bail!("No cores are allowed");
+    }
+    let core = cores[idx % cores.len()];
+    // SAFETY: as above. With a pid of 0, this only pins the calling thread.
+    let res = unsafe {
+        let mut set: libc::cpu_set_t = std::mem::zeroed();
+        libc::CPU_SET(core, &mut set);
+        libc::sched_setaffinity(0, size, &set)
+    };
+    if res != 0 {
+        bail!("Couldn't pin to core {core}: {}", std::io::Error::last_os_error());
+    }
+    Ok(())
+}
+#[cfg(not(target_os = "linux"))]
+pub fn pin_to_core(_idx: usize) -> anyhow::Result<()> {
+    bail!("Pinning to cores is only supported on Linux");
+}